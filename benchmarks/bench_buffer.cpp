@@ -0,0 +1,60 @@
+#include "bt-embedded/buffer.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <vector>
+
+static void chain_free(BteBuffer *buffer)
+{
+    if (buffer->next) chain_free(buffer->next);
+    delete [] reinterpret_cast<uint8_t *>(buffer);
+}
+
+/* Builds a buffer of the given total size, split into segments of at most
+ * segmentSize bytes; a single segment gives a contiguous buffer */
+static BteBuffer *makeChain(uint16_t totalSize, uint16_t segmentSize)
+{
+    BteBuffer *head = nullptr, *prev = nullptr;
+    for (uint16_t allocated = 0; allocated < totalSize;) {
+        uint16_t size = totalSize - allocated;
+        if (size > segmentSize) size = segmentSize;
+        BteBuffer *b = reinterpret_cast<BteBuffer *>(
+            new uint8_t[sizeof(BteBuffer) + size]);
+        b->ref_count = 1;
+        b->free_func = chain_free;
+        b->total_size = totalSize;
+        b->size = size;
+        b->next = nullptr;
+        for (uint16_t i = 0; i < size; i++) b->data[i] = allocated + i;
+        if (prev) prev->next = b;
+        else head = b;
+        prev = b;
+        allocated += size;
+    }
+    return head;
+}
+
+/* Reads a 1024-byte buffer in chunks of the given size */
+static void BM_BufferReader(benchmark::State &state)
+{
+    const uint16_t totalSize = 1024;
+    const uint16_t segmentSize = state.range(0);
+    const uint16_t chunkSize = state.range(1);
+
+    BteBuffer *buffer = makeChain(totalSize, segmentSize);
+    std::vector<uint8_t> out(chunkSize);
+    for (auto _: state) {
+        BteBufferReader reader;
+        bte_buffer_reader_init(&reader, buffer);
+        for (uint16_t pos = 0; pos < totalSize; pos += chunkSize) {
+            bte_buffer_reader_read(&reader, out.data(), chunkSize);
+        }
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    bte_buffer_unref(buffer);
+    state.SetBytesProcessed(state.iterations() * totalSize);
+}
+BENCHMARK(BM_BufferReader)
+    ->ArgNames({ "segment", "chunk" })
+    ->ArgsProduct({ { 1024, 256, 64, 16 }, { 4, 64, 1024 } });
@@ -0,0 +1,125 @@
+#include "null_backend.h"
+
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+
+#include <benchmark/benchmark.h>
+#include <string>
+
+struct CommandRow {
+    const char *name;
+    void (*invoke)(BteHci *hci);
+};
+
+/* The commands which are answered by a single Command Complete event */
+static const CommandRow s_commands[] = {
+    { "reset", [](BteHci *h) { bte_hci_reset(h, ignoreReply); } },
+    { "set_event_mask", [](BteHci *h) {
+        bte_hci_set_event_mask(h, 0x00001fffffffffff, ignoreReply);
+    }},
+    { "inquiry_cancel", [](BteHci *h) {
+        bte_hci_inquiry_cancel(h, ignoreReply);
+    }},
+    { "read_pin_type", [](BteHci *h) {
+        bte_hci_read_pin_type(h, ignoreReply);
+    }},
+    { "write_pin_type", [](BteHci *h) {
+        bte_hci_write_pin_type(h, 0, ignoreReply);
+    }},
+    { "read_local_name", [](BteHci *h) {
+        bte_hci_read_local_name(h, ignoreReply);
+    }},
+    { "write_local_name", [](BteHci *h) {
+        bte_hci_write_local_name(h, "bt-embedded benchmark", ignoreReply);
+    }},
+    { "read_page_timeout", [](BteHci *h) {
+        bte_hci_read_page_timeout(h, ignoreReply);
+    }},
+    { "write_page_timeout", [](BteHci *h) {
+        bte_hci_write_page_timeout(h, 0x2000, ignoreReply);
+    }},
+    { "read_scan_enable", [](BteHci *h) {
+        bte_hci_read_scan_enable(h, ignoreReply);
+    }},
+    { "write_scan_enable", [](BteHci *h) {
+        bte_hci_write_scan_enable(h, 3, ignoreReply);
+    }},
+    { "read_auth_enable", [](BteHci *h) {
+        bte_hci_read_auth_enable(h, ignoreReply);
+    }},
+    { "write_auth_enable", [](BteHci *h) {
+        bte_hci_write_auth_enable(h, 0, ignoreReply);
+    }},
+    { "read_class_of_device", [](BteHci *h) {
+        bte_hci_read_class_of_device(h, ignoreReply);
+    }},
+    { "write_class_of_device", [](BteHci *h) {
+        BteClassOfDevice cod = {{ 0x04, 0x25, 0x00 }};
+        bte_hci_write_class_of_device(h, &cod, ignoreReply);
+    }},
+    { "read_current_iac_lap", [](BteHci *h) {
+        bte_hci_read_current_iac_lap(h, ignoreReply);
+    }},
+    { "write_current_iac_lap", [](BteHci *h) {
+        BteLap laps[] = { BTE_LAP_GIAC, BTE_LAP_LIAC };
+        bte_hci_write_current_iac_lap(h, 2, laps, ignoreReply);
+    }},
+    { "read_inquiry_scan_type", [](BteHci *h) {
+        bte_hci_read_inquiry_scan_type(h, ignoreReply);
+    }},
+    { "write_inquiry_scan_type", [](BteHci *h) {
+        bte_hci_write_inquiry_scan_type(h, 1, ignoreReply);
+    }},
+    { "read_inquiry_mode", [](BteHci *h) {
+        bte_hci_read_inquiry_mode(h, ignoreReply);
+    }},
+    { "write_inquiry_mode", [](BteHci *h) {
+        bte_hci_write_inquiry_mode(h, 1, ignoreReply);
+    }},
+    { "read_page_scan_type", [](BteHci *h) {
+        bte_hci_read_page_scan_type(h, ignoreReply);
+    }},
+    { "write_page_scan_type", [](BteHci *h) {
+        bte_hci_write_page_scan_type(h, 1, ignoreReply);
+    }},
+    { "read_local_version", [](BteHci *h) {
+        bte_hci_read_local_version(h, ignoreReply);
+    }},
+    { "read_local_features", [](BteHci *h) {
+        bte_hci_read_local_features(h, ignoreReply);
+    }},
+    { "read_buffer_size", [](BteHci *h) {
+        bte_hci_read_buffer_size(h, ignoreReply);
+    }},
+    { "read_bd_addr", [](BteHci *h) {
+        bte_hci_read_bd_addr(h, ignoreReply);
+    }},
+};
+
+/* Builds and sends the command, then delivers its reply, so that the pending
+ * command slot is released for the next iteration */
+static void BM_Command(benchmark::State &state, const CommandRow *row)
+{
+    BenchClient client;
+    row->invoke(client.hci());
+    BteBuffer *reply = makeCommandComplete(nullBackendLastOpcode());
+    _bte_hci_dev_handle_event(&_bte_hci_dev, reply);
+
+    for (auto _: state) {
+        row->invoke(client.hci());
+        _bte_hci_dev_handle_event(&_bte_hci_dev, reply);
+    }
+    bte_buffer_unref(reply);
+    state.SetItemsProcessed(state.iterations());
+}
+
+static bool registerCommandBenchmarks()
+{
+    for (const CommandRow &row: s_commands) {
+        std::string name = std::string("BM_Command/") + row.name;
+        benchmark::RegisterBenchmark(name.c_str(), BM_Command, &row);
+    }
+    return true;
+}
+
+static bool s_registered = registerCommandBenchmarks();
@@ -0,0 +1,36 @@
+#include "bt-embedded/data_matcher.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdint>
+
+/* Matches a Command Complete-sized packet against a matcher made of the given
+ * number of one-byte rules (that's how many fit in BTE_DATA_MATCHER_MAX_LEN).
+ * The second argument tells whether the last rule matches. */
+static void BM_DataMatcherCompare(benchmark::State &state)
+{
+    const int numRules = state.range(0);
+    const bool matching = state.range(1);
+
+    uint8_t packet[64];
+    for (unsigned i = 0; i < sizeof(packet); i++) packet[i] = i;
+
+    BteDataMatcher matcher;
+    bte_data_matcher_init(&matcher);
+    for (int i = 0; i < numRules; i++) {
+        uint8_t offset = 3 + i * 2;
+        uint8_t value = packet[offset];
+        if (i == numRules - 1 && !matching) value++;
+        bte_data_matcher_add_rule(&matcher, &value, 1, offset);
+    }
+
+    for (auto _: state) {
+        benchmark::DoNotOptimize(&matcher);
+        bool result = bte_data_matcher_compare(&matcher, packet,
+                                               sizeof(packet));
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DataMatcherCompare)
+    ->ArgNames({ "rules", "match" })
+    ->ArgsProduct({ benchmark::CreateDenseRange(1, 5, 1), { 0, 1 } });
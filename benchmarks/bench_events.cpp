@@ -0,0 +1,70 @@
+#include "null_backend.h"
+
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+
+#include <benchmark/benchmark.h>
+
+/* An event which nobody is interested in: this measures the fixed cost of the
+ * dispatcher */
+static void BM_EventUnhandled(benchmark::State &state)
+{
+    BenchClient client;
+    BteBuffer *event = makeEvent({ HCI_PSCAN_REP_MODE_CHANGE, 7,
+                                   1, 2, 3, 4, 5, 6, 1 });
+    for (auto _: state) {
+        _bte_hci_dev_handle_event(&_bte_hci_dev, event);
+    }
+    bte_buffer_unref(event);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventUnhandled);
+
+/* Fills the given number of pending command slots with commands which will
+ * never be answered, so that the lookups have something to search through */
+static void addUnansweredCommands(BteHci *hci, int count)
+{
+    void (*const commands[])(BteHci *) = {
+        [](BteHci *h) { bte_hci_read_page_timeout(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_scan_enable(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_auth_enable(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_class_of_device(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_pin_type(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_inquiry_mode(h, ignoreReply); },
+        [](BteHci *h) { bte_hci_read_local_version(h, ignoreReply); },
+    };
+    for (int i = 0; i < count; i++) {
+        commands[i](hci);
+    }
+}
+
+/* A Command Complete for which there is no pending command */
+static void BM_EventCommandCompleteUnmatched(benchmark::State &state)
+{
+    BenchClient client;
+    addUnansweredCommands(client.hci(), state.range(0));
+    BteBuffer *event = makeCommandComplete(0x0000 /* NOP */);
+    for (auto _: state) {
+        _bte_hci_dev_handle_event(&_bte_hci_dev, event);
+    }
+    bte_buffer_unref(event);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventCommandCompleteUnmatched)->DenseRange(0, 7);
+
+/* A command and its Command Complete, while other commands are pending */
+static void BM_EventCommandCompleteRoundTrip(benchmark::State &state)
+{
+    BenchClient client;
+    addUnansweredCommands(client.hci(), state.range(0));
+    bte_hci_reset(client.hci(), ignoreReply);
+    BteBuffer *event = makeCommandComplete(nullBackendLastOpcode());
+    _bte_hci_dev_handle_event(&_bte_hci_dev, event);
+    for (auto _: state) {
+        bte_hci_reset(client.hci(), ignoreReply);
+        _bte_hci_dev_handle_event(&_bte_hci_dev, event);
+    }
+    bte_buffer_unref(event);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventCommandCompleteRoundTrip)->DenseRange(0, 7);
@@ -0,0 +1,92 @@
+#include "null_backend.h"
+
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <vector>
+
+/* Builds an Inquiry Result event carrying the responses from devices
+ * [first, first + count), each having a distinct address */
+static BteBuffer *makeInquiryResult(int first, int count)
+{
+    const int responseSize = 14;
+    BteBuffer *buffer =
+        bte_buffer_alloc_contiguous(3 + responseSize * count);
+    std::memset(buffer->data, 0, buffer->size);
+    buffer->data[0] = HCI_INQUIRY_RESULT;
+    buffer->data[1] = 1 + responseSize * count;
+    buffer->data[2] = count;
+    uint8_t *addresses = buffer->data + 3;
+    for (int i = 0; i < count; i++) {
+        int device = first + i;
+        uint8_t *address = addresses + i * 6;
+        address[0] = device & 0xff;
+        address[1] = device >> 8;
+        address[5] = 0x00;
+        address[4] = 0x1f;
+        address[3] = 0x32;
+    }
+    return buffer;
+}
+
+static int s_numReported = 0;
+
+static void inquiryDone(BteHci *, const BteHciInquiryReply *reply, void *)
+{
+    s_numReported += reply->num_responses;
+}
+
+static void inquiryResult(BteHci *, const BteHciInquiryResponse *,
+                          const BteHciEir *, void *)
+{
+    s_numReported++;
+}
+
+/* A complete inquiry: the command, its status, the given number of responses
+ * (grouped into events as told by the second argument) and the completion.
+ * The reply cannot carry more than 255 responses. The third argument selects
+ * the streaming mode. */
+static void BM_Inquiry(benchmark::State &state)
+{
+    const int numResponses = state.range(0);
+    const int perEvent = state.range(1);
+    const bool streaming = state.range(2);
+
+    BenchClient client;
+    if (streaming) {
+        bte_hci_on_inquiry_result(client.hci(), inquiryResult);
+    }
+    std::vector<BteBuffer *> results;
+    for (int i = 0; i < numResponses; i += perEvent) {
+        results.push_back(makeInquiryResult(i, perEvent));
+    }
+    const uint16_t opcode = HCI_INQUIRY_OCF | (HCI_LINK_CTRL_OGF << 10);
+    BteBuffer *status = makeCommandStatus(opcode);
+    BteBuffer *complete = makeEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+
+    for (auto _: state) {
+        s_numReported = 0;
+        bte_hci_inquiry(client.hci(), BTE_LAP_GIAC, 48, 0,
+                        ignoreReply, inquiryDone);
+        _bte_hci_dev_handle_event(&_bte_hci_dev, status);
+        for (BteBuffer *result: results) {
+            _bte_hci_dev_handle_event(&_bte_hci_dev, result);
+        }
+        _bte_hci_dev_handle_event(&_bte_hci_dev, complete);
+    }
+    if (s_numReported != numResponses) {
+        state.SkipWithError("Wrong number of responses");
+    }
+
+    for (BteBuffer *result: results) {
+        bte_buffer_unref(result);
+    }
+    bte_buffer_unref(status);
+    bte_buffer_unref(complete);
+    state.SetItemsProcessed(state.iterations() * numResponses);
+}
+BENCHMARK(BM_Inquiry)
+    ->ArgNames({ "responses", "per_event", "streaming" })
+    ->ArgsProduct({ { 16, 64, 240 }, { 1, 8 }, { 0, 1 } });
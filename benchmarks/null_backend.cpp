@@ -0,0 +1,97 @@
+#include "null_backend.h"
+
+#include "bt-embedded/backend.h"
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+
+#include <cstring>
+
+/* Never run out of command credits, so that no command ends up waiting in the
+ * queue */
+static const uint8_t s_numCommandPackets = 0xff;
+static uint16_t s_lastOpcode = 0;
+
+uint16_t nullBackendLastOpcode()
+{
+    return s_lastOpcode;
+}
+
+BteBuffer *makeEvent(std::initializer_list<uint8_t> bytes)
+{
+    BteBuffer *buffer = bte_buffer_alloc_contiguous(bytes.size());
+    std::memcpy(buffer->data, bytes.begin(), bytes.size());
+    return buffer;
+}
+
+BteBuffer *makeCommandComplete(uint16_t opcode)
+{
+    const uint8_t len = 255;
+    BteBuffer *buffer = bte_buffer_alloc_contiguous(2 + len);
+    std::memset(buffer->data, 0, buffer->size);
+    buffer->data[0] = HCI_COMMAND_COMPLETE;
+    buffer->data[1] = len;
+    buffer->data[2] = s_numCommandPackets;
+    buffer->data[3] = opcode & 0xff;
+    buffer->data[4] = opcode >> 8;
+    return buffer;
+}
+
+BteBuffer *makeCommandStatus(uint16_t opcode)
+{
+    return makeEvent({ HCI_COMMAND_STATUS, 4, 0, s_numCommandPackets,
+                       uint8_t(opcode & 0xff), uint8_t(opcode >> 8) });
+}
+
+BenchClient::BenchClient()
+{
+    _bte_hci_dev_reset_command_queue(&_bte_hci_dev);
+    m_client = bte_client_new();
+    m_hci = bte_hci_get(m_client);
+    _bte_hci_dev.num_packets = s_numCommandPackets;
+}
+
+BenchClient::~BenchClient()
+{
+    bte_client_unref(m_client);
+    _bte_hci_dev_reset_command_queue(&_bte_hci_dev);
+}
+
+static int null_init(BteHciDev *dev)
+{
+    return 0;
+}
+
+static int null_handle_events(BteHciDev *dev, bool wait_for_events,
+                              uint32_t timeout_ms)
+{
+    return 0;
+}
+
+static int null_hci_send_command(BteHciDev *dev, BteBuffer *buffer)
+{
+    s_lastOpcode = buffer->data[0] | (buffer->data[1] << 8);
+    return 0;
+}
+
+static int null_hci_send_data(BteHciDev *dev, BteBuffer *buffer)
+{
+    return 0;
+}
+
+static int null_deinit(BteHciDev *dev)
+{
+    return 0;
+}
+
+const BteBackend _bte_backend = {
+    .capabilities = BTE_BACKEND_CAP_SCATTER_GATHER,
+
+    .init = null_init,
+
+    .handle_events = null_handle_events,
+
+    .hci_send_command = null_hci_send_command,
+    .hci_send_data = null_hci_send_data,
+
+    .deinit = null_deinit,
+};
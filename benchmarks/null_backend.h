@@ -0,0 +1,44 @@
+#ifndef BTE_BENCH_NULL_BACKEND_H
+#define BTE_BENCH_NULL_BACKEND_H
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/buffer.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+
+#include <cstdint>
+#include <initializer_list>
+
+/* The null backend drops everything that the core sends, remembering just the
+ * opcode of the last command, so that the benchmarks can craft the matching
+ * reply. Events are fed straight into the core by the benchmarks themselves. */
+uint16_t nullBackendLastOpcode();
+
+/* Builds a contiguous event buffer, ready to be passed (as many times as
+ * needed) to _bte_hci_dev_handle_event() */
+BteBuffer *makeEvent(std::initializer_list<uint8_t> bytes);
+/* A Command Complete event with a zero-filled payload, large enough for any
+ * reply parser */
+BteBuffer *makeCommandComplete(uint16_t opcode);
+BteBuffer *makeCommandStatus(uint16_t opcode);
+
+/* Creates a client on a fresh controller, with plenty of command credits, and
+ * destroys it (along with any commands it left pending) when going out of
+ * scope */
+class BenchClient {
+public:
+    BenchClient();
+    ~BenchClient();
+
+    BteHci *hci() const { return m_hci; }
+
+private:
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+/* Reply callback which does nothing, whatever the reply type */
+template <typename... Args>
+static void ignoreReply(Args...) {}
+
+#endif /* BTE_BENCH_NULL_BACKEND_H */
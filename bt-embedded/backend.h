@@ -7,20 +7,40 @@
 extern "C" {
 #endif
 
-typedef struct bte_backend_t BteBackend;
-
-/* Interface for platform-specific BT backends. */
+/* The backend can send buffers made of several segments, without the need to
+ * copy them into a contiguous block. Without this capability, the buffers
+ * passed to hci_send_data() are always contiguous. */
+#define BTE_BACKEND_CAP_SCATTER_GATHER (1 << 0)
+
+/* Interface for platform-specific BT backends. The backend is shared by all
+ * the devices using it: any state of its own must be stored in the
+ * backend_data member of the device, which the backend can set in init() if
+ * the creator of the device has not set it already. */
 struct bte_backend_t {
-    int (*init)(void);
+    uint32_t capabilities;
+    /* Number of buffers available to receive ACL packets, and the maximum
+     * payload that each of them can hold. If set, the driver advertises them
+     * to the controller and enables controller to host flow control, so that
+     * the controller never sends more packets than the backend can store. */
+    uint16_t acl_rx_buffer_count;
+    uint16_t acl_rx_buffer_size;
+
+    int (*init)(BteHciDev *dev);
+
+    int (*handle_events)(BteHciDev *dev, bool wait_for_events,
+                         uint32_t timeout_ms);
 
-    int (*handle_events)(bool wait_for_events, uint32_t timeout_ms);
+    int (*hci_send_command)(BteHciDev *dev, BteBuffer *buf);
+    int (*hci_send_data)(BteHciDev *dev, BteBuffer *buf);
 
-    int (*hci_send_command)(BteBuffer *buf);
-    int (*hci_send_data)(BteBuffer *buf);
+    int (*deinit)(BteHciDev *dev);
 
-    int (*deinit)(void);
+    /* Optional: makes a handle_events() call which is waiting in another
+     * thread return as soon as possible. Can be called from any thread. */
+    void (*wakeup)(BteHciDev *dev);
 };
 
+/* The backend of the default device */
 extern const BteBackend _bte_backend;
 
 #ifdef __cplusplus
@@ -0,0 +1,356 @@
+#include "btsnoop_replay.h"
+
+#include "backend.h"
+#include "clock.h"
+#include "hci_proto.h"
+#include "internals.h"
+#include "logging.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BTSNOOP_HEADER_LEN        16
+#define BTSNOOP_RECORD_HEADER_LEN 24
+#define BTSNOOP_DATALINK_HCI_UART 1001
+#define BTSNOOP_DATALINK_H4       1002
+
+#define BTSNOOP_FLAG_RECEIVED  (1 << 0)
+#define BTSNOOP_FLAG_CMD_EVENT (1 << 1)
+
+/* Maximum number of packets delivered by a single handle_events() call, so
+ * that the client's main loop gets a chance to run */
+#define REPLAY_MAX_PACKETS_PER_CALL 32
+/* Host commands which have not been matched in the trace yet */
+#define REPLAY_HOST_COMMANDS 16
+
+typedef struct {
+    uint8_t type;
+    bool received;
+    uint64_t timestamp_us;
+    const uint8_t *data;
+    uint16_t len;
+    size_t next_pos;
+} ReplayRecord;
+
+static uint8_t *s_map = NULL;
+static size_t s_map_size;
+static size_t s_pos;
+static uint32_t s_datalink;
+static uint32_t s_flags;
+
+/* The timestamp of the trace corresponding to s_anchor_us */
+static uint64_t s_anchor_ts;
+static uint64_t s_anchor_us;
+static bool s_anchored;
+
+static uint16_t s_host_commands[REPLAY_HOST_COMMANDS];
+static int s_host_commands_head;
+static int s_host_commands_count;
+
+/* Signalled by replay_wakeup() to interrupt replay_wait_us() */
+static int s_wakeup_fd = -1;
+
+static inline uint32_t read_be32(const uint8_t *ptr)
+{
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+        ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+static void replay_unmap(void)
+{
+    if (s_map) munmap(s_map, s_map_size);
+    s_map = NULL;
+    s_map_size = s_pos = 0;
+}
+
+int bte_btsnoop_replay_set_file(const char *path, uint32_t flags)
+{
+    replay_unmap();
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        BTE_WARN("Cannot open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    struct stat st;
+    int rc = 0;
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto out;
+    }
+    if (st.st_size < BTSNOOP_HEADER_LEN) {
+        rc = -EINVAL;
+        goto out;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        goto out;
+    }
+    s_map = map;
+    s_map_size = st.st_size;
+
+    s_datalink = read_be32(s_map + 12);
+    if (memcmp(s_map, "btsnoop\0", 8) != 0 ||
+        (s_datalink != BTSNOOP_DATALINK_H4 &&
+         s_datalink != BTSNOOP_DATALINK_HCI_UART)) {
+        BTE_WARN("%s is not a supported btsnoop file\n", path);
+        replay_unmap();
+        rc = -EINVAL;
+        goto out;
+    }
+
+    s_pos = BTSNOOP_HEADER_LEN;
+    s_flags = flags;
+    s_anchored = false;
+    s_host_commands_head = s_host_commands_count = 0;
+
+out:
+    close(fd);
+    return rc;
+}
+
+bool bte_btsnoop_replay_finished(void)
+{
+    return !s_map || s_pos + BTSNOOP_RECORD_HEADER_LEN > s_map_size;
+}
+
+static bool replay_peek(ReplayRecord *record)
+{
+    if (bte_btsnoop_replay_finished()) return false;
+
+    const uint8_t *header = s_map + s_pos;
+    uint32_t len = read_be32(header + 4);
+    uint32_t flags = read_be32(header + 8);
+    size_t data_pos = s_pos + BTSNOOP_RECORD_HEADER_LEN;
+    if (UNLIKELY(data_pos + len > s_map_size)) {
+        BTE_WARN("Truncated btsnoop record\n");
+        s_pos = s_map_size;
+        return false;
+    }
+    /* No HCI packet is this long (for H4, the packet type is not part of
+     * it): the trace is corrupt */
+    uint32_t packet_len = s_datalink == BTSNOOP_DATALINK_H4 && len > 0 ?
+        len - 1 : len;
+    if (UNLIKELY(packet_len > UINT16_MAX)) {
+        BTE_WARN("Invalid btsnoop record length %u\n", len);
+        s_pos = s_map_size;
+        return false;
+    }
+
+    record->received = flags & BTSNOOP_FLAG_RECEIVED;
+    record->timestamp_us = ((uint64_t)read_be32(header + 16) << 32) |
+        read_be32(header + 20);
+    record->data = s_map + data_pos;
+    record->len = len;
+    record->next_pos = data_pos + len;
+    if (s_datalink == BTSNOOP_DATALINK_H4) {
+        if (UNLIKELY(len < 1)) {
+            record->type = 0;
+        } else {
+            record->type = record->data[0];
+            record->data++;
+            record->len--;
+        }
+    } else if (flags & BTSNOOP_FLAG_CMD_EVENT) {
+        record->type = record->received ?
+            HCI_EVENT_PACKET : HCI_COMMAND_DATA_PACKET;
+    } else {
+        record->type = HCI_ACL_DATA_PACKET;
+    }
+    return true;
+}
+
+/* Returns true if the host has sent the command found in the trace */
+static bool replay_match_command(const ReplayRecord *record)
+{
+    if (s_host_commands_count == 0) return false;
+
+    uint16_t opcode = s_host_commands[s_host_commands_head];
+    s_host_commands_head = (s_host_commands_head + 1) % REPLAY_HOST_COMMANDS;
+    s_host_commands_count--;
+    if (UNLIKELY(record->len < 2 || read_le16(record->data) != opcode)) {
+        BTE_WARN("Host sent command %04x, the trace has %04x\n", opcode,
+                 record->len >= 2 ? read_le16(record->data) : 0);
+    }
+    return true;
+}
+
+static void replay_anchor(const ReplayRecord *record)
+{
+    s_anchor_ts = record->timestamp_us;
+    s_anchor_us = _bte_clock_now_us();
+    s_anchored = true;
+}
+
+/* Sleeps for the given time (forever, if 0), unless replay_wakeup() is
+ * called; returns false in the latter case */
+static bool replay_wait_us(uint64_t us)
+{
+    int timeout = us == 0 ? -1 : (int)MIN2((us + 999) / 1000, INT_MAX);
+    struct pollfd pfd = { .fd = s_wakeup_fd, .events = POLLIN };
+    int n = poll(&pfd, s_wakeup_fd >= 0 ? 1 : 0, timeout);
+    if (n <= 0) return true;
+
+    uint64_t count;
+    if (read(s_wakeup_fd, &count, sizeof(count)) < 0) {
+        /* Someone else cleared it */
+    }
+    return false;
+}
+
+static int replay_deliver(BteHciDev *dev, const ReplayRecord *record)
+{
+    BteBuffer *buf = bte_buffer_alloc_contiguous(record->len);
+    if (UNLIKELY(!buf)) return -ENOMEM;
+    memcpy(buf->data, record->data, record->len);
+    if (record->type == HCI_EVENT_PACKET) {
+        _bte_hci_dev_handle_event(dev, buf);
+    } else if (record->type == HCI_ACL_DATA_PACKET) {
+        _bte_hci_dev_handle_data(dev, buf);
+    }
+    bte_buffer_unref(buf);
+    return 0;
+}
+
+static int replay_init(BteHciDev *dev)
+{
+    if (s_wakeup_fd < 0) {
+        s_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s_wakeup_fd < 0) return -errno;
+    }
+    if (s_map) return 0;
+
+    const char *path = getenv("BTE_REPLAY_FILE");
+    if (!path) {
+        BTE_WARN("No btsnoop file configured\n");
+        return -ENODEV;
+    }
+    return bte_btsnoop_replay_set_file(path, 0);
+}
+
+static int replay_handle_events(BteHciDev *dev, bool wait_for_events,
+                                uint32_t timeout_ms)
+{
+    if (UNLIKELY(!s_map)) return -EBADF;
+
+    uint64_t deadline_us = _bte_clock_now_us() + timeout_ms * 1000ULL;
+    int num_packets = 0;
+    /* Whether nothing can happen until the host sends a command, or at
+     * all, since the trace is over */
+    bool idle = true;
+    ReplayRecord record;
+    while (num_packets < REPLAY_MAX_PACKETS_PER_CALL && replay_peek(&record)) {
+        if (!record.received) {
+            if (record.type == HCI_COMMAND_DATA_PACKET &&
+                !(s_flags & BTE_BTSNOOP_REPLAY_FLAG_IGNORE_COMMANDS)) {
+                /* The host must send it first */
+                if (!replay_match_command(&record)) break;
+                replay_anchor(&record);
+            }
+            s_pos = record.next_pos;
+            continue;
+        }
+
+        if (s_flags & BTE_BTSNOOP_REPLAY_FLAG_REALTIME) {
+            if (!s_anchored) replay_anchor(&record);
+            uint64_t due_us = s_anchor_us + (record.timestamp_us - s_anchor_ts);
+            uint64_t now_us = _bte_clock_now_us();
+            if (now_us < due_us) {
+                idle = false;
+                if (!wait_for_events || num_packets > 0) break;
+                if (timeout_ms != 0 && due_us > deadline_us) {
+                    if (now_us < deadline_us) {
+                        replay_wait_us(deadline_us - now_us);
+                    }
+                    break;
+                }
+                if (!replay_wait_us(due_us - now_us)) break;
+                /* The record might not be due yet, if we woke up early */
+                continue;
+            }
+        }
+
+        s_pos = record.next_pos;
+        int rc = replay_deliver(dev, &record);
+        if (UNLIKELY(rc < 0)) return rc;
+        num_packets++;
+    }
+
+    if (idle && wait_for_events && num_packets == 0) {
+        /* Don't make the caller spin */
+        uint64_t now_us = _bte_clock_now_us();
+        if (timeout_ms == 0) {
+            replay_wait_us(0);
+        } else if (now_us < deadline_us) {
+            replay_wait_us(deadline_us - now_us);
+        }
+    }
+    return num_packets;
+}
+
+static int replay_hci_send_command(BteHciDev *dev, BteBuffer *buf)
+{
+    if (UNLIKELY(s_host_commands_count == REPLAY_HOST_COMMANDS)) {
+        return -ENOBUFS;
+    }
+    int index = (s_host_commands_head + s_host_commands_count) %
+        REPLAY_HOST_COMMANDS;
+    s_host_commands[index] = read_le16(buf->data);
+    s_host_commands_count++;
+    return 0;
+}
+
+static int replay_hci_send_data(BteHciDev *dev, BteBuffer *buf)
+{
+    /* Nothing to do: the controller's reaction (if any) is in the trace */
+    return 0;
+}
+
+static void replay_wakeup(BteHciDev *dev)
+{
+    if (s_wakeup_fd < 0) return;
+
+    uint64_t count = 1;
+    if (write(s_wakeup_fd, &count, sizeof(count)) < 0) {
+        /* Only fails if the counter is saturated, which is fine */
+    }
+}
+
+static int replay_deinit(BteHciDev *dev)
+{
+    replay_unmap();
+    if (s_wakeup_fd >= 0) {
+        close(s_wakeup_fd);
+        s_wakeup_fd = -1;
+    }
+    return 0;
+}
+
+/* A single trace is replayed at a time: only the default device can use this
+ * backend */
+const BteBackend _bte_backend = {
+    .capabilities = BTE_BACKEND_CAP_SCATTER_GATHER,
+
+    .init = replay_init,
+
+    .handle_events = replay_handle_events,
+
+    .hci_send_command = replay_hci_send_command,
+    .hci_send_data = replay_hci_send_data,
+
+    .deinit = replay_deinit,
+
+    .wakeup = replay_wakeup,
+};
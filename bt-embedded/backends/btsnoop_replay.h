@@ -0,0 +1,39 @@
+#ifndef BTE_BACKENDS_BTSNOOP_REPLAY_H
+#define BTE_BACKENDS_BTSNOOP_REPLAY_H
+
+#include "../types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Backend which plays back a btsnoop capture (see capture.h) instead of
+ * talking to a controller: the packets sent by the controller are delivered to
+ * the stack, while the commands sent by the host are used to keep the replay
+ * in sync with the stack: when the trace reaches a command, the replay stops
+ * until the host sends a command with the same opcode. This makes it possible
+ * to benchmark the stack on real workloads without any Bluetooth hardware.
+ *
+ * If bte_btsnoop_replay_set_file() is not called, the backend reads the file
+ * path from the BTE_REPLAY_FILE environment variable when it's initialized. */
+
+/* Deliver the packets with the timing of the capture, instead of as fast as
+ * possible. The delays are measured from the last command sent by the host,
+ * so that the controller latency is reproduced. */
+#define BTE_BTSNOOP_REPLAY_FLAG_REALTIME        (1 << 0)
+/* Do not wait for the host to send the commands found in the trace */
+#define BTE_BTSNOOP_REPLAY_FLAG_IGNORE_COMMANDS (1 << 1)
+
+/* Maps the given btsnoop file (with the H4 or the HCI UART datalink) and
+ * starts replaying it from the beginning. Returns 0 on success or a negative
+ * error code. */
+int bte_btsnoop_replay_set_file(const char *path, uint32_t flags);
+
+/* Returns true when all the packets of the trace have been replayed */
+bool bte_btsnoop_replay_finished(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_BACKENDS_BTSNOOP_REPLAY_H */
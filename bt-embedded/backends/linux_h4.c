@@ -0,0 +1,616 @@
+#include "linux_h4.h"
+
+#include "backend.h"
+#include "bte.h"
+#include "hci_proto.h"
+#include "internals.h"
+#include "logging.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* Size of the buffer where the incoming byte stream is accumulated; we read as
+ * much as it fits in it with a single read() call, and frame the packets
+ * directly in there. */
+#define H4_RX_BUF_SIZE (16 * 1024)
+
+#define H4_EVENT_BUF_SIZE (HCI_EVENT_HDR_LEN + 255)
+#define H4_ACL_BUF_SIZE   (HCI_ACL_HDR_LEN + 4096)
+
+#define H4_BUFFER_EVENT_COUNT 8
+#define H4_BUFFER_ACL_COUNT   16
+
+#define H4_TX_QUEUE_SIZE 32
+#define H4_TX_IOV_MAX    64
+
+typedef struct {
+    BteBuffer buffer;
+    uint8_t data[H4_EVENT_BUF_SIZE];
+} H4BufferEvent;
+
+typedef struct {
+    BteBuffer buffer;
+    uint8_t data[H4_ACL_BUF_SIZE];
+} H4BufferAcl;
+
+typedef struct {
+    BteBuffer *buffer;
+    uint8_t type;
+} H4TxPacket;
+
+/* State of a backend instance: the default device uses a static one, the
+ * others are allocated by bte_linux_h4_dev_new() */
+typedef struct {
+    char device_path[PATH_MAX];
+    uint32_t baud_rate;
+    bool owns_fd;
+    int fd;
+    int epoll_fd;
+    uint32_t epoll_events;
+    /* Signalled by bte_hci_dev_call() to interrupt epoll_wait() */
+    int wakeup_fd;
+
+    H4BufferEvent buffer_event[H4_BUFFER_EVENT_COUNT];
+    H4BufferAcl buffer_acl[H4_BUFFER_ACL_COUNT];
+
+    uint8_t rx_buffer[H4_RX_BUF_SIZE];
+    uint32_t rx_start;
+    uint32_t rx_end;
+    /* Bytes still to be dropped from the stream (oversized or SCO packets) */
+    uint32_t rx_discard;
+    /* Set when a complete packet could not be delivered because all our
+     * buffers are in use; cleared at the next event loop iteration, when the
+     * delivery is retried. */
+    bool rx_blocked;
+
+    H4TxPacket tx_queue[H4_TX_QUEUE_SIZE];
+    int tx_head;
+    int tx_count;
+    /* Bytes of the first packet in the queue which have already been
+     * written, including the packet indicator */
+    uint32_t tx_offset;
+} H4State;
+
+static H4State s_default_state = {
+    .fd = -1,
+    .epoll_fd = -1,
+    .wakeup_fd = -1,
+};
+
+static inline H4State *h4_state(BteHciDev *dev)
+{
+    return dev->backend_data;
+}
+
+static void h4_set_device(H4State *s, const char *path, uint32_t baud_rate)
+{
+    strncpy(s->device_path, path, sizeof(s->device_path) - 1);
+    s->baud_rate = baud_rate;
+}
+
+void bte_linux_h4_set_device(const char *path, uint32_t baud_rate)
+{
+    h4_set_device(&s_default_state, path, baud_rate);
+}
+
+void bte_linux_h4_set_fd(int fd)
+{
+    s_default_state.fd = fd;
+    s_default_state.owns_fd = false;
+}
+
+BteHciDev *bte_linux_h4_dev_new(const char *path, uint32_t baud_rate)
+{
+    H4State *s = calloc(1, sizeof(H4State));
+    if (UNLIKELY(!s)) return NULL;
+
+    s->fd = -1;
+    s->epoll_fd = -1;
+    s->wakeup_fd = -1;
+    h4_set_device(s, path, baud_rate);
+    BteHciDev *dev = bte_hci_dev_new(&_bte_backend, s);
+    if (UNLIKELY(!dev)) free(s);
+    return dev;
+}
+
+static void h4_buffer_free(BteBuffer *buffer)
+{
+    buffer->ref_count = 0;
+}
+
+static BteBuffer *h4_buffer_alloc(void *pool, size_t stride, int count,
+                                  uint16_t size)
+{
+    uint8_t *ptr = pool;
+    for (int i = 0; i < count; i++, ptr += stride) {
+        BteBuffer *buffer = (BteBuffer *)ptr;
+        if (buffer->ref_count == 0) {
+            buffer->ref_count = 1;
+            buffer->free_func = h4_buffer_free;
+            buffer->total_size = buffer->size = size;
+            buffer->next = NULL;
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+static speed_t h4_speed_for_baud_rate(uint32_t baud_rate)
+{
+    switch (baud_rate) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    case 3000000: return B3000000;
+    case 3500000: return B3500000;
+    case 4000000: return B4000000;
+    default: return B0;
+    }
+}
+
+static int h4_open_device(H4State *s)
+{
+    int rc;
+    int fd = open(s->device_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        BTE_WARN("Cannot open %s: %s\n", s->device_path, strerror(errno));
+        return -errno;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) goto error;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD | CRTSCTS;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (s->baud_rate != 0) {
+        speed_t speed = h4_speed_for_baud_rate(s->baud_rate);
+        if (speed == B0) {
+            BTE_WARN("Unsupported baud rate %u\n", s->baud_rate);
+            errno = EINVAL;
+            goto error;
+        }
+        cfsetspeed(&tio, speed);
+    }
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) goto error;
+    tcflush(fd, TCIOFLUSH);
+
+    s->fd = fd;
+    s->owns_fd = true;
+    return 0;
+
+error:
+    rc = -errno;
+    close(fd);
+    return rc;
+}
+
+static void h4_update_epoll_events(H4State *s)
+{
+    uint32_t events = 0;
+    if (s->rx_end < H4_RX_BUF_SIZE) events |= EPOLLIN;
+    if (s->tx_count > 0) events |= EPOLLOUT;
+    if (events == s->epoll_events) return;
+
+    struct epoll_event event = { .events = events, .data.fd = s->fd };
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+    s->epoll_events = events;
+}
+
+/* Returns the full length of the H4 packet starting at ptr (including the
+ * packet indicator), 0 if not enough bytes have been received to tell it, or
+ * -1 if the packet indicator is invalid. */
+static int h4_packet_length(const uint8_t *ptr, uint32_t len)
+{
+    switch (ptr[0]) {
+    case HCI_EVENT_PACKET:
+        if (len < 1 + HCI_EVENT_HDR_LEN) return 0;
+        return 1 + HCI_EVENT_HDR_LEN + ptr[2];
+    case HCI_ACL_DATA_PACKET:
+        if (len < 1 + HCI_ACL_HDR_LEN) return 0;
+        return 1 + HCI_ACL_HDR_LEN + read_le16(ptr + 3);
+    case HCI_SCO_DATA_PACKET:
+        if (len < 1 + HCI_SCO_HDR_LEN) return 0;
+        return 1 + HCI_SCO_HDR_LEN + ptr[3];
+    default:
+        return -1;
+    }
+}
+
+static int h4_deliver_packet(BteHciDev *dev, uint8_t type, const uint8_t *data,
+                             uint16_t len)
+{
+    H4State *s = h4_state(dev);
+    BteBuffer *buf;
+
+    if (type == HCI_EVENT_PACKET) {
+        buf = h4_buffer_alloc(s->buffer_event, sizeof(H4BufferEvent),
+                              H4_BUFFER_EVENT_COUNT, len);
+    } else {
+        buf = h4_buffer_alloc(s->buffer_acl, sizeof(H4BufferAcl),
+                              H4_BUFFER_ACL_COUNT, len);
+    }
+    if (UNLIKELY(!buf)) return -EAGAIN;
+
+    memcpy(buf->data, data, len);
+    if (type == HCI_EVENT_PACKET) {
+        _bte_hci_dev_handle_event(dev, buf);
+    } else {
+        _bte_hci_dev_handle_data(dev, buf);
+    }
+    bte_buffer_unref(buf);
+    return 0;
+}
+
+/* Frame and deliver all the complete packets found in the receive buffer;
+ * returns the number of delivered packets. */
+static int h4_process_rx(BteHciDev *dev)
+{
+    H4State *s = h4_state(dev);
+    int num_packets = 0;
+
+    while (!s->rx_blocked && s->rx_start < s->rx_end) {
+        uint8_t *ptr = s->rx_buffer + s->rx_start;
+        uint32_t avail = s->rx_end - s->rx_start;
+
+        if (UNLIKELY(s->rx_discard > 0)) {
+            uint32_t len = MIN2(s->rx_discard, avail);
+            s->rx_discard -= len;
+            s->rx_start += len;
+            continue;
+        }
+
+        int len = h4_packet_length(ptr, avail);
+        if (UNLIKELY(len < 0)) {
+            BTE_WARN("H4: invalid packet indicator %02x\n", ptr[0]);
+            s->rx_start++;
+            continue;
+        }
+        if (len == 0) break;
+
+        if (UNLIKELY(ptr[0] == HCI_SCO_DATA_PACKET ||
+                     len - 1 > H4_ACL_BUF_SIZE)) {
+            BTE_WARN("H4: dropping packet %02x of size %d\n", ptr[0], len);
+            s->rx_discard = len;
+            continue;
+        }
+        if ((uint32_t)len > avail) break;
+
+        if (h4_deliver_packet(dev, ptr[0], ptr + 1, len - 1) < 0) {
+            s->rx_blocked = true;
+            break;
+        }
+        s->rx_start += len;
+        num_packets++;
+    }
+
+    /* Move the incomplete packet (if any) at the beginning of the buffer */
+    if (s->rx_start > 0) {
+        uint32_t remaining = s->rx_end - s->rx_start;
+        if (remaining > 0) {
+            memmove(s->rx_buffer, s->rx_buffer + s->rx_start, remaining);
+        }
+        s->rx_start = 0;
+        s->rx_end = remaining;
+    }
+    return num_packets;
+}
+
+static int h4_read(BteHciDev *dev)
+{
+    H4State *s = h4_state(dev);
+    int num_packets = 0;
+
+    while (s->rx_end < H4_RX_BUF_SIZE) {
+        ssize_t len = read(s->fd, s->rx_buffer + s->rx_end,
+                           H4_RX_BUF_SIZE - s->rx_end);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -errno;
+        }
+        if (UNLIKELY(len == 0)) {
+            BTE_WARN("H4: connection closed\n");
+            return -EPIPE;
+        }
+        s->rx_end += len;
+        num_packets += h4_process_rx(dev);
+    }
+    return num_packets;
+}
+
+static int h4_add_iovecs(struct iovec *iov, int n_iov, H4TxPacket *packet,
+                         uint32_t *skip)
+{
+    if (*skip == 0) {
+        iov[n_iov].iov_base = &packet->type;
+        iov[n_iov].iov_len = 1;
+        n_iov++;
+    } else {
+        (*skip)--;
+    }
+
+    uint32_t remaining = packet->buffer->total_size;
+    for (BteBuffer *b = packet->buffer; b && remaining > 0 &&
+         n_iov < H4_TX_IOV_MAX; b = b->next) {
+        uint32_t len = MIN2(b->size, remaining);
+        remaining -= len;
+        if (*skip >= len) {
+            *skip -= len;
+            continue;
+        }
+        iov[n_iov].iov_base = b->data + *skip;
+        iov[n_iov].iov_len = len - *skip;
+        *skip = 0;
+        n_iov++;
+    }
+    return n_iov;
+}
+
+static void h4_tx_consume(H4State *s, size_t written)
+{
+    while (written > 0) {
+        H4TxPacket *packet = &s->tx_queue[s->tx_head];
+        uint32_t remaining = 1 + packet->buffer->total_size - s->tx_offset;
+        if (written < remaining) {
+            s->tx_offset += written;
+            break;
+        }
+        written -= remaining;
+        s->tx_offset = 0;
+        bte_buffer_unref(packet->buffer);
+        s->tx_head = (s->tx_head + 1) % H4_TX_QUEUE_SIZE;
+        s->tx_count--;
+    }
+}
+
+/* Write as many queued packets as the fd accepts, with a single writev() call
+ * whenever possible */
+static int h4_flush_tx(H4State *s)
+{
+    while (s->tx_count > 0) {
+        struct iovec iov[H4_TX_IOV_MAX];
+        int n_iov = 0;
+        uint32_t skip = s->tx_offset;
+        for (int i = 0; i < s->tx_count && n_iov < H4_TX_IOV_MAX - 1; i++) {
+            H4TxPacket *packet =
+                &s->tx_queue[(s->tx_head + i) % H4_TX_QUEUE_SIZE];
+            n_iov = h4_add_iovecs(iov, n_iov, packet, &skip);
+        }
+
+        ssize_t written = writev(s->fd, iov, n_iov);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            BTE_WARN("H4: write failed: %s\n", strerror(errno));
+            return -errno;
+        }
+        h4_tx_consume(s, written);
+    }
+    return 0;
+}
+
+static int h4_send(H4State *s, uint8_t type, BteBuffer *buf)
+{
+    if (UNLIKELY(s->fd < 0)) return -EBADF;
+
+    if (UNLIKELY(s->tx_count == H4_TX_QUEUE_SIZE)) {
+        int rc = h4_flush_tx(s);
+        if (rc < 0) return rc;
+        if (s->tx_count == H4_TX_QUEUE_SIZE) return -ENOBUFS;
+    }
+
+    int index = (s->tx_head + s->tx_count) % H4_TX_QUEUE_SIZE;
+    s->tx_queue[index].buffer = bte_buffer_ref(buf);
+    s->tx_queue[index].type = type;
+    s->tx_count++;
+
+    /* If other packets were already waiting, the fd is not writable: the
+     * packet will be sent when epoll tells us so. */
+    if (s->tx_count == 1) {
+        int rc = h4_flush_tx(s);
+        if (UNLIKELY(rc < 0)) return rc;
+    }
+    h4_update_epoll_events(s);
+    return 0;
+}
+
+static int h4_init(BteHciDev *dev)
+{
+    if (!dev->backend_data) dev->backend_data = &s_default_state;
+    H4State *s = h4_state(dev);
+
+    bool opened_device = false;
+    if (s->fd < 0) {
+        if (s->device_path[0] == '\0') {
+            const char *path = getenv("BTE_H4_DEVICE");
+            const char *baud_rate = getenv("BTE_H4_BAUD_RATE");
+            if (!path) {
+                BTE_WARN("No H4 device configured\n");
+                return -ENODEV;
+            }
+            h4_set_device(s, path,
+                          baud_rate ? strtoul(baud_rate, NULL, 10) : 0);
+        }
+        int rc = h4_open_device(s);
+        if (rc < 0) return rc;
+        opened_device = true;
+    }
+
+    int rc;
+    int flags = fcntl(s->fd, F_GETFL);
+    if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        goto error;
+
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0) goto error;
+
+    s->epoll_events = EPOLLIN;
+    struct epoll_event event = { .events = s->epoll_events, .data.fd = s->fd };
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->fd, &event) < 0) goto error;
+
+    s->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wakeup_fd < 0) goto error;
+    event.events = EPOLLIN;
+    event.data.fd = s->wakeup_fd;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wakeup_fd, &event) < 0)
+        goto error;
+
+    s->rx_start = s->rx_end = s->rx_discard = 0;
+    s->rx_blocked = false;
+    return 0;
+
+error:
+    /* Leave the state as we found it, so that init can be retried */
+    rc = -errno;
+    if (s->wakeup_fd >= 0) {
+        close(s->wakeup_fd);
+        s->wakeup_fd = -1;
+    }
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+        s->epoll_fd = -1;
+    }
+    if (opened_device) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    return rc;
+}
+
+static int h4_handle_events(BteHciDev *dev, bool wait_for_events,
+                            uint32_t timeout_ms)
+{
+    H4State *s = h4_state(dev);
+    if (UNLIKELY(!s || s->epoll_fd < 0)) return -EBADF;
+
+    /* Deliver the packets that were left in the buffer, if the buffers that
+     * were blocking them have been released */
+    s->rx_blocked = false;
+    int num_packets = h4_process_rx(dev);
+    h4_update_epoll_events(s);
+
+    int timeout = 0;
+    if (wait_for_events && num_packets == 0) {
+        timeout = timeout_ms == 0 ? -1 : (int)MIN2(timeout_ms, INT_MAX);
+    }
+
+    struct epoll_event events[2];
+    int n = epoll_wait(s->epoll_fd, events, 2, timeout);
+    if (n < 0) return errno == EINTR ? num_packets : -errno;
+
+    for (int i = 0; i < n; i++) {
+        const struct epoll_event *event = &events[i];
+        if (event->data.fd == s->wakeup_fd) {
+            /* Just clear it: the caller processes the queued calls */
+            uint64_t count;
+            if (read(s->wakeup_fd, &count, sizeof(count)) < 0 &&
+                errno != EAGAIN) return -errno;
+            continue;
+        }
+
+        if (event->events & EPOLLOUT) {
+            int rc = h4_flush_tx(s);
+            if (UNLIKELY(rc < 0)) return rc;
+        }
+
+        if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            int rc = h4_read(dev);
+            if (UNLIKELY(rc < 0)) return rc;
+            num_packets += rc;
+        }
+    }
+
+    h4_update_epoll_events(s);
+    return num_packets;
+}
+
+static int h4_hci_send_command(BteHciDev *dev, BteBuffer *buf)
+{
+    return h4_send(h4_state(dev), HCI_COMMAND_DATA_PACKET, buf);
+}
+
+static int h4_hci_send_data(BteHciDev *dev, BteBuffer *buf)
+{
+    return h4_send(h4_state(dev), HCI_ACL_DATA_PACKET, buf);
+}
+
+static void h4_wakeup(BteHciDev *dev)
+{
+    /* This is called from other threads, while the loop might be blocked in
+     * epoll_wait() */
+    H4State *s = h4_state(dev);
+    if (UNLIKELY(!s || s->wakeup_fd < 0)) return;
+
+    uint64_t count = 1;
+    if (write(s->wakeup_fd, &count, sizeof(count)) < 0) {
+        /* Only fails if the counter is saturated, which is fine */
+    }
+}
+
+static int h4_deinit(BteHciDev *dev)
+{
+    H4State *s = h4_state(dev);
+    if (!s) return 0;
+
+    while (s->tx_count > 0) {
+        bte_buffer_unref(s->tx_queue[s->tx_head].buffer);
+        s->tx_head = (s->tx_head + 1) % H4_TX_QUEUE_SIZE;
+        s->tx_count--;
+    }
+    s->tx_offset = 0;
+
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+        s->epoll_fd = -1;
+    }
+    if (s->wakeup_fd >= 0) {
+        close(s->wakeup_fd);
+        s->wakeup_fd = -1;
+    }
+    if (s->owns_fd && s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s != &s_default_state) free(s);
+    dev->backend_data = NULL;
+    return 0;
+}
+
+const BteBackend _bte_backend = {
+    /* Chained buffers are sent with writev() */
+    .capabilities = BTE_BACKEND_CAP_SCATTER_GATHER,
+    .acl_rx_buffer_count = H4_BUFFER_ACL_COUNT,
+    .acl_rx_buffer_size = H4_ACL_BUF_SIZE - HCI_ACL_HDR_LEN,
+
+    .init = h4_init,
+
+    .handle_events = h4_handle_events,
+
+    .hci_send_command = h4_hci_send_command,
+    .hci_send_data = h4_hci_send_data,
+
+    .deinit = h4_deinit,
+
+    .wakeup = h4_wakeup,
+};
@@ -0,0 +1,39 @@
+#ifndef BTE_BACKENDS_LINUX_H4_H
+#define BTE_BACKENDS_LINUX_H4_H
+
+#include "../types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Configuration of the Linux H4 (UART) backend. These functions must be
+ * called before the first client is created, since that's when the backend
+ * gets initialized.
+ *
+ * If none of them is called, the backend reads the device path and baud rate
+ * from the BTE_H4_DEVICE and BTE_H4_BAUD_RATE environment variables. */
+
+/* Open the serial device at the given path (for example, "/dev/ttyUSB0"),
+ * configure it in raw mode with hardware flow control and set its speed. A
+ * baud_rate of 0 leaves the current speed of the device untouched. */
+void bte_linux_h4_set_device(const char *path, uint32_t baud_rate);
+
+/* Use an already opened file descriptor (a pty, a socket...) carrying the H4
+ * stream. The descriptor is switched to non-blocking mode, but its other
+ * settings are left untouched, and it's not closed when the backend is
+ * deinitialized. */
+void bte_linux_h4_set_fd(int fd);
+
+/* The functions above configure the default device. Additional controllers
+ * get a device of their own: this creates one using the serial device at the
+ * given path, with the same settings as bte_linux_h4_set_device(). The device
+ * is initialized when its first client is created (see
+ * bte_client_new_for_dev()), and must be released with bte_hci_dev_free(). */
+BteHciDev *bte_linux_h4_dev_new(const char *path, uint32_t baud_rate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_BACKENDS_LINUX_H4_H */
@@ -1,6 +1,7 @@
 #include "backend.h"
 #include "internals.h"
 #include "logging.h"
+#include "spsc_ring.h"
 #include "utils.h"
 
 #include <assert.h>
@@ -34,15 +35,16 @@ typedef enum {
     WII_EVENT_DATA,
 } WiiEventType;
 
-typedef struct wii_event_t WiiEvent;
+typedef struct {
+    WiiEventType type;
+    BteBuffer *buffer;
+} WiiEvent;
 
+/* Filled by the USB callbacks, consumed by wii_handle_events() */
 typedef struct {
-    struct wii_event_t {
-        WiiEventType type;
-        BteBuffer *buffer;
-    } ATTRIBUTE_PACKED events[WII_MAX_EVENTS];
-    int current_index;
-    int missed_events;
+    BteSpscRing ring;
+    WiiEvent events[WII_MAX_EVENTS];
+    atomic_int missed_events;
 } WiiEventQueue;
 
 typedef struct {
@@ -60,6 +62,9 @@ static WiiBufferData *s_wii_buffer_data;
 static WiiEventQueue s_wii_event_queue;
 
 static int s_bt_fd = -1;
+/* Set when no buffer was available to read ACL data: the reading is then
+ * restarted once a buffer is released */
+static atomic_bool s_bulk_stalled;
 static cond_t s_event_cond = LWP_COND_NULL;
 static mutex_t s_event_mutex = LWP_MUTEX_NULL;
 
@@ -98,13 +103,19 @@ static BteBuffer *wii_buffer_intr_alloc(uint16_t size)
     return NULL;
 }
 
+static void wii_buffer_data_free(BteBuffer *buffer)
+{
+    buffer->ref_count = 0;
+    if (atomic_exchange(&s_bulk_stalled, false)) read_bulk();
+}
+
 static BteBuffer *wii_buffer_data_alloc(uint16_t size)
 {
     for (int i = 0; i < WII_BUFFER_DATA_COUNT; i++) {
         BteBuffer *buffer = &s_wii_buffer_data[i].buffer;
         if (buffer->ref_count == 0) {
             buffer->ref_count = 1;
-            buffer->free_func = wii_buffer_free;
+            buffer->free_func = wii_buffer_data_free;
             buffer->total_size = buffer->size = size;
             buffer->next = NULL;
             return buffer;
@@ -115,14 +126,18 @@ static BteBuffer *wii_buffer_data_alloc(uint16_t size)
 
 static inline void queue_event(WiiEventType type, BteBuffer *buffer)
 {
-    if (s_wii_event_queue.current_index >= WII_MAX_EVENTS) {
-        s_wii_event_queue.missed_events++;
+    WiiEventQueue *queue = &s_wii_event_queue;
+    int32_t slot = _bte_spsc_ring_write_slot(&queue->ring);
+    if (UNLIKELY(slot < 0)) {
+        atomic_fetch_add(&queue->missed_events, 1);
+        bte_buffer_unref(buffer);
         return;
     }
 
-    WiiEvent *e = &s_wii_event_queue.events[s_wii_event_queue.current_index++];
+    WiiEvent *e = &queue->events[slot];
     e->type = type;
     e->buffer = buffer;
+    _bte_spsc_ring_push(&queue->ring);
     LWP_CondSignal(s_event_cond);
 }
 
@@ -173,7 +188,20 @@ static s32 read_bulk()
 
     u16 len = ACL_BUF_SIZE;
     BteBuffer *buf = wii_buffer_data_alloc(len);
-    if (!buf) return -ENOMEM;
+    if (!buf) {
+        /* All buffers are held by the clients. Since flow control is enabled,
+         * the controller won't send more data than we can store: let the
+         * next released buffer resume the reading, but check again in case
+         * one was released meanwhile. */
+        atomic_store(&s_bulk_stalled, true);
+        buf = wii_buffer_data_alloc(len);
+        if (!buf) return -ENOMEM;
+        if (!atomic_exchange(&s_bulk_stalled, false)) {
+            /* wii_buffer_data_free() has already resumed the reading */
+            buf->ref_count = 0;
+            return 0;
+        }
+    }
 
     u8 *ptr = bte_buffer_contiguous_data(buf, len);
     s32 ret = USB_ReadBlkMsgAsync(s_bt_fd, ENDPOINT_ACL_IN, len, ptr,
@@ -181,7 +209,7 @@ static s32 read_bulk()
     return ret;
 }
 
-static int wii_init()
+static int wii_init(BteHciDev *dev)
 {
     int rc = USB_Initialize();
     BTE_DEBUG("USB_Initialize returned %d\n", rc);
@@ -196,6 +224,7 @@ static int wii_init()
 
     LWP_CondInit(&s_event_cond);
     LWP_MutexInit(&s_event_mutex, false);
+    _bte_spsc_ring_init(&s_wii_event_queue.ring, WII_MAX_EVENTS);
 
     s_wii_buffer_intr =
         alloc_usb_buffers(sizeof(WiiBufferIntr) * WII_BUFFER_INTR_COUNT);
@@ -210,20 +239,12 @@ static int wii_init()
     return 0;
 }
 
-static int wii_handle_events(bool wait_for_events, uint32_t timeout_ms)
+static int wii_handle_events(BteHciDev *dev, bool wait_for_events,
+                             uint32_t timeout_ms)
 {
-    WiiEventQueue queue;
-    u32 level;
+    WiiEventQueue *queue = &s_wii_event_queue;
 
-    LWP_MutexLock(s_event_mutex);
-    _CPU_ISR_Disable(level);
-    /* Create a copy of the queue to ensure it doesn't get modified while we
-     * process it */
-    memcpy(&queue, &s_wii_event_queue, sizeof(queue));
-    s_wii_event_queue.current_index = 0; /* empty the queue */
-    s_wii_event_queue.missed_events = 0;
-    _CPU_ISR_Restore(level);
-    if (wait_for_events && queue.current_index == 0) {
+    if (wait_for_events && _bte_spsc_ring_count(&queue->ring) == 0) {
         /* Note that here there is a small risk of a deadlock: if an event is
          * received right at this point, the interrupt handler will run and
          * call LWP_CondSignal() before we have called LWP_CondWait()
@@ -235,31 +256,33 @@ static int wii_handle_events(bool wait_for_events, uint32_t timeout_ms)
         struct timespec ts;
         ts.tv_sec = timeout_ms / 1000000;
         ts.tv_nsec = (timeout_ms % 1000000) * 1000;
+        LWP_MutexLock(s_event_mutex);
         LWP_CondTimedWait(s_event_cond, s_event_mutex, &ts);
-        _CPU_ISR_Disable(level);
-        memcpy(&queue, &s_wii_event_queue, sizeof(queue));
-        s_wii_event_queue.current_index = 0; /* empty the queue */
-        s_wii_event_queue.missed_events = 0;
-        _CPU_ISR_Restore(level);
+        LWP_MutexUnlock(s_event_mutex);
     }
-    LWP_MutexUnlock(s_event_mutex);
 
-    if (UNLIKELY(queue.missed_events > 0)) {
-        BTE_WARN("%d events were not reported!", queue.missed_events);
+    int missed_events = atomic_exchange(&queue->missed_events, 0);
+    if (UNLIKELY(missed_events > 0)) {
+        BTE_WARN("%d events were not reported!", missed_events);
     }
 
-    for (int i = 0; i < queue.current_index; i++) {
-        WiiEvent *event = &queue.events[i];
+    /* Only process the events which are already there: those arriving
+     * meanwhile will be handled in the next call */
+    uint32_t count = _bte_spsc_ring_count(&queue->ring);
+    for (uint32_t i = 0; i < count; i++) {
+        WiiEvent *event =
+            &queue->events[_bte_spsc_ring_read_slot(&queue->ring)];
 
         if (event->type == WII_EVENT_INTR) {
-            _bte_hci_dev_handle_event(event->buffer);
+            _bte_hci_dev_handle_event(dev, event->buffer);
         } else if (event->type == WII_EVENT_DATA) {
-            _bte_hci_dev_handle_data(event->buffer);
+            _bte_hci_dev_handle_data(dev, event->buffer);
         }
         bte_buffer_unref(event->buffer);
+        _bte_spsc_ring_pop(&queue->ring);
     }
 
-    return queue.current_index;
+    return count;
 }
 
 static s32 hci_send_command_cb(s32 result, void *userdata)
@@ -269,10 +292,10 @@ static s32 hci_send_command_cb(s32 result, void *userdata)
     return result;
 }
 
-static int wii_hci_send_command(BteBuffer *buf)
+static int wii_hci_send_command(BteHciDev *dev, BteBuffer *buf)
 {
-    BTE_DEBUG("%s fd = %d, buf %p, data %p, size=%d\n", __func__, s_bt_fd, buf,
-              buf->data, buf->size);
+    BTE_DEBUG_DEFERRED("Sending command %04x, size %u\n",
+                       read_le16(buf->data), buf->size);
     if (UNLIKELY(s_bt_fd < 0)) return -EBADF;
 
     int rc;
@@ -300,26 +323,16 @@ static s32 hci_send_data_cb(s32 result, void *userdata)
     return result;
 }
 
-static int wii_hci_send_data(BteBuffer *buf)
+static int wii_hci_send_data(BteHciDev *dev, BteBuffer *buf)
 {
     if (UNLIKELY(s_bt_fd < 0)) return -EBADF;
 
-    BteBuffer *sent_buf;
-
-    if (buf->total_size == buf->size) {
-        sent_buf = buf;
-        bte_buffer_ref(buf);
-    } else {
-        sent_buf = bte_buffer_alloc_contiguous(buf->total_size);
-        if (UNLIKELY(!sent_buf)) return -ENOMEM;
-
-        BteBufferReader reader;
-        bte_buffer_reader_init(&reader, buf);
-        bte_buffer_reader_read(&reader, sent_buf->data, buf->total_size);
-    }
+    /* Since we don't advertise BTE_BACKEND_CAP_SCATTER_GATHER, the buffer is
+     * always contiguous */
+    bte_buffer_ref(buf);
     int rc = USB_WriteBlkMsgAsync(s_bt_fd, ENDPOINT_ACL_OUT,
-                                  sent_buf->size, sent_buf->data,
-                                  hci_send_data_cb, sent_buf);
+                                  buf->total_size, buf->data,
+                                  hci_send_data_cb, buf);
     if (UNLIKELY(rc != USB_OK)) {
         bte_buffer_unref(buf);
         rc = -EIO;
@@ -327,14 +340,27 @@ static int wii_hci_send_data(BteBuffer *buf)
     return rc;
 }
 
-static int wii_deinit()
+static void wii_wakeup(BteHciDev *dev)
+{
+    if (s_event_cond == LWP_COND_NULL) return;
+    LWP_MutexLock(s_event_mutex);
+    LWP_CondSignal(s_event_cond);
+    LWP_MutexUnlock(s_event_mutex);
+}
+
+static int wii_deinit(BteHciDev *dev)
 {
     USB_CloseDevice(&s_bt_fd);
 
     return 0;
 }
 
+/* The console has a single controller, and all the state above is static:
+ * only the default device can use this backend */
 const BteBackend _bte_backend = {
+    .acl_rx_buffer_count = WII_BUFFER_DATA_COUNT,
+    .acl_rx_buffer_size = ACL_BUF_SIZE - HCI_ACL_HDR_LEN,
+
     .init = wii_init,
 
     .handle_events = wii_handle_events,
@@ -343,4 +369,6 @@ const BteBackend _bte_backend = {
     .hci_send_data = wii_hci_send_data,
 
     .deinit = wii_deinit,
+
+    .wakeup = wii_wakeup,
 };
@@ -1,16 +1,93 @@
 #include "bte.h"
 
 #include "backend.h"
+#include "internals.h"
 #include "logging.h"
 
+#include <errno.h>
+
+int bte_hci_dev_wait_events(BteHciDev *dev, uint32_t timeout_ms)
+{
+    /* Don't sleep if other threads have left some work for us */
+    bool wait_for_events = _bte_hci_dev_process_calls(dev) == 0 &&
+        !_bte_hci_dev_has_calls(dev);
+    /* The controller might be waiting for these before sending more data */
+    _bte_hci_dev_flush_host_completed(dev);
+    timeout_ms = _bte_hci_dev_timers_wait_ms(dev, timeout_ms);
+    int rc = dev->backend->handle_events(dev, wait_for_events, timeout_ms);
+    _bte_hci_dev_process_timers(dev);
+    _bte_hci_dev_process_calls(dev);
+    if (dev->acl_tx_retry) _bte_hci_dev_acl_schedule(dev);
+    _bte_hci_dev_flush_host_completed(dev);
+    return rc;
+}
+
+int bte_hci_dev_handle_events(BteHciDev *dev)
+{
+    bool wait_for_events = false;
+    _bte_hci_dev_process_calls(dev);
+    int rc = dev->backend->handle_events(dev, wait_for_events, 0);
+    _bte_hci_dev_process_timers(dev);
+    _bte_hci_dev_process_calls(dev);
+    if (dev->acl_tx_retry) _bte_hci_dev_acl_schedule(dev);
+    _bte_hci_dev_flush_host_completed(dev);
+    return rc;
+}
+
 int bte_wait_events(uint32_t timeout_ms)
 {
-    bool wait_for_events = true;
-    return _bte_backend.handle_events(wait_for_events, timeout_ms);
+    return bte_hci_dev_wait_events(&_bte_hci_dev, timeout_ms);
 }
 
 int bte_handle_events(void)
 {
-    bool wait_for_events = false;
-    return _bte_backend.handle_events(wait_for_events, 0);
+    return bte_hci_dev_handle_events(&_bte_hci_dev);
+}
+
+BteHciDev *bte_hci_dev_get_default(void)
+{
+    return &_bte_hci_dev;
+}
+
+static void dev_wakeup(BteHciDev *dev)
+{
+    if (dev->backend->wakeup) dev->backend->wakeup(dev);
+}
+
+int bte_hci_dev_call(BteHciDev *dev, BteHciDevCallCb callback,
+                     void *userdata)
+{
+    uint32_t pos;
+    if (UNLIKELY(!_bte_mpsc_ring_reserve(&dev->call_ring, &pos))) {
+        return -EAGAIN;
+    }
+
+    struct bte_hci_dev_call_t *call =
+        &dev->calls[_bte_mpsc_ring_slot(&dev->call_ring, pos)];
+    call->callback = callback;
+    call->userdata = userdata;
+    _bte_mpsc_ring_commit(&dev->call_ring, pos);
+    dev_wakeup(dev);
+    return 0;
+}
+
+int bte_hci_dev_run(BteHciDev *dev)
+{
+    int rc = 0;
+    while (!atomic_load(&dev->loop_quit)) {
+        rc = bte_hci_dev_wait_events(dev, 0);
+        if (UNLIKELY(rc < 0)) {
+            BTE_WARN("Event loop stopped: %d\n", rc);
+            break;
+        }
+    }
+    /* Let the loop be started again */
+    atomic_store(&dev->loop_quit, false);
+    return rc < 0 ? rc : 0;
+}
+
+void bte_hci_dev_quit(BteHciDev *dev)
+{
+    atomic_store(&dev->loop_quit, true);
+    dev_wakeup(dev);
 }
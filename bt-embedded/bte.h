@@ -16,6 +16,41 @@ int bte_wait_events(uint32_t timeout_ms);
  * there are no events to deliver. */
 int bte_handle_events(void);
 
+/* The functions above serve the default device, which uses the backend the
+ * library was built with. Systems with more than one controller create a
+ * device for each of the others: every device has its own command queue,
+ * connections and clients, and its events are processed by the functions
+ * below, which behave like the ones above. */
+BteHciDev *bte_hci_dev_new(const BteBackend *backend, void *backend_data);
+/* Releases the device, which must not have any clients left */
+void bte_hci_dev_free(BteHciDev *dev);
+
+int bte_hci_dev_wait_events(BteHciDev *dev, uint32_t timeout_ms);
+int bte_hci_dev_handle_events(BteHciDev *dev);
+
+/* The default device, for the functions below */
+BteHciDev *bte_hci_dev_get_default(void);
+
+/* Each device can be serviced by an event loop running in a thread of its
+ * own, so that several controllers are handled in parallel. The clients of a
+ * device are bound to its loop: their callbacks are invoked in the loop
+ * thread, and the bte_hci_* functions must be called from there too. Other
+ * threads hand work over to the loop with bte_hci_dev_call(). */
+typedef void (*BteHciDevCallCb)(BteHciDev *dev, void *userdata);
+
+/* Queues a function to be run by the event loop of the device, waking the
+ * loop up if it's waiting for events. Can be called from any thread; returns
+ * -EAGAIN if the queue is full. */
+int bte_hci_dev_call(BteHciDev *dev, BteHciDevCallCb callback,
+                     void *userdata);
+
+/* Processes the events of the device until bte_hci_dev_quit() is called:
+ * this is meant to be the body of the thread servicing the device. Returns
+ * 0, or a negative error code if the backend failed. */
+int bte_hci_dev_run(BteHciDev *dev);
+/* Makes bte_hci_dev_run() return; can be called from any thread */
+void bte_hci_dev_quit(BteHciDev *dev);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,198 @@
+#include "buffer.h"
+
+#include "utils.h"
+
+#include <stdalign.h>
+
+/* Pool slots are stored in static arrays, and the free slots are linked
+ * through a separate array of indices. The head of each free list packs the
+ * index of the first free slot with a tag, which is incremented on every
+ * update to protect the compare-and-swap from the ABA problem. Slots which
+ * have never been used are not in the free list: they are handed out by
+ * bumping the high-water mark, so that no initialization is needed. */
+
+#define POOL_EMPTY 0xffff
+
+#ifdef BTE_BUFFER_ALIGNMENT_SIZE
+#  define POOL_ALIGN BTE_BUFFER_ALIGNMENT_SIZE
+#else
+#  define POOL_ALIGN alignof(BteBuffer)
+#endif
+
+#define POOL_STRIDE(size) \
+    ((sizeof(BteBuffer) + (size) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+typedef struct {
+    uint8_t *storage;
+    atomic_uint_least16_t *next_free;
+    uint16_t stride;
+    uint16_t size;
+    uint16_t count;
+    atomic_uint_least32_t free_head;
+    atomic_uint_least16_t num_used;
+} BufferPool;
+
+#define DEFINE_POOL_STORAGE(name, size, count) \
+    static alignas(POOL_ALIGN) uint8_t \
+        s_##name##_storage[(count) > 0 ? (count) * POOL_STRIDE(size) : 1]; \
+    static atomic_uint_least16_t s_##name##_next_free[(count) > 0 ? (count) : 1]
+
+#define POOL(name, payload_size, num) { \
+    .storage = s_##name##_storage, \
+    .next_free = s_##name##_next_free, \
+    .stride = POOL_STRIDE(payload_size), \
+    .size = (payload_size), \
+    .count = (num), \
+    .free_head = POOL_EMPTY, \
+}
+
+DEFINE_POOL_STORAGE(small, BTE_BUFFER_POOL_SMALL_SIZE,
+                    BTE_BUFFER_POOL_SMALL_COUNT);
+DEFINE_POOL_STORAGE(medium, BTE_BUFFER_POOL_MEDIUM_SIZE,
+                    BTE_BUFFER_POOL_MEDIUM_COUNT);
+DEFINE_POOL_STORAGE(large, BTE_BUFFER_POOL_LARGE_SIZE,
+                    BTE_BUFFER_POOL_LARGE_COUNT);
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+DEFINE_POOL_STORAGE(segment, BTE_BUFFER_SEGMENT_SIZE,
+                    BTE_BUFFER_POOL_SEGMENT_COUNT);
+#endif
+
+/* Ordered by size */
+static BufferPool s_pools[] = {
+    POOL(small, BTE_BUFFER_POOL_SMALL_SIZE, BTE_BUFFER_POOL_SMALL_COUNT),
+    POOL(medium, BTE_BUFFER_POOL_MEDIUM_SIZE, BTE_BUFFER_POOL_MEDIUM_COUNT),
+    POOL(large, BTE_BUFFER_POOL_LARGE_SIZE, BTE_BUFFER_POOL_LARGE_COUNT),
+};
+
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+static BufferPool s_segment_pool =
+    POOL(segment, BTE_BUFFER_SEGMENT_SIZE, BTE_BUFFER_POOL_SEGMENT_COUNT);
+#endif
+
+static inline BteBuffer *pool_slot(BufferPool *pool, uint16_t index)
+{
+    return (BteBuffer *)(pool->storage + index * pool->stride);
+}
+
+static BteBuffer *pool_get(BufferPool *pool)
+{
+    uint32_t head = atomic_load(&pool->free_head);
+    uint16_t index;
+    do {
+        index = head & 0xffff;
+        if (index == POOL_EMPTY) break;
+        uint32_t next = atomic_load_explicit(&pool->next_free[index],
+                                             memory_order_relaxed);
+        uint32_t new_head = ((head & 0xffff0000) + 0x10000) | next;
+        if (atomic_compare_exchange_weak(&pool->free_head, &head, new_head)) {
+            return pool_slot(pool, index);
+        }
+    } while (true);
+
+    /* The free list is empty: take a slot which was never used */
+    uint16_t used = atomic_load(&pool->num_used);
+    do {
+        if (used >= pool->count) return NULL;
+    } while (!atomic_compare_exchange_weak(&pool->num_used, &used, used + 1));
+    return pool_slot(pool, used);
+}
+
+static void pool_put(BufferPool *pool, BteBuffer *buffer)
+{
+    uint16_t index = ((uint8_t *)buffer - pool->storage) / pool->stride;
+    uint32_t head = atomic_load(&pool->free_head);
+    uint32_t new_head;
+    do {
+        atomic_store_explicit(&pool->next_free[index], head & 0xffff,
+                              memory_order_relaxed);
+        new_head = ((head & 0xffff0000) + 0x10000) | index;
+    } while (!atomic_compare_exchange_weak(&pool->free_head, &head, new_head));
+}
+
+static inline bool pool_contains(const BufferPool *pool, const void *ptr)
+{
+    return (const uint8_t *)ptr >= pool->storage &&
+        (const uint8_t *)ptr < pool->storage + pool->count * pool->stride;
+}
+
+static BteBuffer *buffer_init(BteBuffer *b, uint16_t size)
+{
+    b->ref_count = 1;
+    b->free_func = bte_buffer_free;
+    b->total_size = b->size = size;
+    b->next = NULL;
+    return b;
+}
+
+BteBuffer *bte_buffer_alloc_contiguous(uint16_t size)
+{
+    BteBuffer *b = NULL;
+    for (int i = 0; i < ARRAY_SIZE(s_pools) && !b; i++) {
+        if (size <= s_pools[i].size) b = pool_get(&s_pools[i]);
+    }
+    if (UNLIKELY(!b)) {
+        b = bte_malloc(sizeof(BteBuffer) + size);
+        if (UNLIKELY(!b)) return NULL;
+    }
+    return buffer_init(b, size);
+}
+
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+static void buffer_chain_free(BteBuffer *buffer)
+{
+    while (buffer) {
+        BteBuffer *next = buffer->next;
+        bte_buffer_free(buffer);
+        buffer = next;
+    }
+}
+
+static BteBuffer *segment_alloc(uint16_t size)
+{
+    BteBuffer *b = pool_get(&s_segment_pool);
+    return b ? buffer_init(b, size) : bte_buffer_alloc_contiguous(size);
+}
+#endif
+
+BteBuffer *bte_buffer_alloc(uint16_t size)
+{
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+    if (size > BTE_BUFFER_SEGMENT_SIZE) {
+        BteBuffer *head = NULL, *tail = NULL;
+        for (uint16_t allocated = 0; allocated < size;) {
+            uint16_t segment_size = MIN2(size - allocated,
+                                         BTE_BUFFER_SEGMENT_SIZE);
+            BteBuffer *b = segment_alloc(segment_size);
+            if (UNLIKELY(!b)) {
+                buffer_chain_free(head);
+                return NULL;
+            }
+            if (tail) tail->next = b;
+            else head = b;
+            tail = b;
+            allocated += segment_size;
+        }
+        head->total_size = size;
+        head->free_func = buffer_chain_free;
+        return head;
+    }
+#endif
+    return bte_buffer_alloc_contiguous(size);
+}
+
+void bte_buffer_free(BteBuffer *buffer)
+{
+    for (int i = 0; i < ARRAY_SIZE(s_pools); i++) {
+        if (pool_contains(&s_pools[i], buffer)) {
+            pool_put(&s_pools[i], buffer);
+            return;
+        }
+    }
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+    if (pool_contains(&s_segment_pool, buffer)) {
+        pool_put(&s_segment_pool, buffer);
+        return;
+    }
+#endif
+    free(buffer);
+}
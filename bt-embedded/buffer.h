@@ -42,25 +42,52 @@ static inline void *bte_malloc(uint16_t size)
 #endif
 }
 
-/* Used for small packets (TODO: clarify) */
-static inline BteBuffer *bte_buffer_alloc_contiguous(uint16_t size)
-{
-    BteBuffer *b = (BteBuffer*)bte_malloc(sizeof(BteBuffer) + size);
-    b->ref_count = 1;
-    b->free_func = (void (*)(BteBuffer *))free;
-    b->total_size = b->size = size;
-    b->next = NULL;
-    return b;
-}
+/* Size classes of the buffer pools used by bte_buffer_alloc(). The sizes are
+ * the payload sizes, and should be large enough for most commands, for any
+ * event, and for an ACL packet of the controller's MTU, respectively. Setting
+ * a count to 0 disables the pool. */
+#ifndef BTE_BUFFER_POOL_SMALL_SIZE
+#  define BTE_BUFFER_POOL_SMALL_SIZE 32
+#endif
+#ifndef BTE_BUFFER_POOL_SMALL_COUNT
+#  define BTE_BUFFER_POOL_SMALL_COUNT 16
+#endif
+#ifndef BTE_BUFFER_POOL_MEDIUM_SIZE
+#  define BTE_BUFFER_POOL_MEDIUM_SIZE 260
+#endif
+#ifndef BTE_BUFFER_POOL_MEDIUM_COUNT
+#  define BTE_BUFFER_POOL_MEDIUM_COUNT 8
+#endif
+#ifndef BTE_BUFFER_POOL_LARGE_SIZE
+#  define BTE_BUFFER_POOL_LARGE_SIZE 1028
+#endif
+#ifndef BTE_BUFFER_POOL_LARGE_COUNT
+#  define BTE_BUFFER_POOL_LARGE_COUNT 8
+#endif
 
-static inline BteBuffer *bte_buffer_alloc(uint16_t size)
-{
-    /* TODO: Let the platform define constants telling how the buffer should be
-     * setup: whether as a big single area, as a list of equally-sized buffers.
-     * Depending on this information, here we should allocate the buffer
-     * accordingly. */
-    return bte_buffer_alloc_contiguous(size);
-}
+/* Number of segments in the pool reserved for chained buffers; only used if
+ * the platform defines BTE_BUFFER_SEGMENT_SIZE */
+#ifndef BTE_BUFFER_POOL_SEGMENT_COUNT
+#  define BTE_BUFFER_POOL_SEGMENT_COUNT 32
+#endif
+
+/* Allocates a contiguous buffer from the smallest pool that fits it; if all
+ * suitable pools are exhausted, falls back to the heap. Can be called from
+ * any thread. */
+BteBuffer *bte_buffer_alloc_contiguous(uint16_t size);
+
+/* Allocates a buffer which might be split into several segments: this
+ * happens when the platform defines BTE_BUFFER_SEGMENT_SIZE and the buffer is
+ * larger than that. Use the BteBufferReader and BteBufferWriter to access the
+ * data. The whole chain is released when the last reference on the head is
+ * dropped. */
+BteBuffer *bte_buffer_alloc(uint16_t size);
+
+/* Releases the memory of a contiguous buffer, without looking at its
+ * reference count. This is the free_func of the buffers returned by
+ * bte_buffer_alloc_contiguous(), and it's exposed so that custom free
+ * functions can chain up to it. */
+void bte_buffer_free(BteBuffer *buffer);
 
 static inline void bte_buffer_shrink(BteBuffer *buffer, uint16_t size)
 {
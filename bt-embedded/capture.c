@@ -0,0 +1,167 @@
+#include "capture.h"
+
+#include "buffer.h"
+#include "clock.h"
+#include "hci_proto.h"
+#include "internals.h"
+#include "mpsc_ring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Microseconds between year 0 and the Unix epoch, as used by btsnoop */
+#define BTSNOOP_EPOCH_DELTA_US 0x00dcddb30f2f8000ULL
+#define BTSNOOP_VERSION        1
+#define BTSNOOP_DATALINK_H4    1002
+
+#define BTSNOOP_FLAG_RECEIVED  (1 << 0)
+#define BTSNOOP_FLAG_CMD_EVENT (1 << 1)
+
+typedef struct {
+    uint64_t timestamp_us;
+    uint16_t orig_len;
+    uint16_t incl_len;
+    uint8_t type;
+    bool received;
+    uint8_t data[BTE_CAPTURE_SNAP_LEN];
+} CaptureRecord;
+
+/* Set with release ordering once the sink is set up */
+atomic_bool _bte_capture_enabled = false;
+
+static CaptureRecord s_records[BTE_CAPTURE_RING_SIZE];
+static atomic_uint_least32_t s_record_sequences[BTE_CAPTURE_RING_SIZE];
+static BteMpscRing s_ring =
+    BTE_MPSC_RING_INIT(s_record_sequences, BTE_CAPTURE_RING_SIZE);
+static atomic_uint_least32_t s_num_dropped;
+
+static BteCaptureWriteCb s_write_cb;
+static void *s_write_userdata;
+static FILE *s_file;
+/* Maps the monotonic clock to the wall clock */
+static uint64_t s_time_offset_us;
+
+static inline void write_be32(uint32_t value, uint8_t *ptr)
+{
+    ptr[0] = value >> 24;
+    ptr[1] = value >> 16;
+    ptr[2] = value >> 8;
+    ptr[3] = value;
+}
+
+static inline void write_be64(uint64_t value, uint8_t *ptr)
+{
+    write_be32(value >> 32, ptr);
+    write_be32(value, ptr + 4);
+}
+
+void _bte_capture_packet(uint8_t type, bool received, BteBuffer *buffer)
+{
+    uint32_t pos;
+    if (UNLIKELY(!_bte_mpsc_ring_reserve(&s_ring, &pos))) {
+        atomic_fetch_add(&s_num_dropped, 1);
+        return;
+    }
+
+    CaptureRecord *record = &s_records[_bte_mpsc_ring_slot(&s_ring, pos)];
+    record->timestamp_us = _bte_clock_now_us();
+    record->type = type;
+    record->received = received;
+    record->orig_len = buffer->total_size;
+    record->incl_len = MIN2(buffer->total_size, BTE_CAPTURE_SNAP_LEN);
+    BteBufferReader reader;
+    bte_buffer_reader_init(&reader, buffer);
+    bte_buffer_reader_read(&reader, record->data, record->incl_len);
+    _bte_mpsc_ring_commit(&s_ring, pos);
+}
+
+static bool file_write(const void *data, size_t size, void *userdata)
+{
+    return fwrite(data, 1, size, userdata) == size;
+}
+
+bool bte_capture_start(BteCaptureWriteCb write_cb, void *userdata)
+{
+    if (UNLIKELY(atomic_load(&_bte_capture_enabled))) return false;
+
+    /* Packets captured by other threads while the previous capture was being
+     * stopped do not belong in this one */
+    while (_bte_mpsc_ring_read_slot(&s_ring) >= 0) {
+        _bte_mpsc_ring_pop(&s_ring);
+    }
+
+    uint8_t header[16] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+    write_be32(BTSNOOP_VERSION, header + 8);
+    write_be32(BTSNOOP_DATALINK_H4, header + 12);
+    if (UNLIKELY(!write_cb(header, sizeof(header), userdata))) return false;
+
+    s_write_cb = write_cb;
+    s_write_userdata = userdata;
+    s_time_offset_us = (uint64_t)time(NULL) * 1000000 - _bte_clock_now_us();
+    atomic_store(&s_num_dropped, 0);
+    atomic_store_explicit(&_bte_capture_enabled, true, memory_order_release);
+    return true;
+}
+
+bool bte_capture_start_file(const char *path)
+{
+    if (UNLIKELY(atomic_load(&_bte_capture_enabled))) return false;
+
+    FILE *file = fopen(path, "wb");
+    if (UNLIKELY(!file)) return false;
+
+    /* Set up before capture is enabled, like the rest of the sink */
+    s_file = file;
+    if (UNLIKELY(!bte_capture_start(file_write, file))) {
+        s_file = NULL;
+        fclose(file);
+        return false;
+    }
+    return true;
+}
+
+int bte_capture_flush(void)
+{
+    if (!s_write_cb) return 0;
+
+    int count = 0;
+    int32_t slot;
+    while ((slot = _bte_mpsc_ring_read_slot(&s_ring)) >= 0) {
+        CaptureRecord *record = &s_records[slot];
+        /* The H4 packet type is part of the packet data */
+        uint8_t header[24 + 1];
+        uint32_t flags = record->received ? BTSNOOP_FLAG_RECEIVED : 0;
+        if (record->type == HCI_COMMAND_DATA_PACKET ||
+            record->type == HCI_EVENT_PACKET) {
+            flags |= BTSNOOP_FLAG_CMD_EVENT;
+        }
+        write_be32(record->orig_len + 1, header);
+        write_be32(record->incl_len + 1, header + 4);
+        write_be32(flags, header + 8);
+        write_be32(atomic_load(&s_num_dropped), header + 12);
+        write_be64(record->timestamp_us + s_time_offset_us +
+                   BTSNOOP_EPOCH_DELTA_US, header + 16);
+        header[24] = record->type;
+
+        bool ok = s_write_cb(header, sizeof(header), s_write_userdata) &&
+            s_write_cb(record->data, record->incl_len, s_write_userdata);
+        _bte_mpsc_ring_pop(&s_ring);
+        if (UNLIKELY(!ok)) return -EIO;
+        count++;
+    }
+    if (s_file) fflush(s_file);
+    return count;
+}
+
+void bte_capture_stop(void)
+{
+    atomic_store(&_bte_capture_enabled, false);
+    bte_capture_flush();
+    if (s_file) {
+        fclose(s_file);
+        s_file = NULL;
+    }
+    s_write_cb = NULL;
+    s_write_userdata = NULL;
+}
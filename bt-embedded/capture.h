@@ -0,0 +1,51 @@
+#ifndef BTE_CAPTURE_H
+#define BTE_CAPTURE_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of packets which can be stored before bte_capture_flush() is called;
+ * must be a power of two */
+#ifndef BTE_CAPTURE_RING_SIZE
+#  define BTE_CAPTURE_RING_SIZE 128
+#endif
+
+/* Maximum number of bytes stored for each packet; the rest is truncated */
+#ifndef BTE_CAPTURE_SNAP_LEN
+#  define BTE_CAPTURE_SNAP_LEN 64
+#endif
+
+/* Writes a chunk of the btsnoop stream; returns false on error */
+typedef bool (*BteCaptureWriteCb)(const void *data, size_t size,
+                                  void *userdata);
+
+/* Starts recording the HCI traffic (commands, events and ACL data). The
+ * packets are stored, with their timestamps, into a preallocated ring, and
+ * only written out in btsnoop format (H4 datalink) when bte_capture_flush()
+ * is called. The btsnoop file header is written right away.
+ * Returns false if a capture is already running or the header could not be
+ * written. */
+bool bte_capture_start(BteCaptureWriteCb write_cb, void *userdata);
+
+/* Like bte_capture_start(), but writes to the given file */
+bool bte_capture_start_file(const char *path);
+
+/* Writes out the recorded packets; this is meant to be called periodically,
+ * from a context where blocking I/O is acceptable. Must not be called from
+ * more than one thread at a time. Returns the number of written packets, or
+ * -EIO on write errors. */
+int bte_capture_flush(void);
+
+/* Flushes the remaining packets and stops the capture */
+void bte_capture_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_CAPTURE_H */
@@ -13,9 +13,9 @@ static void bte_client_free(BteClient *client)
     free(client);
 }
 
-BteClient *bte_client_new(void)
+BteClient *bte_client_new_for_dev(BteHciDev *dev)
 {
-    if (UNLIKELY(_bte_hci_dev_init() < 0)) {
+    if (UNLIKELY(_bte_hci_dev_init(dev) < 0)) {
         return NULL;
     }
 
@@ -24,13 +24,19 @@ BteClient *bte_client_new(void)
 
     memset(client, 0, sizeof(*client));
     client->ref_count = 1;
-    if (UNLIKELY(!_bte_hci_dev_add_client(client))) {
+    client->hci.dev = dev;
+    if (UNLIKELY(!_bte_hci_dev_add_client(dev, client))) {
         bte_client_unref(client);
         return NULL;
     }
     return client;
 }
 
+BteClient *bte_client_new(void)
+{
+    return bte_client_new_for_dev(&_bte_hci_dev);
+}
+
 BteClient *bte_client_ref(BteClient *client)
 {
     atomic_fetch_add(&client->ref_count, 1);
@@ -7,7 +7,12 @@
 extern "C" {
 #endif
 
+/* Creates a client of the default device */
 BteClient *bte_client_new(void);
+/* Creates a client of the given device (see bte_hci_dev_new()); the first
+ * client of a device triggers its initialization. All the callbacks of the
+ * client are invoked from the event loop of its device. */
+BteClient *bte_client_new_for_dev(BteHciDev *dev);
 BteClient *bte_client_ref(BteClient *client);
 void bte_client_unref(BteClient *client);
 
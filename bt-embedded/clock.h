@@ -0,0 +1,35 @@
+#ifndef BTE_CLOCK_H
+#define BTE_CLOCK_H
+
+#include <stdint.h>
+#ifdef __wii__
+#  include <ogc/lwp_watchdog.h>
+#else
+#  include <time.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BUILDING_BT_EMBEDDED
+#error "This is not a public header!"
+#endif
+
+/* Monotonic time, in microseconds, from an unspecified starting point */
+static inline uint64_t _bte_clock_now_us(void)
+{
+#ifdef __wii__
+    return ticks_to_microsecs(gettime());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_CLOCK_H */
@@ -0,0 +1,130 @@
+#include "command_stats.h"
+
+#include "clock.h"
+#include "internals.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(BTE_COMMAND_STATS_MAX_OPCODES < 256,
+               "BTE_COMMAND_STATS_MAX_OPCODES must fit in a byte");
+
+atomic_bool _bte_command_stats_enabled = false;
+
+/* Open addressing index of stats.opcodes, keyed on the opcode; it has twice
+ * as many entries as the opcodes, so it always has some free entries. The
+ * entries hold the position in stats.opcodes, plus one. */
+#define INDEX_SIZE (BTE_COMMAND_STATS_MAX_OPCODES * 2)
+
+/* Each device has its own, allocated when the first event is recorded: they
+ * are only touched from the thread running the device's event loop */
+struct bte_command_stats_data_t {
+    BteCommandStats stats;
+    uint8_t index[INDEX_SIZE];
+};
+
+static BteCommandOpcodeStats *stats_for_opcode(BteCommandStatsData *data,
+                                               uint16_t opcode)
+{
+    BteCommandStats *stats = &data->stats;
+    uint32_t slot = ((opcode * 0x9e3779b1) >> 16) % INDEX_SIZE;
+    while (data->index[slot] != 0) {
+        BteCommandOpcodeStats *os = &stats->opcodes[data->index[slot] - 1];
+        if (os->opcode == opcode) return os;
+        slot = (slot + 1) % INDEX_SIZE;
+    }
+
+    if (UNLIKELY(stats->num_opcodes >= BTE_COMMAND_STATS_MAX_OPCODES)) {
+        stats->num_untracked++;
+        return NULL;
+    }
+    BteCommandOpcodeStats *os = &stats->opcodes[stats->num_opcodes++];
+    os->opcode = opcode;
+    data->index[slot] = stats->num_opcodes;
+    return os;
+}
+
+static inline int latency_bucket(uint32_t latency_us)
+{
+    if (latency_us == 0) return 0;
+    int bucket = 32 - __builtin_clz(latency_us);
+    return MIN2(bucket, BTE_COMMAND_STATS_NUM_BUCKETS - 1);
+}
+
+void _bte_command_stats_record(BteHciDev *dev, BteCommandStatsEvent event,
+                               uint16_t opcode, uint64_t sent_at_us)
+{
+    if (UNLIKELY(!dev->command_stats)) {
+        dev->command_stats = calloc(1, sizeof(BteCommandStatsData));
+        if (UNLIKELY(!dev->command_stats)) return;
+    }
+    BteCommandOpcodeStats *os = stats_for_opcode(dev->command_stats, opcode);
+    if (UNLIKELY(!os)) return;
+
+    switch (event) {
+    case BTE_COMMAND_STATS_SENT:
+        os->num_sent++;
+        break;
+    case BTE_COMMAND_STATS_REJECTED:
+        os->num_rejected++;
+        break;
+    case BTE_COMMAND_STATS_ORPHANED:
+        os->num_orphaned++;
+        break;
+    case BTE_COMMAND_STATS_TIMED_OUT:
+        os->num_timed_out++;
+        break;
+    case BTE_COMMAND_STATS_COMPLETED:
+        {
+            uint64_t elapsed_us = _bte_clock_now_us() - sent_at_us;
+            uint32_t latency_us =
+                elapsed_us > UINT32_MAX ? UINT32_MAX : elapsed_us;
+            os->num_completed++;
+            os->total_latency_us += latency_us;
+            if (latency_us > os->max_latency_us) {
+                os->max_latency_us = latency_us;
+            }
+            os->latency_histogram[latency_bucket(latency_us)]++;
+        }
+        break;
+    }
+}
+
+void _bte_command_stats_free(BteHciDev *dev)
+{
+    free(dev->command_stats);
+    dev->command_stats = NULL;
+}
+
+void bte_command_stats_enable(bool enable)
+{
+    atomic_store_explicit(&_bte_command_stats_enabled, enable,
+                          memory_order_relaxed);
+}
+
+void bte_hci_dev_command_stats_snapshot(BteHciDev *dev,
+                                        BteCommandStats *stats)
+{
+    if (dev->command_stats) {
+        *stats = dev->command_stats->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void bte_hci_dev_command_stats_reset(BteHciDev *dev)
+{
+    if (dev->command_stats) {
+        memset(dev->command_stats, 0, sizeof(*dev->command_stats));
+    }
+}
+
+void bte_command_stats_snapshot(BteCommandStats *stats)
+{
+    bte_hci_dev_command_stats_snapshot(&_bte_hci_dev, stats);
+}
+
+void bte_command_stats_reset(void)
+{
+    bte_hci_dev_command_stats_reset(&_bte_hci_dev);
+}
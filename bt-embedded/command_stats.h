@@ -0,0 +1,69 @@
+#ifndef BTE_COMMAND_STATS_H
+#define BTE_COMMAND_STATS_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of distinct opcodes for which statistics are kept */
+#ifndef BTE_COMMAND_STATS_MAX_OPCODES
+#  define BTE_COMMAND_STATS_MAX_OPCODES 32
+#endif
+
+/* The latency histograms have a logarithmic scale: bucket 0 counts the
+ * replies which arrived in less than 1us, bucket i the ones which arrived in
+ * [2^(i-1), 2^i) us; the last bucket also counts anything slower (above 4
+ * seconds). */
+#define BTE_COMMAND_STATS_NUM_BUCKETS 24
+
+typedef struct {
+    uint16_t opcode;
+    uint32_t num_sent;
+    /* Commands for which the Command Complete or Command Status event has been
+     * received */
+    uint32_t num_completed;
+    /* Commands which could not be issued because no pending command slot was
+     * available (or the same command was already pending), or which the
+     * backend failed to send */
+    uint32_t num_rejected;
+    /* Command Complete or Command Status events which did not match any
+     * pending command */
+    uint32_t num_orphaned;
+    /* Commands which the controller did not answer in time */
+    uint32_t num_timed_out;
+    uint32_t max_latency_us;
+    uint64_t total_latency_us;
+    uint32_t latency_histogram[BTE_COMMAND_STATS_NUM_BUCKETS];
+} BteCommandOpcodeStats;
+
+typedef struct {
+    /* Opcodes in the order they were first seen */
+    uint16_t num_opcodes;
+    BteCommandOpcodeStats opcodes[BTE_COMMAND_STATS_MAX_OPCODES];
+    /* Events about opcodes which did not fit in the table */
+    uint32_t num_untracked;
+} BteCommandStats;
+
+/* Starts or stops collecting per-opcode statistics on the HCI commands of all
+ * devices: their latency is measured from the moment they are sent to the
+ * moment their Command Complete or Command Status event is received.
+ * Collection is disabled by default; stopping it does not clear the collected
+ * data. Can be called from any thread. */
+void bte_command_stats_enable(bool enable);
+
+/* Copies the current statistics of the device; these functions must be
+ * called from the thread running the device's event loop. */
+void bte_hci_dev_command_stats_snapshot(BteHciDev *dev,
+                                        BteCommandStats *stats);
+void bte_hci_dev_command_stats_reset(BteHciDev *dev);
+/* The same, for the default device */
+void bte_command_stats_snapshot(BteCommandStats *stats);
+void bte_command_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_COMMAND_STATS_H */
@@ -66,6 +66,22 @@ static inline bool bte_data_matcher_add_rule(BteDataMatcher *matcher,
     return true;
 }
 
+/* Returns a pointer to the data of the rule at the given index, and fills in
+ * its offset and length; returns NULL if there's no such rule. */
+static inline const uint8_t *bte_data_matcher_get_rule(
+    const BteDataMatcher *matcher, int index, uint8_t *offset, uint8_t *len)
+{
+    if (index >= matcher->num_rules) return NULL;
+
+    const uint8_t *ptr = matcher->bytes;
+    for (int i = 0; i < index; i++) {
+        ptr += 2 + ptr[1];
+    }
+    *offset = ptr[0];
+    *len = ptr[1];
+    return ptr + 2;
+}
+
 static inline bool bte_data_matcher_compare(const BteDataMatcher *matcher,
                                             const void *data, size_t data_len)
 {
@@ -0,0 +1,98 @@
+#include "hci.h"
+#include "internals.h"
+#include "utils.h"
+
+#define MODE_UNKNOWN 0xff
+
+BteHciCachedDevice *_bte_device_cache_lookup(BteHciDev *dev,
+                                             const BteBdAddr *address)
+{
+    for (int i = 0; i < BTE_HCI_DEVICE_CACHE_SIZE; i++) {
+        BteHciCachedDevice *d = &dev->device_cache[i];
+        if (d->last_used &&
+            memcmp(&d->address, address, sizeof(*address)) == 0) {
+            d->last_used = ++dev->device_cache_clock;
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the entry for the device, replacing the least recently used one if
+ * the device is not in the cache yet */
+static BteHciCachedDevice *device_cache_get(BteHciDev *dev,
+                                            const BteBdAddr *address)
+{
+    BteHciCachedDevice *d = _bte_device_cache_lookup(dev, address);
+    if (d) return d;
+
+    d = &dev->device_cache[0];
+    for (int i = 1; i < BTE_HCI_DEVICE_CACHE_SIZE; i++) {
+        BteHciCachedDevice *candidate = &dev->device_cache[i];
+        if (candidate->last_used < d->last_used) d = candidate;
+    }
+    d->address = *address;
+    d->page_scan_rep_mode = MODE_UNKNOWN;
+    d->clock_offset = BTE_HCI_CLOCK_OFFSET_INVALID;
+    d->last_used = ++dev->device_cache_clock;
+    return d;
+}
+
+void _bte_device_cache_update(BteHciDev *dev, const BteBdAddr *address,
+                              uint8_t page_scan_rep_mode,
+                              uint16_t clock_offset)
+{
+    BteHciCachedDevice *d = device_cache_get(dev, address);
+    d->page_scan_rep_mode = page_scan_rep_mode;
+    d->clock_offset = clock_offset;
+}
+
+void _bte_device_cache_handle_event(BteHciDev *dev, uint8_t code,
+                                    const uint8_t *data, uint8_t len)
+{
+    const BteHciAclConnection *conn;
+    BteHciCachedDevice *d;
+
+    switch (code) {
+    case HCI_CONNECTION_COMPLETE:
+        /* status, handle, address, link type, encryption mode */
+        if (len < 11 || data[0] != HCI_SUCCESS) return;
+        device_cache_get(dev, (const BteBdAddr *)(data + 3));
+        break;
+    case HCI_READ_CLOCK_OFFSET_COMPLETE:
+        /* status, handle, clock offset */
+        if (len < 5 || data[0] != HCI_SUCCESS) return;
+        conn = _bte_hci_dev_acl_connection(dev, read_le16(data + 1) &
+                                           HCI_ACL_HANDLE_MASK);
+        if (!conn || conn->state != BTE_HCI_CONN_STATE_CONNECTED) return;
+        d = device_cache_get(dev, &conn->address);
+        d->clock_offset = read_le16(data + 3);
+        break;
+    case HCI_PSCAN_REP_MODE_CHANGE:
+        if (len < 7) return;
+        d = device_cache_get(dev, (const BteBdAddr *)data);
+        d->page_scan_rep_mode = data[6];
+        break;
+    }
+}
+
+bool bte_hci_get_cached_paging_params(BteHci *hci, const BteBdAddr *address,
+                                      uint8_t *page_scan_rep_mode,
+                                      uint16_t *clock_offset)
+{
+    const BteHciCachedDevice *d = _bte_device_cache_lookup(hci_dev(hci),
+                                                           address);
+    if (!d) return false;
+
+    *page_scan_rep_mode = d->page_scan_rep_mode != MODE_UNKNOWN ?
+        d->page_scan_rep_mode : BTE_HCI_PAGE_SCAN_REP_MODE_R2;
+    *clock_offset = d->clock_offset;
+    return true;
+}
+
+void bte_hci_clear_device_cache(BteHci *hci)
+{
+    BteHciDev *dev = hci_dev(hci);
+    memset(dev->device_cache, 0, sizeof(dev->device_cache));
+    dev->device_cache_clock = 0;
+}
@@ -0,0 +1,105 @@
+#include "backend.h"
+#include "client.h"
+#include "driver.h"
+#include "internals.h"
+#include "logging.h"
+
+#define STOP_ON_FAILURE(hci, reply)                                            \
+    if (reply->status != HCI_SUCCESS) {                                        \
+        _bte_hci_dev_set_status(hci_dev(hci), BTE_HCI_INIT_STATUS_FAILED);     \
+        bte_client_unref(bte_hci_get_client(hci));                             \
+        return;                                                                \
+    }
+
+/* Driver for standard HCI controllers which don't need any vendor-specific
+ * setup (firmware upload, patches...) to become operational. */
+
+static void initialization_done(BteHci *hci)
+{
+    BteHciDev *dev = hci_dev(hci);
+
+    BTE_DEBUG("%s\n", __func__);
+    bte_client_unref(bte_hci_get_client(hci));
+    _bte_hci_dev_set_status(dev, BTE_HCI_INIT_STATUS_INITIALIZED);
+}
+
+static void on_bd_addr_done(BteHci *hci, const BteHciReadBdAddrReply *reply,
+                            void *userdata)
+{
+    BteHciDev *dev = userdata;
+
+    BTE_DEBUG("%s\n", __func__);
+    STOP_ON_FAILURE(hci, reply);
+
+    dev->address = reply->address;
+    initialization_done(hci);
+}
+
+/* Failing to enable flow control is not fatal: we just lose data if the
+ * clients are too slow at consuming it */
+static void on_flow_control_done(BteHci *hci, const BteHciReply *reply,
+                                 void *)
+{
+    BTE_DEBUG("%s\n", __func__);
+    if (reply->status != HCI_SUCCESS) {
+        BTE_WARN("Cannot enable flow control (%d)\n", reply->status);
+    }
+    bte_hci_read_bd_addr(hci, on_bd_addr_done);
+}
+
+static void on_host_buffer_size_done(BteHci *hci, const BteHciReply *reply,
+                                     void *)
+{
+    BTE_DEBUG("%s\n", __func__);
+    if (reply->status != HCI_SUCCESS) {
+        on_flow_control_done(hci, reply, NULL);
+        return;
+    }
+    bte_hci_set_ctrl_to_host_flow_control(
+        hci, BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL, on_flow_control_done);
+}
+
+static void on_buffer_size_done(BteHci *hci,
+                                const BteHciReadBufferSizeReply *reply,
+                                void *userdata)
+{
+    BteHciDev *dev = userdata;
+
+    BTE_DEBUG("%s\n", __func__);
+    STOP_ON_FAILURE(hci, reply);
+
+    dev->acl_mtu = reply->acl_mtu;
+    dev->sco_mtu = reply->sco_mtu;
+    dev->acl_max_packets = reply->acl_max_packets;
+    dev->sco_max_packets = reply->sco_max_packets;
+    dev->info_flags |= BTE_HCI_INFO_GOT_BUFFER_SIZE;
+    if (dev->backend->acl_rx_buffer_count > 0) {
+        bte_hci_set_host_buffer_size(hci, dev->backend->acl_rx_buffer_size,
+                                     dev->backend->acl_rx_buffer_count, 0, 0,
+                                     on_host_buffer_size_done);
+    } else {
+        bte_hci_read_bd_addr(hci, on_bd_addr_done);
+    }
+}
+
+static void on_reset_done(BteHci *hci, const BteHciReply *reply, void *)
+{
+    BTE_DEBUG("%s\n", __func__);
+    STOP_ON_FAILURE(hci, reply);
+
+    bte_hci_read_buffer_size(hci, on_buffer_size_done);
+}
+
+static int generic_init(BteHciDev *dev)
+{
+    BteClient *client = bte_client_new_for_dev(dev);
+    bte_client_set_userdata(client, dev);
+    BteHci *hci = bte_hci_get(client);
+
+    bte_hci_reset(hci, on_reset_done);
+    return 0;
+}
+
+const BteDriver _bte_driver = {
+    .init = generic_init,
+};
@@ -1,3 +1,4 @@
+#include "backend.h"
 #include "client.h"
 #include "driver.h"
 #include "internals.h"
@@ -8,7 +9,7 @@
 
 #define STOP_ON_FAILURE(hci, reply)                                            \
     if (reply->status != HCI_SUCCESS) {                                        \
-        _bte_hci_dev_set_status(BTE_HCI_INIT_STATUS_FAILED);                   \
+        _bte_hci_dev_set_status(hci_dev(hci), BTE_HCI_INIT_STATUS_FAILED);     \
         bte_client_unref(bte_hci_get_client(hci));                             \
         return;                                                                \
     }
@@ -42,11 +43,13 @@ static const uint8_t wii_patch_1[92] = {
     0x86, 0xf0, 0x18, 0xfd, 0x21, 0x4f, 0x3b, 0x60
 };
 
-static void initialization_done(BteClient *client)
+static void initialization_done(BteHci *hci)
 {
+    BteHciDev *dev = hci_dev(hci);
+
     BTE_DEBUG("%s\n", __func__);
-    bte_client_unref(client);
-    _bte_hci_dev_set_status(BTE_HCI_INIT_STATUS_INITIALIZED);
+    bte_client_unref(bte_hci_get_client(hci));
+    _bte_hci_dev_set_status(dev, BTE_HCI_INIT_STATUS_INITIALIZED);
 }
 
 static void on_reset_patched_done(BteHci *hci, const BteHciReply *reply, void *)
@@ -74,7 +77,7 @@ static void on_reset_patched_done(BteHci *hci, const BteHciReply *reply, void *)
      * Then BTE_SetEvtFilter(0x01,0x00,NULL,...), which calls
      *   hci_set_event_filter(0x01,0x00,NULL)
      */
-    initialization_done(bte_hci_get_client(hci));
+    initialization_done(hci);
 }
 
 static void on_patch_end_done(BteHci *hci, BteBuffer *reply, void *)
@@ -149,6 +152,30 @@ static void on_read_local_version_done(
     bte_hci_read_bd_addr(hci, on_bd_addr_done);
 }
 
+/* Failing to enable flow control is not fatal: we just lose data if the
+ * clients are too slow at consuming it */
+static void on_flow_control_done(BteHci *hci, const BteHciReply *reply,
+                                 void *)
+{
+    BTE_DEBUG("%s\n", __func__);
+    if (reply->status != HCI_SUCCESS) {
+        BTE_WARN("Cannot enable flow control (%d)\n", reply->status);
+    }
+    bte_hci_read_local_version(hci, on_read_local_version_done);
+}
+
+static void on_host_buffer_size_done(BteHci *hci, const BteHciReply *reply,
+                                     void *)
+{
+    BTE_DEBUG("%s\n", __func__);
+    if (reply->status != HCI_SUCCESS) {
+        on_flow_control_done(hci, reply, NULL);
+        return;
+    }
+    bte_hci_set_ctrl_to_host_flow_control(
+        hci, BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL, on_flow_control_done);
+}
+
 static void on_buffer_size_done(BteHci *hci,
                                 const BteHciReadBufferSizeReply *reply,
                                 void *userdata)
@@ -167,10 +194,12 @@ static void on_buffer_size_done(BteHci *hci,
      * - write_cod
      * - write_local_name
      * - write_pin_type
-     * - read_host_buffer_size
-     * - read_local_version
+     * Then it sets the host buffer size (without enabling flow control,
+     * though) and reads the local version, which we do too.
      */
-    bte_hci_read_local_version(hci, on_read_local_version_done);
+    bte_hci_set_host_buffer_size(hci, dev->backend->acl_rx_buffer_size,
+                                 dev->backend->acl_rx_buffer_count, 0, 0,
+                                 on_host_buffer_size_done);
 }
 
 static void on_reset_done(BteHci *hci, const BteHciReply *reply, void *)
@@ -183,7 +212,7 @@ static void on_reset_done(BteHci *hci, const BteHciReply *reply, void *)
 
 static int wii_init(BteHciDev *dev)
 {
-    BteClient *client = bte_client_new();
+    BteClient *client = bte_client_new_for_dev(dev);
     bte_client_set_userdata(client, dev);
     BteHci *hci = bte_hci_get(client);
 
@@ -4,6 +4,8 @@
 #include "internals.h"
 #include "logging.h"
 
+#include <errno.h>
+
 static void command_complete_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
 {
     if (!client_cb) return;
@@ -16,7 +18,8 @@ static void command_complete_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
 static void write_clock_offset(uint16_t clock_offset, uint8_t *data)
 {
     if (clock_offset != BTE_HCI_CLOCK_OFFSET_INVALID) {
-        write_le16(clock_offset & 0x7fff, data);
+        /* Bit 15 tells the controller that the offset is valid */
+        write_le16((clock_offset & 0x7fff) | 0x8000, data);
     } else {
         write_le16(0, data);
     }
@@ -25,6 +28,7 @@ static void write_clock_offset(uint16_t clock_offset, uint8_t *data)
 static void common_read_connection_status_cb(BteHci *hci, uint8_t status,
                                              BteHciPendingCommand *pc)
 {
+    BteHciDev *dev = hci_dev(hci);
     if (status != 0) goto error;
 
     struct _bte_hci_tmpdata_common_read_connection_t *tmpdata =
@@ -37,16 +41,17 @@ static void common_read_connection_status_cb(BteHci *hci, uint8_t status,
     bte_data_matcher_add_rule(&matcher, handle_le, 2,
                               /* 1 for the status byte */
                               HCI_CMD_EVENT_POS_DATA + 1);
-    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(&matcher);
+    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(dev,
+                                                          &matcher);
     if (UNLIKELY(!ev)) goto error;
 
     ev->hci = hci;
     ev->command_cb.event_common_read_connection.client_cb = tmpdata->client_cb;
-    _bte_hci_dev_install_event_handler(
+    _bte_hci_dev_install_event_handler(dev,
         tmpdata->event_code, tmpdata->handler_cb, NULL);
 
 error:
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 }
 
 static void common_read_connection(BteHci *hci,
@@ -65,7 +70,7 @@ static void common_read_connection(BteHci *hci,
 
     /* In the status callback we read this and setup the event matcher */
     struct _bte_hci_tmpdata_common_read_connection_t *tmpdata =
-        &hci->last_async_cmd_data.common_read_connection;
+        &_bte_hci_async_cmd_data(hci, b)->common_read_connection;
     tmpdata->conn_handle = conn_handle;
     tmpdata->client_cb = client_cb;
     tmpdata->event_code = event_code;
@@ -73,7 +78,7 @@ static void common_read_connection(BteHci *hci,
 
     uint8_t *data = b->data + HCI_CMD_HDR_LEN;
     write_le16(conn_handle, data);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 BteHci *bte_hci_get(BteClient *client)
@@ -86,9 +91,14 @@ BteClient *bte_hci_get_client(BteHci *hci)
     return hci_client(hci);
 }
 
+BteHciDev *bte_hci_get_dev(BteHci *hci)
+{
+    return hci_dev(hci);
+}
+
 void bte_hci_on_initialized(BteHci *hci, BteInitializedCb callback)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    BteHciDev *dev = hci_dev(hci);
     hci->initialized_cb = callback;
     if (dev->init_status == BTE_HCI_INIT_STATUS_INITIALIZED ||
         dev->init_status == BTE_HCI_INIT_STATUS_FAILED) {
@@ -97,29 +107,50 @@ void bte_hci_on_initialized(BteHci *hci, BteInitializedCb callback)
     }
 }
 
-BteHciSupportedFeatures bte_hci_get_supported_features(BteHci *)
+BteHciSupportedFeatures bte_hci_get_supported_features(BteHci *hci)
 {
-    return _bte_hci_dev.supported_features;
+    return hci_dev(hci)->supported_features;
 }
 
 uint16_t bte_hci_get_acl_mtu(BteHci *hci)
 {
-    return _bte_hci_dev.acl_mtu;
+    return hci_dev(hci)->acl_mtu;
 }
 
 uint8_t bte_hci_get_sco_mtu(BteHci *hci)
 {
-    return _bte_hci_dev.sco_mtu;
+    return hci_dev(hci)->sco_mtu;
 }
 
 uint16_t bte_hci_get_acl_max_packets(BteHci *hci)
 {
-    return _bte_hci_dev.acl_max_packets;
+    return hci_dev(hci)->acl_max_packets;
 }
 
 uint16_t bte_hci_get_sco_max_packets(BteHci *hci)
 {
-    return _bte_hci_dev.sco_max_packets;
+    return hci_dev(hci)->sco_max_packets;
+}
+
+void bte_hci_get_command_queue_stats(BteHci *hci,
+                                     BteHciCommandQueueStats *stats)
+{
+    *stats = hci_dev(hci)->command_queue.stats;
+}
+
+void bte_hci_set_command_timeout(BteHci *hci, uint32_t timeout_ms)
+{
+    hci->command_timeout_ms = timeout_ms;
+}
+
+void bte_hci_set_thread_safe(BteHci *hci, bool thread_safe)
+{
+    hci->thread_safe = thread_safe;
+}
+
+unsigned bte_hci_take_rejected_commands(BteHci *hci)
+{
+    return atomic_exchange(&hci->rejected_commands, 0);
 }
 
 void bte_hci_nop(BteHci *hci, BteHciDoneCb callback)
@@ -127,55 +158,253 @@ void bte_hci_nop(BteHci *hci, BteHciDoneCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, 0, 0, 3,
         command_complete_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
+}
+
+/* The Inquiry Result events store the responses column-wise: all the
+ * addresses first, then all the page scan repetition modes, and so on. The
+ * Inquiry Result with RSSI event replaces the page scan period mode with the
+ * RSSI, which comes last. */
+static void inquiry_decode_response(const uint8_t *data, int num_responses,
+                                    int i, bool with_rssi,
+                                    BteHciInquiryResponse *r)
+{
+    const uint8_t *ptr = data;
+    memcpy(&r->address, ptr + sizeof(r->address) * i, sizeof(r->address));
+    ptr += sizeof(r->address) * num_responses;
+    r->page_scan_rep_mode = ptr[i];
+    ptr += num_responses;
+    if (with_rssi) {
+        r->page_scan_period_mode = 0;
+    } else {
+        r->page_scan_period_mode = ptr[i];
+        ptr += num_responses;
+    }
+    r->reserved = ptr[i];
+    ptr += num_responses;
+    int cod_size = sizeof(r->class_of_device);
+    memcpy(&r->class_of_device, ptr + cod_size * i, cod_size);
+    ptr += cod_size * num_responses;
+    r->clock_offset = read_le16(ptr + 2 * i);
+    ptr += 2 * num_responses;
+    r->rssi = with_rssi ? (int8_t)ptr[i] : BTE_HCI_INQUIRY_RSSI_UNKNOWN;
 }
 
-static void inquiry_result_cb(BteBuffer *buffer, void *cb_data)
+typedef struct bte_hci_inquiry_seen_t InquirySeen;
+
+#define INQUIRY_SEEN_MIN_CAPACITY 32
+#define INQUIRY_NOT_STORED UINT8_MAX
+
+static inline uint32_t inquiry_address_hash(const BteBdAddr *address)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    const uint8_t *b = address->bytes;
+    uint32_t h = (b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24)) ^
+        ((b[4] | (b[5] << 8)) * 0x85ebca6b);
+    return (h * 0x9e3779b1) >> 12;
+}
 
-    uint8_t *data = buffer->data + HCI_CMD_REPLY_POS_HDR_LEN;
-    int num_responses = data[0];
-    data++;
+/* Returns the entry for the given address or, if the address is not there,
+ * the free entry where it should go */
+static InquirySeen *inquiry_seen_lookup(InquirySeen *table, uint16_t capacity,
+                                        const BteBdAddr *address)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t i = inquiry_address_hash(address) & mask;
+    while (table[i].used &&
+           memcmp(&table[i].address, address, sizeof(*address)) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static bool inquiry_seen_grow(BteHciDev *dev)
+{
+    struct bte_hci_inquiry_data_t *inquiry = &dev->inquiry;
+    uint16_t capacity = inquiry->seen_capacity ?
+        inquiry->seen_capacity * 2 : INQUIRY_SEEN_MIN_CAPACITY;
+    if (UNLIKELY(capacity < inquiry->seen_capacity)) return false;
+
+    InquirySeen *table = calloc(capacity, sizeof(InquirySeen));
+    if (UNLIKELY(!table)) return false;
+
+    for (int i = 0; i < inquiry->seen_capacity; i++) {
+        const InquirySeen *entry = &inquiry->seen[i];
+        if (!entry->used) continue;
+        *inquiry_seen_lookup(table, capacity, &entry->address) = *entry;
+    }
+    free(inquiry->seen);
+    inquiry->seen = table;
+    inquiry->seen_capacity = capacity;
+    return true;
+}
+
+/* Returns the entry of the device having the given address, adding it (and
+ * setting *is_new) if this is the first time that we see it. Returns NULL if
+ * there's no memory for a new entry. */
+static InquirySeen *inquiry_add_seen(BteHciDev *dev, const BteBdAddr *address,
+                                     bool *is_new)
+{
+    struct bte_hci_inquiry_data_t *inquiry = &dev->inquiry;
+
+    /* Keep the load factor below 1/2 */
+    if (inquiry->num_seen >= inquiry->seen_capacity / 2 &&
+        UNLIKELY(!inquiry_seen_grow(dev))) {
+        return NULL;
+    }
+
+    InquirySeen *entry = inquiry_seen_lookup(inquiry->seen,
+                                             inquiry->seen_capacity, address);
+    *is_new = !entry->used;
+    if (*is_new) {
+        entry->address = *address;
+        entry->used = true;
+        inquiry->num_seen++;
+    }
+    return entry;
+}
 
-    ensure_array_size((void**)&dev->inquiry.responses,
-                      sizeof(BteHciInquiryResponse), 32,
-                      dev->inquiry.num_responses, num_responses);
-    if (UNLIKELY(!dev->inquiry.responses)) return;
+static void inquiry_stream_results(BteHci *hci, const uint8_t *data,
+                                   int num_responses, bool with_rssi,
+                                   const BteHciEir *eir)
+{
+    BteHciDev *dev = hci_dev(hci);
 
-    BteHciInquiryResponse *responses = dev->inquiry.responses;
-    int i_tail = dev->inquiry.num_responses;
     for (int i = 0; i < num_responses; i++) {
-        BteHciInquiryResponse *r = &responses[i_tail];
-        uint8_t *ptr = data;
-        memcpy(&r->address, ptr + sizeof(r->address) * i, sizeof(r->address));
-        ptr += sizeof(r->address) * num_responses;
-        r->page_scan_rep_mode = ptr[i];
-        ptr += num_responses;
-        r->page_scan_period_mode = ptr[i];
-        ptr += num_responses;
-        r->reserved = ptr[i];
-        ptr += num_responses;
-        int cod_size = sizeof(r->class_of_device);
-        memcpy(&r->class_of_device, ptr + cod_size * i, cod_size);
-        ptr += cod_size * num_responses;
-        r->clock_offset = le16toh(*((uint16_t*)ptr + i));
-        /* Check if the record is a duplicate */
-        bool duplicate = false;
-        for (int j = 0; j < dev->inquiry.num_responses; j++) {
-            if (memcmp(r, &responses[j], sizeof(*r)) == 0) {
-                duplicate = true;
-                break;
+        BteHciInquiryResponse r;
+        inquiry_decode_response(data, num_responses, i, with_rssi, &r);
+        _bte_device_cache_update(dev, &r.address, r.page_scan_rep_mode,
+                                 r.clock_offset);
+        bool is_new = false;
+        /* If we cannot remember it, we might report the device again, which
+         * is better than not reporting it at all */
+        if (!inquiry_add_seen(dev, &r.address, &is_new) || is_new) {
+            hci->inquiry_result_cb(hci, &r, eir, hci_userdata(hci));
+        }
+    }
+}
+
+static void inquiry_store_results(BteHciDev *dev, const uint8_t *data,
+                                  int num_responses, bool with_rssi)
+{
+    struct bte_hci_inquiry_data_t *inquiry = &dev->inquiry;
+
+    for (int i = 0; i < num_responses; i++) {
+        BteHciInquiryResponse r;
+        inquiry_decode_response(data, num_responses, i, with_rssi, &r);
+        _bte_device_cache_update(dev, &r.address, r.page_scan_rep_mode,
+                                 r.clock_offset);
+        bool is_new = false;
+        InquirySeen *entry = inquiry_add_seen(dev, &r.address, &is_new);
+        if (UNLIKELY(!entry)) continue;
+
+        if (!is_new) {
+            /* Keep the most recent data (the clock offset drifts) */
+            if (entry->index != INQUIRY_NOT_STORED) {
+                inquiry->responses[entry->index] = r;
             }
+            continue;
         }
-        if (!duplicate) i_tail++;
+
+        /* num_responses is an uint8_t, and the last value is reserved */
+        entry->index = INQUIRY_NOT_STORED;
+        if (UNLIKELY(inquiry->num_responses >= INQUIRY_NOT_STORED)) continue;
+        ensure_array_size((void**)&inquiry->responses,
+                          sizeof(BteHciInquiryResponse), 32,
+                          inquiry->num_responses, 1);
+        if (UNLIKELY(!inquiry->responses)) {
+            /* All the stored indexes are now invalid */
+            _bte_hci_dev_inquiry_cleanup(dev);
+            return;
+        }
+        entry->index = inquiry->num_responses;
+        inquiry->responses[inquiry->num_responses++] = r;
+    }
+}
+
+static void inquiry_handle_results(BteHci *hci, BteBuffer *buffer,
+                                   bool with_rssi)
+{
+    uint8_t *data = buffer->data + HCI_CMD_REPLY_POS_HDR_LEN;
+    int num_responses = data[0];
+    data++;
+    if (UNLIKELY(buffer->size < HCI_CMD_REPLY_POS_HDR_LEN + 1 +
+                 num_responses * HCI_INQUIRY_RESPONSE_LEN)) {
+        return;
+    }
+
+    if (hci->inquiry_result_cb) {
+        inquiry_stream_results(hci, data, num_responses, with_rssi, NULL);
+    } else {
+        inquiry_store_results(hci_dev(hci), data, num_responses, with_rssi);
+    }
+}
+
+static void inquiry_result_cb(BteHciDev *dev, BteBuffer *buffer, void *cb_data)
+{
+    inquiry_handle_results(cb_data, buffer, false);
+}
+
+static void inquiry_result_with_rssi_cb(BteHciDev *dev, BteBuffer *buffer,
+                                        void *cb_data)
+{
+    inquiry_handle_results(cb_data, buffer, true);
+}
+
+/* The Extended Inquiry Result event carries a single response, laid out as in
+ * the Inquiry Result with RSSI event, followed by the EIR data */
+static void extended_inquiry_result_cb(BteHciDev *dev, BteBuffer *buffer,
+                                       void *cb_data)
+{
+    BteHci *hci = cb_data;
+
+    uint8_t *data = buffer->data + HCI_CMD_REPLY_POS_HDR_LEN;
+    if (UNLIKELY(buffer->size < HCI_CMD_REPLY_POS_HDR_LEN + 1 +
+                 HCI_INQUIRY_RESPONSE_LEN || data[0] != 1)) {
+        return;
     }
-    dev->inquiry.num_responses = i_tail;
+    data++;
+
+    if (!hci->inquiry_result_cb) {
+        inquiry_store_results(hci_dev(hci), data, 1, true);
+        return;
+    }
+
+    /* The EIR data might have been truncated by the controller */
+    int eir_len = buffer->size - HCI_CMD_REPLY_POS_HDR_LEN - 1 -
+        HCI_INQUIRY_RESPONSE_LEN;
+    BteHciEir eir = {
+        data + HCI_INQUIRY_RESPONSE_LEN,
+        eir_len < HCI_EIR_DATA_LEN ? eir_len : HCI_EIR_DATA_LEN,
+    };
+    inquiry_stream_results(hci, data, 1, true, &eir);
+}
+
+static void inquiry_install_handlers(BteHci *hci,
+                                     BteHciEventHandlerCb complete_cb)
+{
+    BteHciDev *dev = hci_dev(hci);
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_RESULT,
+                                       inquiry_result_cb, hci);
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_RESULT_WITH_RSSI,
+                                       inquiry_result_with_rssi_cb, hci);
+    _bte_hci_dev_install_event_handler(dev, HCI_EXTENDED_INQUIRY_RESULT,
+                                       extended_inquiry_result_cb, hci);
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_COMPLETE,
+                                       complete_cb, hci);
+}
+
+static void inquiry_remove_handlers(BteHciDev *dev)
+{
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_COMPLETE, NULL, NULL);
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_RESULT, NULL, NULL);
+    _bte_hci_dev_install_event_handler(dev, HCI_INQUIRY_RESULT_WITH_RSSI,
+                                       NULL, NULL);
+    _bte_hci_dev_install_event_handler(dev, HCI_EXTENDED_INQUIRY_RESULT,
+                                       NULL, NULL);
 }
 
-static void inquiry_event_cb(BteBuffer *buffer, void *cb_data)
+static void inquiry_event_cb(BteHciDev *dev, BteBuffer *buffer, void *cb_data)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     BteHci *hci = cb_data;
     BteHciInquiryReply reply;
 
@@ -185,26 +414,67 @@ static void inquiry_event_cb(BteBuffer *buffer, void *cb_data)
     reply.responses = dev->inquiry.responses;
 
     BteHciInquiryCb inquiry_cb = hci->inquiry_cb;
-    _bte_hci_dev_install_event_handler(HCI_INQUIRY_COMPLETE, NULL, NULL);
-    _bte_hci_dev_install_event_handler(HCI_INQUIRY_RESULT, NULL, NULL);
+    inquiry_remove_handlers(dev);
     hci->inquiry_cb = NULL;
 
     inquiry_cb(hci, &reply, hci_userdata(hci));
-    _bte_hci_dev_inquiry_cleanup();
+    _bte_hci_dev_inquiry_cleanup(dev);
 }
 
 static void inquiry_status_cb(BteHci *hci, uint8_t status,
                               BteHciPendingCommand *pc)
 {
     if (status == 0) {
-        _bte_hci_dev_install_event_handler(HCI_INQUIRY_RESULT,
-                                           inquiry_result_cb, hci);
-        _bte_hci_dev_install_event_handler(HCI_INQUIRY_COMPLETE,
-                                           inquiry_event_cb, hci);
+        inquiry_install_handlers(hci, inquiry_event_cb);
     } else {
         hci->inquiry_cb = NULL;
     }
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(hci_dev(hci), pc);
+}
+
+void bte_hci_on_inquiry_result(BteHci *hci, BteHciInquiryResultCb callback)
+{
+    hci->inquiry_result_cb = callback;
+}
+
+void bte_hci_eir_iter_init(BteHciEirIter *iter, const BteHciEir *eir)
+{
+    iter->ptr = eir->data;
+    iter->end = eir->data + eir->len;
+}
+
+bool bte_hci_eir_iter_next(BteHciEirIter *iter, BteHciEirField *field)
+{
+    /* Each structure starts with its length, which includes the type; a zero
+     * length marks the start of the padding */
+    if (iter->end - iter->ptr < 2) return false;
+    uint8_t len = iter->ptr[0];
+    if (len == 0 || UNLIKELY(len > iter->end - iter->ptr - 1)) {
+        iter->ptr = iter->end;
+        return false;
+    }
+
+    field->type = iter->ptr[1];
+    field->len = len - 1;
+    field->data = iter->ptr + 2;
+    iter->ptr += 1 + len;
+    return true;
+}
+
+bool bte_hci_eir_find(const BteHciEir *eir, uint8_t type,
+                      BteHciEirField *field)
+{
+    BteHciEirIter iter;
+    bte_hci_eir_iter_init(&iter, eir);
+    while (bte_hci_eir_iter_next(&iter, field)) {
+        if (field->type == type) return true;
+    }
+    return false;
+}
+
+static void inquiry_prepare(BteHci *hci, BteBuffer *, void *callback)
+{
+    hci->inquiry_cb = callback;
 }
 
 void bte_hci_inquiry(BteHci *hci, BteLap lap, uint8_t len, uint8_t max_resp,
@@ -215,14 +485,13 @@ void bte_hci_inquiry(BteHci *hci, BteLap lap, uint8_t len, uint8_t max_resp,
         inquiry_status_cb, status_cb);
     if (UNLIKELY(!b)) return;
 
-    hci->inquiry_cb = callback;
     uint8_t *data = b->data + HCI_CMD_HDR_LEN;
     data[0] = lap & 0xff;
     data[1] = (lap >> 8) & 0xff;
     data[2] = (lap >> 16) & 0xff;
     data[3] = len;
     data[4] = max_resp;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, inquiry_prepare, callback);
 }
 
 void bte_hci_inquiry_cancel(BteHci *hci, BteHciDoneCb callback)
@@ -231,12 +500,12 @@ void bte_hci_inquiry_cancel(BteHci *hci, BteHciDoneCb callback)
         hci,
         HCI_INQUIRY_CANCEL_OCF, HCI_LINK_CTRL_OGF, HCI_INQUIRY_CANCEL_PLEN,
         command_complete_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void periodic_inquiry_event_cb(BteBuffer *buffer, void *cb_data)
+static void periodic_inquiry_event_cb(BteHciDev *dev, BteBuffer *buffer,
+                                      void *cb_data)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     BteHci *hci = cb_data;
 
     uint8_t *data = buffer->data + HCI_CMD_REPLY_POS_HDR_LEN;
@@ -246,7 +515,7 @@ static void periodic_inquiry_event_cb(BteBuffer *buffer, void *cb_data)
     reply.responses = dev->inquiry.responses;
 
     hci->inquiry_cb(hci, &reply, hci_userdata(hci));
-    _bte_hci_dev_inquiry_cleanup();
+    _bte_hci_dev_inquiry_cleanup(dev);
 }
 
 static void periodic_inquiry_complete_cb(BteHci *hci, BteBuffer *buffer,
@@ -254,16 +523,20 @@ static void periodic_inquiry_complete_cb(BteHci *hci, BteBuffer *buffer,
 {
     uint8_t status = buffer->data[HCI_CMD_REPLY_POS_STATUS];
     if (status == 0) {
-        _bte_hci_dev_install_event_handler(HCI_INQUIRY_RESULT,
-                                           inquiry_result_cb, hci);
-        _bte_hci_dev_install_event_handler(HCI_INQUIRY_COMPLETE,
-                                           periodic_inquiry_event_cb, hci);
+        inquiry_install_handlers(hci, periodic_inquiry_event_cb);
     } else {
         hci->inquiry_cb = NULL;
     }
     command_complete_cb(hci, buffer, client_cb);
 }
 
+static void periodic_inquiry_prepare(BteHci *hci, BteBuffer *,
+                                     void *callback)
+{
+    _bte_hci_dev_inquiry_cleanup(hci_dev(hci));
+    hci->inquiry_cb = callback;
+}
+
 void bte_hci_periodic_inquiry(BteHci *hci,
                               uint16_t min_period, uint16_t max_period,
                               BteLap lap, uint8_t len, uint8_t max_resp,
@@ -278,8 +551,6 @@ void bte_hci_periodic_inquiry(BteHci *hci,
         periodic_inquiry_complete_cb, status_cb);
     if (UNLIKELY(!b)) return;
 
-    _bte_hci_dev_inquiry_cleanup();
-    hci->inquiry_cb = callback;
     uint8_t *data = b->data + HCI_CMD_HDR_LEN;
     *(uint16_t *)&data[0] = htole16(max_period);
     *(uint16_t *)&data[2] = htole16(min_period);
@@ -288,15 +559,15 @@ void bte_hci_periodic_inquiry(BteHci *hci,
     data[6] = (lap >> 16) & 0xff;
     data[7] = len;
     data[8] = max_resp;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, periodic_inquiry_prepare,
+                                     callback);
 }
 
 static void exit_periodic_inquiry_cb(BteHci *hci, BteBuffer *buffer,
                                      void *client_cb)
 {
-    _bte_hci_dev_inquiry_cleanup();
-    _bte_hci_dev_install_event_handler(HCI_INQUIRY_COMPLETE, NULL, NULL);
-    _bte_hci_dev_install_event_handler(HCI_INQUIRY_RESULT, NULL, NULL);
+    _bte_hci_dev_inquiry_cleanup(hci_dev(hci));
+    inquiry_remove_handlers(hci_dev(hci));
     hci->inquiry_cb = NULL;
     command_complete_cb(hci, buffer, client_cb);
 }
@@ -308,12 +579,12 @@ void bte_hci_exit_periodic_inquiry(BteHci *hci, BteHciDoneCb callback)
         HCI_EXIT_PERIODIC_INQUIRY_OCF, HCI_LINK_CTRL_OGF,
         HCI_EXIT_PERIODIC_INQUIRY_PLEN,
         exit_periodic_inquiry_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void conn_complete_event_cb(BteBuffer *buffer, void *)
+static void conn_complete_event_cb(BteHciDev *dev, BteBuffer *buffer, void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -327,10 +598,14 @@ static void conn_complete_event_cb(BteBuffer *buffer, void *)
     data += 6;
     reply.link_type = data[0];
     reply.encryption_mode = data[1];
+    /* This might be synthesized on timeout, not seen by the HCI device */
+    if (reply.status != HCI_SUCCESS) {
+        _bte_hci_dev_connection_failed(dev, &reply.address);
+    }
 
     BteHciCreateConnectionCb create_connection_cb =
         pc->command_cb.event_conn_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     create_connection_cb(hci, &reply, hci_userdata(hci));
 }
@@ -338,6 +613,7 @@ static void conn_complete_event_cb(BteBuffer *buffer, void *)
 static void create_connection_status_cb(BteHci *hci, uint8_t status,
                                         BteHciPendingCommand *pc)
 {
+    BteHciDev *dev = hci_dev(hci);
     if (status != 0) goto error;
 
     struct _bte_hci_tmpdata_create_connection_t *tmpdata =
@@ -350,16 +626,29 @@ static void create_connection_status_cb(BteHci *hci, uint8_t status,
                               &tmpdata->address, 6,
                               /* 3 = 1 status byte + 2 conn handle */
                               HCI_CMD_REPLY_POS_HDR_LEN + 3);
-    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(&matcher);
+    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(dev,
+                                                          &matcher);
     if (UNLIKELY(!ev)) goto error;
 
     ev->hci = hci;
     ev->command_cb.event_conn_complete.client_cb = tmpdata->client_cb;
-    _bte_hci_dev_install_event_handler(HCI_CONNECTION_COMPLETE,
+    _bte_hci_dev_install_event_handler(dev, HCI_CONNECTION_COMPLETE,
                                        conn_complete_event_cb, NULL);
+    _bte_hci_dev_free_command(dev, pc);
+    return;
 
 error:
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_connection_failed(
+        dev, &hci->last_async_cmd_data.create_connection.address);
+    _bte_hci_dev_free_command(dev, pc);
+}
+
+/* The commands creating or accepting a connection start with the address */
+static void connection_connecting_prepare(BteHci *hci, BteBuffer *buffer,
+                                          void *role)
+{
+    const BteBdAddr *address = (void *)(buffer->data + HCI_CMD_HDR_LEN);
+    _bte_hci_dev_connection_connecting(hci, address, (uintptr_t)role);
 }
 
 void bte_hci_create_connection(BteHci *hci,
@@ -378,7 +667,7 @@ void bte_hci_create_connection(BteHci *hci,
 
     /* In the status callback we read this and setup the event matcher */
     struct _bte_hci_tmpdata_create_connection_t *tmpdata =
-        &hci->last_async_cmd_data.create_connection;
+        &_bte_hci_async_cmd_data(hci, b)->create_connection;
     memcpy(&tmpdata->address, address, sizeof(*address));
     tmpdata->client_cb = callback;
 
@@ -394,7 +683,66 @@ void bte_hci_create_connection(BteHci *hci,
     write_clock_offset(clock_offset, data);
     data += 2;
     data[0] = allow_role_switch;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, connection_connecting_prepare,
+                                     (void *)BTE_HCI_ROLE_MASTER);
+}
+
+void bte_hci_on_disconnection(BteHci *hci, BteHciDisconnectionCb callback)
+{
+    hci->disconnection_cb = callback;
+}
+
+static void connection_info(const BteHciAclConnection *conn,
+                            BteHciConnectionInfo *info)
+{
+    info->state = conn->state;
+    info->role = conn->role;
+    info->mode = conn->mode;
+    info->conn_handle = conn->conn_handle;
+    info->address = conn->address;
+    info->rx_packets = conn->rx_packets;
+    info->tx_packets = conn->tx_packets;
+    info->rx_bytes = conn->rx_bytes;
+    info->tx_bytes = conn->tx_bytes;
+}
+
+bool bte_hci_get_connection_info(BteHci *hci, BteHciConnHandle conn_handle,
+                                 BteHciConnectionInfo *info)
+{
+    const BteHciAclConnection *conn =
+        _bte_hci_dev_acl_connection(hci_dev(hci), conn_handle);
+    if (!conn) return false;
+    connection_info(conn, info);
+    return true;
+}
+
+bool bte_hci_get_connection_by_address(BteHci *hci, const BteBdAddr *address,
+                                       BteHciConnectionInfo *info)
+{
+    const BteHciAclConnection *conn =
+        _bte_hci_dev_connection_by_address(hci_dev(hci), address);
+    if (!conn) return false;
+    connection_info(conn, info);
+    return true;
+}
+
+void bte_hci_connect(BteHci *hci,
+                     const BteBdAddr *address,
+                     BtePacketType packet_type,
+                     bool allow_role_switch,
+                     BteHciDoneCb status_cb,
+                     BteHciCreateConnectionCb callback)
+{
+    uint8_t page_scan_rep_mode;
+    uint16_t clock_offset;
+    if (!bte_hci_get_cached_paging_params(hci, address, &page_scan_rep_mode,
+                                          &clock_offset)) {
+        page_scan_rep_mode = BTE_HCI_PAGE_SCAN_REP_MODE_R2;
+        clock_offset = BTE_HCI_CLOCK_OFFSET_INVALID;
+    }
+    bte_hci_create_connection(hci, address, packet_type, page_scan_rep_mode,
+                              clock_offset, allow_role_switch,
+                              status_cb, callback);
 }
 
 static void disconnect_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -413,7 +761,7 @@ void bte_hci_disconnect(BteHci *hci, BteHciConnHandle handle, uint8_t reason,
     uint8_t *data = b->data + HCI_CMD_HDR_LEN;
     write_le16(handle, data);
     data[2] = reason;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_create_connection_cancel(BteHci *hci, const BteBdAddr *address,
@@ -425,7 +773,7 @@ void bte_hci_create_connection_cancel(BteHci *hci, const BteBdAddr *address,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, address, sizeof(*address));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_accept_connection(BteHci *hci,
@@ -442,7 +790,7 @@ void bte_hci_accept_connection(BteHci *hci,
 
     /* In the status callback we read this and setup the event matcher */
     struct _bte_hci_tmpdata_create_connection_t *tmpdata =
-        &hci->last_async_cmd_data.create_connection;
+        &_bte_hci_async_cmd_data(hci, b)->create_connection;
     memcpy(&tmpdata->address, address, sizeof(*address));
     tmpdata->client_cb = callback;
 
@@ -450,7 +798,8 @@ void bte_hci_accept_connection(BteHci *hci,
     memcpy(data, address, sizeof(*address));
     data += sizeof(*address);
     data[0] = role;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, connection_connecting_prepare,
+                                     (void *)(uintptr_t)role);
 }
 
 void bte_hci_reject_connection(BteHci *hci,
@@ -467,7 +816,7 @@ void bte_hci_reject_connection(BteHci *hci,
 
     /* In the status callback we read this and setup the event matcher */
     struct _bte_hci_tmpdata_create_connection_t *tmpdata =
-        &hci->last_async_cmd_data.create_connection;
+        &_bte_hci_async_cmd_data(hci, b)->create_connection;
     memcpy(&tmpdata->address, address, sizeof(*address));
     tmpdata->client_cb = callback;
 
@@ -475,7 +824,7 @@ void bte_hci_reject_connection(BteHci *hci,
     memcpy(data, address, sizeof(*address));
     data += sizeof(*address);
     data[0] = reason;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static bool client_handle_connection_request(BteHci *hci, void *cb_data)
@@ -489,16 +838,18 @@ static bool client_handle_connection_request(BteHci *hci, void *cb_data)
                                    hci_userdata(hci));
 }
 
-static void connection_request_event_cb(BteBuffer *buffer, void *cb_data)
+static void connection_request_event_cb(BteHciDev *dev, BteBuffer *buffer,
+                                        void *cb_data)
 {
     uint8_t *data = buffer->data + HCI_CMD_EVENT_POS_DATA;
-    _bte_hci_dev_foreach_hci_client(client_handle_connection_request, data);
+    _bte_hci_dev_foreach_hci_client(dev, client_handle_connection_request,
+                                    data);
 }
 
 void bte_hci_on_connection_request(BteHci *hci, BteHciConnectionRequestCb callback)
 {
     hci->connection_request_cb = callback;
-    _bte_hci_dev_install_event_handler(HCI_CONNECTION_REQUEST,
+    _bte_hci_dev_install_event_handler(hci_dev(hci), HCI_CONNECTION_REQUEST,
                                        connection_request_event_cb, NULL);
 }
 
@@ -509,16 +860,17 @@ static bool client_handle_link_key_request(BteHci *hci, void *cb_data)
         hci->link_key_request_cb(hci, address, hci_userdata(hci));
 }
 
-static void link_key_request_event_cb(BteBuffer *buffer, void *cb_data)
+static void link_key_request_event_cb(BteHciDev *dev, BteBuffer *buffer,
+                                      void *cb_data)
 {
     uint8_t *data = buffer->data + HCI_CMD_EVENT_POS_DATA;
-    _bte_hci_dev_foreach_hci_client(client_handle_link_key_request, data);
+    _bte_hci_dev_foreach_hci_client(dev, client_handle_link_key_request, data);
 }
 
 void bte_hci_on_link_key_request(BteHci *hci, BteHciLinkKeyRequestCb callback)
 {
     hci->link_key_request_cb = callback;
-    _bte_hci_dev_install_event_handler(HCI_LINK_KEY_REQUEST,
+    _bte_hci_dev_install_event_handler(hci_dev(hci), HCI_LINK_KEY_REQUEST,
                                        link_key_request_event_cb, NULL);
 }
 
@@ -545,7 +897,7 @@ void bte_hci_link_key_req_reply(BteHci *hci, const BteBdAddr *address,
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, address, sizeof(*address));
     memcpy(b->data + HCI_CMD_HDR_LEN + sizeof(*address), key, sizeof(*key));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_link_key_req_neg_reply(BteHci *hci, const BteBdAddr *address,
@@ -557,7 +909,7 @@ void bte_hci_link_key_req_neg_reply(BteHci *hci, const BteBdAddr *address,
         link_key_req_reply_cb, callback);
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, address, sizeof(*address));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static bool client_handle_pin_code_request(BteHci *hci, void *cb_data)
@@ -567,16 +919,17 @@ static bool client_handle_pin_code_request(BteHci *hci, void *cb_data)
         hci->pin_code_request_cb(hci, address, hci_userdata(hci));
 }
 
-static void pin_code_request_event_cb(BteBuffer *buffer, void *cb_data)
+static void pin_code_request_event_cb(BteHciDev *dev, BteBuffer *buffer,
+                                      void *cb_data)
 {
     uint8_t *data = buffer->data + HCI_CMD_EVENT_POS_DATA;
-    _bte_hci_dev_foreach_hci_client(client_handle_pin_code_request, data);
+    _bte_hci_dev_foreach_hci_client(dev, client_handle_pin_code_request, data);
 }
 
 void bte_hci_on_pin_code_request(BteHci *hci, BteHciPinCodeRequestCb callback)
 {
     hci->pin_code_request_cb = callback;
-    _bte_hci_dev_install_event_handler(HCI_PIN_CODE_REQUEST,
+    _bte_hci_dev_install_event_handler(hci_dev(hci), HCI_PIN_CODE_REQUEST,
                                        pin_code_request_event_cb, NULL);
 }
 
@@ -596,7 +949,7 @@ void bte_hci_pin_code_req_reply(BteHci *hci, const BteBdAddr *address,
     data[0] = len; data++;
     memcpy(data, pin, len);
     data[len] = 0; /* Just to be on the safe side */
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_pin_code_req_neg_reply(BteHci *hci, const BteBdAddr *address,
@@ -608,12 +961,12 @@ void bte_hci_pin_code_req_neg_reply(BteHci *hci, const BteBdAddr *address,
         link_key_req_reply_cb, callback);
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, address, sizeof(*address));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void auth_complete_event_cb(BteBuffer *buffer, void *)
+static void auth_complete_event_cb(BteHciDev *dev, BteBuffer *buffer, void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -624,7 +977,7 @@ static void auth_complete_event_cb(BteBuffer *buffer, void *)
 
     BteHciAuthRequestedCb auth_requested_cb =
         pc->command_cb.event_auth_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     auth_requested_cb(hci, &reply, hci_userdata(hci));
 }
@@ -640,9 +993,10 @@ void bte_hci_auth_requested(BteHci *hci,
                            status_cb, callback);
 }
 
-static void remote_name_req_complete_event_cb(BteBuffer *buffer, void *)
+static void remote_name_req_complete_event_cb(BteHciDev *dev, BteBuffer *buffer,
+                                              void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -655,7 +1009,7 @@ static void remote_name_req_complete_event_cb(BteBuffer *buffer, void *)
 
     BteHciReadRemoteNameCb read_remote_name_cb =
         pc->command_cb.event_remote_name_req_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     read_remote_name_cb(hci, &reply, hci_userdata(hci));
 }
@@ -663,6 +1017,7 @@ static void remote_name_req_complete_event_cb(BteBuffer *buffer, void *)
 static void read_remote_name_status_cb(BteHci *hci, uint8_t status,
                                        BteHciPendingCommand *pc)
 {
+    BteHciDev *dev = hci_dev(hci);
     if (status != 0) goto error;
 
     struct _bte_hci_tmpdata_read_remote_name_t *tmpdata =
@@ -674,17 +1029,18 @@ static void read_remote_name_status_cb(BteHci *hci, uint8_t status,
     bte_data_matcher_add_rule(&matcher, &tmpdata->address, 6,
                               /* 1 for the status byte */
                               HCI_CMD_EVENT_POS_DATA + 1);
-    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(&matcher);
+    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(dev,
+                                                          &matcher);
     if (UNLIKELY(!ev)) goto error;
 
     ev->hci = hci;
     ev->command_cb.event_remote_name_req_complete.client_cb =
         tmpdata->client_cb;
-    _bte_hci_dev_install_event_handler(
+    _bte_hci_dev_install_event_handler(dev, 
         HCI_REMOTE_NAME_REQ_COMPLETE, remote_name_req_complete_event_cb, NULL);
 
 error:
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 }
 
 void bte_hci_read_remote_name(BteHci *hci,
@@ -702,7 +1058,7 @@ void bte_hci_read_remote_name(BteHci *hci,
 
     /* In the status callback we read this and setup the event matcher */
     struct _bte_hci_tmpdata_read_remote_name_t *tmpdata =
-        &hci->last_async_cmd_data.read_remote_name;
+        &_bte_hci_async_cmd_data(hci, b)->read_remote_name;
     memcpy(&tmpdata->address, address, sizeof(*address));
     tmpdata->client_cb = callback;
 
@@ -714,12 +1070,13 @@ void bte_hci_read_remote_name(BteHci *hci,
     data[0] = 0; /* reserved */
     data++;
     write_clock_offset(clock_offset, data);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void read_remote_features_complete_event_cb(BteBuffer *buffer, void *)
+static void read_remote_features_complete_event_cb(BteHciDev *dev,
+                                                   BteBuffer *buffer, void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -731,7 +1088,7 @@ static void read_remote_features_complete_event_cb(BteBuffer *buffer, void *)
 
     BteHciReadRemoteFeaturesCb read_remote_features_cb =
         pc->command_cb.event_read_remote_features_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     read_remote_features_cb(hci, &reply, hci_userdata(hci));
 }
@@ -747,9 +1104,11 @@ void bte_hci_read_remote_features(BteHci *hci, BteHciConnHandle conn_handle,
         status_cb, callback);
 }
 
-static void read_remote_version_info_complete_event_cb(BteBuffer *buffer, void *)
+static void read_remote_version_info_complete_event_cb(BteHciDev *dev,
+                                                       BteBuffer *buffer,
+                                                       void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -767,7 +1126,7 @@ static void read_remote_version_info_complete_event_cb(BteBuffer *buffer, void *
 
     BteHciReadRemoteVersionInfoCb read_remote_version_info_cb =
         pc->command_cb.event_read_remote_version_info_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     read_remote_version_info_cb(hci, &reply, hci_userdata(hci));
 }
@@ -784,9 +1143,10 @@ void bte_hci_read_remote_version_info(BteHci *hci,
         status_cb, callback);
 }
 
-static void read_clock_offset_complete_event_cb(BteBuffer *buffer, void *)
+static void read_clock_offset_complete_event_cb(BteHciDev *dev,
+                                                BteBuffer *buffer, void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -798,7 +1158,7 @@ static void read_clock_offset_complete_event_cb(BteBuffer *buffer, void *)
 
     BteHciReadClockOffsetCb read_clock_offset_cb =
         pc->command_cb.event_read_clock_offset_complete.client_cb;
-    _bte_hci_dev_free_command(pc);
+    _bte_hci_dev_free_command(dev, pc);
 
     read_clock_offset_cb(hci, &reply, hci_userdata(hci));
 }
@@ -833,12 +1193,12 @@ void bte_hci_set_sniff_mode(BteHci *hci, BteHciConnHandle conn_handle,
     write_le16(attempt_slots, data);
     data += 2;
     write_le16(timeout, data);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void mode_change_event_cb(BteBuffer *buffer, void *)
+static void mode_change_event_cb(BteHciDev *dev, BteBuffer *buffer, void *)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
     if (UNLIKELY(!pc)) return;
 
     BteHci *hci = pc->hci;
@@ -854,13 +1214,14 @@ static void mode_change_event_cb(BteBuffer *buffer, void *)
 
     BteHciModeChangeCb cb = pc->command_cb.event_mode_change.client_cb;
     if (cb(hci, &reply, hci_userdata(hci))) {
-        _bte_hci_dev_free_command(pc);
+        _bte_hci_dev_free_command(dev, pc);
     }
 }
 
 void bte_hci_on_mode_change(BteHci *hci, BteHciConnHandle conn_handle,
                             BteHciModeChangeCb callback)
 {
+    BteHciDev *dev = hci_dev(hci);
     BteDataMatcher matcher;
     bte_data_matcher_init(&matcher);
     uint8_t event_type = HCI_MODE_CHANGE;
@@ -872,16 +1233,18 @@ void bte_hci_on_mode_change(BteHci *hci, BteHciConnHandle conn_handle,
                               HCI_CMD_EVENT_POS_DATA + 1);
     if (!callback) {
         /* We must remove our listener */
-        BteHciPendingCommand *ev = _bte_hci_dev_get_pending_command(&matcher);
-        if (ev && ev->hci == hci) _bte_hci_dev_free_command(ev);
+        BteHciPendingCommand *ev =
+            _bte_hci_dev_get_pending_command(dev, &matcher);
+        if (ev && ev->hci == hci) _bte_hci_dev_free_command(dev, ev);
         return;
     }
-    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(&matcher);
+    BteHciPendingCommand *ev = _bte_hci_dev_alloc_command(dev,
+                                                          &matcher);
     if (UNLIKELY(!ev)) return; /* already installed */
 
     ev->hci = hci;
     ev->command_cb.event_mode_change.client_cb = callback;
-    _bte_hci_dev_install_event_handler(HCI_MODE_CHANGE,
+    _bte_hci_dev_install_event_handler(dev, HCI_MODE_CHANGE,
                                        mode_change_event_cb, NULL);
 }
 
@@ -906,7 +1269,7 @@ void bte_hci_read_link_policy_settings(BteHci *hci,
         read_link_policy_settings_cb, callback);
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_link_policy_settings(BteHci *hci,
@@ -921,7 +1284,7 @@ void bte_hci_write_link_policy_settings(BteHci *hci,
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
     write_le16(settings, b->data + HCI_CMD_HDR_LEN + 2);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_set_event_mask(BteHci *hci, BteHciEventMask mask,
@@ -933,7 +1296,7 @@ void bte_hci_set_event_mask(BteHci *hci, BteHciEventMask mask,
     if (UNLIKELY(!b)) return;
     uint64_t le_mask = htole64(mask);
     memcpy(b->data + HCI_CMD_HDR_LEN, &le_mask, sizeof(le_mask));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_reset(BteHci *hci, BteHciDoneCb callback)
@@ -941,7 +1304,7 @@ void bte_hci_reset(BteHci *hci, BteHciDoneCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_RESET_OCF, HCI_HC_BB_OGF, HCI_RESET_PLEN,
         command_complete_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_set_event_filter(BteHci *hci, uint8_t filter_type,
@@ -982,7 +1345,7 @@ void bte_hci_set_event_filter(BteHci *hci, uint8_t filter_type,
             memcpy(data + 2, filter_data, cond_len);
         }
     }
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_pin_type_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -999,7 +1362,7 @@ void bte_hci_read_pin_type(BteHci *hci, BteHciReadPinTypeCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_PIN_TYPE_OCF, HCI_HC_BB_OGF, HCI_R_PIN_TYPE_PLEN,
         read_pin_type_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_pin_type(BteHci *hci, uint8_t pin_type,
@@ -1010,12 +1373,12 @@ void bte_hci_write_pin_type(BteHci *hci, uint8_t pin_type,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = pin_type;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
-static void return_link_keys_cb(BteBuffer *buffer, void *cb_data)
+static void return_link_keys_cb(BteHciDev *dev, BteBuffer *buffer,
+                                void *cb_data)
 {
-    BteHciDev *dev = &_bte_hci_dev;
 
     uint8_t *data = buffer->data + HCI_CMD_REPLY_POS_HDR_LEN;
     int num_responses = data[0];
@@ -1040,7 +1403,7 @@ static void return_link_keys_cb(BteBuffer *buffer, void *cb_data)
 
 static void read_stored_link_key_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    BteHciDev *dev = hci_dev(hci);
 
     if (client_cb) {
         BteHciReadStoredLinkKeyReply reply;
@@ -1056,8 +1419,16 @@ static void read_stored_link_key_cb(BteHci *hci, BteBuffer *buffer, void *client
         callback(hci, &reply, hci_userdata(hci));
     }
 
-    _bte_hci_dev_install_event_handler(HCI_RETURN_LINK_KEYS, NULL, NULL);
-    _bte_hci_dev_stored_keys_cleanup();
+    _bte_hci_dev_install_event_handler(dev, HCI_RETURN_LINK_KEYS, NULL, NULL);
+    _bte_hci_dev_stored_keys_cleanup(dev);
+}
+
+static void read_stored_link_key_prepare(BteHci *hci, BteBuffer *, void *)
+{
+    BteHciDev *dev = hci_dev(hci);
+    _bte_hci_dev_stored_keys_cleanup(dev);
+    _bte_hci_dev_install_event_handler(dev, HCI_RETURN_LINK_KEYS,
+                                       return_link_keys_cb, hci);
 }
 
 void bte_hci_read_stored_link_key(BteHci *hci, const BteBdAddr *address,
@@ -1068,15 +1439,13 @@ void bte_hci_read_stored_link_key(BteHci *hci, const BteBdAddr *address,
         HCI_R_STORED_LINK_KEY_PLEN, read_stored_link_key_cb, callback);
     if (UNLIKELY(!b)) return;
 
-    _bte_hci_dev_stored_keys_cleanup();
-    _bte_hci_dev_install_event_handler(HCI_RETURN_LINK_KEYS,
-                                       return_link_keys_cb, hci);
     uint8_t *data = b->data + HCI_CMD_HDR_LEN;
     if (address) {
         memcpy(data, address, sizeof(*address));
     }
     data[6] = address ? 0 : 1;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, read_stored_link_key_prepare,
+                                     NULL);
 }
 
 static void write_stored_link_key_cb(BteHci *hci, BteBuffer *buffer,
@@ -1110,7 +1479,7 @@ void bte_hci_write_stored_link_key(BteHci *hci, int num_keys,
         memcpy(ptr_addr + i * sizeof(*address), address, sizeof(*address));
         memcpy(ptr_key + i * sizeof(*key), key, sizeof(*key));
     }
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void delete_stored_link_key_cb(BteHci *hci, BteBuffer *buffer,
@@ -1138,7 +1507,7 @@ void bte_hci_delete_stored_link_key(BteHci *hci, const BteBdAddr *address,
         memcpy(data, address, sizeof(*address));
     }
     data[6] = address ? 0 : 1;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_local_name(BteHci *hci, const char *name,
@@ -1149,7 +1518,7 @@ void bte_hci_write_local_name(BteHci *hci, const char *name,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     strncpy((char *)b->data + HCI_CMD_HDR_LEN, name, HCI_MAX_NAME_LEN);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_local_name_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1169,7 +1538,7 @@ void bte_hci_read_local_name(BteHci *hci, BteHciReadLocalNameCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_LOCAL_NAME_OCF, HCI_HC_BB_OGF, HCI_R_LOCAL_NAME_PLEN,
         read_local_name_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_page_timeout_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1187,7 +1556,7 @@ void bte_hci_read_page_timeout(BteHci *hci, BteHciReadPageTimeoutCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_PAGE_TIMEOUT_OCF, HCI_HC_BB_OGF, HCI_R_PAGE_TIMEOUT_PLEN,
         read_page_timeout_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_page_timeout(BteHci *hci, uint16_t page_timeout,
@@ -1198,7 +1567,7 @@ void bte_hci_write_page_timeout(BteHci *hci, uint16_t page_timeout,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     write_le16(page_timeout, b->data + HCI_CMD_HDR_LEN);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_scan_enable_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1215,7 +1584,7 @@ void bte_hci_read_scan_enable(BteHci *hci, BteHciReadScanEnableCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_SCAN_EN_OCF, HCI_HC_BB_OGF, HCI_R_SCAN_EN_PLEN,
         read_scan_enable_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_scan_enable(BteHci *hci, uint8_t scan_enable,
@@ -1226,7 +1595,7 @@ void bte_hci_write_scan_enable(BteHci *hci, uint8_t scan_enable,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = scan_enable;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_auth_enable_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1243,7 +1612,7 @@ void bte_hci_read_auth_enable(BteHci *hci, BteHciReadAuthEnableCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_AUTH_ENABLE_OCF, HCI_HC_BB_OGF, HCI_R_AUTH_ENABLE_PLEN,
         read_auth_enable_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_auth_enable(BteHci *hci, uint8_t auth_enable,
@@ -1254,7 +1623,7 @@ void bte_hci_write_auth_enable(BteHci *hci, uint8_t auth_enable,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = auth_enable;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_class_of_device_cb(BteHci *hci, BteBuffer *buffer,
@@ -1274,7 +1643,7 @@ void bte_hci_read_class_of_device(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_COD_OCF, HCI_HC_BB_OGF, HCI_R_COD_PLEN,
         read_class_of_device_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_class_of_device(BteHci *hci, const BteClassOfDevice *cod,
@@ -1285,7 +1654,7 @@ void bte_hci_write_class_of_device(BteHci *hci, const BteClassOfDevice *cod,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, cod, sizeof(*cod));
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_auto_flush_timeout_cb(BteHci *hci, BteBuffer *buffer,
@@ -1309,7 +1678,7 @@ void bte_hci_read_auto_flush_timeout(BteHci *hci,
         read_auto_flush_timeout_cb, callback);
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_auto_flush_timeout(BteHci *hci,
@@ -1323,7 +1692,14 @@ void bte_hci_write_auto_flush_timeout(BteHci *hci,
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
     write_le16(timeout, b->data + HCI_CMD_HDR_LEN + 2);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
+}
+
+static void ctrl_to_host_flow_control_prepare(BteHci *hci, BteBuffer *buffer,
+                                              void *)
+{
+    /* Applied when the controller confirms it */
+    hci_dev(hci)->host_flow_control_requested = buffer->data[HCI_CMD_HDR_LEN];
 }
 
 void bte_hci_set_ctrl_to_host_flow_control(BteHci *hci, uint8_t enable,
@@ -1334,7 +1710,15 @@ void bte_hci_set_ctrl_to_host_flow_control(BteHci *hci, uint8_t enable,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = enable;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b,
+                                     ctrl_to_host_flow_control_prepare, NULL);
+}
+
+static void host_buffer_size_prepare(BteHci *hci, BteBuffer *buffer, void *)
+{
+    /* Applied when the controller confirms it */
+    hci_dev(hci)->host_acl_packets_requested =
+        read_le16(buffer->data + HCI_CMD_HDR_LEN + 3);
 }
 
 void bte_hci_set_host_buffer_size(BteHci *hci,
@@ -1353,7 +1737,7 @@ void bte_hci_set_host_buffer_size(BteHci *hci,
     data[2] = sync_packet_len;
     write_le16(acl_packets, data + 3);
     write_le16(sync_packets, data + 5);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command_prepared(hci, b, host_buffer_size_prepare, NULL);
 }
 
 static void read_current_iac_lap_cb(BteHci *hci, BteBuffer *buffer,
@@ -1384,7 +1768,7 @@ void bte_hci_read_current_iac_lap(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_CUR_IACLAP_OCF, HCI_HC_BB_OGF, HCI_R_CUR_IACLAP_PLEN,
         read_current_iac_lap_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_current_iac_lap(BteHci *hci,
@@ -1405,23 +1789,28 @@ void bte_hci_write_current_iac_lap(BteHci *hci,
         data[2] = (lap >> 16) & 0xff;
         data += 3;
     }
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_host_num_comp_packets(BteHci *hci,
                                    BteHciConnHandle conn_handle,
                                    uint16_t num_packets)
 {
-    BteBuffer *b = _bte_hci_dev_add_command_no_reply(
-        HCI_HOST_NUM_COMPL_OCF, HCI_HC_BB_OGF, HCI_H_NUM_COMPL_PLEN);
-    if (UNLIKELY(!b)) return;
-    uint8_t *data = b->data + HCI_CMD_HDR_LEN;
-    data[0] = 1;
-    data++;
-    write_le16(conn_handle, data);
-    data += 2;
-    write_le16(num_packets, data);
-    _bte_hci_send_command(b);
+    /* Any batched reports are sent in the same command */
+    _bte_hci_dev_add_host_completed(hci_dev(hci), conn_handle, num_packets);
+    _bte_hci_dev_flush_host_completed(hci_dev(hci));
+}
+
+void bte_hci_host_num_comp_packets_add(BteHci *hci,
+                                       BteHciConnHandle conn_handle,
+                                       uint16_t num_packets)
+{
+    _bte_hci_dev_add_host_completed(hci_dev(hci), conn_handle, num_packets);
+}
+
+void bte_hci_host_num_comp_packets_flush(BteHci *hci)
+{
+    _bte_hci_dev_flush_host_completed(hci_dev(hci));
 }
 
 static void read_link_sv_timeout_cb(BteHci *hci, BteBuffer *buffer,
@@ -1446,7 +1835,7 @@ void bte_hci_read_link_sv_timeout(BteHci *hci,
         read_link_sv_timeout_cb, callback);
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_link_sv_timeout(BteHci *hci,
@@ -1461,7 +1850,7 @@ void bte_hci_write_link_sv_timeout(BteHci *hci,
     if (UNLIKELY(!b)) return;
     write_le16(conn_handle, b->data + HCI_CMD_HDR_LEN);
     write_le16(timeout, b->data + HCI_CMD_HDR_LEN + 2);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_inquiry_scan_type_cb(BteHci *hci, BteBuffer *buffer,
@@ -1480,7 +1869,7 @@ void bte_hci_read_inquiry_scan_type(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_INQUIRY_SCAN_TYPE_OCF, HCI_HC_BB_OGF, HCI_CMD_HDR_LEN,
         read_inquiry_scan_type_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_inquiry_scan_type(BteHci *hci, uint8_t inquiry_scan_type,
@@ -1492,7 +1881,7 @@ void bte_hci_write_inquiry_scan_type(BteHci *hci, uint8_t inquiry_scan_type,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = inquiry_scan_type;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_inquiry_mode_cb(BteHci *hci, BteBuffer *buffer,
@@ -1510,7 +1899,7 @@ void bte_hci_read_inquiry_mode(BteHci *hci, BteHciReadInquiryModeCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_INQUIRY_MODE_OCF, HCI_HC_BB_OGF, HCI_CMD_HDR_LEN,
         read_inquiry_mode_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_inquiry_mode(BteHci *hci, uint8_t inquiry_mode,
@@ -1521,7 +1910,7 @@ void bte_hci_write_inquiry_mode(BteHci *hci, uint8_t inquiry_mode,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = inquiry_mode;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_page_scan_type_cb(BteHci *hci, BteBuffer *buffer,
@@ -1540,7 +1929,7 @@ void bte_hci_read_page_scan_type(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_PAGE_SCAN_TYPE_OCF, HCI_HC_BB_OGF, HCI_CMD_HDR_LEN,
         read_page_scan_type_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 void bte_hci_write_page_scan_type(BteHci *hci, uint8_t page_scan_type,
@@ -1552,7 +1941,7 @@ void bte_hci_write_page_scan_type(BteHci *hci, uint8_t page_scan_type,
         command_complete_cb, callback);
     if (UNLIKELY(!b)) return;
     b->data[HCI_CMD_HDR_LEN] = page_scan_type;
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_local_version_cb(BteHci *hci, BteBuffer *buffer,
@@ -1577,7 +1966,7 @@ void bte_hci_read_local_version(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(hci,
         HCI_R_LOC_VERS_INFO_OCF, HCI_INFO_PARAM_OGF, HCI_R_LOC_VERS_INFO_PLEN,
         read_local_version_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_local_features_cb(BteHci *hci, BteBuffer *buffer,
@@ -1598,7 +1987,7 @@ void bte_hci_read_local_features(BteHci *hci,
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_LOC_FEAT_OCF, HCI_INFO_PARAM_OGF, HCI_R_LOC_FEAT_PLEN,
         read_local_features_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_buffer_size_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1620,7 +2009,7 @@ void bte_hci_read_buffer_size(BteHci *hci, BteHciReadBufferSizeCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_BUF_SIZE_OCF, HCI_INFO_PARAM_OGF, HCI_R_BUF_SIZE_PLEN,
         read_buffer_size_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void read_bd_addr_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1639,7 +2028,7 @@ void bte_hci_read_bd_addr(BteHci *hci, BteHciReadBdAddrCb callback)
     BteBuffer *b = _bte_hci_dev_add_pending_command(
         hci, HCI_R_BD_ADDR_OCF, HCI_INFO_PARAM_OGF, HCI_R_BD_ADDR_PLEN,
         read_bd_addr_cb, callback);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static void vendor_command_cb(BteHci *hci, BteBuffer *buffer, void *client_cb)
@@ -1657,7 +2046,7 @@ void bte_hci_vendor_command(BteHci *hci, uint16_t ocf,
         vendor_command_cb, callback);
     if (UNLIKELY(!b)) return;
     memcpy(b->data + HCI_CMD_HDR_LEN, data, len);
-    _bte_hci_send_command(b);
+    _bte_hci_submit_command(hci, b);
 }
 
 static bool client_handle_vendor_event(BteHci *hci, void *cb_data)
@@ -1667,14 +2056,93 @@ static bool client_handle_vendor_event(BteHci *hci, void *cb_data)
         hci->vendor_event_cb(hci, buffer, hci_userdata(hci));
 }
 
-static void vendor_event_cb(BteBuffer *buffer, void *cb_data)
+static void vendor_event_cb(BteHciDev *dev, BteBuffer *buffer, void *cb_data)
 {
-    _bte_hci_dev_foreach_hci_client(client_handle_vendor_event, buffer);
+    _bte_hci_dev_foreach_hci_client(dev, client_handle_vendor_event, buffer);
 }
 
 void bte_hci_on_vendor_event(BteHci *hci, BteHciVendorEventCb callback)
 {
     hci->vendor_event_cb = callback;
-    _bte_hci_dev_install_event_handler(HCI_VENDOR_SPECIFIC_EVENT,
+    _bte_hci_dev_install_event_handler(hci_dev(hci), HCI_VENDOR_SPECIFIC_EVENT,
                                        vendor_event_cb, NULL);
 }
+
+bool bte_hci_on_acl_data(BteHci *hci, BteHciConnHandle conn_handle,
+                         BteHciAclDataCb callback)
+{
+    BteHciDev *dev = hci_dev(hci);
+    BteHciAclConnection *conn =
+        _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (!callback) {
+        if (conn && conn->hci == hci) {
+            _bte_hci_dev_release_acl_connection(dev, conn);
+        }
+        return true;
+    }
+
+    if (conn) {
+        if (conn->hci && conn->hci != hci) return false;
+        conn->hci = hci;
+    } else {
+        conn = _bte_hci_dev_alloc_acl_connection(dev, conn_handle);
+        if (UNLIKELY(!conn)) return false;
+        conn->hci = hci;
+    }
+    conn->data_cb = callback;
+    return true;
+}
+
+uint16_t bte_hci_acl_pdu_size(const BteBuffer *pdu)
+{
+    uint16_t size = 0;
+    for (const BteBuffer *b = pdu->next; b; b = b->next) {
+        size += b->size - HCI_ACL_HDR_LEN;
+    }
+    return size;
+}
+
+uint16_t bte_hci_acl_pdu_read(const BteBuffer *pdu, uint16_t offset,
+                              void *data, uint16_t size)
+{
+    uint8_t *ptr = data;
+    uint16_t total_read = 0;
+    for (const BteBuffer *b = pdu->next; b && size > 0; b = b->next) {
+        uint16_t fragment_len = b->size - HCI_ACL_HDR_LEN;
+        if (offset >= fragment_len) {
+            offset -= fragment_len;
+            continue;
+        }
+        uint16_t len = MIN2(fragment_len - offset, size);
+        memcpy(ptr, b->data + HCI_ACL_HDR_LEN + offset, len);
+        ptr += len;
+        total_read += len;
+        size -= len;
+        offset = 0;
+    }
+    return total_read;
+}
+
+int bte_hci_send_acl_data(BteHci *hci, BteHciConnHandle conn_handle,
+                          BteBuffer *pdu)
+{
+    BteHciDev *dev = hci_dev(hci);
+    if (UNLIKELY(pdu->total_size == 0)) return -EINVAL;
+
+    BteHciAclConnection *conn =
+        _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (conn) {
+        if (UNLIKELY(conn->hci && conn->hci != hci)) return -EBUSY;
+        conn->hci = hci;
+    } else {
+        conn = _bte_hci_dev_alloc_acl_connection(dev, conn_handle);
+        if (UNLIKELY(!conn)) return -ENOMEM;
+        conn->hci = hci;
+    }
+
+    int rc = _bte_hci_dev_queue_acl_data(dev, conn, pdu);
+    if (UNLIKELY(rc < 0)) return rc;
+
+    _bte_hci_dev_acl_schedule(dev);
+    return 0;
+}
@@ -16,6 +16,9 @@ BteHci *bte_hci_get(BteClient *client);
 
 BteClient *bte_hci_get_client(BteHci *hci);
 
+/* The device (controller) which the client is bound to */
+BteHciDev *bte_hci_get_dev(BteHci *hci);
+
 typedef void (*BteInitializedCb)(BteHci *hci, bool success, void *userdata);
 void bte_hci_on_initialized(BteHci *hci, BteInitializedCb callback);
 
@@ -27,6 +30,51 @@ uint8_t bte_hci_get_sco_mtu(BteHci *hci);
 uint16_t bte_hci_get_acl_max_packets(BteHci *hci);
 uint16_t bte_hci_get_sco_max_packets(BteHci *hci);
 
+/* Commands are sent to the controller only as long as it has room for them
+ * (as told by the Num_HCI_Command_Packets parameter of the Command Complete
+ * and Command Status events); the others wait in a queue. If the backend
+ * fails to send a command, its callback is invoked with the HCI_HW_FAILURE
+ * status and the next one in the queue is sent. */
+typedef struct {
+    uint16_t depth; /* Commands currently in the queue */
+    uint16_t max_depth; /* Highest depth reached */
+    uint32_t num_queued; /* Commands which had to wait in the queue */
+    uint32_t num_dropped; /* Commands discarded because the queue was full */
+    uint64_t total_wait_us; /* Sum of the time spent in the queue */
+    uint64_t max_wait_us; /* Longest time spent in the queue */
+} BteHciCommandQueueStats;
+void bte_hci_get_command_queue_stats(BteHci *hci,
+                                     BteHciCommandQueueStats *stats);
+
+/* If the controller does not reply to a command within timeout_ms, the
+ * command is dropped and its callback is invoked with the HCI_HOST_TIMEOUT
+ * status. The timeout applies to the commands issued by this client after
+ * this call; 0 disables it, and the default is 2 seconds. The events which
+ * complete the asynchronous commands (such as the Connection Complete event)
+ * are awaited for up to one minute instead. Timeouts are only checked from
+ * bte_handle_events() and bte_wait_events(). */
+void bte_hci_set_command_timeout(BteHci *hci, uint32_t timeout_ms);
+
+/* Allows calling the command functions of this client (those which send an
+ * HCI command and report its outcome to a callback) from any thread. The
+ * command is encoded in the calling thread and handed over to the event loop
+ * of the device through a lock-free queue (see bte_hci_dev_call()): the loop
+ * then sends it, and invokes the callbacks in its own thread. If the command
+ * cannot be handed over (because the queue is full, or memory is exhausted),
+ * its callback is never invoked: the command is counted instead, see
+ * bte_hci_take_rejected_commands().
+ *
+ * The commands of a thread-safe client are always deferred to the event loop,
+ * even when issued from the loop thread. The other functions, such as those
+ * installing callbacks, must still be called from the loop thread, and so
+ * must this one; the client must not be freed while some of its commands
+ * might still be in the queue. */
+void bte_hci_set_thread_safe(BteHci *hci, bool thread_safe);
+/* Returns how many commands of a thread-safe client could not be handed over
+ * to the event loop since the last call, and resets the count. Can be called
+ * from any thread. */
+unsigned bte_hci_take_rejected_commands(BteHci *hci);
+
 /* All command replies start with this struct */
 typedef struct {
     uint8_t status;
@@ -47,8 +95,13 @@ typedef struct {
     uint8_t reserved;
     BteClassOfDevice class_of_device;
     uint16_t clock_offset;
+    /* In dBm; only reported if the inquiry mode is not
+     * BTE_HCI_INQUIRY_MODE_STANDARD */
+    int8_t rssi;
 } BTE_PACKED BteHciInquiryResponse;
 
+#define BTE_HCI_INQUIRY_RSSI_UNKNOWN (int8_t)127
+
 typedef struct {
     uint8_t status;
     uint8_t num_responses;
@@ -58,6 +111,62 @@ typedef struct {
 typedef void (*BteHciInquiryCb)(BteHci *hci,
                                 const BteHciInquiryReply *reply,
                                 void *userdata);
+/* The Extended Inquiry Response data of a device: a sequence of AD
+ * structures, each made of a type and a payload */
+typedef struct {
+    const uint8_t *data;
+    uint8_t len;
+} BteHciEir;
+
+#define BTE_HCI_EIR_FLAGS                 (uint8_t)0x01
+#define BTE_HCI_EIR_UUID16_INCOMPLETE     (uint8_t)0x02
+#define BTE_HCI_EIR_UUID16_COMPLETE       (uint8_t)0x03
+#define BTE_HCI_EIR_UUID32_INCOMPLETE     (uint8_t)0x04
+#define BTE_HCI_EIR_UUID32_COMPLETE       (uint8_t)0x05
+#define BTE_HCI_EIR_UUID128_INCOMPLETE    (uint8_t)0x06
+#define BTE_HCI_EIR_UUID128_COMPLETE      (uint8_t)0x07
+#define BTE_HCI_EIR_NAME_SHORTENED        (uint8_t)0x08
+#define BTE_HCI_EIR_NAME_COMPLETE         (uint8_t)0x09
+#define BTE_HCI_EIR_TX_POWER_LEVEL        (uint8_t)0x0a
+#define BTE_HCI_EIR_DEVICE_ID             (uint8_t)0x10
+#define BTE_HCI_EIR_MANUFACTURER_SPECIFIC (uint8_t)0xff
+
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *data; /* Points into the EIR data, no copy is made */
+} BteHciEirField;
+
+typedef struct {
+    const uint8_t *ptr;
+    const uint8_t *end;
+} BteHciEirIter;
+
+/* Walks the AD structures of the EIR data:
+ *
+ *     BteHciEirIter iter;
+ *     BteHciEirField field;
+ *     bte_hci_eir_iter_init(&iter, eir);
+ *     while (bte_hci_eir_iter_next(&iter, &field)) { ... }
+ *
+ * The iteration stops at the first malformed structure. */
+void bte_hci_eir_iter_init(BteHciEirIter *iter, const BteHciEir *eir);
+bool bte_hci_eir_iter_next(BteHciEirIter *iter, BteHciEirField *field);
+/* Returns false if no field of the given type is present */
+bool bte_hci_eir_find(const BteHciEir *eir, uint8_t type,
+                      BteHciEirField *field);
+
+/* Streaming mode: when this callback is set, each device is reported as soon
+ * as it is discovered (once per inquiry), and the BteHciInquiryCb callback is
+ * then only invoked with the final status, without any responses. If the
+ * inquiry mode is BTE_HCI_INQUIRY_MODE_EXTENDED and the device sent an
+ * extended inquiry response, its data is passed in eir, which is otherwise
+ * NULL. The response and the EIR data are only valid during the callback. */
+typedef void (*BteHciInquiryResultCb)(BteHci *hci,
+                                      const BteHciInquiryResponse *response,
+                                      const BteHciEir *eir,
+                                      void *userdata);
+void bte_hci_on_inquiry_result(BteHci *hci, BteHciInquiryResultCb callback);
 void bte_hci_inquiry(BteHci *hci, BteLap lap, uint8_t len, uint8_t max_resp,
                      BteHciDoneCb status_cb,
                      BteHciInquiryCb callback);
@@ -71,6 +180,9 @@ void bte_hci_exit_periodic_inquiry(BteHci *hci, BteHciDoneCb callback);
 
 #define BTE_HCI_CLOCK_OFFSET_INVALID (uint16_t)0xffff
 
+#define BTE_HCI_LINK_TYPE_SCO (uint8_t)0
+#define BTE_HCI_LINK_TYPE_ACL (uint8_t)1
+
 typedef struct {
     uint8_t status;
     uint8_t link_type;
@@ -91,6 +203,69 @@ void bte_hci_create_connection(BteHci *hci,
                                BteHciCreateConnectionCb callback);
 void bte_hci_disconnect(BteHci *hci, BteHciConnHandle handle, uint8_t reason,
                         BteHciDoneCb callback);
+
+typedef struct {
+    uint8_t status;
+    BteHciConnHandle conn_handle;
+    uint8_t reason;
+} BteHciDisconnectionCompleteReply;
+
+/* Invoked on all the clients which set it, when any link goes down. By the
+ * time this is called, the data queued on the connection has been dropped. */
+typedef void (*BteHciDisconnectionCb)(
+    BteHci *hci, const BteHciDisconnectionCompleteReply *reply,
+    void *userdata);
+void bte_hci_on_disconnection(BteHci *hci, BteHciDisconnectionCb callback);
+
+#define BTE_HCI_CONN_STATE_CONNECTING (uint8_t)1
+#define BTE_HCI_CONN_STATE_CONNECTED  (uint8_t)2
+/* A client used the handle before the link was seen coming up, so only the
+ * handle is known */
+#define BTE_HCI_CONN_STATE_UNTRACKED  (uint8_t)3
+
+typedef struct {
+    uint8_t state;
+    uint8_t role; /* BTE_HCI_ROLE_* */
+    uint8_t mode; /* BTE_HCI_MODE_* */
+    BteHciConnHandle conn_handle; /* Not valid while connecting */
+    BteBdAddr address;
+    /* ACL packets exchanged with the controller */
+    uint32_t rx_packets;
+    uint32_t tx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+} BteHciConnectionInfo;
+
+/* The ACL links are tracked from the Create Connection or Accept Connection
+ * Request commands, or from the Connection Complete event, until the
+ * Disconnection Complete event. These return false if there is no such
+ * connection. */
+bool bte_hci_get_connection_info(BteHci *hci, BteHciConnHandle conn_handle,
+                                 BteHciConnectionInfo *info);
+bool bte_hci_get_connection_by_address(BteHci *hci, const BteBdAddr *address,
+                                       BteHciConnectionInfo *info);
+
+#define BTE_HCI_PAGE_SCAN_REP_MODE_R0 (uint8_t)0
+#define BTE_HCI_PAGE_SCAN_REP_MODE_R1 (uint8_t)1
+#define BTE_HCI_PAGE_SCAN_REP_MODE_R2 (uint8_t)2
+
+/* The page scan repetition mode and the clock offset of the recently seen
+ * devices are remembered, as learnt from the inquiry results, the Read Clock
+ * Offset replies, the Connection Complete and the Page Scan Repetition Mode
+ * Change events. This connects to the device using them, which makes paging
+ * faster; for unknown devices, the R2 mode and no clock offset are used. */
+void bte_hci_connect(BteHci *hci,
+                     const BteBdAddr *address,
+                     BtePacketType packet_type,
+                     bool allow_role_switch,
+                     BteHciDoneCb status_cb,
+                     BteHciCreateConnectionCb callback);
+/* Returns false if the device is not in the cache. The clock offset is
+ * BTE_HCI_CLOCK_OFFSET_INVALID if it is not known. */
+bool bte_hci_get_cached_paging_params(BteHci *hci, const BteBdAddr *address,
+                                      uint8_t *page_scan_rep_mode,
+                                      uint16_t *clock_offset);
+void bte_hci_clear_device_cache(BteHci *hci);
 void bte_hci_create_connection_cancel(BteHci *hci, const BteBdAddr *address,
                                       BteHciDoneCb callback);
 
@@ -447,6 +622,14 @@ void bte_hci_write_auto_flush_timeout(BteHci *hci,
 #define BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_SYNC     (uint8_t)2
 #define BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL_SYNC (uint8_t)3
 
+/* When ACL flow control is enabled, the received ACL packets are reported to
+ * the controller as completed once the PDUs containing them are released with
+ * bte_buffer_unref(); clients holding on to PDUs therefore slow down the
+ * controller, instead of causing data to be lost. The driver enables it at
+ * initialization if the backend has a bounded pool of receive buffers.
+ * Since releasing a PDU then updates the state of the device, the last
+ * reference on it must be dropped in the thread running the device's event
+ * loop; other threads can hand it back with bte_hci_dev_call(). */
 void bte_hci_set_ctrl_to_host_flow_control(BteHci *hci, uint8_t enable,
                                            BteHciDoneCb callback);
 
@@ -471,9 +654,22 @@ void bte_hci_write_current_iac_lap(BteHci *hci,
                                    uint8_t num_laps, const BteLap *laps,
                                    BteHciDoneCb callback);
 
+/* Sends the given count right away, together with any count collected with
+ * bte_hci_host_num_comp_packets_add() */
 void bte_hci_host_num_comp_packets(BteHci *hci,
                                    BteHciConnHandle conn_handle,
                                    uint16_t num_packets);
+/* Collects the count, to be sent in a single command together with those of
+ * other connections. The command is sent at the end of the current
+ * bte_handle_events() pass, or earlier if too many handles or packets have
+ * been collected or if the oldest count has been waiting for too long (see
+ * BTE_HCI_HOST_COMPLETED_* in internals.h). This is also what the library
+ * does by itself for the received packets when ACL flow control is enabled. */
+void bte_hci_host_num_comp_packets_add(BteHci *hci,
+                                       BteHciConnHandle conn_handle,
+                                       uint16_t num_packets);
+/* Sends the counts collected so far */
+void bte_hci_host_num_comp_packets_flush(BteHci *hci);
 
 typedef struct {
     uint8_t status;
@@ -508,6 +704,7 @@ void bte_hci_write_inquiry_scan_type(BteHci *hci, uint8_t inquiry_scan_type,
 
 #define BTE_HCI_INQUIRY_MODE_STANDARD (uint8_t)0
 #define BTE_HCI_INQUIRY_MODE_RSSI     (uint8_t)1
+#define BTE_HCI_INQUIRY_MODE_EXTENDED (uint8_t)2
 
 typedef struct {
     uint8_t status;
@@ -594,6 +791,41 @@ typedef bool (*BteHciVendorEventCb)(BteHci *hci,
                                     void *userdata);
 void bte_hci_on_vendor_event(BteHci *hci, BteHciVendorEventCb callback);
 
+/* ACL data */
+
+/* Incoming ACL packets are reassembled into complete L2CAP PDUs before being
+ * delivered. In order to avoid copying the data, the PDU buffer is a chain of
+ * the ACL packets received from the controller: each segment starts with the
+ * 4-byte ACL header, followed by a fragment of the payload. Use the
+ * bte_hci_acl_pdu_*() functions to access the payload. The buffer is only
+ * valid during the callback, unless the client takes a reference on it (see
+ * bte_hci_set_ctrl_to_host_flow_control() about releasing it). */
+typedef void (*BteHciAclDataCb)(BteHci *hci, BteHciConnHandle conn_handle,
+                                BteBuffer *pdu, void *userdata);
+/* Only one client can receive the data of a connection; pass NULL as the
+ * callback to stop receiving it. Returns false if the connection is already
+ * handled by another client, or if too many connections are in use. */
+bool bte_hci_on_acl_data(BteHci *hci, BteHciConnHandle conn_handle,
+                         BteHciAclDataCb callback);
+
+/* Size of the payload of a PDU, including the L2CAP header */
+uint16_t bte_hci_acl_pdu_size(const BteBuffer *pdu);
+/* Copies up to size bytes of the PDU payload, starting at offset, and
+ * returns the number of copied bytes */
+uint16_t bte_hci_acl_pdu_read(const BteBuffer *pdu, uint16_t offset,
+                              void *data, uint16_t size);
+
+/* Queues a PDU (L2CAP header included) for transmission on the given ACL
+ * connection. The PDU is split into packets no larger than the controller's
+ * ACL MTU, and they are sent as the controller reports free buffers; packets
+ * for different connections are interleaved. When the PDU is a chain whose
+ * segments fit the MTU, the data is not copied.
+ * A reference on the PDU is taken, so the caller can unref it right away.
+ * Returns 0 on success, -ENOBUFS if the transmission queue is full, -EBUSY if
+ * the connection belongs to another client, -EINVAL if the PDU is empty. */
+int bte_hci_send_acl_data(BteHci *hci, BteHciConnHandle conn_handle,
+                          BteBuffer *pdu);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,27 +1,35 @@
 #include "hci.h"
 #include "backend.h"
+#include "clock.h"
 #include "driver.h"
 #include "hci_proto.h"
 #include "internals.h"
 #include "logging.h"
 
 #include <errno.h>
+#include <stdalign.h>
 
-BteHciDev _bte_hci_dev;
+BteHciDev _bte_hci_dev = {
+    .backend = &_bte_backend,
+    .driver = &_bte_driver,
+    .call_ring = BTE_MPSC_RING_INIT(_bte_hci_dev.call_sequences,
+                                    BTE_HCI_DEV_CALL_QUEUE_SIZE),
+};
 
-BteHciEventHandler *_bte_hci_dev_handler_for_event(uint8_t event_code)
+BteHciEventHandler *_bte_hci_dev_handler_for_event(BteHciDev *dev,
+                                                   uint8_t event_code)
 {
     if (event_code == HCI_VENDOR_SPECIFIC_EVENT) event_code = 0;
     if (UNLIKELY(event_code > BTE_HCI_EVENT_LAST)) {
         return NULL;
     }
-    return &_bte_hci_dev.event_handlers[event_code];
+    return &dev->event_handlers[event_code];
 }
 
-bool _bte_hci_dev_foreach_hci_client(BteHciForeachHciClientCb callback,
+bool _bte_hci_dev_foreach_hci_client(BteHciDev *dev,
+                                     BteHciForeachHciClientCb callback,
                                      void *cb_data)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     for (int i = 0; i < BTE_HCI_MAX_CLIENTS; i++) {
         if (!dev->clients[i]) continue;
         if (callback(&dev->clients[i]->hci, cb_data)) return true;
@@ -38,6 +46,7 @@ static uint16_t build_opcode(uint16_t ocf, uint8_t ogf)
 static BteBuffer *hci_command_alloc(uint16_t ocf, uint8_t ogf, uint8_t len)
 {
     BteBuffer *b = bte_buffer_alloc_contiguous(len);
+    if (UNLIKELY(!b)) return NULL;
     uint8_t *ptr = b->data;
     *(uint16_t*)ptr = build_opcode(ocf, ogf);
     ptr[2] = len - HCI_CMD_HDR_LEN;
@@ -55,71 +64,168 @@ static void hci_dev_dispose(BteHciDev *dev, BteHci *hci)
     for (int i = 0; i < BTE_HCI_MAX_PENDING_COMMANDS; i++) {
         BteHciPendingCommand *pc = &dev->pending_commands[i];
         if (!bte_data_matcher_is_empty(&pc->matcher) && pc->hci == hci) {
-            _bte_hci_dev_free_command(pc);
+            _bte_hci_dev_free_command(dev, pc);
         }
     }
+
+    for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+        BteHciAclConnection *conn = &dev->acl_connections[i];
+        if (conn->state != 0 && conn->hci == hci) {
+            _bte_hci_dev_release_acl_connection(dev, conn);
+        }
+    }
+}
+
+#define PENDING_UNINDEXED_BUCKET BTE_HCI_PENDING_HASH_SIZE
+
+_Static_assert((BTE_HCI_PENDING_HASH_SIZE &
+                (BTE_HCI_PENDING_HASH_SIZE - 1)) == 0,
+               "BTE_HCI_PENDING_HASH_SIZE must be a power of two");
+
+static inline uint16_t pending_hash(uint8_t event_code, const uint8_t *key)
+{
+    uint32_t h = event_code | (key[0] << 8) | (key[1] << 16);
+    return (h * 0x9e3779b1) >> 16 & (BTE_HCI_PENDING_HASH_SIZE - 1);
+}
+
+/* Returns the bucket where a command with this matcher belongs */
+static uint16_t pending_bucket_for_matcher(BteHciDev *dev,
+                                           const BteDataMatcher *matcher)
+{
+    uint8_t offset, len;
+    const uint8_t *event_code = bte_data_matcher_get_rule(matcher, 0,
+                                                          &offset, &len);
+    if (!event_code || offset != 0 || len != 1 ||
+        *event_code > BTE_HCI_EVENT_LAST) {
+        return PENDING_UNINDEXED_BUCKET;
+    }
+
+    const uint8_t *key = bte_data_matcher_get_rule(matcher, 1, &offset, &len);
+    if (!key || offset == 0 || len < 2) return PENDING_UNINDEXED_BUCKET;
+
+    uint8_t *key_offset = &dev->pending_key_offsets[*event_code];
+    if (*key_offset == 0) {
+        *key_offset = offset;
+    } else if (*key_offset != offset) {
+        return PENDING_UNINDEXED_BUCKET;
+    }
+    return pending_hash(*event_code, key);
+}
+
+static BteHciPendingCommand *pending_find_in_bucket(BteHciDev *dev,
+                                                    uint16_t bucket,
+                                                    const void *data,
+                                                    size_t len)
+{
+    uint16_t index = dev->pending_buckets[bucket];
+    while (index != 0) {
+        BteHciPendingCommand *pc = &dev->pending_commands[index - 1];
+        if (bte_data_matcher_compare(&pc->matcher, data, len)) return pc;
+        index = pc->index_next;
+    }
+    return NULL;
 }
 
 BteHciPendingCommand *_bte_hci_dev_find_pending_command_raw(
-    const void *data, size_t len)
+    BteHciDev *dev, const void *data, size_t len)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    const uint8_t *bytes = data;
 
-    for (int i = 0; i < BTE_HCI_MAX_PENDING_COMMANDS; i++) {
-        BteHciPendingCommand *pc = &dev->pending_commands[i];
-        if (!bte_data_matcher_is_empty(&pc->matcher) &&
-            bte_data_matcher_compare(&pc->matcher, data, len)) {
-            return pc;
+    if (dev->num_pending_commands == 0 || len == 0) return NULL;
+
+    uint8_t event_code = bytes[0];
+    if (event_code <= BTE_HCI_EVENT_LAST) {
+        uint8_t key_offset = dev->pending_key_offsets[event_code];
+        if (key_offset != 0 && key_offset + 2 <= len) {
+            uint16_t bucket = pending_hash(event_code, bytes + key_offset);
+            BteHciPendingCommand *pc =
+                pending_find_in_bucket(dev, bucket, data, len);
+            if (pc) return pc;
         }
     }
-    return NULL;
+    return pending_find_in_bucket(dev, PENDING_UNINDEXED_BUCKET, data, len);
 }
 
 BteHciPendingCommand *_bte_hci_dev_find_pending_command(
-    const BteBuffer *buffer)
+    BteHciDev *dev, const BteBuffer *buffer)
 {
-    return _bte_hci_dev_find_pending_command_raw(buffer->data, buffer->size);
+    return _bte_hci_dev_find_pending_command_raw(dev, buffer->data,
+                                                 buffer->size);
 }
 
-static void deliver_status_to_client(BteBuffer *buffer)
+/* Opcode 0 is used by the controller to just announce how many commands it can
+ * accept: not having a pending command for it is not an anomaly */
+static inline void record_orphaned_reply(BteHciDev *dev,
+                                         const BteBuffer *buffer,
+                                         int opcode_pos)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
-    if (LIKELY(pc)) {
-        /* Free the pending command, but before doing it save the data that we
-         * are still using. */
-        BteHci *hci = pc->hci;
-        BteHciCommandStatusCb command_status_cb =
-            pc->command_cb.cmd_status.status;
-        BteHciDoneCb client_cb = pc->command_cb.cmd_status.client_cb;
+    if (buffer->size < opcode_pos + 2) return;
+    uint16_t opcode = read_le16(buffer->data + opcode_pos);
+    if (opcode != 0) {
+        _bte_command_stats(dev, BTE_COMMAND_STATS_ORPHANED, opcode, 0);
+    }
+}
 
-        uint8_t status = buffer->data[HCI_CMD_STATUS_POS_STATUS];
-        if (command_status_cb) {
-            command_status_cb(hci, status, pc);
-        } else {
-            _bte_hci_dev_free_command(pc);
-        }
+static void complete_status(BteHciDev *dev, BteHciPendingCommand *pc,
+                            uint8_t status)
+{
+    /* Free the pending command, but before doing it save the data that we
+     * are still using. */
+    BteHci *hci = pc->hci;
+    BteHciCommandStatusCb command_status_cb = pc->command_cb.cmd_status.status;
+    BteHciDoneCb client_cb = pc->command_cb.cmd_status.client_cb;
 
-        BteHciReply reply;
-        reply.status = status;
-        client_cb(hci, &reply, hci_userdata(hci));
+    if (command_status_cb) {
+        command_status_cb(hci, status, pc);
+    } else {
+        _bte_hci_dev_free_command(dev, pc);
     }
+
+    BteHciReply reply;
+    reply.status = status;
+    client_cb(hci, &reply, hci_userdata(hci));
 }
 
-static void deliver_reply_to_client(BteBuffer *buffer)
+static void complete_reply(BteHciDev *dev, BteHciPendingCommand *pc,
+                           BteBuffer *buffer)
 {
-    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(buffer);
-    if (LIKELY(pc)) {
-        BteHciCommandCb command_cb = pc->command_cb.cmd_complete.complete;
-        void *client_cb = pc->command_cb.cmd_complete.client_cb;
-        _bte_hci_dev_free_command(pc);
+    BteHci *hci = pc->hci;
+    BteHciCommandCb command_cb = pc->command_cb.cmd_complete.complete;
+    void *client_cb = pc->command_cb.cmd_complete.client_cb;
+    _bte_hci_dev_free_command(dev, pc);
 
-        command_cb(pc->hci, buffer, client_cb);
+    command_cb(hci, buffer, client_cb);
+}
+
+static void deliver_status_to_client(BteHciDev *dev, BteBuffer *buffer)
+{
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
+    if (UNLIKELY(!pc)) {
+        record_orphaned_reply(dev, buffer, HCI_CMD_STATUS_POS_OPCODE);
+    } else {
+        _bte_command_stats(dev, BTE_COMMAND_STATS_COMPLETED,
+                           read_le16(buffer->data + HCI_CMD_STATUS_POS_OPCODE),
+                           pc->sent_at_us);
+        complete_status(dev, pc, buffer->data[HCI_CMD_STATUS_POS_STATUS]);
+    }
+}
+
+static void deliver_reply_to_client(BteHciDev *dev, BteBuffer *buffer)
+{
+    BteHciPendingCommand *pc = _bte_hci_dev_find_pending_command(dev, buffer);
+    if (UNLIKELY(!pc)) {
+        record_orphaned_reply(dev, buffer, HCI_CMD_REPLY_POS_OPCODE);
+    } else {
+        _bte_command_stats(dev, BTE_COMMAND_STATS_COMPLETED,
+                           read_le16(buffer->data + HCI_CMD_REPLY_POS_OPCODE),
+                           pc->sent_at_us);
+        complete_reply(dev, pc, buffer);
     }
 }
 
-static void handle_info_param(uint16_t ocf, const uint8_t *data, uint8_t len)
+static void handle_info_param(BteHciDev *dev, uint16_t ocf,
+                              const uint8_t *data, uint8_t len)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     switch (ocf) {
     case HCI_R_LOC_FEAT_OCF:
         if (data[0] == HCI_SUCCESS) {
@@ -132,36 +238,503 @@ static void handle_info_param(uint16_t ocf, const uint8_t *data, uint8_t len)
     }
 }
 
-static void handle_host_control(uint16_t ocf, const uint8_t *data, uint8_t len)
+static void handle_host_control(BteHciDev *dev, uint16_t ocf,
+                                const uint8_t *data, uint8_t len)
 {
+    if (UNLIKELY(len < 1) || data[0] != HCI_SUCCESS) return;
+
     switch (ocf) {
     case HCI_RESET_OCF:
+        dev->host_flow_control = BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF;
+        dev->host_acl_packets = 0;
+        dev->host_completed_count = 0;
+        dev->host_completed_packets = 0;
+        for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+            dev->acl_connections[i].rx_unreported = 0;
+        }
+        break;
+    case HCI_SET_HC_TO_H_FC_OCF:
+        dev->host_flow_control = dev->host_flow_control_requested;
+        break;
+    case HCI_HOST_BUF_SIZE_OCF:
+        dev->host_acl_packets = dev->host_acl_packets_requested;
         break;
     }
 }
 
-int _bte_hci_send_command(BteBuffer *buffer)
+/* The Host Number Of Completed Packets command can be sent even when the
+ * controller is not accepting other commands, and does not consume a credit */
+static inline bool command_needs_credit(BteBuffer *buffer)
+{
+    return hci_command_opcode(buffer) !=
+        build_opcode(HCI_HOST_NUM_COMPL_OCF, HCI_HC_BB_OGF);
+}
+
+static void command_sent(BteHciDev *dev, BteBuffer *buffer);
+static void command_send_failed(BteHciDev *dev, BteBuffer *buffer);
+
+static int transmit_command(BteHciDev *dev, BteBuffer *buffer)
+{
+    bool needs_credit = command_needs_credit(buffer);
+    if (needs_credit) atomic_fetch_sub(&dev->num_packets, 1);
+    _bte_capture(HCI_COMMAND_DATA_PACKET, false, buffer);
+    int rc = dev->backend->hci_send_command(dev, buffer);
+    if (!needs_credit) return rc;
+
+    if (LIKELY(rc >= 0)) {
+        command_sent(dev, buffer);
+    } else {
+        /* The controller will never reply to it, so the credit is still
+         * there and the command can be completed right away */
+        atomic_fetch_add(&dev->num_packets, 1);
+        command_send_failed(dev, buffer);
+    }
+    return rc;
+}
+
+static int command_queue_push(BteHciDev *dev, BteBuffer *buffer)
+{
+    struct bte_hci_command_queue_t *q = &dev->command_queue;
+
+    if (UNLIKELY(q->count == BTE_HCI_COMMAND_QUEUE_SIZE)) {
+        BTE_WARN("Command queue full, dropping command %04x\n",
+                 le16toh(hci_command_opcode(buffer)));
+        q->stats.num_dropped++;
+        return -ENOBUFS;
+    }
+
+    int index = (q->head + q->count) % BTE_HCI_COMMAND_QUEUE_SIZE;
+    q->commands[index].buffer = bte_buffer_ref(buffer);
+    q->commands[index].queued_at_us = _bte_clock_now_us();
+    q->count++;
+
+    q->stats.depth = q->count;
+    if (q->count > q->stats.max_depth) q->stats.max_depth = q->count;
+    q->stats.num_queued++;
+    return 0;
+}
+
+static void command_queue_drain(BteHciDev *dev)
+{
+    struct bte_hci_command_queue_t *q = &dev->command_queue;
+
+    while (q->count > 0 && dev->num_packets > 0) {
+        struct bte_hci_queued_command_t *cmd = &q->commands[q->head];
+        BteBuffer *buffer = cmd->buffer;
+        uint64_t wait_us = _bte_clock_now_us() - cmd->queued_at_us;
+
+        q->head = (q->head + 1) % BTE_HCI_COMMAND_QUEUE_SIZE;
+        q->count--;
+        q->stats.depth = q->count;
+        q->stats.total_wait_us += wait_us;
+        if (wait_us > q->stats.max_wait_us) q->stats.max_wait_us = wait_us;
+
+        transmit_command(dev, buffer);
+        bte_buffer_unref(buffer);
+    }
+}
+
+void _bte_hci_dev_reset_command_queue(BteHciDev *dev)
+{
+    struct bte_hci_command_queue_t *q = &dev->command_queue;
+
+    while (q->count > 0) {
+        bte_buffer_unref(q->commands[q->head].buffer);
+        q->head = (q->head + 1) % BTE_HCI_COMMAND_QUEUE_SIZE;
+        q->count--;
+    }
+    q->head = 0;
+    memset(&q->stats, 0, sizeof(q->stats));
+    dev->num_packets = 1;
+}
+
+int _bte_hci_send_command(BteHciDev *dev, BteBuffer *buffer)
 {
     if (UNLIKELY(!buffer)) return -ENOMEM;
-    int rc = _bte_backend.hci_send_command(buffer);
-    /* The backend, if needed, will increase the reference count. But we
-     * ourselves don't need this buffer anymore */
+
+    int rc;
+    /* Preserve the ordering: if some commands are already waiting, this one
+     * must wait too */
+    if (!command_needs_credit(buffer) ||
+        (dev->command_queue.count == 0 && dev->num_packets > 0)) {
+        rc = transmit_command(dev, buffer);
+    } else {
+        rc = command_queue_push(dev, buffer);
+    }
+    /* The backend (or the queue), if needed, will increase the reference
+     * count. But we ourselves don't need this buffer anymore */
     bte_buffer_unref(buffer);
     return rc;
 }
 
-int _bte_hci_dev_handle_event(BteBuffer *buf)
+static void handle_completed_packets(BteHciDev *dev, const uint8_t *data,
+                                     uint8_t len)
+{
+    if (UNLIKELY(len < 1)) return;
+    uint8_t num_handles = data[0];
+    if (UNLIKELY(len < 1 + num_handles * 4)) return;
+
+    for (int i = 0; i < num_handles; i++) {
+        const uint8_t *ptr = data + 1 + i * 4;
+        BteHciConnHandle conn_handle = read_le16(ptr) & HCI_ACL_HANDLE_MASK;
+        uint16_t num_packets = read_le16(ptr + 2);
+
+        BteHciAclConnection *conn =
+            _bte_hci_dev_acl_connection(dev, conn_handle);
+        if (conn) {
+            conn->tx_in_flight -= MIN2(conn->tx_in_flight, num_packets);
+        }
+        dev->acl_in_flight -= MIN2(dev->acl_in_flight, num_packets);
+    }
+    _bte_hci_dev_acl_schedule(dev);
+}
+
+static inline bool host_flow_control_acl(const BteHciDev *dev)
+{
+    return dev->host_flow_control & BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL;
+}
+
+void _bte_hci_dev_flush_host_completed(BteHciDev *dev)
+{
+    uint8_t count = dev->host_completed_count;
+    for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+        if (dev->acl_connections[i].rx_unreported > 0) count++;
+    }
+    if (count == 0) return;
+
+    BteBuffer *b = hci_command_alloc(HCI_HOST_NUM_COMPL_OCF, HCI_HC_BB_OGF,
+                                     HCI_CMD_HDR_LEN + 1 + count * 4);
+    /* Nothing is lost: we'll try again next time */
+    if (UNLIKELY(!b)) return;
+    uint8_t *data = b->data + HCI_CMD_HDR_LEN;
+    *data++ = count;
+    for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+        BteHciAclConnection *conn = &dev->acl_connections[i];
+        if (conn->rx_unreported == 0) continue;
+        write_le16(conn->conn_handle, data);
+        write_le16(conn->rx_unreported, data + 2);
+        data += 4;
+        conn->rx_unreported = 0;
+    }
+    for (int i = 0; i < dev->host_completed_count; i++) {
+        write_le16(dev->host_completed[i].conn_handle, data);
+        write_le16(dev->host_completed[i].num_packets, data + 2);
+        data += 4;
+    }
+    dev->host_completed_count = 0;
+    dev->host_completed_packets = 0;
+    _bte_hci_send_command(dev, b);
+}
+
+/* Finds where to count the packets of a handle we don't track a connection
+ * for; returns NULL if there is no room */
+static struct bte_hci_host_completed_t *
+host_completed_entry(BteHciDev *dev, BteHciConnHandle conn_handle)
 {
-    {
-        int len = buf->size;
-        if (len > 16) len = 16;
+    for (int i = 0; i < dev->host_completed_count; i++) {
+        if (dev->host_completed[i].conn_handle == conn_handle) {
+            return &dev->host_completed[i];
+        }
+    }
 
-        BTE_DEBUG("Event, size %d:", buf->size);
-        for (int i = 0; i < len; i++) {
-            BTE_DEBUG(" %02x", buf->data[i]);
+    if (dev->host_completed_count == BTE_HCI_HOST_COMPLETED_MAX_HANDLES) {
+        _bte_hci_dev_flush_host_completed(dev);
+        if (UNLIKELY(dev->host_completed_count > 0)) return NULL;
+    }
+    struct bte_hci_host_completed_t *entry =
+        &dev->host_completed[dev->host_completed_count++];
+    entry->conn_handle = conn_handle;
+    entry->num_packets = 0;
+    return entry;
+}
+
+void _bte_hci_dev_add_host_completed(BteHciDev *dev,
+                                     BteHciConnHandle conn_handle,
+                                     uint16_t num_packets)
+{
+    uint64_t now = _bte_clock_now_us();
+    if (dev->host_completed_packets == 0) {
+        dev->host_completed_since_us = now;
+    }
+
+    /* Counts are kept in the connection whenever we track it, so that they
+     * survive a failure to allocate the command */
+    BteHciAclConnection *conn = _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (conn) {
+        conn->rx_unreported += num_packets;
+    } else {
+        struct bte_hci_host_completed_t *entry =
+            host_completed_entry(dev, conn_handle);
+        if (UNLIKELY(!entry)) {
+            BTE_WARN("Cannot report %d packets on handle %03x\n",
+                     num_packets, conn_handle);
+            return;
         }
-        BTE_DEBUG("\n");
+        entry->num_packets += num_packets;
     }
+    dev->host_completed_packets += num_packets;
+
+    if (dev->host_completed_packets >= BTE_HCI_HOST_COMPLETED_FLUSH_PACKETS ||
+        now - dev->host_completed_since_us >=
+        (uint64_t)BTE_HCI_HOST_COMPLETED_FLUSH_MS * 1000) {
+        _bte_hci_dev_flush_host_completed(dev);
+    }
+}
+
+/* After a disconnection, the controller no longer expects the packets of the
+ * connection to be reported */
+static void host_completed_drop(BteHciDev *dev, BteHciConnHandle conn_handle)
+{
+    for (int i = 0; i < dev->host_completed_count; i++) {
+        if (dev->host_completed[i].conn_handle == conn_handle) {
+            dev->host_completed_packets -= dev->host_completed[i].num_packets;
+            dev->host_completed[i] =
+                dev->host_completed[--dev->host_completed_count];
+            break;
+        }
+    }
+}
+
+#define CONN_INDEXED_HANDLE  (1 << 0)
+#define CONN_INDEXED_ADDRESS (1 << 1)
+
+_Static_assert((BTE_HCI_CONN_HASH_SIZE & (BTE_HCI_CONN_HASH_SIZE - 1)) == 0,
+               "BTE_HCI_CONN_HASH_SIZE must be a power of two");
+_Static_assert(BTE_HCI_MAX_ACL_CONNECTIONS < UINT8_MAX,
+               "Connections are indexed with an uint8_t");
+
+/* Handles are usually assigned sequentially by the controller, so their low
+ * bits are already well distributed */
+static inline uint8_t *conn_handle_bucket(BteHciDev *dev,
+                                          BteHciConnHandle conn_handle)
+{
+    return &dev->conn_by_handle[conn_handle & (BTE_HCI_CONN_HASH_SIZE - 1)];
+}
+
+static inline uint8_t *conn_address_bucket(BteHciDev *dev,
+                                           const BteBdAddr *address)
+{
+    const uint8_t *b = address->bytes;
+    uint8_t hash = b[0] ^ (b[1] << 3) ^ (b[2] << 5) ^ b[3];
+    return &dev->conn_by_address[hash & (BTE_HCI_CONN_HASH_SIZE - 1)];
+}
+
+static inline uint8_t conn_link(BteHciDev *dev, BteHciAclConnection *conn)
+{
+    return conn - dev->acl_connections + 1;
+}
+
+static void conn_index(BteHciDev *dev, BteHciAclConnection *conn,
+                       uint8_t which)
+{
+    if ((which & CONN_INDEXED_HANDLE) &&
+        !(conn->indexed & CONN_INDEXED_HANDLE)) {
+        uint8_t *bucket = conn_handle_bucket(dev, conn->conn_handle);
+        conn->handle_next = *bucket;
+        *bucket = conn_link(dev, conn);
+    }
+    if ((which & CONN_INDEXED_ADDRESS) &&
+        !(conn->indexed & CONN_INDEXED_ADDRESS)) {
+        uint8_t *bucket = conn_address_bucket(dev, &conn->address);
+        conn->address_next = *bucket;
+        *bucket = conn_link(dev, conn);
+    }
+    conn->indexed |= which;
+}
+
+static void conn_unindex(BteHciDev *dev, BteHciAclConnection *conn)
+{
+    uint8_t link = conn_link(dev, conn);
+    if (conn->indexed & CONN_INDEXED_HANDLE) {
+        uint8_t *ptr = conn_handle_bucket(dev, conn->conn_handle);
+        while (*ptr != link) ptr = &dev->acl_connections[*ptr - 1].handle_next;
+        *ptr = conn->handle_next;
+    }
+    if (conn->indexed & CONN_INDEXED_ADDRESS) {
+        uint8_t *ptr = conn_address_bucket(dev, &conn->address);
+        while (*ptr != link) ptr = &dev->acl_connections[*ptr - 1].address_next;
+        *ptr = conn->address_next;
+    }
+    conn->indexed = 0;
+}
+
+BteHciAclConnection *_bte_hci_dev_acl_connection(BteHciDev *dev,
+                                                 BteHciConnHandle conn_handle)
+{
+    uint8_t link = *conn_handle_bucket(dev, conn_handle);
+    while (link) {
+        BteHciAclConnection *conn = &dev->acl_connections[link - 1];
+        if (conn->conn_handle == conn_handle) return conn;
+        link = conn->handle_next;
+    }
+    return NULL;
+}
+
+BteHciAclConnection *_bte_hci_dev_connection_by_address(
+    BteHciDev *dev, const BteBdAddr *address)
+{
+    uint8_t link = *conn_address_bucket(dev, address);
+    while (link) {
+        BteHciAclConnection *conn = &dev->acl_connections[link - 1];
+        if (memcmp(&conn->address, address, sizeof(*address)) == 0) {
+            return conn;
+        }
+        link = conn->address_next;
+    }
+    return NULL;
+}
+
+static BteHciAclConnection *conn_alloc(BteHciDev *dev, uint8_t state)
+{
+    for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+        BteHciAclConnection *conn = &dev->acl_connections[i];
+        if (conn->state == 0) {
+            memset(conn, 0, sizeof(*conn));
+            conn->state = state;
+            conn->mode = BTE_HCI_MODE_ACTIVE;
+            conn->serial = ++dev->acl_conn_serial;
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+BteHciAclConnection *_bte_hci_dev_alloc_acl_connection(
+    BteHciDev *dev, BteHciConnHandle conn_handle)
+{
+    BteHciAclConnection *conn = conn_alloc(dev, BTE_HCI_CONN_STATE_UNTRACKED);
+    if (UNLIKELY(!conn)) return NULL;
+    conn->conn_handle = conn_handle;
+    conn_index(dev, conn, CONN_INDEXED_HANDLE);
+    return conn;
+}
+
+void _bte_hci_dev_connection_connecting(BteHci *hci, const BteBdAddr *address,
+                                        uint8_t role)
+{
+    BteHciDev *dev = hci_dev(hci);
+    /* A connection might already be tracked, if we are retrying */
+    BteHciAclConnection *conn =
+        _bte_hci_dev_connection_by_address(dev, address);
+    if (!conn) {
+        conn = conn_alloc(dev, BTE_HCI_CONN_STATE_CONNECTING);
+        /* We'll track it anyway once it's up, if a slot frees up */
+        if (UNLIKELY(!conn)) return;
+        conn->address = *address;
+        conn_index(dev, conn, CONN_INDEXED_ADDRESS);
+    } else if (conn->state != BTE_HCI_CONN_STATE_CONNECTING) {
+        return;
+    }
+    conn->hci = hci;
+    conn->role = role;
+}
+
+void _bte_hci_dev_connection_failed(BteHciDev *dev, const BteBdAddr *address)
+{
+    BteHciAclConnection *conn =
+        _bte_hci_dev_connection_by_address(dev, address);
+    if (conn && conn->state == BTE_HCI_CONN_STATE_CONNECTING) {
+        _bte_hci_dev_free_acl_connection(dev, conn);
+    }
+}
+
+static void handle_connection_complete(BteHciDev *dev, const uint8_t *data,
+                                       uint8_t len)
+{
+    /* status, handle, address, link type, encryption mode */
+    if (UNLIKELY(len < 11)) return;
+    const BteBdAddr *address = (const BteBdAddr *)(data + 3);
+    if (data[0] != HCI_SUCCESS) {
+        _bte_hci_dev_connection_failed(dev, address);
+        return;
+    }
+    if (data[9] != BTE_HCI_LINK_TYPE_ACL) return;
+
+    BteHciConnHandle conn_handle = read_le16(data + 1) & HCI_ACL_HANDLE_MASK;
+    BteHciAclConnection *conn = _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (!conn) {
+        conn = _bte_hci_dev_connection_by_address(dev, address);
+        if (conn && conn->state != BTE_HCI_CONN_STATE_CONNECTING) {
+            /* A stale entry: we missed its disconnection */
+            _bte_hci_dev_free_acl_connection(dev, conn);
+            conn = NULL;
+        }
+    }
+    if (!conn) {
+        /* Incoming, and not accepted by any of our clients (for example
+         * because of an event filter) */
+        conn = conn_alloc(dev, BTE_HCI_CONN_STATE_CONNECTED);
+        if (UNLIKELY(!conn)) {
+            BTE_WARN("No room to track connection %03x\n", conn_handle);
+            return;
+        }
+        conn->role = BTE_HCI_ROLE_SLAVE;
+    }
+
+    conn_unindex(dev, conn);
+    conn->state = BTE_HCI_CONN_STATE_CONNECTED;
+    conn->conn_handle = conn_handle;
+    conn->address = *address;
+    /* Even if the slot was already tracking the handle, this is a new link */
+    conn->serial = ++dev->acl_conn_serial;
+    conn_index(dev, conn, CONN_INDEXED_HANDLE | CONN_INDEXED_ADDRESS);
+}
+
+static void handle_disconnection_complete(BteHciDev *dev,
+                                          const uint8_t *data, uint8_t len)
+{
+    if (UNLIKELY(len < 4)) return;
+    BteHciDisconnectionCompleteReply reply;
+    reply.status = data[0];
+    reply.conn_handle = read_le16(data + 1) & HCI_ACL_HANDLE_MASK;
+    reply.reason = data[3];
+
+    BteHciAclConnection *conn = reply.status == HCI_SUCCESS ?
+        _bte_hci_dev_acl_connection(dev, reply.conn_handle) : NULL;
+    if (conn) {
+        /* The controller has flushed the packets of this connection, and
+         * won't report them as completed */
+        dev->acl_in_flight -= MIN2(dev->acl_in_flight, conn->tx_in_flight);
+        _bte_hci_dev_free_acl_connection(dev, conn);
+    }
+    if (reply.status == HCI_SUCCESS) {
+        host_completed_drop(dev, reply.conn_handle);
+    }
+
+    for (int i = 0; i < BTE_HCI_MAX_CLIENTS; i++) {
+        BteClient *client = dev->clients[i];
+        if (client && client->hci.disconnection_cb) {
+            client->hci.disconnection_cb(&client->hci, &reply,
+                                         client->userdata);
+        }
+    }
+    if (conn) _bte_hci_dev_acl_schedule(dev);
+}
+
+static void handle_role_change(BteHciDev *dev, const uint8_t *data,
+                               uint8_t len)
+{
+    /* status, address, new role */
+    if (UNLIKELY(len < 8) || data[0] != HCI_SUCCESS) return;
+    BteHciAclConnection *conn =
+        _bte_hci_dev_connection_by_address(dev, (const BteBdAddr *)(data + 1));
+    if (conn) conn->role = data[7];
+}
+
+static void handle_mode_change(BteHciDev *dev, const uint8_t *data,
+                               uint8_t len)
+{
+    /* status, handle, current mode, interval */
+    if (UNLIKELY(len < 6) || data[0] != HCI_SUCCESS) return;
+    BteHciConnHandle conn_handle = read_le16(data + 1) & HCI_ACL_HANDLE_MASK;
+    BteHciAclConnection *conn = _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (conn) conn->mode = data[3];
+}
+
+int _bte_hci_dev_handle_event(BteHciDev *dev, BteBuffer *buf)
+{
+    _bte_capture(HCI_EVENT_PACKET, true, buf);
+    BTE_DEBUG_DEFERRED("Event %02x, size %u\n", buf->data[0], buf->size);
 
     uint8_t code = buf->data[0];
     uint8_t len = buf->data[1];
@@ -169,74 +742,568 @@ int _bte_hci_dev_handle_event(BteBuffer *buf)
     uint16_t opcode;
     switch (code) {
     case HCI_COMMAND_COMPLETE:
-        _bte_hci_dev.num_packets = data[0];
+        dev->num_packets = data[0];
+        command_queue_drain(dev);
         if (len < 3) break;
         opcode = *(uint16_t *)(data + 1);
         uint16_t opcode_h = le16toh(opcode);
         uint16_t ocf = opcode_h & 0x03ff;
         uint8_t ogf = opcode_h >> 10;
-        BTE_DEBUG("opcode %04x, ogf %02x, ocf %04x\n", opcode, ogf, ocf);
+        BTE_DEBUG_DEFERRED("opcode %04x, ogf %02x, ocf %04x\n",
+                           opcode_h, ogf, ocf);
         switch (ogf) {
         case HCI_INFO_PARAM_OGF:
-            handle_info_param(ocf, data + 3, len - 3);
+            handle_info_param(dev, ocf, data + 3, len - 3);
             break;
         case HCI_HC_BB_OGF:
-            handle_host_control(ocf, data + 3, len - 3);
+            handle_host_control(dev, ocf, data + 3, len - 3);
             break;
         }
-        deliver_reply_to_client(buf);
+        deliver_reply_to_client(dev, buf);
         break;
     case HCI_COMMAND_STATUS:
-        _bte_hci_dev.num_packets = data[1];
-        deliver_status_to_client(buf);
+        dev->num_packets = data[1];
+        command_queue_drain(dev);
+        deliver_status_to_client(dev, buf);
+        break;
+    case HCI_NBR_OF_COMPLETED_PACKETS:
+        handle_completed_packets(dev, data, len);
+        break;
+    case HCI_CONNECTION_COMPLETE:
+        handle_connection_complete(dev, data, len);
+        _bte_device_cache_handle_event(dev, code, data, len);
+        break;
+    case HCI_DISCONNECTION_COMPLETE:
+        handle_disconnection_complete(dev, data, len);
+        break;
+    case HCI_ROLE_CHANGE:
+        handle_role_change(dev, data, len);
+        break;
+    case HCI_MODE_CHANGE:
+        handle_mode_change(dev, data, len);
+        break;
+    case HCI_READ_CLOCK_OFFSET_COMPLETE:
+    case HCI_PSCAN_REP_MODE_CHANGE:
+        _bte_device_cache_handle_event(dev, code, data, len);
         break;
     }
 
-    BteHciEventHandler *handler = _bte_hci_dev_handler_for_event(code);
+    BteHciEventHandler *handler = _bte_hci_dev_handler_for_event(dev, code);
     if (handler && handler->handler_cb) {
-        handler->handler_cb(buf, handler->cb_data);
+        handler->handler_cb(dev, buf, handler->cb_data);
     }
 
     /* The event buffer is unreferenced by the platform backend */
     return 0;
 }
 
-int _bte_hci_dev_handle_data(BteBuffer *buf)
+static void acl_rx_reset(BteHciAclConnection *conn)
+{
+    if (conn->rx_pdu) bte_buffer_unref(conn->rx_pdu);
+    conn->rx_pdu = conn->rx_tail = NULL;
+    conn->rx_expected = conn->rx_received = 0;
+    conn->rx_fragments = 0;
+}
+
+/* Drops the PDU being reassembled, and the packets still to come for it */
+static void acl_rx_discard(BteHciAclConnection *conn)
+{
+    acl_rx_reset(conn);
+    conn->rx_discard = true;
+}
+
+static void acl_tx_pop(BteHciAclConnection *conn)
+{
+    bte_buffer_unref(conn->tx_queue[conn->tx_head]);
+    conn->tx_head = (conn->tx_head + 1) % BTE_HCI_ACL_TX_QUEUE_SIZE;
+    conn->tx_count--;
+    conn->tx_sent = 0;
+    conn->tx_segment = conn->tx_count > 0 ?
+        conn->tx_queue[conn->tx_head] : NULL;
+    conn->tx_segment_offset = 0;
+}
+
+static void acl_drop_queues(BteHciAclConnection *conn)
+{
+    acl_rx_reset(conn);
+    while (conn->tx_count > 0) acl_tx_pop(conn);
+}
+
+void _bte_hci_dev_free_acl_connection(BteHciDev *dev,
+                                      BteHciAclConnection *conn)
+{
+    acl_drop_queues(conn);
+    conn_unindex(dev, conn);
+    if (conn->rx_unreported > 0) {
+        /* The link might still be up: keep its count with the untracked
+         * handles (the disconnection handler discards it otherwise) */
+        uint16_t num_packets = conn->rx_unreported;
+        conn->rx_unreported = 0;
+        struct bte_hci_host_completed_t *entry =
+            host_completed_entry(dev, conn->conn_handle);
+        if (LIKELY(entry)) {
+            entry->num_packets += num_packets;
+        } else {
+            dev->host_completed_packets -= num_packets;
+        }
+    }
+    conn->state = 0;
+    conn->hci = NULL;
+    conn->data_cb = NULL;
+}
+
+void _bte_hci_dev_release_acl_connection(BteHciDev *dev,
+                                         BteHciAclConnection *conn)
+{
+    if (conn->state == BTE_HCI_CONN_STATE_UNTRACKED) {
+        _bte_hci_dev_free_acl_connection(dev, conn);
+        return;
+    }
+
+    /* The link is still up, and another client might take it over */
+    acl_drop_queues(conn);
+    conn->hci = NULL;
+    conn->data_cb = NULL;
+}
+
+/* An outgoing ACL packet sent without copying the client data: the ACL header
+ * is followed by the segments of the client PDU, and the total_size of the
+ * buffer tells how much of them belongs to this packet. */
+typedef struct {
+    BteBuffer buffer;
+    uint8_t header[HCI_ACL_HDR_LEN];
+    BteBuffer *pdu;
+} AclTxFragment;
+
+static void acl_fragment_free(BteBuffer *buffer)
+{
+    AclTxFragment *fragment = (AclTxFragment *)buffer;
+    bte_buffer_unref(fragment->pdu);
+    bte_buffer_free(buffer);
+}
+
+int _bte_hci_dev_queue_acl_data(BteHciDev *dev, BteHciAclConnection *conn,
+                                BteBuffer *pdu)
+{
+    if (UNLIKELY(conn->tx_count == BTE_HCI_ACL_TX_QUEUE_SIZE)) return -ENOBUFS;
+
+    int index = (conn->tx_head + conn->tx_count) % BTE_HCI_ACL_TX_QUEUE_SIZE;
+    conn->tx_queue[index] = bte_buffer_ref(pdu);
+    if (conn->tx_count++ == 0) {
+        conn->tx_sent = 0;
+        conn->tx_segment = pdu;
+        conn->tx_segment_offset = 0;
+    }
+    return 0;
+}
+
+/* Whether the next fragment can reference the client data, instead of
+ * copying it */
+static inline bool acl_fragment_zero_copy(const BteHciDev *dev,
+                                          const BteHciAclConnection *conn)
+{
+    return conn->tx_segment_offset == 0 &&
+        (dev->backend->capabilities & BTE_BACKEND_CAP_SCATTER_GATHER);
+}
+
+/* Decides how many bytes of the current PDU go into the next packet */
+static uint16_t acl_fragment_len(const BteHciDev *dev,
+                                 const BteHciAclConnection *conn,
+                                 uint16_t remaining, uint16_t mtu)
+{
+    if (!acl_fragment_zero_copy(dev, conn)) return MIN2(mtu, remaining);
+
+    /* Take whole segments, as long as they fit: this way the next fragment
+     * will also start at the beginning of a segment, and we won't need to
+     * copy it. */
+    uint16_t len = 0;
+    for (const BteBuffer *b = conn->tx_segment; b && len < remaining;
+         b = b->next) {
+        uint16_t size = MIN2(b->size, remaining - len);
+        if (len + size > mtu) break;
+        len += size;
+    }
+    return len > 0 ? len : MIN2(mtu, remaining);
+}
+
+static BteBuffer *acl_build_fragment(BteHciDev *dev, BteHciAclConnection *conn)
+{
+    BteBuffer *pdu = conn->tx_queue[conn->tx_head];
+    uint16_t remaining = pdu->total_size - conn->tx_sent;
+    uint16_t mtu = dev->acl_mtu > 0 ? dev->acl_mtu : remaining;
+    uint16_t len = acl_fragment_len(dev, conn, remaining, mtu);
+
+    BteBuffer *buffer;
+    if (acl_fragment_zero_copy(dev, conn)) {
+        buffer = bte_buffer_alloc_contiguous(sizeof(AclTxFragment) -
+                                             sizeof(BteBuffer));
+        if (UNLIKELY(!buffer)) return NULL;
+        AclTxFragment *fragment = (AclTxFragment *)buffer;
+        buffer->free_func = acl_fragment_free;
+        buffer->size = HCI_ACL_HDR_LEN;
+        buffer->next = conn->tx_segment;
+        fragment->pdu = bte_buffer_ref(pdu);
+    } else {
+        /* The fragment starts in the middle of a segment, or the backend
+         * cannot send chained buffers */
+        buffer = bte_buffer_alloc_contiguous(HCI_ACL_HDR_LEN + len);
+        if (UNLIKELY(!buffer)) return NULL;
+        uint8_t *ptr = buffer->data + HCI_ACL_HDR_LEN;
+        uint16_t to_copy = len;
+        const BteBuffer *b = conn->tx_segment;
+        uint16_t offset = conn->tx_segment_offset;
+        while (to_copy > 0) {
+            uint16_t n = MIN2(b->size - offset, to_copy);
+            memcpy(ptr, b->data + offset, n);
+            ptr += n;
+            to_copy -= n;
+            b = b->next;
+            offset = 0;
+        }
+    }
+    buffer->total_size = HCI_ACL_HDR_LEN + len;
+
+    uint8_t pb = conn->tx_sent == 0 ?
+        HCI_ACL_PB_FIRST_FLUSH : HCI_ACL_PB_CONTINUING;
+    write_le16(conn->conn_handle | (pb << HCI_ACL_PB_SHIFT), buffer->data);
+    write_le16(len, buffer->data + 2);
+    return buffer;
+}
+
+/* Advances to the data of the next fragment; only called once the backend
+ * has accepted the current one, so that a failed send can be retried */
+static void acl_fragment_sent(BteHciAclConnection *conn, uint16_t len)
+{
+    BteBuffer *pdu = conn->tx_queue[conn->tx_head];
+    conn->tx_sent += len;
+    len += conn->tx_segment_offset;
+    while (conn->tx_segment && len >= conn->tx_segment->size) {
+        len -= conn->tx_segment->size;
+        conn->tx_segment = conn->tx_segment->next;
+    }
+    conn->tx_segment_offset = len;
+    if (conn->tx_sent == pdu->total_size) acl_tx_pop(conn);
+}
+
+void _bte_hci_dev_acl_schedule(BteHciDev *dev)
+{
+    uint16_t max_packets = dev->acl_max_packets > 0 ? dev->acl_max_packets : 1;
+
+    dev->acl_tx_retry = false;
+    while (dev->acl_in_flight < max_packets) {
+        /* Round-robin: one packet per connection at a time */
+        BteHciAclConnection *conn = NULL;
+        for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+            int index = (dev->acl_tx_next + i) % BTE_HCI_MAX_ACL_CONNECTIONS;
+            if (dev->acl_connections[index].tx_count > 0) {
+                conn = &dev->acl_connections[index];
+                dev->acl_tx_next = (index + 1) % BTE_HCI_MAX_ACL_CONNECTIONS;
+                break;
+            }
+        }
+        if (!conn) break;
+
+        BteBuffer *fragment = acl_build_fragment(dev, conn);
+        if (UNLIKELY(!fragment)) break;
+
+        _bte_capture(HCI_ACL_DATA_PACKET, false, fragment);
+        uint16_t payload_size = fragment->total_size - HCI_ACL_HDR_LEN;
+        int rc = dev->backend->hci_send_data(dev, fragment);
+        bte_buffer_unref(fragment);
+        if (UNLIKELY(rc < 0)) {
+            /* Typically the backend's queue is full: the fragment is retried
+             * at the next event loop iteration, with this connection going
+             * first to preserve the order */
+            BTE_WARN("Failed to send ACL data on handle %03x: %d\n",
+                     conn->conn_handle, rc);
+            dev->acl_tx_next = conn - dev->acl_connections;
+            dev->acl_tx_retry = true;
+            break;
+        }
+        acl_fragment_sent(conn, payload_size);
+        dev->acl_in_flight++;
+        conn->tx_in_flight++;
+        conn->tx_packets++;
+        conn->tx_bytes += payload_size;
+    }
+}
+
+/* The PDU is an empty buffer (whose storage holds an AclPduHead), followed by
+ * the ACL packets as we received them from the backend. Each of them has its
+ * own free function, so we must detach them from the chain and release them
+ * one by one. */
+typedef struct {
+    BteHciDev *dev;
+    /* The serial of the connection the PDU was received on */
+    uint32_t conn_serial;
+} AclPduHead;
+
+static void acl_pdu_free(BteBuffer *pdu)
 {
-    int len = buf->size;
-    if (len > 10) len = 10;
+    BteBuffer *fragment = pdu->next;
+    while (fragment) {
+        BteBuffer *next = fragment->next;
+        fragment->next = NULL;
+        bte_buffer_unref(fragment);
+        fragment = next;
+    }
+    bte_buffer_free(pdu);
+}
+
+/* Used instead of acl_pdu_free() when flow control is enabled: the controller
+ * must be told that the buffers holding the packets are available again.
+ * Releasing a PDU after its link has been disconnected reports nothing, since
+ * the controller has already forgotten about those packets; this holds even
+ * if the controller has since assigned the same handle to a new link. */
+static void acl_pdu_free_flow_controlled(BteBuffer *pdu)
+{
+    BteBuffer *fragment = pdu->next;
+    uint16_t num_packets = 0;
+    for (BteBuffer *b = fragment; b; b = b->next) num_packets++;
+    if (fragment) {
+        BteHciConnHandle conn_handle =
+            read_le16(fragment->data) & HCI_ACL_HANDLE_MASK;
+        AclPduHead head;
+        memcpy(&head, pdu->data, sizeof(head));
+        const BteHciAclConnection *conn =
+            _bte_hci_dev_acl_connection(head.dev, conn_handle);
+        if (conn && conn->serial == head.conn_serial) {
+            _bte_hci_dev_add_host_completed(head.dev, conn_handle,
+                                            num_packets);
+        }
+    }
+    acl_pdu_free(pdu);
+}
 
-    BTE_DEBUG("Data, size %d:", buf->size);
-    for (int i = 0; i < len; i++) {
-        BTE_DEBUG(" %02x", buf->data[i]);
+static BteBuffer *acl_pdu_new(BteHciDev *dev, const BteHciAclConnection *conn)
+{
+    BteBuffer *pdu = bte_buffer_alloc_contiguous(sizeof(AclPduHead));
+    if (LIKELY(pdu)) {
+        AclPduHead head = { dev, conn->serial };
+        memcpy(pdu->data, &head, sizeof(head));
+        /* The head is not part of the PDU data */
+        pdu->size = pdu->total_size = 0;
+        pdu->free_func = host_flow_control_acl(dev) ?
+            acl_pdu_free_flow_controlled : acl_pdu_free;
+    }
+    return pdu;
+}
+
+static BteBuffer *acl_fragment_from_buffer(BteBuffer *buf, uint16_t size)
+{
+    if (LIKELY(!buf->next)) {
+        /* Drop any trailing bytes that the backend might have left */
+        if (buf->size > size) bte_buffer_shrink(buf, size);
+        return bte_buffer_ref(buf);
+    }
+
+    /* The backend delivered the packet in several segments: since we use the
+     * next pointer to chain the packets, we need to make a contiguous copy */
+    BteBuffer *fragment = bte_buffer_alloc_contiguous(size);
+    if (UNLIKELY(!fragment)) return NULL;
+    BteBufferReader reader;
+    bte_buffer_reader_init(&reader, buf);
+    bte_buffer_reader_read(&reader, fragment->data, size);
+    return fragment;
+}
+
+/* The packets of a PDU hold on to the backend's receive buffers until the PDU
+ * is released, and with flow control they are only then reported to the
+ * controller: if it needs more packets than there are buffers, or than the
+ * controller may send before waiting for the host, reassembly would never
+ * complete. Returns 0 if there is no such limit. */
+static inline uint16_t acl_rx_max_fragments(const BteHciDev *dev)
+{
+    uint16_t max_fragments = dev->backend->acl_rx_buffer_count;
+    if (host_flow_control_acl(dev) && dev->host_acl_packets != 0 &&
+        (max_fragments == 0 || dev->host_acl_packets < max_fragments)) {
+        max_fragments = dev->host_acl_packets;
+    }
+    return max_fragments;
+}
+
+/* Adds the packet to the PDU being reassembled; stored is set if the packet
+ * has become part of it, and will be released together with it */
+static int acl_receive(BteHciDev *dev, BteBuffer *buf, uint16_t header,
+                       bool *stored)
+{
+    uint16_t len = read_le16(buf->data + 2);
+    BteHciConnHandle conn_handle = header & HCI_ACL_HANDLE_MASK;
+    uint8_t pb = (header >> HCI_ACL_PB_SHIFT) & HCI_ACL_PB_MASK;
+    if (UNLIKELY(HCI_ACL_HDR_LEN + len > buf->total_size)) {
+        BTE_WARN("ACL packet truncated (%d < %d)\n", buf->total_size,
+                 HCI_ACL_HDR_LEN + len);
+        return -EINVAL;
+    }
+
+    BteHciAclConnection *conn = _bte_hci_dev_acl_connection(dev, conn_handle);
+    if (!conn) return 0; /* Nobody is interested in this data */
+    conn->rx_packets++;
+    conn->rx_bytes += len;
+
+    if (pb != HCI_ACL_PB_CONTINUING) {
+        if (UNLIKELY(conn->rx_pdu)) {
+            BTE_WARN("Incomplete PDU on handle %03x dropped\n", conn_handle);
+            acl_rx_reset(conn);
+        }
+        conn->rx_discard = false;
+        conn->rx_pdu = conn->rx_tail = acl_pdu_new(dev, conn);
+        if (UNLIKELY(!conn->rx_pdu)) return -ENOMEM;
+    } else if (UNLIKELY(!conn->rx_pdu)) {
+        if (conn->rx_discard) return 0; /* Already reported */
+        BTE_WARN("Unexpected continuation on handle %03x\n", conn_handle);
+        return -EINVAL;
+    }
+
+    BteBuffer *pdu = conn->rx_pdu;
+    uint16_t fragment_size = HCI_ACL_HDR_LEN + len;
+    if (UNLIKELY(pdu->total_size + fragment_size > UINT16_MAX)) {
+        BTE_WARN("PDU too large on handle %03x\n", conn_handle);
+        acl_rx_discard(conn);
+        return -EMSGSIZE;
+    }
+
+    BteBuffer *fragment = acl_fragment_from_buffer(buf, fragment_size);
+    if (UNLIKELY(!fragment)) {
+        acl_rx_reset(conn);
+        return -ENOMEM;
+    }
+    conn->rx_tail->next = fragment;
+    conn->rx_tail = fragment;
+    *stored = true;
+    pdu->total_size += fragment_size;
+    conn->rx_received += len;
+    conn->rx_fragments++;
+
+    if (conn->rx_expected == 0 && conn->rx_received >= 2) {
+        uint8_t l2cap_len[2];
+        bte_hci_acl_pdu_read(pdu, 0, l2cap_len, sizeof(l2cap_len));
+        conn->rx_expected = read_le16(l2cap_len) + L2CAP_HDR_LEN;
+        if (UNLIKELY(conn->rx_expected > BTE_HCI_ACL_RX_MAX_PDU_SIZE)) {
+            BTE_WARN("PDU too large on handle %03x (%u bytes)\n",
+                     conn_handle, conn->rx_expected);
+            acl_rx_discard(conn);
+            return -EMSGSIZE;
+        }
+    }
+
+    if (conn->rx_expected != 0 && conn->rx_received >= conn->rx_expected) {
+        if (UNLIKELY(conn->rx_received > conn->rx_expected)) {
+            BTE_WARN("PDU on handle %03x longer than expected (%u > %u)\n",
+                     conn_handle, conn->rx_received, conn->rx_expected);
+        }
+        /* Detach the PDU before invoking the callback, which could remove
+         * the connection */
+        conn->rx_pdu = conn->rx_tail = NULL;
+        conn->rx_expected = conn->rx_received = 0;
+        conn->rx_fragments = 0;
+        if (conn->data_cb) {
+            conn->data_cb(conn->hci, conn_handle, pdu,
+                          hci_userdata(conn->hci));
+        }
+        bte_buffer_unref(pdu);
+        return 0;
+    }
+
+    uint16_t max_fragments = acl_rx_max_fragments(dev);
+    if (UNLIKELY(max_fragments != 0 && conn->rx_fragments >= max_fragments)) {
+        BTE_WARN("PDU on handle %03x exceeds the receive buffers\n",
+                 conn_handle);
+        acl_rx_discard(conn);
+        return -ENOBUFS;
     }
-    BTE_DEBUG("\n");
     return 0;
 }
 
-int _bte_hci_dev_init()
+int _bte_hci_dev_handle_data(BteHciDev *dev, BteBuffer *buf)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    _bte_capture(HCI_ACL_DATA_PACKET, true, buf);
+    if (UNLIKELY(buf->size < HCI_ACL_HDR_LEN)) return -EINVAL;
+
+    uint16_t header = read_le16(buf->data);
+    bool stored = false;
+    int rc = acl_receive(dev, buf, header, &stored);
+    /* Packets which we didn't keep are released as soon as we return */
+    if (!stored && host_flow_control_acl(dev)) {
+        _bte_hci_dev_add_host_completed(dev, header & HCI_ACL_HANDLE_MASK, 1);
+    }
+    return rc;
+}
 
+int _bte_hci_dev_init(BteHciDev *dev)
+{
     if (dev->init_status != BTE_HCI_INIT_STATUS_UNINITIALIZED) {
         /* Initialization has already started */
         return dev->init_status == BTE_HCI_INIT_STATUS_FAILED ? -EIO : 0;
     }
 
     dev->init_status = BTE_HCI_INIT_STATUS_INITIALIZING;
+    _bte_hci_dev_reset_command_queue(dev);
 
-    int rc = _bte_backend.init();
-    if (rc < 0) return rc;
+    int rc = dev->backend->init(dev);
+    if (rc < 0) {
+        /* The backend leaves nothing behind: the next client can retry */
+        dev->init_status = BTE_HCI_INIT_STATUS_UNINITIALIZED;
+        return rc;
+    }
 
-    return _bte_driver.init(dev);
+    return dev->driver->init(dev);
 }
 
-bool _bte_hci_dev_add_client(BteClient *client)
+BteHciDev *bte_hci_dev_new(const BteBackend *backend, void *backend_data)
+{
+    BteHciDev *dev = calloc(1, sizeof(BteHciDev));
+    if (UNLIKELY(!dev)) return NULL;
+
+    dev->backend = backend;
+    dev->backend_data = backend_data;
+    dev->driver = &_bte_driver;
+    dev->call_ring = (BteMpscRing)BTE_MPSC_RING_INIT(
+        dev->call_sequences, BTE_HCI_DEV_CALL_QUEUE_SIZE);
+    return dev;
+}
+
+int _bte_hci_dev_process_calls(BteHciDev *dev)
+{
+    /* Calls queued by the callbacks themselves wait for the next round,
+     * otherwise a function re-queueing itself would never let us go */
+    int count = 0;
+    int32_t slot;
+    while (count < BTE_HCI_DEV_CALL_QUEUE_SIZE &&
+           (slot = _bte_mpsc_ring_read_slot(&dev->call_ring)) >= 0) {
+        struct bte_hci_dev_call_t call = dev->calls[slot];
+        /* Release the slot before invoking the callback */
+        _bte_mpsc_ring_pop(&dev->call_ring);
+        call.callback(dev, call.userdata);
+        count++;
+    }
+    return count;
+}
+
+void bte_hci_dev_free(BteHciDev *dev)
+{
+    /* The default device lives as long as the program */
+    if (UNLIKELY(dev == &_bte_hci_dev)) return;
+
+    for (int i = 0; i < BTE_HCI_MAX_ACL_CONNECTIONS; i++) {
+        acl_drop_queues(&dev->acl_connections[i]);
+    }
+    _bte_hci_dev_reset_command_queue(dev);
+    _bte_hci_dev_inquiry_cleanup(dev);
+    _bte_hci_dev_stored_keys_cleanup(dev);
+    _bte_command_stats_free(dev);
+    /* Even if it was never initialized, the backend might own some state
+     * given to the device by its creator */
+    if (dev->backend->deinit) dev->backend->deinit(dev);
+    free(dev);
+}
+
+bool _bte_hci_dev_add_client(BteHciDev *dev, BteClient *client)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     for (int i = 0; i < BTE_HCI_MAX_CLIENTS; i++) {
         if (!dev->clients[i]) {
             dev->clients[i] = client;
+            client->hci.command_timeout_ms = BTE_HCI_COMMAND_TIMEOUT_MS;
             return true;
         }
     }
@@ -245,7 +1312,7 @@ bool _bte_hci_dev_add_client(BteClient *client)
 
 void _bte_hci_dev_remove_client(BteClient *client)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    BteHciDev *dev = client->hci.dev;
 
     hci_dev_dispose(dev, &client->hci);
 
@@ -257,9 +1324,8 @@ void _bte_hci_dev_remove_client(BteClient *client)
     }
 }
 
-void _bte_hci_dev_set_status(BteHciInitStatus status)
+void _bte_hci_dev_set_status(BteHciDev *dev, BteHciInitStatus status)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     dev->init_status = status;
 
     BTE_DEBUG("%s, status %d\n", __func__, status);
@@ -277,59 +1343,380 @@ void _bte_hci_dev_set_status(BteHciInitStatus status)
     }
 }
 
-BteHciPendingCommand *_bte_hci_dev_alloc_command(const BteDataMatcher *matcher)
+#define TIMER_NOT_ARMED 0xffff
+/* The timeout has expired, but the client has not been notified yet */
+#define TIMER_EXPIRED   0xfffe
+#define TIMER_TICK_US   ((uint64_t)BTE_HCI_TIMER_TICK_MS * 1000)
+
+static void timer_arm(BteHciDev *dev, BteHciPendingCommand *pc,
+                      uint32_t timeout_ms)
+{
+    if (timeout_ms == 0) {
+        pc->timer_slot = TIMER_NOT_ARMED;
+        return;
+    }
+
+    uint64_t deadline_us = pc->sent_at_us + (uint64_t)timeout_ms * 1000;
+    uint64_t tick = (deadline_us + TIMER_TICK_US - 1) / TIMER_TICK_US;
+    /* Don't put it in a slot which we have already processed */
+    if (tick <= dev->timer_tick) tick = dev->timer_tick + 1;
+
+    uint16_t slot = tick % BTE_HCI_TIMER_WHEEL_SIZE;
+    pc->deadline_tick = tick;
+    pc->timer_slot = slot;
+    pc->timer_next = dev->timer_slots[slot];
+    dev->timer_slots[slot] = (pc - dev->pending_commands) + 1;
+    dev->num_timers++;
+}
+
+static void timer_disarm(BteHciDev *dev, BteHciPendingCommand *pc)
+{
+    if (pc->timer_slot < BTE_HCI_TIMER_WHEEL_SIZE) {
+        uint16_t index = pc - dev->pending_commands;
+        uint16_t *link = &dev->timer_slots[pc->timer_slot];
+        while (*link != index + 1) {
+            link = &dev->pending_commands[*link - 1].timer_next;
+        }
+        *link = pc->timer_next;
+        dev->num_timers--;
+    }
+    pc->timer_slot = TIMER_NOT_ARMED;
+}
+
+/* Builds the event that the controller would have sent to complete the
+ * command, with the given status */
+static BteBuffer *pending_build_reply(const BteHciPendingCommand *pc,
+                                      uint8_t event_code, uint8_t status)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    const uint8_t len = 255;
+    BteBuffer *b = bte_buffer_alloc_contiguous(HCI_CMD_REPLY_POS_HDR_LEN + len);
+    if (UNLIKELY(!b)) return NULL;
 
-    BteHciPendingCommand *pending_command = NULL;
-    if (dev->num_pending_commands == 0) {
-        /* Fast track, no checks needed */
-        pending_command = &dev->pending_commands[0];
-    } else if (dev->num_pending_commands < BTE_HCI_MAX_PENDING_COMMANDS) {
-        for (int i = 0; i < BTE_HCI_MAX_PENDING_COMMANDS; i++) {
-            BteHciPendingCommand *pc = &dev->pending_commands[i];
-            if (bte_data_matcher_is_empty(&pc->matcher)) {
-                /* Found a free slot */
-                if (!pending_command) {
-                    pending_command = pc;
-                    break;
-                }
-            } else if (bte_data_matcher_is_same(matcher, &pc->matcher)) {
-                /* The same command has been queued; unless we do some deeper
-                 * checks on the buffer data in the reply handler, we won't be
-                 * able to match the reply with the pending command, therefore
-                 * we refuse it. */
-                return NULL;
+    memset(b->data, 0, b->size);
+    b->data[1] = len;
+    /* All the events completing a command start with the status, except for
+     * the Command Complete event */
+    int status_pos = event_code == HCI_COMMAND_COMPLETE ?
+        HCI_CMD_REPLY_POS_STATUS : HCI_CMD_EVENT_POS_DATA;
+    b->data[status_pos] = status;
+
+    const uint8_t *rule;
+    uint8_t offset, rule_len;
+    for (int i = 0;
+         (rule = bte_data_matcher_get_rule(&pc->matcher, i, &offset,
+                                           &rule_len)) != NULL;
+         i++) {
+        memcpy(b->data + offset, rule, rule_len);
+    }
+    return b;
+}
+
+static void pending_expire(BteHciDev *dev, BteHciPendingCommand *pc)
+{
+    uint8_t offset, len;
+    const uint8_t *event_code = bte_data_matcher_get_rule(&pc->matcher, 0,
+                                                          &offset, &len);
+    const uint8_t *key = bte_data_matcher_get_rule(&pc->matcher, 1,
+                                                   &offset, &len);
+    BteBuffer *reply = NULL;
+    if (LIKELY(event_code && key && len >= 2)) {
+        reply = pending_build_reply(pc, *event_code, HCI_HOST_TIMEOUT);
+    }
+    if (UNLIKELY(!reply)) {
+        _bte_hci_dev_free_command(dev, pc);
+        return;
+    }
+
+    switch (*event_code) {
+    case HCI_COMMAND_COMPLETE:
+    case HCI_COMMAND_STATUS:
+        BTE_WARN("Command %04x timed out\n", read_le16(key));
+        _bte_command_stats(dev, BTE_COMMAND_STATS_TIMED_OUT,
+                           read_le16(key), 0);
+        if (*event_code == HCI_COMMAND_COMPLETE) {
+            complete_reply(dev, pc, reply);
+        } else {
+            complete_status(dev, pc, HCI_HOST_TIMEOUT);
+        }
+        /* The reply would have carried the credit for the next command:
+         * assume that the controller can accept one, or we'd stall */
+        atomic_store(&dev->num_packets, 1);
+        command_queue_drain(dev);
+        break;
+    default:
+        BTE_WARN("Timed out waiting for event %02x\n", *event_code);
+        BteHciEventHandler *handler =
+            _bte_hci_dev_handler_for_event(dev, *event_code);
+        if (handler && handler->handler_cb) {
+            handler->handler_cb(dev, reply, handler->cb_data);
+        }
+    }
+
+    /* If nobody took care of the command, reclaim its slot */
+    if (pc->timer_slot == TIMER_EXPIRED) {
+        _bte_hci_dev_free_command(dev, pc);
+    }
+    bte_buffer_unref(reply);
+}
+
+void _bte_hci_dev_process_timers(BteHciDev *dev)
+{
+    if (dev->num_timers == 0) return;
+
+    uint64_t now_tick = _bte_clock_now_us() / TIMER_TICK_US;
+    if (now_tick <= dev->timer_tick) return;
+
+    /* Collect the expired commands first, since the callbacks can modify the
+     * wheel */
+    uint16_t expired[BTE_HCI_MAX_PENDING_COMMANDS];
+    int num_expired = 0;
+    uint64_t tick = dev->timer_tick + 1;
+    if (now_tick - tick >= BTE_HCI_TIMER_WHEEL_SIZE) {
+        tick = now_tick - BTE_HCI_TIMER_WHEEL_SIZE + 1;
+    }
+    for (; tick <= now_tick; tick++) {
+        uint16_t *link = &dev->timer_slots[tick % BTE_HCI_TIMER_WHEEL_SIZE];
+        while (*link != 0) {
+            uint16_t index = *link - 1;
+            BteHciPendingCommand *pc = &dev->pending_commands[index];
+            if (pc->deadline_tick <= now_tick) {
+                *link = pc->timer_next;
+                pc->timer_slot = TIMER_EXPIRED;
+                dev->num_timers--;
+                expired[num_expired++] = index;
+            } else {
+                link = &pc->timer_next;
             }
         }
     }
+    dev->timer_tick = now_tick;
 
-    if (LIKELY(pending_command)) {
-        bte_data_matcher_copy(&pending_command->matcher, matcher);
-        dev->num_pending_commands++;
+    for (int i = 0; i < num_expired; i++) {
+        BteHciPendingCommand *pc = &dev->pending_commands[expired[i]];
+        /* The callback of a previous command might have freed this one */
+        if (pc->timer_slot != TIMER_EXPIRED) continue;
+        pending_expire(dev, pc);
+    }
+}
+
+uint32_t _bte_hci_dev_timers_wait_ms(BteHciDev *dev, uint32_t timeout_ms)
+{
+    if (dev->num_timers == 0) return timeout_ms;
+
+    if (timeout_ms == 0 || timeout_ms > BTE_HCI_TIMER_TICK_MS) {
+        timeout_ms = BTE_HCI_TIMER_TICK_MS;
+    }
+    return timeout_ms;
+}
+
+static BteHciPendingCommand *pending_find_same(BteHciDev *dev,
+                                               uint16_t bucket,
+                                               const BteDataMatcher *matcher)
+{
+    uint16_t index = dev->pending_buckets[bucket];
+    while (index != 0) {
+        BteHciPendingCommand *pc = &dev->pending_commands[index - 1];
+        if (bte_data_matcher_is_same(matcher, &pc->matcher)) return pc;
+        index = pc->index_next;
+    }
+    return NULL;
+}
+
+static void command_matcher(BteDataMatcher *matcher, const uint8_t *event,
+                            const BteBuffer *buffer)
+{
+    bte_data_matcher_init(matcher);
+    bte_data_matcher_add_rule(matcher, event, 1, 0);
+    if (*event == HCI_COMMAND_COMPLETE) {
+        bte_data_matcher_add_rule(matcher, buffer->data, 2,
+                                  HCI_CMD_REPLY_POS_OPCODE);
+    } else { /* *event == HCI_COMMAND_STATUS */
+        bte_data_matcher_add_rule(matcher, buffer->data, 2,
+                                  HCI_CMD_STATUS_POS_OPCODE);
+    }
+}
+
+/* The command timeout only starts running when the command is actually sent,
+ * not while it's waiting in the command queue; the same goes for the
+ * statistics, so that sent commands are those that can complete or time out */
+static void command_sent(BteHciDev *dev, BteBuffer *buffer)
+{
+    static const uint8_t events[] = {
+        HCI_COMMAND_COMPLETE, HCI_COMMAND_STATUS,
+    };
+    _bte_command_stats(dev, BTE_COMMAND_STATS_SENT,
+                       le16toh(hci_command_opcode(buffer)), 0);
+    for (int i = 0; i < ARRAY_SIZE(events); i++) {
+        BteDataMatcher matcher;
+        command_matcher(&matcher, &events[i], buffer);
+        BteHciPendingCommand *pc =
+            _bte_hci_dev_get_pending_command(dev, &matcher);
+        if (pc) {
+            pc->sent_at_us = _bte_clock_now_us();
+            timer_disarm(dev, pc);
+            timer_arm(dev, pc, pc->timeout_ms);
+            return;
+        }
+    }
+}
+
+/* Completes the command with the HCI_HW_FAILURE status, as pending_expire()
+ * does when the controller does not answer */
+static void command_send_failed(BteHciDev *dev, BteBuffer *buffer)
+{
+    static const uint8_t events[] = {
+        HCI_COMMAND_COMPLETE, HCI_COMMAND_STATUS,
+    };
+    uint16_t opcode = le16toh(hci_command_opcode(buffer));
+    BTE_WARN("Failed to send command %04x\n", opcode);
+    _bte_command_stats(dev, BTE_COMMAND_STATS_REJECTED, opcode, 0);
+    for (int i = 0; i < ARRAY_SIZE(events); i++) {
+        BteDataMatcher matcher;
+        command_matcher(&matcher, &events[i], buffer);
+        BteHciPendingCommand *pc =
+            _bte_hci_dev_get_pending_command(dev, &matcher);
+        if (!pc) continue;
+
+        if (events[i] == HCI_COMMAND_STATUS) {
+            complete_status(dev, pc, HCI_HW_FAILURE);
+            return;
+        }
+        BteBuffer *reply = pending_build_reply(pc, events[i], HCI_HW_FAILURE);
+        if (UNLIKELY(!reply)) {
+            _bte_hci_dev_free_command(dev, pc);
+            return;
+        }
+        complete_reply(dev, pc, reply);
+        bte_buffer_unref(reply);
+        return;
+    }
+}
+
+static BteHciPendingCommand *pending_alloc(BteHciDev *dev,
+                                           const BteDataMatcher *matcher)
+{
+    if (UNLIKELY(dev->num_pending_commands >= BTE_HCI_MAX_PENDING_COMMANDS))
+        return NULL;
+
+    uint16_t bucket = pending_bucket_for_matcher(dev, matcher);
+    if (pending_find_same(dev, bucket, matcher)) {
+        /* The same command has been queued; unless we do some deeper
+         * checks on the buffer data in the reply handler, we won't be
+         * able to match the reply with the pending command, therefore
+         * we refuse it. */
+        return NULL;
     }
 
+    uint16_t index;
+    if (dev->pending_num_free_slots > 0) {
+        index = dev->pending_free_slots[--dev->pending_num_free_slots];
+    } else {
+        index = dev->pending_used_slots++;
+    }
+
+    BteHciPendingCommand *pending_command = &dev->pending_commands[index];
+    bte_data_matcher_copy(&pending_command->matcher, matcher);
+    pending_command->sent_at_us = _bte_clock_now_us();
+    pending_command->index_bucket = bucket;
+    pending_command->index_next = dev->pending_buckets[bucket];
+    dev->pending_buckets[bucket] = index + 1;
+    dev->num_pending_commands++;
+
+    return pending_command;
+}
+
+BteHciPendingCommand *_bte_hci_dev_alloc_command(BteHciDev *dev,
+                                                 const BteDataMatcher *matcher)
+{
+    BteHciPendingCommand *pending_command = pending_alloc(dev, matcher);
+    if (LIKELY(pending_command)) {
+        timer_arm(dev, pending_command, BTE_HCI_COMPLETION_TIMEOUT_MS);
+    }
     return pending_command;
 }
 
 BteHciPendingCommand *_bte_hci_dev_get_pending_command(
-    const BteDataMatcher *matcher)
+    BteHciDev *dev, const BteDataMatcher *matcher)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    uint16_t bucket = pending_bucket_for_matcher(dev, matcher);
+    return pending_find_same(dev, bucket, matcher);
+}
 
-    for (int i = 0; i < BTE_HCI_MAX_PENDING_COMMANDS; i++) {
-        BteHciPendingCommand *pc = &dev->pending_commands[i];
-        if (bte_data_matcher_is_same(matcher, &pc->matcher)) {
-            return pc;
-        }
+/* The commands of thread-safe clients are built in the calling thread, but
+ * registered by the event loop; meanwhile, what the registration needs is
+ * stored in the command buffer, after the command itself. */
+typedef struct {
+    BteHci *hci;
+    uint8_t reply_event;
+    uint32_t timeout_ms;
+    BteHciCommandCbUnion command_cb;
+    union _bte_hci_last_async_cmd_data_u async_cmd_data;
+    BteHciCommandPrepareCb prepare_cb;
+    void *prepare_data;
+} BteHciSubmission;
+
+static inline BteHciSubmission *command_submission(BteBuffer *buffer)
+{
+    uintptr_t ptr = (uintptr_t)(buffer->data + buffer->size);
+    uintptr_t align = alignof(BteHciSubmission);
+    return (BteHciSubmission *)((ptr + align - 1) & ~(align - 1));
+}
+
+static BteBuffer *hci_command_alloc_submission(uint16_t ocf, uint8_t ogf,
+                                               uint8_t len)
+{
+    BteBuffer *b = bte_buffer_alloc_contiguous(
+        len + alignof(BteHciSubmission) - 1 + sizeof(BteHciSubmission));
+    if (UNLIKELY(!b)) return NULL;
+    b->size = b->total_size = len;
+    uint8_t *ptr = b->data;
+    *(uint16_t*)ptr = build_opcode(ocf, ogf);
+    ptr[2] = len - HCI_CMD_HDR_LEN;
+    return b;
+}
+
+static void command_rejected(BteHci *hci, BteBuffer *buffer,
+                             const BteHciCommandCbUnion *command_cb)
+{
+    /* We could also take cmd_complete.client_cb, it makes no difference */
+    BteHciDoneCb base_cb = command_cb->cmd_status.client_cb;
+    if (buffer) {
+        _bte_command_stats(hci_dev(hci), BTE_COMMAND_STATS_REJECTED,
+                           le16toh(hci_command_opcode(buffer)), 0);
+        bte_buffer_unref(buffer);
+    }
+    if (base_cb) {
+        BteHciReply reply = { HCI_MEMORY_FULL };
+        base_cb(hci, &reply, hci_userdata(hci));
     }
-    return NULL;
 }
 
-BteBuffer *_bte_hci_dev_add_command_no_reply(uint16_t ocf, uint8_t ogf,
-                                             uint8_t len)
+/* The command of a thread-safe client could not be handed over to the event
+ * loop: since we might be in another thread, the client callback cannot be
+ * invoked */
+static void submission_rejected(BteHci *hci, BteBuffer *buffer)
 {
-    return hci_command_alloc(ocf, ogf, len);
+    if (buffer) bte_buffer_unref(buffer);
+    atomic_fetch_add(&hci->rejected_commands, 1);
+}
+
+static bool command_register(BteHci *hci, BteBuffer *buffer,
+                             uint8_t reply_event, uint32_t timeout_ms,
+                             const BteHciCommandCbUnion *command_cb)
+{
+    BteDataMatcher matcher;
+    command_matcher(&matcher, &reply_event, buffer);
+
+    BteHciDev *dev = hci_dev(hci);
+    BteHciPendingCommand *pending_command = pending_alloc(dev, &matcher);
+    if (UNLIKELY(!pending_command)) return false;
+
+    /* The timer is armed once the command is sent */
+    pending_command->timer_slot = TIMER_NOT_ARMED;
+    pending_command->timeout_ms = timeout_ms;
+    pending_command->command_cb = *command_cb;
+    pending_command->hci = hci;
+    return true;
 }
 
 BteBuffer *_bte_hci_dev_add_command(BteHci *hci, uint16_t ocf,
@@ -337,44 +1724,105 @@ BteBuffer *_bte_hci_dev_add_command(BteHci *hci, uint16_t ocf,
                                     uint8_t reply_event,
                                     const BteHciCommandCbUnion *command_cb)
 {
-    /* We could also take cmd_complete.client_cb, it makes no difference */
-    BteHciDoneCb base_cb = command_cb->cmd_status.client_cb;
-    BteBuffer *buffer = hci_command_alloc(ocf, ogf, len);
-    if (UNLIKELY(!buffer)) goto error_buffer;
+    if (hci->thread_safe) {
+        /* We might not be in the event loop thread: don't touch the device
+         * yet, that's done in command_submitted_cb() */
+        BteBuffer *buffer = hci_command_alloc_submission(ocf, ogf, len);
+        if (UNLIKELY(!buffer)) {
+            submission_rejected(hci, NULL);
+            return NULL;
+        }
 
-    BteDataMatcher matcher;
-    bte_data_matcher_init(&matcher);
-    bte_data_matcher_add_rule(&matcher, &reply_event, 1, 0);
-    if (reply_event == HCI_COMMAND_COMPLETE) {
-        bte_data_matcher_add_rule(&matcher, buffer->data, 2,
-                                  HCI_CMD_REPLY_POS_OPCODE);
-    } else { /* reply_event == HCI_COMMAND_STATUS */
-        bte_data_matcher_add_rule(&matcher, buffer->data, 2,
-                                  HCI_CMD_STATUS_POS_OPCODE);
+        BteHciSubmission *s = command_submission(buffer);
+        s->hci = hci;
+        s->reply_event = reply_event;
+        s->timeout_ms = hci->command_timeout_ms;
+        s->command_cb = *command_cb;
+        s->prepare_cb = NULL;
+        s->prepare_data = NULL;
+        return buffer;
     }
 
-    BteHciPendingCommand *pending_command =
-        _bte_hci_dev_alloc_command(&matcher);
-    if (UNLIKELY(!pending_command)) goto error_command;
+    BteBuffer *buffer = hci_command_alloc(ocf, ogf, len);
+    if (UNLIKELY(!buffer)) goto error;
 
-    pending_command->command_cb = *command_cb;
-    pending_command->hci = hci;
+    if (UNLIKELY(!command_register(hci, buffer, reply_event,
+                                   hci->command_timeout_ms, command_cb))) {
+        command_rejected(hci, buffer, command_cb);
+        return NULL;
+    }
     return buffer;
 
-error_command:
-    bte_buffer_unref(buffer);
-error_buffer:
-    if (base_cb) {
-        BteHciReply reply = { HCI_MEMORY_FULL };
-        base_cb(hci, &reply, hci_userdata(hci));
-    }
+error:
+    command_rejected(hci, NULL, command_cb);
     return NULL;
 }
 
-void _bte_hci_dev_free_command(BteHciPendingCommand *cmd)
+union _bte_hci_last_async_cmd_data_u *
+_bte_hci_async_cmd_data(BteHci *hci, BteBuffer *buffer)
 {
-    BteHciDev *dev = &_bte_hci_dev;
+    return hci->thread_safe ?
+        &command_submission(buffer)->async_cmd_data :
+        &hci->last_async_cmd_data;
+}
+
+/* Runs in the event loop, for the commands of thread-safe clients */
+static void command_submitted_cb(BteHciDev *dev, void *userdata)
+{
+    BteBuffer *buffer = userdata;
+    BteHciSubmission *s = command_submission(buffer);
+    BteHci *hci = s->hci;
+
+    if (UNLIKELY(!command_register(hci, buffer, s->reply_event,
+                                   s->timeout_ms, &s->command_cb))) {
+        command_rejected(hci, buffer, &s->command_cb);
+        return;
+    }
+
+    /* The Command Status handler reads it from the client */
+    if (s->reply_event == HCI_COMMAND_STATUS) {
+        hci->last_async_cmd_data = s->async_cmd_data;
+    }
+    if (s->prepare_cb) s->prepare_cb(hci, buffer, s->prepare_data);
+    _bte_hci_send_command(dev, buffer);
+}
+
+int _bte_hci_submit_command_prepared(BteHci *hci, BteBuffer *buffer,
+                                     BteHciCommandPrepareCb prepare_cb,
+                                     void *prepare_data)
+{
+    if (UNLIKELY(!buffer)) return -ENOMEM;
+
+    BteHciDev *dev = hci_dev(hci);
+    if (!hci->thread_safe) {
+        if (prepare_cb) prepare_cb(hci, buffer, prepare_data);
+        return _bte_hci_send_command(dev, buffer);
+    }
+
+    BteHciSubmission *s = command_submission(buffer);
+    s->prepare_cb = prepare_cb;
+    s->prepare_data = prepare_data;
+    int rc = bte_hci_dev_call(dev, command_submitted_cb, buffer);
+    if (UNLIKELY(rc < 0)) submission_rejected(hci, buffer);
+    return rc;
+}
+
+void _bte_hci_dev_free_command(BteHciDev *dev, BteHciPendingCommand *cmd)
+{
+    if (UNLIKELY(bte_data_matcher_is_empty(&cmd->matcher))) return;
+
+    uint16_t index = cmd - dev->pending_commands;
+
+    /* Unlink the command from its bucket */
+    uint16_t *link = &dev->pending_buckets[cmd->index_bucket];
+    while (*link != index + 1) {
+        link = &dev->pending_commands[*link - 1].index_next;
+    }
+    *link = cmd->index_next;
+    timer_disarm(dev, cmd);
+
     bte_data_matcher_init(&cmd->matcher);
+    dev->pending_free_slots[dev->pending_num_free_slots++] = index;
     dev->num_pending_commands--;
 }
 
@@ -404,11 +1852,11 @@ _bte_hci_dev_add_pending_async_command(BteHci *hci, uint16_t ocf,
                                     HCI_COMMAND_STATUS, &cmd);
 }
 
-void _bte_hci_dev_install_event_handler(uint8_t event_code,
+void _bte_hci_dev_install_event_handler(BteHciDev *dev, uint8_t event_code,
                                         BteHciEventHandlerCb handler_cb,
                                         void *cb_data)
 {
-    BteHciEventHandler *h = _bte_hci_dev_handler_for_event(event_code);
+    BteHciEventHandler *h = _bte_hci_dev_handler_for_event(dev, event_code);
     if (UNLIKELY(!h)) return;
 
     if (UNLIKELY(handler_cb && h->handler_cb)) {
@@ -418,17 +1866,19 @@ void _bte_hci_dev_install_event_handler(uint8_t event_code,
     h->cb_data = cb_data;
 }
 
-void _bte_hci_dev_inquiry_cleanup(void)
+void _bte_hci_dev_inquiry_cleanup(BteHciDev *dev)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     free(dev->inquiry.responses);
     dev->inquiry.responses = NULL;
     dev->inquiry.num_responses = 0;
+    free(dev->inquiry.seen);
+    dev->inquiry.seen = NULL;
+    dev->inquiry.num_seen = 0;
+    dev->inquiry.seen_capacity = 0;
 }
 
-void _bte_hci_dev_stored_keys_cleanup(void)
+void _bte_hci_dev_stored_keys_cleanup(BteHciDev *dev)
 {
-    BteHciDev *dev = &_bte_hci_dev;
     free(dev->stored_keys.responses);
     dev->stored_keys.responses = NULL;
     dev->stored_keys.num_responses = 0;
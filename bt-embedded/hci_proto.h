@@ -50,6 +50,18 @@ extern "C" {
 #define HCI_SCO_HDR_LEN   3
 #define HCI_CMD_HDR_LEN   3
 
+/* ACL data packet header */
+#define HCI_ACL_HANDLE_MASK        0x0fff
+#define HCI_ACL_PB_SHIFT           12
+#define HCI_ACL_PB_MASK            0x3
+#define HCI_ACL_PB_FIRST_NON_FLUSH 0x0
+#define HCI_ACL_PB_CONTINUING      0x1
+#define HCI_ACL_PB_FIRST_FLUSH     0x2
+
+/* The L2CAP basic header (length and channel ID), found at the beginning of
+ * every ACL PDU */
+#define L2CAP_HDR_LEN 4
+
 /* Specification defined parameters */
 #define HCI_BD_ADDR_LEN  6
 #define HCI_LINK_KEY_LEN 16
@@ -421,9 +433,13 @@ extern "C" {
 #define HCI_EVENT_READ_REMOTE_EXT_FEATURES_COMPL ((uint64_t)(1 << 34))
 #define HCI_EVENT_SYNC_CONN_COMPL                ((uint64_t)(1 << 43))
 #define HCI_EVENT_SYNC_CONN_CHANGED              ((uint64_t)(1 << 44))
+#define HCI_EVENT_EXTENDED_INQUIRY_RESULT        ((uint64_t)1 << 54)
 #define HCI_EVENT_ALL                            ((uint64_t)0x1fffffffffff)
 
 #define HCI_MAX_NAME_LEN 248
+/* Size of each response in the Inquiry Result events */
+#define HCI_INQUIRY_RESPONSE_LEN 14
+#define HCI_EIR_DATA_LEN 240
 
 #define BTE_LAP_GIAC 0x009E8B33
 #define BTE_LAP_LIAC 0x009E8B00
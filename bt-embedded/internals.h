@@ -1,8 +1,10 @@
 #ifndef BTE_INTERNALS_H
 #define BTE_INTERNALS_H
 
+#include "bte.h"
 #include "data_matcher.h"
 #include "hci.h"
+#include "mpsc_ring.h"
 #include "types.h"
 #include "utils.h"
 
@@ -17,7 +19,87 @@ extern "C" {
 #error "This is not a public header!"
 #endif
 
-#define BTE_HCI_MAX_PENDING_COMMANDS 8
+#ifndef BTE_HCI_MAX_PENDING_COMMANDS
+#  define BTE_HCI_MAX_PENDING_COMMANDS 8
+#endif
+/* Number of buckets in the hash table indexing the pending commands; must be
+ * a power of two. Twice the number of pending commands is a good value. */
+#ifndef BTE_HCI_PENDING_HASH_SIZE
+#  define BTE_HCI_PENDING_HASH_SIZE 16
+#endif
+/* Commands waiting for the controller to accept them. All commands expecting
+ * a reply also occupy a pending command slot, so this only needs to be larger
+ * than BTE_HCI_MAX_PENDING_COMMANDS to make room for the commands which don't
+ * have a reply. */
+#ifndef BTE_HCI_COMMAND_QUEUE_SIZE
+#  define BTE_HCI_COMMAND_QUEUE_SIZE (BTE_HCI_MAX_PENDING_COMMANDS * 2)
+#endif
+/* Connections whose ACL data can be received at the same time */
+#ifndef BTE_HCI_MAX_ACL_CONNECTIONS
+#  define BTE_HCI_MAX_ACL_CONNECTIONS 8
+#endif
+/* Buckets of the indexes used to find the connections by handle and by
+ * address; must be a power of two */
+#ifndef BTE_HCI_CONN_HASH_SIZE
+#  define BTE_HCI_CONN_HASH_SIZE 16
+#endif
+/* Largest incoming L2CAP PDU (header included) which is reassembled; larger
+ * ones are dropped */
+#ifndef BTE_HCI_ACL_RX_MAX_PDU_SIZE
+#  define BTE_HCI_ACL_RX_MAX_PDU_SIZE UINT16_MAX
+#endif
+/* Outgoing PDUs that can be queued on a single connection */
+#ifndef BTE_HCI_ACL_TX_QUEUE_SIZE
+#  define BTE_HCI_ACL_TX_QUEUE_SIZE 8
+#endif
+/* Default time allowed to the controller to reply to a command with a Command
+ * Complete or Command Status event; see bte_hci_set_command_timeout() */
+#ifndef BTE_HCI_COMMAND_TIMEOUT_MS
+#  define BTE_HCI_COMMAND_TIMEOUT_MS 2000
+#endif
+/* Time allowed for the events completing the asynchronous commands
+ * (Connection Complete, Remote Name Request Complete...). The controller has
+ * its own timeouts for these procedures, so this is only a safety net. */
+#ifndef BTE_HCI_COMPLETION_TIMEOUT_MS
+#  define BTE_HCI_COMPLETION_TIMEOUT_MS 60000
+#endif
+/* The command timeouts are kept in a timer wheel having this many slots, each
+ * covering BTE_HCI_TIMER_TICK_MS; timeouts are therefore rounded up to the
+ * tick. */
+#ifndef BTE_HCI_TIMER_WHEEL_SIZE
+#  define BTE_HCI_TIMER_WHEEL_SIZE 32
+#endif
+#ifndef BTE_HCI_TIMER_TICK_MS
+#  define BTE_HCI_TIMER_TICK_MS 100
+#endif
+/* Remote devices whose paging parameters are remembered; see
+ * bte_hci_connect() */
+#ifndef BTE_HCI_DEVICE_CACHE_SIZE
+#  define BTE_HCI_DEVICE_CACHE_SIZE 16
+#endif
+/* Untracked connection handles (see BTE_HCI_MAX_ACL_CONNECTIONS) whose
+ * released ACL packets can be reported to the controller with a single Host
+ * Number Of Completed Packets command, together with the tracked ones; the
+ * reports are sent at the end of each bte_handle_events() pass, or earlier if
+ * more handles need them */
+#ifndef BTE_HCI_HOST_COMPLETED_MAX_HANDLES
+#  define BTE_HCI_HOST_COMPLETED_MAX_HANDLES 8
+#endif
+/* The reports are also sent without waiting for the end of the pass once
+ * they cover this many packets, or once the oldest of them has waited this
+ * long: otherwise the controller could run out of credits */
+#ifndef BTE_HCI_HOST_COMPLETED_FLUSH_PACKETS
+#  define BTE_HCI_HOST_COMPLETED_FLUSH_PACKETS 4
+#endif
+#ifndef BTE_HCI_HOST_COMPLETED_FLUSH_MS
+#  define BTE_HCI_HOST_COMPLETED_FLUSH_MS 10
+#endif
+
+/* Number of functions that other threads can queue to the event loop of a
+ * device (see bte_hci_dev_call()); must be a power of two */
+#ifndef BTE_HCI_DEV_CALL_QUEUE_SIZE
+#  define BTE_HCI_DEV_CALL_QUEUE_SIZE 32
+#endif
 /* Note that the driver typically creates a client to setup the device, so this
  * must be 2 at the very least. */
 #define BTE_HCI_MAX_CLIENTS 4
@@ -50,10 +132,19 @@ typedef void (*BteHciCommandCb)(BteHci *hci, BteBuffer *buffer,
 typedef void (*BteHciCommandStatusCb)(BteHci *hci, uint8_t status,
                                       BteHciPendingCommand *pc);
 
+typedef struct bte_hci_acl_connection_t BteHciAclConnection;
+
 typedef struct bte_hci_event_handler_t BteHciEventHandler;
-typedef void (*BteHciEventHandlerCb)(BteBuffer *buffer, void *cb_data);
+typedef void (*BteHciEventHandlerCb)(BteHciDev *dev, BteBuffer *buffer,
+                                     void *cb_data);
+
+struct bte_hci_dev_t {
+    /* The transport, with its own per-device state, and the driver setting
+     * up the controller */
+    const BteBackend *backend;
+    void *backend_data;
+    const struct bte_driver_t *driver;
 
-typedef struct bte_hci_dev_t {
     BteHciInitStatus init_status;
     BteHciInfo info_flags;
 
@@ -62,6 +153,19 @@ typedef struct bte_hci_dev_t {
         /* When a result is received, we will look at the opcode (and possibly
          * other data) to deliver the reply to the correct client */
         BteDataMatcher matcher;
+        /* When the command was sent to the controller */
+        uint64_t sent_at_us;
+        /* Armed when the command leaves the queue, see command_sent() */
+        uint32_t timeout_ms;
+        /* The timer wheel tick at which the command expires, the wheel slot
+         * where the command is linked and the index (plus one) of the next
+         * command in the same slot */
+        uint64_t deadline_tick;
+        uint16_t timer_slot;
+        uint16_t timer_next;
+        /* Index (plus one) of the next command in the same hash bucket */
+        uint16_t index_next;
+        uint16_t index_bucket;
         BteHci *hci;
         union bte_hci_command_cb_u {
             struct bte_hci_cmd_complete_t {
@@ -103,23 +207,158 @@ typedef struct bte_hci_dev_t {
             } event_mode_change;
         } command_cb;
     } pending_commands[BTE_HCI_MAX_PENDING_COMMANDS];
+    /* Hash index of the pending commands, keyed on the event code and on the
+     * first two bytes of the second matcher rule (the command opcode, or a
+     * connection handle, or a BT address); all the commands waiting for the
+     * same event code must have their key at the same offset, which is stored
+     * in pending_key_offsets. Commands whose matcher does not fit this scheme
+     * are stored in an additional bucket, which is always searched.
+     * Buckets contain the index of the first command, plus one. */
+    uint16_t pending_buckets[BTE_HCI_PENDING_HASH_SIZE + 1];
+    uint8_t pending_key_offsets[BTE_HCI_EVENT_LAST + 1];
+    /* Slots below this index have been used at least once; the free ones are
+     * in the pending_free_slots stack. */
+    uint16_t pending_used_slots;
+    uint16_t pending_num_free_slots;
+    uint16_t pending_free_slots[BTE_HCI_MAX_PENDING_COMMANDS];
+    /* Timer wheel of the pending command timeouts: each slot holds the index
+     * (plus one) of the first command expiring at a tick which maps to it */
+    uint16_t timer_slots[BTE_HCI_TIMER_WHEEL_SIZE];
+    uint64_t timer_tick; /* The last processed tick */
+    uint16_t num_timers;
 
     BteClient *clients[BTE_HCI_MAX_CLIENTS];
 
     BteBdAddr address;
     BteHciSupportedFeatures supported_features;
+    /* Number of commands that the controller can currently accept */
     atomic_int num_packets;
+    /* Commands waiting for num_packets to become positive */
+    struct bte_hci_command_queue_t {
+        struct bte_hci_queued_command_t {
+            BteBuffer *buffer;
+            uint64_t queued_at_us;
+        } commands[BTE_HCI_COMMAND_QUEUE_SIZE];
+        uint16_t head;
+        uint16_t count;
+        BteHciCommandQueueStats stats;
+    } command_queue;
     uint16_t acl_mtu;
     uint8_t sco_mtu;
     uint16_t acl_max_packets;
     uint16_t sco_max_packets;
 
+    /* ACL connections, their state and their reassembly state */
+    struct bte_hci_acl_connection_t {
+        uint8_t state; /* BTE_HCI_CONN_STATE_*, 0 if the slot is free */
+        uint8_t role;
+        uint8_t mode;
+        /* Which of the indexes below the connection is in */
+        uint8_t indexed;
+        /* Next connection in the same bucket of the indexes (plus one) */
+        uint8_t handle_next;
+        uint8_t address_next;
+        BteHciConnHandle conn_handle;
+        BteBdAddr address;
+        BteHci *hci; /* The owning client, receiving the data */
+        BteHciAclDataCb data_cb;
+        uint32_t rx_packets;
+        uint32_t tx_packets;
+        uint64_t rx_bytes;
+        uint64_t tx_bytes;
+        /* Payload size of the PDU being reassembled (0 if not yet known), and
+         * how much of it we have received so far; the L2CAP header makes the
+         * former exceed 16 bits */
+        uint32_t rx_expected;
+        uint32_t rx_received;
+        BteBuffer *rx_pdu;
+        BteBuffer *rx_tail;
+        /* Packets making up rx_pdu */
+        uint16_t rx_fragments;
+        /* Set when the PDU was dropped, to ignore the rest of its packets */
+        bool rx_discard;
+        /* Outgoing PDUs; the first one is being fragmented, and tx_segment
+         * and tx_segment_offset point to the data for the next fragment. */
+        BteBuffer *tx_queue[BTE_HCI_ACL_TX_QUEUE_SIZE];
+        uint8_t tx_head;
+        uint8_t tx_count;
+        uint16_t tx_sent;
+        uint16_t tx_segment_offset;
+        BteBuffer *tx_segment;
+        /* Packets sent to the controller and not yet completed */
+        uint16_t tx_in_flight;
+        /* Received packets which have been released, but not yet reported
+         * to the controller */
+        uint16_t rx_unreported;
+        /* Tells this link apart from earlier ones which used the same slot
+         * or handle, see acl_conn_serial */
+        uint32_t serial;
+    } acl_connections[BTE_HCI_MAX_ACL_CONNECTIONS];
+    /* Heads of the index buckets: position in acl_connections plus one, 0 if
+     * the bucket is empty */
+    uint8_t conn_by_handle[BTE_HCI_CONN_HASH_SIZE];
+    uint8_t conn_by_address[BTE_HCI_CONN_HASH_SIZE];
+    /* Packets sent to the controller and not yet completed, for all
+     * connections; must not exceed acl_max_packets */
+    uint16_t acl_in_flight;
+    /* Where the round-robin ACL scheduler will start from next time */
+    uint8_t acl_tx_next;
+    /* Set when the backend refused a fragment: the event loop then runs the
+     * scheduler again */
+    bool acl_tx_retry;
+    /* Incremented for every new link; received PDUs remember the serial of
+     * their link, so that releasing them after the handle has been reused
+     * doesn't report their packets on the new link */
+    uint32_t acl_conn_serial;
+
+    /* Controller to host flow control (BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_*):
+     * the value sent with the last Set Controller To Host Flow Control
+     * command, and the one which the controller has accepted */
+    uint8_t host_flow_control_requested;
+    uint8_t host_flow_control;
+    /* The ACL packet count advertised with Host Buffer Size, in the last
+     * command sent and as accepted by the controller: with flow control, the
+     * controller never has more packets than these outstanding */
+    uint16_t host_acl_packets_requested;
+    uint16_t host_acl_packets;
+    /* Received ACL packets which have been released, but not yet reported to
+     * the controller: the total, and those of the handles we don't track a
+     * connection for (the others are counted in their rx_unreported) */
+    uint8_t host_completed_count;
+    uint16_t host_completed_packets;
+    /* When the first of the pending reports was added */
+    uint64_t host_completed_since_us;
+    struct bte_hci_host_completed_t {
+        BteHciConnHandle conn_handle;
+        uint16_t num_packets;
+    } host_completed[BTE_HCI_HOST_COMPLETED_MAX_HANDLES];
+
     /* Ongoing inquiry data */
     struct bte_hci_inquiry_data_t {
         uint8_t num_responses;
         BteHciInquiryResponse *responses;
+        /* Open addressing hash table of the devices seen so far, keyed on
+         * their address; its capacity is a power of two. In streaming mode,
+         * the responses are not stored and only this table is used. */
+        uint16_t num_seen;
+        uint16_t seen_capacity;
+        struct bte_hci_inquiry_seen_t {
+            BteBdAddr address;
+            bool used;
+            uint8_t index; /* Position in the responses array */
+        } *seen;
     } inquiry;
 
+    /* Paging parameters of the most recently seen remote devices; when full,
+     * the least recently used entry is replaced */
+    struct bte_hci_cached_device_t {
+        BteBdAddr address;
+        uint8_t page_scan_rep_mode; /* 0xff if unknown */
+        uint16_t clock_offset;
+        uint32_t last_used; /* 0 if the entry is free */
+    } device_cache[BTE_HCI_DEVICE_CACHE_SIZE];
+    uint32_t device_cache_clock;
+
     /* Ongoing reading of stored link keys */
     struct bte_hci_stored_keys_t {
         uint8_t num_responses;
@@ -131,7 +370,20 @@ typedef struct bte_hci_dev_t {
         BteHciEventHandlerCb handler_cb;
         void *cb_data;
     } event_handlers[BTE_HCI_EVENT_LAST];
-} BteHciDev;
+
+    /* Functions queued by other threads, run by the event loop */
+    BteMpscRing call_ring;
+    atomic_uint_least32_t call_sequences[BTE_HCI_DEV_CALL_QUEUE_SIZE];
+    struct bte_hci_dev_call_t {
+        BteHciDevCallCb callback;
+        void *userdata;
+    } calls[BTE_HCI_DEV_CALL_QUEUE_SIZE];
+    /* Set by bte_hci_dev_quit() */
+    atomic_bool loop_quit;
+
+    /* See command_stats.c; NULL until some statistics are recorded */
+    struct bte_command_stats_data_t *command_stats;
+};
 
 struct bte_client_t {
     atomic_int ref_count;
@@ -141,10 +393,18 @@ struct bte_client_t {
         BteInitializedCb initialized_cb;
 
         BteHciInquiryCb inquiry_cb;
+        BteHciInquiryResultCb inquiry_result_cb;
         BteHciConnectionRequestCb connection_request_cb;
         BteHciLinkKeyRequestCb link_key_request_cb;
         BteHciPinCodeRequestCb pin_code_request_cb;
         BteHciVendorEventCb vendor_event_cb;
+        BteHciDisconnectionCb disconnection_cb;
+
+        uint32_t command_timeout_ms;
+        /* Set by bte_hci_set_thread_safe() */
+        bool thread_safe;
+        /* See bte_hci_take_rejected_commands() */
+        atomic_uint rejected_commands;
 
         /* Storage for temporary data, only valid since issuing an asynchronous
          * command till the time that its corresponding command status event
@@ -166,9 +426,8 @@ struct bte_client_t {
             } read_remote_name;
         } last_async_cmd_data;
 
-        /* Should we ever start supporting more than one HCI device, we should
-         * store a pointer to the HCI device here. AS of now, we have a single
-         * HCI device, accessible under the _bte_hci_dev global variable. */
+        /* The device which the client is bound to */
+        BteHciDev *dev;
     } hci;
 };
 
@@ -182,32 +441,44 @@ static inline void *hci_userdata(BteHci *hci)
     return hci_client(hci)->userdata;
 }
 
+/* The default device, driven by the backend and driver which the library has
+ * been built with; see bte_hci_dev_new() for the others */
 extern BteHciDev _bte_hci_dev;
 
-int _bte_hci_dev_init(void);
-bool _bte_hci_dev_add_client(BteClient *client);
+static inline BteHciDev *hci_dev(BteHci *hci)
+{
+    return hci_client(hci)->hci.dev;
+}
+
+int _bte_hci_dev_init(BteHciDev *dev);
+/* Runs the functions queued with bte_hci_dev_call(); returns their number */
+int _bte_hci_dev_process_calls(BteHciDev *dev);
+static inline bool _bte_hci_dev_has_calls(BteHciDev *dev)
+{
+    return _bte_mpsc_ring_read_slot(&dev->call_ring) >= 0;
+}
+bool _bte_hci_dev_add_client(BteHciDev *dev, BteClient *client);
 void _bte_hci_dev_remove_client(BteClient *client);
 void _bte_hci_dispose(BteHci *hci);
 
 typedef bool (*BteHciForeachHciClientCb)(BteHci *hci, void *cb_data);
-bool _bte_hci_dev_foreach_hci_client(BteHciForeachHciClientCb callback,
+bool _bte_hci_dev_foreach_hci_client(BteHciDev *dev,
+                                     BteHciForeachHciClientCb callback,
                                      void *cb_data);
 
 /* Called by the driver once the initialization is complete */
-void _bte_hci_dev_set_status(BteHciInitStatus status);
+void _bte_hci_dev_set_status(BteHciDev *dev, BteHciInitStatus status);
 
 /* Called by the platform backend */
-int _bte_hci_dev_handle_event(BteBuffer *buf);
-int _bte_hci_dev_handle_data(BteBuffer *buf);
+int _bte_hci_dev_handle_event(BteHciDev *dev, BteBuffer *buf);
+int _bte_hci_dev_handle_data(BteHciDev *dev, BteBuffer *buf);
 
 /* Called by the HCI layer */
 BteHciPendingCommand *_bte_hci_dev_alloc_command(
-    const BteDataMatcher *matcher);
+    BteHciDev *dev, const BteDataMatcher *matcher);
 BteHciPendingCommand *_bte_hci_dev_get_pending_command(
-    const BteDataMatcher *matcher);
+    BteHciDev *dev, const BteDataMatcher *matcher);
 
-BteBuffer *_bte_hci_dev_add_command_no_reply(uint16_t ocf, uint8_t ogf,
-                                             uint8_t len);
 BteBuffer *_bte_hci_dev_add_command(BteHci *hci, uint16_t ocf,
                                     uint8_t ogf, uint8_t len,
                                     uint8_t reply_event,
@@ -223,20 +494,126 @@ _bte_hci_dev_add_pending_async_command(BteHci *hci, uint16_t ocf,
                                        BteHciCommandStatusCb command_cb,
                                        void *client_cb);
 
+/* Performs the side effects of a command on the host state; for thread-safe
+ * clients this is deferred to the event loop, like the command registration */
+typedef void (*BteHciCommandPrepareCb)(BteHci *hci, BteBuffer *buffer,
+                                       void *prepare_data);
+/* Sends a command created by one of the functions above; unlike
+ * _bte_hci_send_command(), it's safe to call from other threads if the
+ * client is thread-safe */
+int _bte_hci_submit_command_prepared(BteHci *hci, BteBuffer *buffer,
+                                     BteHciCommandPrepareCb prepare_cb,
+                                     void *prepare_data);
+static inline int _bte_hci_submit_command(BteHci *hci, BteBuffer *buffer)
+{
+    return _bte_hci_submit_command_prepared(hci, buffer, NULL, NULL);
+}
+/* Where the command functions store the data needed by the Command Status
+ * handler of an asynchronous command */
+union _bte_hci_last_async_cmd_data_u *
+_bte_hci_async_cmd_data(BteHci *hci, BteBuffer *buffer);
+
 BteHciPendingCommand *_bte_hci_dev_find_pending_command(
-    const BteBuffer *buffer);
+    BteHciDev *dev, const BteBuffer *buffer);
 BteHciPendingCommand *_bte_hci_dev_find_pending_command_raw(
-    const void *buffer, size_t len);
-void _bte_hci_dev_free_command(BteHciPendingCommand *cmd);
-int _bte_hci_send_command(BteBuffer *buffer);
-
-void _bte_hci_dev_install_event_handler(uint8_t event_code,
+    BteHciDev *dev, const void *buffer, size_t len);
+void _bte_hci_dev_free_command(BteHciDev *dev, BteHciPendingCommand *cmd);
+int _bte_hci_send_command(BteHciDev *dev, BteBuffer *buffer);
+/* Fails the pending commands whose timeout has expired */
+void _bte_hci_dev_process_timers(BteHciDev *dev);
+/* Returns how long the caller can wait for events (0 meaning forever) without
+ * delaying the expiration of the timeouts, given the desired timeout_ms */
+uint32_t _bte_hci_dev_timers_wait_ms(BteHciDev *dev, uint32_t timeout_ms);
+/* Drop all queued commands and assume that the controller can accept one
+ * command, which is its state after power on */
+void _bte_hci_dev_reset_command_queue(BteHciDev *dev);
+
+BteHciAclConnection *_bte_hci_dev_acl_connection(BteHciDev *dev,
+                                                 BteHciConnHandle conn_handle);
+BteHciAclConnection *_bte_hci_dev_connection_by_address(
+    BteHciDev *dev, const BteBdAddr *address);
+/* For a link which we have not seen coming up */
+BteHciAclConnection *_bte_hci_dev_alloc_acl_connection(
+    BteHciDev *dev, BteHciConnHandle conn_handle);
+void _bte_hci_dev_free_acl_connection(BteHciDev *dev,
+                                      BteHciAclConnection *conn);
+/* Called when the owning client stops using the connection */
+void _bte_hci_dev_release_acl_connection(BteHciDev *dev,
+                                         BteHciAclConnection *conn);
+/* Tracks a link being established by the client */
+void _bte_hci_dev_connection_connecting(BteHci *hci, const BteBdAddr *address,
+                                        uint8_t role);
+void _bte_hci_dev_connection_failed(BteHciDev *dev, const BteBdAddr *address);
+int _bte_hci_dev_queue_acl_data(BteHciDev *dev, BteHciAclConnection *conn,
+                                BteBuffer *pdu);
+void _bte_hci_dev_acl_schedule(BteHciDev *dev);
+/* Batches the released ACL packets, to be reported to the controller with a
+ * single command; see bte_hci_host_num_comp_packets_add() */
+void _bte_hci_dev_add_host_completed(BteHciDev *dev,
+                                     BteHciConnHandle conn_handle,
+                                     uint16_t num_packets);
+/* Sends the batched reports; called at the end of each event processing pass
+ * and before waiting for events */
+void _bte_hci_dev_flush_host_completed(BteHciDev *dev);
+
+void _bte_hci_dev_install_event_handler(BteHciDev *dev, uint8_t event_code,
                                         BteHciEventHandlerCb handler_cb,
                                         void *cb_data);
-BteHciEventHandler *_bte_hci_dev_handler_for_event(uint8_t event_code);
+BteHciEventHandler *_bte_hci_dev_handler_for_event(BteHciDev *dev,
+                                                   uint8_t event_code);
+
+void _bte_hci_dev_inquiry_cleanup(BteHciDev *dev);
+void _bte_hci_dev_stored_keys_cleanup(BteHciDev *dev);
+
+/* Device cache; see bte_hci_connect() */
+typedef struct bte_hci_cached_device_t BteHciCachedDevice;
 
-void _bte_hci_dev_inquiry_cleanup(void);
-void _bte_hci_dev_stored_keys_cleanup(void);
+void _bte_device_cache_update(BteHciDev *dev, const BteBdAddr *address,
+                              uint8_t page_scan_rep_mode,
+                              uint16_t clock_offset);
+/* Feeds the cache from the events carrying paging parameters */
+void _bte_device_cache_handle_event(BteHciDev *dev, uint8_t code,
+                                    const uint8_t *data, uint8_t len);
+BteHciCachedDevice *_bte_device_cache_lookup(BteHciDev *dev,
+                                             const BteBdAddr *address);
+
+/* Packet capture; see capture.h */
+extern atomic_bool _bte_capture_enabled;
+void _bte_capture_packet(uint8_t type, bool received, BteBuffer *buffer);
+
+static inline void _bte_capture(uint8_t type, bool received, BteBuffer *buffer)
+{
+    if (UNLIKELY(atomic_load_explicit(&_bte_capture_enabled,
+                                      memory_order_acquire))) {
+        _bte_capture_packet(type, received, buffer);
+    }
+}
+
+/* Command statistics; see command_stats.h */
+typedef enum {
+    BTE_COMMAND_STATS_SENT,
+    BTE_COMMAND_STATS_REJECTED,
+    BTE_COMMAND_STATS_COMPLETED,
+    BTE_COMMAND_STATS_ORPHANED,
+    BTE_COMMAND_STATS_TIMED_OUT,
+} BteCommandStatsEvent;
+
+extern atomic_bool _bte_command_stats_enabled;
+/* The sent_at_us parameter is only used for BTE_COMMAND_STATS_COMPLETED */
+typedef struct bte_command_stats_data_t BteCommandStatsData;
+void _bte_command_stats_record(BteHciDev *dev, BteCommandStatsEvent event,
+                               uint16_t opcode, uint64_t sent_at_us);
+void _bte_command_stats_free(BteHciDev *dev);
+
+static inline void _bte_command_stats(BteHciDev *dev,
+                                      BteCommandStatsEvent event,
+                                      uint16_t opcode, uint64_t sent_at_us)
+{
+    if (UNLIKELY(atomic_load_explicit(&_bte_command_stats_enabled,
+                                      memory_order_relaxed))) {
+        _bte_command_stats_record(dev, event, opcode, sent_at_us);
+    }
+}
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,92 @@
+#include "logging.h"
+
+#include "mpsc_ring.h"
+#include "utils.h"
+
+#include <stdarg.h>
+
+#define LOG_MESSAGE_SIZE 256
+
+typedef struct {
+    uint8_t level;
+    const char *format;
+    uint32_t args[4];
+} LogRecord;
+
+static LogRecord s_records[BTE_LOG_DEFERRED_SIZE];
+static atomic_uint_least32_t s_record_sequences[BTE_LOG_DEFERRED_SIZE];
+static BteMpscRing s_deferred =
+    BTE_MPSC_RING_INIT(s_record_sequences, BTE_LOG_DEFERRED_SIZE);
+static atomic_uint_least32_t s_num_dropped;
+
+static void default_sink(int level, const char *message, void *userdata)
+{
+    fputs(message, stdout);
+}
+
+static BteLogSink s_sink = default_sink;
+static void *s_sink_userdata = NULL;
+
+void bte_log_set_sink(BteLogSink sink, void *userdata)
+{
+    s_sink = sink ? sink : default_sink;
+    s_sink_userdata = userdata;
+}
+
+void _bte_log(int level, const char *format, ...)
+{
+    char message[LOG_MESSAGE_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    s_sink(level, message, s_sink_userdata);
+}
+
+void _bte_log_deferred(int level, const char *format,
+                       uint32_t arg0, uint32_t arg1,
+                       uint32_t arg2, uint32_t arg3)
+{
+    uint32_t pos;
+    if (UNLIKELY(!_bte_mpsc_ring_reserve(&s_deferred, &pos))) {
+        atomic_fetch_add(&s_num_dropped, 1);
+        return;
+    }
+
+    LogRecord *record = &s_records[_bte_mpsc_ring_slot(&s_deferred, pos)];
+    record->level = level;
+    record->format = format;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    record->args[3] = arg3;
+    _bte_mpsc_ring_commit(&s_deferred, pos);
+}
+
+int bte_log_flush(void)
+{
+    char message[LOG_MESSAGE_SIZE];
+    int count = 0;
+
+    uint32_t num_dropped = atomic_exchange(&s_num_dropped, 0);
+    if (UNLIKELY(num_dropped > 0)) {
+        snprintf(message, sizeof(message), "%u log messages dropped\n",
+                 (unsigned)num_dropped);
+        s_sink(BTE_LOG_LEVEL_WARN, message, s_sink_userdata);
+    }
+
+    int32_t slot;
+    while ((slot = _bte_mpsc_ring_read_slot(&s_deferred)) >= 0) {
+        LogRecord *record = &s_records[slot];
+        snprintf(message, sizeof(message), record->format,
+                 record->args[0], record->args[1],
+                 record->args[2], record->args[3]);
+        int level = record->level;
+        /* Release the record before invoking the sink */
+        _bte_mpsc_ring_pop(&s_deferred);
+        s_sink(level, message, s_sink_userdata);
+        count++;
+    }
+    return count;
+}
@@ -2,22 +2,74 @@
 #define BTE_LOGGING_H
 
 #include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define DEBUG 1
+#define BTE_LOG_LEVEL_NONE  0
+#define BTE_LOG_LEVEL_ERROR 1
+#define BTE_LOG_LEVEL_WARN  2
+#define BTE_LOG_LEVEL_INFO  3
+#define BTE_LOG_LEVEL_DEBUG 4
 
-#define BTE_WARN(...) printf(__VA_ARGS__)
-#define BTE_INFO(...) printf(__VA_ARGS__)
-#if DEBUG
-#define BTE_DEBUG(...) printf(__VA_ARGS__)
-#else
-#define BTE_DEBUG(...) (void)0
+/* Messages above this level are compiled out */
+#ifndef BTE_LOG_LEVEL
+#  define BTE_LOG_LEVEL BTE_LOG_LEVEL_WARN
 #endif
 
+/* Number of records in the deferred log ring; must be a power of two */
+#ifndef BTE_LOG_DEFERRED_SIZE
+#  define BTE_LOG_DEFERRED_SIZE 64
+#endif
+
+/* Receives every formatted log message. The default sink prints the messages
+ * on the standard output. */
+typedef void (*BteLogSink)(int level, const char *message, void *userdata);
+
+/* Installs the log sink; passing NULL restores the default one */
+void bte_log_set_sink(BteLogSink sink, void *userdata);
+
+/* Formats the records stored in the deferred log ring and passes them to the
+ * sink. Call this from a low-priority context, such as the application's idle
+ * loop. Returns the number of delivered records. */
+int bte_log_flush(void);
+
+void _bte_log(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void _bte_log_deferred(int level, const char *format,
+                       uint32_t arg0, uint32_t arg1,
+                       uint32_t arg2, uint32_t arg3);
+
+#define _BTE_LOG(level, ...) do { \
+    if (BTE_LOG_LEVEL >= level) _bte_log(level, __VA_ARGS__); \
+} while (0)
+
+#define BTE_ERROR(...) _BTE_LOG(BTE_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define BTE_WARN(...)  _BTE_LOG(BTE_LOG_LEVEL_WARN, __VA_ARGS__)
+#define BTE_INFO(...)  _BTE_LOG(BTE_LOG_LEVEL_INFO, __VA_ARGS__)
+#define BTE_DEBUG(...) _BTE_LOG(BTE_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* For hot paths: the message is stored in a lock-free ring, and formatted
+ * only when bte_log_flush() is called. Up to four integer arguments are
+ * supported; they are stored as uint32_t, so the format must only use 32-bit
+ * integer conversions (%d, %u, %x...). The format must be a string literal. */
+#define _BTE_LOG_ARGS(_, a0, a1, a2, a3, ...) \
+    (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2), (uint32_t)(a3)
+#define _BTE_LOG_DEFERRED(level, format, ...) do { \
+    if (BTE_LOG_LEVEL >= level) { \
+        _bte_log_deferred(level, format, \
+                          _BTE_LOG_ARGS(0, ##__VA_ARGS__, 0, 0, 0, 0)); \
+    } \
+} while (0)
+
+#define BTE_WARN_DEFERRED(...) \
+    _BTE_LOG_DEFERRED(BTE_LOG_LEVEL_WARN, __VA_ARGS__)
+#define BTE_DEBUG_DEFERRED(...) \
+    _BTE_LOG_DEFERRED(BTE_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 #ifdef __cplusplus
 }
 #endif
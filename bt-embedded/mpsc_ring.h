@@ -0,0 +1,104 @@
+#ifndef BTE_MPSC_RING_H
+#define BTE_MPSC_RING_H
+
+#ifdef __cplusplus
+#include <atomic>
+using namespace std;
+#else
+#include <stdatomic.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BUILDING_BT_EMBEDDED
+#error "This is not a public header!"
+#endif
+
+/* Lock-free ring for any number of producers (threads or interrupt handlers)
+ * and a single consumer. Like BteSpscRing, it only manages the indices of an
+ * array of "size" slots owned by the user, where size is a power of two.
+ *
+ * Each slot has a sequence number, telling whether it can be written (the
+ * sequence equals the position of the writer) or read (it equals the position
+ * of the reader + 1). The sequences are stored minus the index of the slot,
+ * so that a zero-initialized array is a valid empty ring, and rings can be
+ * statically allocated without an init call. */
+typedef struct bte_mpsc_ring_t {
+    atomic_uint_least32_t *sequences;
+    atomic_uint_least32_t write_pos;
+    uint32_t read_pos;
+    uint32_t size;
+} BteMpscRing;
+
+#define BTE_MPSC_RING_INIT(sequences_array, ring_size) { \
+    .sequences = sequences_array, .size = ring_size, \
+}
+
+static inline uint32_t _bte_mpsc_ring_slot(const BteMpscRing *ring,
+                                           uint32_t pos)
+{
+    return pos & (ring->size - 1);
+}
+
+/* Reserves a slot for writing, storing its position into *pos; returns false
+ * if the ring is full. Use _bte_mpsc_ring_slot() to get the slot index. */
+static inline bool _bte_mpsc_ring_reserve(BteMpscRing *ring, uint32_t *pos)
+{
+    uint32_t p = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    while (true) {
+        uint32_t index = _bte_mpsc_ring_slot(ring, p);
+        uint32_t sequence = atomic_load_explicit(&ring->sequences[index],
+                                                 memory_order_acquire) + index;
+        int32_t diff = (int32_t)(sequence - p);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->write_pos, &p, p + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            p = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+        }
+    }
+    *pos = p;
+    return true;
+}
+
+/* Makes the slot reserved at pos visible to the consumer */
+static inline void _bte_mpsc_ring_commit(BteMpscRing *ring, uint32_t pos)
+{
+    uint32_t index = _bte_mpsc_ring_slot(ring, pos);
+    atomic_store_explicit(&ring->sequences[index], pos + 1 - index,
+                          memory_order_release);
+}
+
+/* Returns the index of the oldest committed slot, or -1 if there is none */
+static inline int32_t _bte_mpsc_ring_read_slot(BteMpscRing *ring)
+{
+    uint32_t pos = ring->read_pos;
+    uint32_t index = _bte_mpsc_ring_slot(ring, pos);
+    uint32_t sequence = atomic_load_explicit(&ring->sequences[index],
+                                             memory_order_acquire) + index;
+    return sequence == pos + 1 ? (int32_t)index : -1;
+}
+
+/* Gives the slot returned by _bte_mpsc_ring_read_slot() back to the
+ * producers */
+static inline void _bte_mpsc_ring_pop(BteMpscRing *ring)
+{
+    uint32_t pos = ring->read_pos;
+    uint32_t index = _bte_mpsc_ring_slot(ring, pos);
+    atomic_store_explicit(&ring->sequences[index], pos + ring->size - index,
+                          memory_order_release);
+    ring->read_pos = pos + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_MPSC_RING_H */
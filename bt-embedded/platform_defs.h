@@ -9,6 +9,11 @@ extern "C" {
 #  define BTE_BUFFER_ALIGNMENT_SIZE 32
 #endif
 
+/* If defined, bte_buffer_alloc() returns buffers larger than this as chains
+ * of segments of this size, instead of a single block. This avoids large
+ * allocations, at the cost of making the data non contiguous. */
+/* #define BTE_BUFFER_SEGMENT_SIZE 256 */
+
 #ifdef BTE_BUFFER_ALIGNMENT_SIZE
 #  define BTE_BUFFER_ALIGN __attribute__((aligned(BTE_BUFFER_ALIGNMENT_SIZE)))
 #else
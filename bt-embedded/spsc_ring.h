@@ -0,0 +1,90 @@
+#ifndef BTE_SPSC_RING_H
+#define BTE_SPSC_RING_H
+
+#ifdef __cplusplus
+#include <atomic>
+using namespace std;
+#else
+#include <stdatomic.h>
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BUILDING_BT_EMBEDDED
+#error "This is not a public header!"
+#endif
+
+/* Lock-free ring for a single producer (typically an interrupt handler or a
+ * callback running in another thread) and a single consumer. The ring only
+ * manages the indices: the slots are stored by the user in an array of
+ * "size" elements, where size is a power of two.
+ *
+ * The producer fills the slot returned by _bte_spsc_ring_write_slot() and then
+ * publishes it with _bte_spsc_ring_push(); the consumer accesses the slot
+ * returned by _bte_spsc_ring_read_slot() in place, and releases it with
+ * _bte_spsc_ring_pop(). The indices grow freely and are masked on access. */
+typedef struct bte_spsc_ring_t {
+    atomic_uint_least32_t head; /* Only written by the consumer */
+    atomic_uint_least32_t tail; /* Only written by the producer */
+    uint32_t size;
+} BteSpscRing;
+
+static inline void _bte_spsc_ring_init(BteSpscRing *ring, uint32_t size)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->size = size;
+}
+
+/* Returns the index of the slot to be filled, or -1 if the ring is full */
+static inline int32_t _bte_spsc_ring_write_slot(BteSpscRing *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= ring->size) return -1;
+    return tail & (ring->size - 1);
+}
+
+/* Makes the slot returned by _bte_spsc_ring_write_slot() visible to the
+ * consumer */
+static inline void _bte_spsc_ring_push(BteSpscRing *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Returns the index of the oldest filled slot, or -1 if the ring is empty */
+static inline int32_t _bte_spsc_ring_read_slot(BteSpscRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) return -1;
+    return head & (ring->size - 1);
+}
+
+/* Gives the slot returned by _bte_spsc_ring_read_slot() back to the
+ * producer */
+static inline void _bte_spsc_ring_pop(BteSpscRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Number of filled slots; only accurate when called by the consumer, and
+ * only as a lower bound */
+static inline uint32_t _bte_spsc_ring_count(BteSpscRing *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTE_SPSC_RING_H */
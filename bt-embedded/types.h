@@ -12,9 +12,11 @@ extern "C" {
 
 #define BTE_PACKED __attribute__((packed))
 
+typedef struct bte_backend_t BteBackend;
 typedef struct bte_buffer_t BteBuffer;
 typedef struct bte_client_t BteClient;
 typedef struct bte_hci_t BteHci;
+typedef struct bte_hci_dev_t BteHciDev;
 
 typedef struct {
     uint8_t bytes[6];
@@ -3,7 +3,7 @@
 
 static int dummy_init(BteHciDev *dev)
 {
-    _bte_hci_dev_set_status(BTE_HCI_INIT_STATUS_INITIALIZED);
+    _bte_hci_dev_set_status(dev, BTE_HCI_INIT_STATUS_INITIALIZED);
     return 0;
 }
 
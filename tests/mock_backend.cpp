@@ -4,10 +4,9 @@
 #include "bt-embedded/internals.h"
 
 #include <cassert>
+#include <chrono>
 #include <errno.h>
 
-MockBackend *MockBackend::s_instance = nullptr;
-
 Buffer::Buffer(BteBuffer *buffer)
 {
     resize(buffer->total_size);
@@ -54,14 +53,28 @@ BteBuffer *Buffer::toBuffer(uint16_t max_packet_size) const
     return buffer;
 }
 
-MockBackend::MockBackend()
+MockBackend::MockBackend(BteHciDev *dev):
+    m_dev(dev)
 {
-    s_instance = this;
+    m_dev->backend_data = this;
+    /* Each test starts with a fresh controller */
+    _bte_hci_dev_reset_command_queue(m_dev);
 }
 
 MockBackend::~MockBackend()
 {
-    s_instance = nullptr;
+    if (m_origBackend) m_dev->backend = m_origBackend;
+    m_dev->backend_data = nullptr;
+}
+
+void MockBackend::setCapabilities(uint32_t capabilities)
+{
+    if (!m_origBackend) {
+        m_origBackend = m_dev->backend;
+        m_backend = *m_origBackend;
+        m_dev->backend = &m_backend;
+    }
+    m_backend.capabilities = capabilities;
 }
 
 int MockBackend::callInit()
@@ -87,54 +100,92 @@ int MockBackend::callSendData(BteBuffer *buffer)
     return 0;
 }
 
+void MockBackend::wakeup()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wakeup = true;
+    m_cond.notify_all();
+}
+
+void MockBackend::waitForBuffers(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto ready = [this]() {
+        return m_wakeup || !m_queuedEvents.empty() || !m_queuedData.empty();
+    };
+    if (timeout_ms == 0) {
+        m_cond.wait(lock, ready);
+    } else {
+        m_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+    }
+    m_wakeup = false;
+}
+
 int MockBackend::sendQueuedBuffers()
 {
-    int count = m_queuedEvents.size() + m_queuedData.size();
-    for (const Buffer &b: m_queuedEvents) {
+    std::vector<Buffer> queuedEvents, queuedData;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        queuedEvents.swap(m_queuedEvents);
+        queuedData.swap(m_queuedData);
+    }
+
+    /* Delivered without holding the lock, since the handlers might queue
+     * more buffers */
+    int count = queuedEvents.size() + queuedData.size();
+    for (const Buffer &b: queuedEvents) {
         BteBuffer *buffer = b.toBuffer();
-        _bte_hci_dev_handle_event(buffer);
+        _bte_hci_dev_handle_event(m_dev, buffer);
         bte_buffer_unref(buffer);
     }
-    for (const Buffer &b: m_queuedData) {
+    for (const Buffer &b: queuedData) {
         BteBuffer *buffer = b.toBuffer();
-        _bte_hci_dev_handle_data(buffer);
+        _bte_hci_dev_handle_data(m_dev, buffer);
         bte_buffer_unref(buffer);
     }
-    m_queuedEvents.clear();
-    m_queuedData.clear();
     return count;
 }
 
-static int mock_init()
+static int mock_init(BteHciDev *dev)
 {
-    MockBackend *backend = MockBackend::instance();
+    MockBackend *backend = MockBackend::instance(dev);
     return backend->callInit();
 }
 
-static int mock_handle_events(bool wait_for_events, uint32_t timeout_ms)
+static int mock_handle_events(BteHciDev *dev, bool wait_for_events,
+                              uint32_t timeout_ms)
 {
-    MockBackend *backend = MockBackend::instance();
+    MockBackend *backend = MockBackend::instance(dev);
+    if (wait_for_events) backend->waitForBuffers(timeout_ms);
     return backend->sendQueuedBuffers();
 }
 
-static int mock_hci_send_command(BteBuffer *buffer)
+static int mock_hci_send_command(BteHciDev *dev, BteBuffer *buffer)
 {
-    MockBackend *backend = MockBackend::instance();
+    MockBackend *backend = MockBackend::instance(dev);
     return backend->callSendCommand(buffer);
 }
 
-static int mock_hci_send_data(BteBuffer *buffer)
+static int mock_hci_send_data(BteHciDev *dev, BteBuffer *buffer)
 {
-    MockBackend *backend = MockBackend::instance();
+    MockBackend *backend = MockBackend::instance(dev);
     return backend->callSendData(buffer);
 }
 
-static int mock_deinit()
+static int mock_deinit(BteHciDev *dev)
 {
     return 0;
 }
 
+static void mock_wakeup(BteHciDev *dev)
+{
+    MockBackend *backend = MockBackend::instance(dev);
+    if (backend) backend->wakeup();
+}
+
 const BteBackend _bte_backend = {
+    .capabilities = BTE_BACKEND_CAP_SCATTER_GATHER,
+
     .init = mock_init,
 
     .handle_events = mock_handle_events,
@@ -143,4 +194,6 @@ const BteBackend _bte_backend = {
     .hci_send_data = mock_hci_send_data,
 
     .deinit = mock_deinit,
+
+    .wakeup = mock_wakeup,
 };
@@ -4,22 +4,33 @@
 #include "bte_cpp.h"
 
 #include "bt-embedded/backend.h"
+#include "bt-embedded/internals.h"
 
+#include <condition_variable>
 #include <functional>
+#include <mutex>
 #include <vector>
 
 using Buffer = Bte::Buffer;
 
 class MockBackend {
 public:
-    MockBackend();
+    /* The mock backend serves the given device, which can be one created with
+     * bte_hci_dev_new(&_bte_backend, nullptr) */
+    MockBackend(BteHciDev *dev = &_bte_hci_dev);
     ~MockBackend();
 
+    BteHciDev *dev() const { return m_dev; }
+
     using InitCb = std::function<int()>;
     void onInit(const InitCb &initBb) {
         m_initCb = initBb;
     }
 
+    /* Makes the device see a backend with these capabilities instead of
+     * BTE_BACKEND_CAP_SCATTER_GATHER, until the MockBackend is destroyed */
+    void setCapabilities(uint32_t capabilities);
+
     using SendCb = std::function<int(BteBuffer*)>;
     void onSendCommand(const SendCb &sendCommandCb) {
         m_sendCommandCb = sendCommandCb;
@@ -38,23 +49,36 @@ public:
         return m_sentData.empty() ? Buffer() : m_sentData.back();
     }
 
+    /* These can be called from any thread */
     void sendEvent(const Buffer &buffer) {
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_queuedEvents.push_back(buffer);
+        m_cond.notify_all();
     }
 
     void sendData(const Buffer &buffer) {
-        m_queuedEvents.push_back(buffer);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queuedData.push_back(buffer);
+        m_cond.notify_all();
     }
 
-    static MockBackend *instance() { return s_instance; }
+    void wakeup();
+
+    static MockBackend *instance(BteHciDev *dev) {
+        return static_cast<MockBackend*>(dev->backend_data);
+    }
 
     int callInit();
     int callSendCommand(BteBuffer *buffer);
     int callSendData(BteBuffer *buffer);
     int sendQueuedBuffers();
+    /* A zero timeout means waiting forever */
+    void waitForBuffers(uint32_t timeout_ms);
 
 private:
-    static MockBackend *s_instance;
+    BteHciDev *m_dev;
+    const BteBackend *m_origBackend = nullptr;
+    BteBackend m_backend;
     InitCb m_initCb;
     SendCb m_sendCommandCb;
     SendCb m_sendDataCb;
@@ -62,6 +86,9 @@ private:
     std::vector<Buffer> m_sentData;
     std::vector<Buffer> m_queuedEvents;
     std::vector<Buffer> m_queuedData;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_wakeup = false;
 };
 
 #endif /* BTE_MOCK_BACKEND_H */
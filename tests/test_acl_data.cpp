@@ -0,0 +1,623 @@
+#include "mock_backend.h"
+#include "type_utils.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/internals.h"
+#include <gtest/gtest.h>
+
+struct ReceivedPdu {
+    BteHciConnHandle conn_handle;
+    Buffer payload;
+    int num_fragments;
+
+    bool operator==(const ReceivedPdu &other) const {
+        return conn_handle == other.conn_handle &&
+            payload == other.payload &&
+            num_fragments == other.num_fragments;
+    }
+};
+
+static std::vector<ReceivedPdu> s_receivedPdus;
+static BteBuffer *s_keptPdu = nullptr;
+
+static void storePdu(BteHci *hci, BteHciConnHandle conn_handle,
+                     BteBuffer *pdu, void *userdata)
+{
+    Buffer payload;
+    payload.resize(bte_hci_acl_pdu_size(pdu));
+    uint16_t read =
+        bte_hci_acl_pdu_read(pdu, 0, payload.data(), payload.size());
+    EXPECT_EQ(read, payload.size());
+    int num_fragments = 0;
+    for (BteBuffer *b = pdu->next; b; b = b->next) num_fragments++;
+    s_receivedPdus.push_back({conn_handle, payload, num_fragments});
+}
+
+static void keepPdu(BteHci *hci, BteHciConnHandle conn_handle,
+                    BteBuffer *pdu, void *userdata)
+{
+    storePdu(hci, conn_handle, pdu, userdata);
+    s_keptPdu = bte_buffer_ref(pdu);
+}
+
+/* Builds an ACL packet */
+static Buffer aclPacket(BteHciConnHandle conn_handle, uint8_t pb,
+                        const Buffer &payload)
+{
+    uint16_t header = conn_handle | (pb << HCI_ACL_PB_SHIFT);
+    uint16_t len = payload.size();
+    return Buffer{
+        uint8_t(header & 0xff), uint8_t(header >> 8),
+        uint8_t(len & 0xff), uint8_t(len >> 8),
+    } + payload;
+}
+
+class TestAclData: public testing::Test {
+protected:
+    void SetUp() override {
+        s_receivedPdus.clear();
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client);
+    }
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+TEST_F(TestAclData, testSingleFragment) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0102, storePdu));
+
+    Buffer pdu{3, 0, 0x40, 0, 1, 2, 3};
+    m_backend.sendData(aclPacket(0x0102, HCI_ACL_PB_FIRST_FLUSH, pdu));
+    /* Data for another connection is ignored */
+    m_backend.sendData(aclPacket(0x0103, HCI_ACL_PB_FIRST_FLUSH, pdu));
+    bte_handle_events();
+
+    std::vector<ReceivedPdu> expectedPdus = {
+        {0x0102, pdu, 1},
+    };
+    ASSERT_EQ(s_receivedPdus, expectedPdus);
+}
+
+TEST_F(TestAclData, testReassembly) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0002, storePdu));
+
+    /* Fragments of two connections are interleaved */
+    Buffer pdu1{6, 0, 0x40, 0, 1, 2, 3, 4, 5, 6};
+    Buffer pdu2{2, 0, 0x41, 0, 0xaa, 0xbb};
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_NON_FLUSH,
+                                 Buffer{6}));
+    m_backend.sendData(aclPacket(0x0002, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{2, 0, 0x41}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{0, 0x40, 0, 1, 2}));
+    m_backend.sendData(aclPacket(0x0002, HCI_ACL_PB_CONTINUING,
+                                 Buffer{0, 0xaa, 0xbb}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{3, 4, 5, 6}));
+    bte_handle_events();
+
+    std::vector<ReceivedPdu> expectedPdus = {
+        {0x0002, pdu2, 2},
+        {0x0001, pdu1, 3},
+    };
+    ASSERT_EQ(s_receivedPdus, expectedPdus);
+}
+
+TEST_F(TestAclData, testBrokenSequences) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+
+    Buffer pdu{1, 0, 0x40, 0, 0x11};
+    /* A continuation without a start is dropped */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{1, 2, 3}));
+    /* An incomplete PDU is dropped when a new one starts */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{8, 0, 0x40, 0, 1}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH, pdu));
+    bte_handle_events();
+
+    std::vector<ReceivedPdu> expectedPdus = {
+        {0x0001, pdu, 1},
+    };
+    ASSERT_EQ(s_receivedPdus, expectedPdus);
+}
+
+TEST_F(TestAclData, testOversizedPdu) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+
+    /* The total length (0xffff plus the L2CAP header) doesn't fit 16 bits:
+     * the PDU is dropped, together with its continuations */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{0xff, 0xff, 0x40, 0, 1}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{2, 3, 4}));
+    ASSERT_EQ(bte_handle_events(), 2);
+    ASSERT_TRUE(s_receivedPdus.empty());
+
+    /* The next PDU is received normally */
+    Buffer pdu{1, 0, 0x40, 0, 0x11};
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH, pdu));
+    bte_handle_events();
+    std::vector<ReceivedPdu> expectedPdus = {
+        {0x0001, pdu, 1},
+    };
+    ASSERT_EQ(s_receivedPdus, expectedPdus);
+}
+
+TEST_F(TestAclData, testKeepPdu) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, keepPdu));
+
+    Buffer pdu{4, 0, 0x40, 0, 1, 2, 3, 4};
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{4, 0, 0x40}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{0, 1, 2, 3, 4}));
+    bte_handle_events();
+    ASSERT_NE(s_keptPdu, nullptr);
+    BteBuffer *kept = s_keptPdu;
+    s_keptPdu = nullptr;
+
+    /* Receive another PDU; the kept one must not be affected */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 9}));
+    bte_handle_events();
+    ASSERT_NE(s_keptPdu, nullptr);
+    bte_buffer_unref(s_keptPdu);
+
+    Buffer payload;
+    payload.resize(bte_hci_acl_pdu_size(kept));
+    bte_hci_acl_pdu_read(kept, 0, payload.data(), payload.size());
+    ASSERT_EQ(payload, pdu);
+
+    /* Partial reads across fragments */
+    uint8_t bytes[3];
+    ASSERT_EQ(bte_hci_acl_pdu_read(kept, 2, bytes, sizeof(bytes)), 3);
+    ASSERT_EQ(Buffer(bytes, bytes + 3), Buffer({0x40, 0, 1}));
+    ASSERT_EQ(bte_hci_acl_pdu_read(kept, 6, bytes, sizeof(bytes)), 2);
+    bte_buffer_unref(kept);
+}
+
+TEST_F(TestAclData, testConnectionOwnership) {
+    BteClient *other = bte_client_new();
+    BteHci *otherHci = bte_hci_get(other);
+
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+    ASSERT_FALSE(bte_hci_on_acl_data(otherHci, 0x0001, storePdu));
+    /* Another client cannot remove our listener */
+    ASSERT_TRUE(bte_hci_on_acl_data(otherHci, 0x0001, nullptr));
+    ASSERT_NE(_bte_hci_dev_acl_connection(&_bte_hci_dev, 0x0001), nullptr);
+
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, nullptr));
+    ASSERT_TRUE(bte_hci_on_acl_data(otherHci, 0x0001, storePdu));
+
+    /* Destroying the client releases its connections */
+    bte_client_unref(other);
+    ASSERT_EQ(_bte_hci_dev_acl_connection(&_bte_hci_dev, 0x0001), nullptr);
+}
+
+TEST_F(TestAclData, testBatchedCompletedPackets) {
+    size_t numCommands = m_backend.sentCommands().size();
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0001, 1);
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0002, 1);
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0001, 1);
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands);
+
+    /* Sent at the end of the pass */
+    bte_handle_events();
+    Buffer expectedCommand{
+        0x35, 0x0c, 9, 2,
+        0x01, 0x00, 2, 0,
+        0x02, 0x00, 1, 0,
+    };
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 1);
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+
+    /* The immediate variant also sends what was collected */
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0003, 1);
+    bte_hci_host_num_comp_packets(m_hci, 0x0004, 2);
+    expectedCommand = Buffer{
+        0x35, 0x0c, 9, 2,
+        0x03, 0x00, 1, 0,
+        0x04, 0x00, 2, 0,
+    };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 2);
+}
+
+TEST_F(TestAclData, testBatchedCompletedPacketsThresholds) {
+    size_t numCommands = m_backend.sentCommands().size();
+
+    /* Too many packets */
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0001, 2);
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0002, 2);
+    Buffer expectedCommand{
+        0x35, 0x0c, 9, 2,
+        0x01, 0x00, 2, 0,
+        0x02, 0x00, 2, 0,
+    };
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 1);
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+
+    /* Waiting for too long */
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0001, 1);
+    _bte_hci_dev.host_completed_since_us -= 20000;
+    bte_hci_host_num_comp_packets_add(m_hci, 0x0002, 1);
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 2);
+
+    /* Too many handles */
+    const int maxHandles = 8; /* BTE_HCI_HOST_COMPLETED_MAX_HANDLES */
+    for (int i = 0; i <= maxHandles; i++) {
+        _bte_hci_dev.host_completed_packets = 0;
+        bte_hci_host_num_comp_packets_add(m_hci, 0x0010 + i, 1);
+    }
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 3);
+    ASSERT_EQ(m_backend.lastCommand().size(), 4 + 4 * maxHandles);
+    bte_hci_host_num_comp_packets_flush(m_hci);
+    expectedCommand = Buffer{ 0x35, 0x0c, 5, 1, 0x18, 0x00, 1, 0 };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+}
+
+class TestAclTransmit: public TestAclData {
+protected:
+    void SetUp() override {
+        TestAclData::SetUp();
+        _bte_hci_dev.acl_mtu = 4;
+        _bte_hci_dev.acl_max_packets = 2;
+        _bte_hci_dev.acl_in_flight = 0;
+        _bte_hci_dev.acl_tx_next = 0;
+        _bte_hci_dev.acl_tx_retry = false;
+    }
+
+    void completePackets(BteHciConnHandle conn_handle, uint16_t count) {
+        m_backend.sendEvent({
+            HCI_NBR_OF_COMPLETED_PACKETS, 5, 1,
+            uint8_t(conn_handle & 0xff), uint8_t(conn_handle >> 8),
+            uint8_t(count & 0xff), uint8_t(count >> 8),
+        });
+        bte_handle_events();
+    }
+};
+
+TEST_F(TestAclTransmit, testFragmentation) {
+    Buffer pdu{6, 0, 0x40, 0, 1, 2, 3, 4, 5, 6};
+    BteBuffer *b = pdu.toBuffer();
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+    bte_buffer_unref(b);
+
+    /* Only two packets can be in flight */
+    std::vector<Buffer> expectedData = {
+        aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH, Buffer{6, 0, 0x40, 0}),
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{1, 2, 3, 4}),
+    };
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+
+    completePackets(0x0001, 1);
+    expectedData.push_back(
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{5, 6}));
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+
+    completePackets(0x0001, 2);
+    ASSERT_EQ(_bte_hci_dev.acl_in_flight, 0);
+}
+
+TEST_F(TestAclTransmit, testChainIsNotCopied) {
+    _bte_hci_dev.acl_mtu = 8;
+    _bte_hci_dev.acl_max_packets = 8;
+
+    /* Segments of 4 bytes: two of them fit in a packet */
+    Buffer pdu{8, 0, 0x40, 0, 1, 2, 3, 4, 5, 6, 7, 8};
+    BteBuffer *b = pdu.toBuffer(4);
+    std::vector<BteBuffer *> firstSegments;
+    m_backend.onSendData([&](BteBuffer *buffer) {
+        firstSegments.push_back(buffer->next);
+        return 0;
+    });
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+
+    std::vector<Buffer> expectedData = {
+        aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                  Buffer{8, 0, 0x40, 0, 1, 2, 3, 4}),
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{5, 6, 7, 8}),
+    };
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+    std::vector<BteBuffer *> expectedSegments = { b, b->next->next };
+    ASSERT_EQ(firstSegments, expectedSegments);
+    /* The sent packets have been released */
+    ASSERT_EQ(b->ref_count, 1);
+    bte_buffer_unref(b);
+}
+
+TEST_F(TestAclTransmit, testChainIsCopiedForContiguousBackends) {
+    m_backend.setCapabilities(0);
+    _bte_hci_dev.acl_mtu = 8;
+    _bte_hci_dev.acl_max_packets = 8;
+
+    Buffer pdu{8, 0, 0x40, 0, 1, 2, 3, 4, 5, 6, 7, 8};
+    BteBuffer *b = pdu.toBuffer(4);
+    std::vector<bool> chained;
+    m_backend.onSendData([&](BteBuffer *buffer) {
+        chained.push_back(buffer->next != nullptr);
+        return 0;
+    });
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+
+    std::vector<Buffer> expectedData = {
+        aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                  Buffer{8, 0, 0x40, 0, 1, 2, 3, 4}),
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{5, 6, 7, 8}),
+    };
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+    std::vector<bool> expectedChained = { false, false };
+    ASSERT_EQ(chained, expectedChained);
+    /* The client data is not referenced by the copies */
+    ASSERT_EQ(b->ref_count, 1);
+    bte_buffer_unref(b);
+}
+
+TEST_F(TestAclTransmit, testRoundRobin) {
+    _bte_hci_dev.acl_max_packets = 3;
+
+    Buffer pdu1{4, 0, 0x40, 0, 1, 2, 3, 4};
+    Buffer pdu2{2, 0, 0x41, 0, 0xaa, 0xbb};
+    BteBuffer *b1 = pdu1.toBuffer();
+    BteBuffer *b2 = pdu2.toBuffer();
+    /* Queue both PDUs before any credit is available */
+    _bte_hci_dev.acl_in_flight = 3;
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b1), 0);
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0002, b2), 0);
+    bte_buffer_unref(b1);
+    bte_buffer_unref(b2);
+    ASSERT_TRUE(m_backend.sentData().empty());
+
+    _bte_hci_dev.acl_in_flight = 0;
+    completePackets(0x0003, 0);
+    std::vector<Buffer> expectedData = {
+        aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH, Buffer{4, 0, 0x40, 0}),
+        aclPacket(0x0002, HCI_ACL_PB_FIRST_FLUSH, Buffer{2, 0, 0x41, 0}),
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{1, 2, 3, 4}),
+    };
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+
+    completePackets(0x0001, 2);
+    expectedData.push_back(
+        aclPacket(0x0002, HCI_ACL_PB_CONTINUING, Buffer{0xaa, 0xbb}));
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+}
+
+TEST_F(TestAclTransmit, testSendFailureIsRetried) {
+    Buffer pdu{6, 0, 0x40, 0, 1, 2, 3, 4, 5, 6};
+    BteBuffer *b = pdu.toBuffer();
+    /* The backend queue is full at first */
+    int failures = 1;
+    m_backend.onSendData([&](BteBuffer *) {
+        return failures-- > 0 ? -ENOBUFS : 0;
+    });
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+    bte_buffer_unref(b);
+
+    /* The scheduler stopped at the refused fragment */
+    Buffer first = aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                             Buffer{6, 0, 0x40, 0});
+    std::vector<Buffer> expectedData = { first };
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+    ASSERT_EQ(_bte_hci_dev.acl_in_flight, 0);
+
+    /* The event loop retries it, and nothing is lost */
+    bte_handle_events();
+    expectedData.push_back(first);
+    expectedData.push_back(
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{1, 2, 3, 4}));
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+
+    completePackets(0x0001, 2);
+    expectedData.push_back(
+        aclPacket(0x0001, HCI_ACL_PB_CONTINUING, Buffer{5, 6}));
+    ASSERT_EQ(m_backend.sentData(), expectedData);
+}
+
+TEST_F(TestAclTransmit, testErrors) {
+    BteClient *other = bte_client_new();
+    BteHci *otherHci = bte_hci_get(other);
+    _bte_hci_dev.acl_in_flight = _bte_hci_dev.acl_max_packets;
+
+    Buffer pdu{1, 0, 0x40, 0, 1};
+    BteBuffer *b = pdu.toBuffer();
+    for (int i = 0; i < BTE_HCI_ACL_TX_QUEUE_SIZE; i++) {
+        ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+    }
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), -ENOBUFS);
+    ASSERT_EQ(bte_hci_send_acl_data(otherHci, 0x0001, b), -EBUSY);
+    ASSERT_EQ(b->ref_count, 1 + BTE_HCI_ACL_TX_QUEUE_SIZE);
+
+    /* Queued PDUs are released together with the client */
+    bte_client_unref(m_client);
+    m_client = other;
+    ASSERT_EQ(b->ref_count, 1);
+    bte_buffer_unref(b);
+}
+
+class TestAclFlowControl: public TestAclData {
+protected:
+    void SetUp() override {
+        TestAclData::SetUp();
+        bte_hci_set_ctrl_to_host_flow_control(
+            m_hci, BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL, ignoreReply);
+        m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x31, 0x0c, 0 });
+        bte_handle_events();
+    }
+
+    void TearDown() override {
+        _bte_hci_dev.host_flow_control = BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF;
+        _bte_hci_dev.host_acl_packets = 0;
+        _bte_hci_dev.host_completed_count = 0;
+        TestAclData::TearDown();
+    }
+
+    static void ignoreReply(BteHci *, const BteHciReply *, void *) {}
+};
+
+TEST_F(TestAclFlowControl, testReleasedPacketsAreReported) {
+    ASSERT_EQ(_bte_hci_dev.host_flow_control,
+              BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL);
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0002, keepPdu));
+    size_t numCommands = m_backend.sentCommands().size();
+
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{2, 0, 0x40}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{0, 1, 2}));
+    m_backend.sendData(aclPacket(0x0002, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    /* Nobody receives this one, so it's released immediately */
+    m_backend.sendData(aclPacket(0x0003, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    bte_handle_events();
+
+    /* A single command reports both handles; the kept PDU is not reported */
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 1);
+    Buffer expectedCommand{
+        0x35, 0x0c, 9, 2,
+        0x01, 0x00, 2, 0,
+        0x03, 0x00, 1, 0,
+    };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+
+    bte_buffer_unref(s_keptPdu);
+    s_keptPdu = nullptr;
+    bte_handle_events();
+    expectedCommand = Buffer{ 0x35, 0x0c, 5, 1, 0x02, 0x00, 1, 0 };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+
+    /* Nothing else to report */
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 2);
+}
+
+TEST_F(TestAclFlowControl, testDisconnectedLinksAreNotReported) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0002, keepPdu));
+    size_t numCommands = m_backend.sentCommands().size();
+
+    m_backend.sendData(aclPacket(0x0002, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    bte_handle_events();
+    ASSERT_NE(s_keptPdu, nullptr);
+    m_backend.sendEvent({ HCI_DISCONNECTION_COMPLETE, 4, 0, 0x02, 0x00,
+                          HCI_OTHER_END_TERMINATED_CONN_USER_ENDED });
+    bte_handle_events();
+    bte_buffer_unref(s_keptPdu);
+    s_keptPdu = nullptr;
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands);
+}
+
+TEST_F(TestAclFlowControl, testCountsSurviveTheConnection) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, keepPdu));
+    size_t numCommands = m_backend.sentCommands().size();
+
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    bte_handle_events();
+    ASSERT_NE(s_keptPdu, nullptr);
+
+    /* The count is not lost when we stop tracking the link */
+    bte_buffer_unref(s_keptPdu);
+    s_keptPdu = nullptr;
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, nullptr));
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands);
+    bte_hci_host_num_comp_packets_flush(m_hci);
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 1);
+    Buffer expectedCommand{ 0x35, 0x0c, 5, 1, 0x01, 0x00, 1, 0 };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+}
+
+TEST_F(TestAclFlowControl, testReusedHandlesAreNotReported) {
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0002, keepPdu));
+    size_t numCommands = m_backend.sentCommands().size();
+
+    m_backend.sendData(aclPacket(0x0002, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    bte_handle_events();
+    ASSERT_NE(s_keptPdu, nullptr);
+    m_backend.sendEvent({ HCI_DISCONNECTION_COMPLETE, 4, 0, 0x02, 0x00,
+                          HCI_OTHER_END_TERMINATED_CONN_USER_ENDED });
+    /* The controller gives the same handle to a new link */
+    m_backend.sendEvent({
+        HCI_CONNECTION_COMPLETE, 11, 0, 0x02, 0x00, 1, 2, 3, 4, 5, 6,
+        BTE_HCI_LINK_TYPE_ACL, 0,
+    });
+    bte_handle_events();
+    ASSERT_NE(_bte_hci_dev_acl_connection(&_bte_hci_dev, 0x0002), nullptr);
+
+    /* The packets of the old link must not be credited to the new one */
+    bte_buffer_unref(s_keptPdu);
+    s_keptPdu = nullptr;
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands);
+
+    m_backend.sendEvent({ HCI_DISCONNECTION_COMPLETE, 4, 0, 0x02, 0x00,
+                          HCI_OTHER_END_TERMINATED_CONN_USER_ENDED });
+    bte_handle_events();
+}
+
+TEST_F(TestAclFlowControl, testPduExceedingHostBuffers) {
+    bte_hci_set_host_buffer_size(m_hci, 27, 2, 0, 0, ignoreReply);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x33, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(_bte_hci_dev.host_acl_packets, 2);
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, storePdu));
+    size_t numCommands = m_backend.sentCommands().size();
+
+    /* The controller would wait for the first two packets to be reported
+     * before sending the third one: the PDU is dropped instead */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{4, 0, 0x40, 0}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{1, 2}));
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands + 1);
+    Buffer expectedCommand{ 0x35, 0x0c, 5, 1, 0x01, 0x00, 2, 0 };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+
+    /* Its last packet is ignored, but still reported */
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{3, 4}));
+    bte_handle_events();
+    expectedCommand = Buffer{ 0x35, 0x0c, 5, 1, 0x01, 0x00, 1, 0 };
+    ASSERT_EQ(m_backend.lastCommand(), expectedCommand);
+    ASSERT_TRUE(s_receivedPdus.empty());
+
+    /* PDUs fitting the buffers are received normally */
+    Buffer pdu{2, 0, 0x40, 0, 1, 2};
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{2, 0, 0x40, 0}));
+    m_backend.sendData(aclPacket(0x0001, HCI_ACL_PB_CONTINUING,
+                                 Buffer{1, 2}));
+    bte_handle_events();
+    std::vector<ReceivedPdu> expectedPdus = {
+        {0x0001, pdu, 2},
+    };
+    ASSERT_EQ(s_receivedPdus, expectedPdus);
+}
+
+TEST_F(TestAclFlowControl, testResetDisablesFlowControl) {
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(_bte_hci_dev.host_flow_control,
+              BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF);
+
+    size_t numCommands = m_backend.sentCommands().size();
+    m_backend.sendData(aclPacket(0x0003, HCI_ACL_PB_FIRST_FLUSH,
+                                 Buffer{1, 0, 0x40, 0, 1}));
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), numCommands);
+}
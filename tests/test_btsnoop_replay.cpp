@@ -0,0 +1,213 @@
+#include "bt-embedded/backends/btsnoop_replay.h"
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+
+#include <chrono>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+static void appendBe32(Bytes &bytes, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        bytes.push_back(uint8_t(value >> shift));
+    }
+}
+
+/* Writes a btsnoop file with the H4 datalink */
+class TraceWriter {
+public:
+    TraceWriter() {
+        m_bytes = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+        appendBe32(m_bytes, 1);
+        appendBe32(m_bytes, 1002);
+    }
+
+    void add(bool received, uint64_t timestampUs, const Bytes &packet) {
+        bool cmdEvent = packet[0] == HCI_COMMAND_DATA_PACKET ||
+            packet[0] == HCI_EVENT_PACKET;
+        appendBe32(m_bytes, packet.size());
+        appendBe32(m_bytes, packet.size());
+        appendBe32(m_bytes, (received ? 1 : 0) | (cmdEvent ? 2 : 0));
+        appendBe32(m_bytes, 0);
+        appendBe32(m_bytes, uint32_t(timestampUs >> 32));
+        appendBe32(m_bytes, uint32_t(timestampUs));
+        m_bytes.insert(m_bytes.end(), packet.begin(), packet.end());
+    }
+
+    std::string save() {
+        char path[] = "/tmp/bte-replay-XXXXXX";
+        int fd = mkstemp(path);
+        EXPECT_GE(fd, 0);
+        EXPECT_EQ(write(fd, m_bytes.data(), m_bytes.size()),
+                  ssize_t(m_bytes.size()));
+        close(fd);
+        return path;
+    }
+
+private:
+    Bytes m_bytes;
+};
+
+static std::vector<uint8_t> s_statuses;
+
+static void statusCb(BteHci *, const BteHciReply *reply, void *)
+{
+    s_statuses.push_back(reply->status);
+}
+
+class TestBtsnoopReplay: public testing::Test {
+protected:
+    void TearDown() override {
+        if (m_client) bte_client_unref(m_client);
+        if (!m_path.empty()) unlink(m_path.c_str());
+    }
+
+    void start(TraceWriter &trace, uint32_t flags) {
+        s_statuses.clear();
+        m_path = trace.save();
+        ASSERT_EQ(bte_btsnoop_replay_set_file(m_path.c_str(), flags), 0);
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+    }
+
+    std::string m_path;
+    BteClient *m_client = nullptr;
+    BteHci *m_hci;
+};
+
+TEST_F(TestBtsnoopReplay, testInvalidFile) {
+    ASSERT_EQ(bte_btsnoop_replay_set_file("/nonexistent", 0), -ENOENT);
+
+    char path[] = "/tmp/bte-replay-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_EQ(write(fd, "not a btsnoop file", 18), 18);
+    close(fd);
+    ASSERT_EQ(bte_btsnoop_replay_set_file(path, 0), -EINVAL);
+    unlink(path);
+}
+
+TEST_F(TestBtsnoopReplay, testRepliesFollowCommands) {
+    TraceWriter trace;
+    trace.add(false, 1000, { HCI_COMMAND_DATA_PACKET, 0x03, 0x0c, 0 });
+    trace.add(true, 2000, { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                            1, 0x03, 0x0c, 0 });
+    trace.add(false, 3000, { HCI_COMMAND_DATA_PACKET, 0x18, 0x0c, 2,
+                             0x00, 0x20 });
+    trace.add(true, 4000, { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                            1, 0x18, 0x0c, 0x12 });
+    start(trace, 0);
+
+    /* Nothing happens until the host sends the first command */
+    ASSERT_EQ(bte_handle_events(), 0);
+    bte_hci_reset(m_hci, statusCb);
+    ASSERT_EQ(bte_handle_events(), 1);
+    ASSERT_EQ(s_statuses, Bytes { 0 });
+    ASSERT_FALSE(bte_btsnoop_replay_finished());
+
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    ASSERT_EQ(bte_handle_events(), 1);
+    ASSERT_EQ(s_statuses, Bytes({ 0, 0x12 }));
+    ASSERT_TRUE(bte_btsnoop_replay_finished());
+}
+
+static int s_numPdus;
+
+static void countPdu(BteHci *, BteHciConnHandle, BteBuffer *, void *)
+{
+    s_numPdus++;
+}
+
+TEST_F(TestBtsnoopReplay, testFullSpeed) {
+    TraceWriter trace;
+    const int numPackets = 100;
+    for (int i = 0; i < numPackets; i++) {
+        /* Commands are not waited for */
+        trace.add(false, i * 1000000, { HCI_COMMAND_DATA_PACKET, 1, 2, 0 });
+        trace.add(true, i * 1000000, { HCI_ACL_DATA_PACKET, 0x01, 0x20, 5, 0,
+                                       1, 0, 0x40, 0, uint8_t(i) });
+    }
+    start(trace, BTE_BTSNOOP_REPLAY_FLAG_IGNORE_COMMANDS);
+    s_numPdus = 0;
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0001, countPdu));
+
+    int delivered = 0;
+    while (!bte_btsnoop_replay_finished()) {
+        int rc = bte_handle_events();
+        ASSERT_GT(rc, 0);
+        delivered += rc;
+    }
+    ASSERT_EQ(delivered, numPackets);
+    ASSERT_EQ(s_numPdus, numPackets);
+}
+
+TEST_F(TestBtsnoopReplay, testRealtime) {
+    TraceWriter trace;
+    Bytes event = { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                    1, 0x03, 0x0c, 0 };
+    trace.add(false, 1000000, { HCI_COMMAND_DATA_PACKET, 0x03, 0x0c, 0 });
+    trace.add(true, 1000000, event);
+    trace.add(true, 1050000, event);
+    start(trace, BTE_BTSNOOP_REPLAY_FLAG_REALTIME);
+
+    using Clock = std::chrono::steady_clock;
+    bte_hci_reset(m_hci, statusCb);
+    auto start = Clock::now();
+    ASSERT_EQ(bte_handle_events(), 1);
+    /* The second event is not due yet */
+    ASSERT_EQ(bte_handle_events(), 0);
+    ASSERT_EQ(bte_wait_events(10), 0);
+    ASSERT_EQ(bte_wait_events(1000), 1);
+    ASSERT_GE(Clock::now() - start, std::chrono::milliseconds(50));
+    ASSERT_TRUE(bte_btsnoop_replay_finished());
+}
+
+TEST_F(TestBtsnoopReplay, testWaitingForTheHost) {
+    TraceWriter trace;
+    trace.add(false, 1000, { HCI_COMMAND_DATA_PACKET, 0x03, 0x0c, 0 });
+    trace.add(true, 2000, { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                            1, 0x03, 0x0c, 0 });
+    start(trace, 0);
+
+    /* Both while the trace waits for a command and once it's over, waiting
+     * for events must not return before the timeout */
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    ASSERT_EQ(bte_wait_events(30), 0);
+    ASSERT_GE(Clock::now() - start, std::chrono::milliseconds(30));
+
+    bte_hci_reset(m_hci, statusCb);
+    ASSERT_EQ(bte_handle_events(), 1);
+    ASSERT_TRUE(bte_btsnoop_replay_finished());
+    start = Clock::now();
+    ASSERT_EQ(bte_wait_events(30), 0);
+    ASSERT_GE(Clock::now() - start, std::chrono::milliseconds(30));
+
+    /* But the loop can still be stopped from another thread */
+    std::thread loop([]() { bte_hci_dev_run(bte_hci_dev_get_default()); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    bte_hci_dev_quit(bte_hci_dev_get_default());
+    loop.join();
+}
+
+TEST_F(TestBtsnoopReplay, testOversizedRecord) {
+    TraceWriter trace;
+    Bytes packet(0x10002, 0);
+    packet[0] = HCI_ACL_DATA_PACKET;
+    trace.add(true, 1000, packet);
+    start(trace, BTE_BTSNOOP_REPLAY_FLAG_IGNORE_COMMANDS);
+
+    /* The record is refused, rather than being delivered truncated */
+    s_numPdus = 0;
+    ASSERT_TRUE(bte_hci_on_acl_data(m_hci, 0x0000, countPdu));
+    ASSERT_EQ(bte_handle_events(), 0);
+    ASSERT_TRUE(bte_btsnoop_replay_finished());
+    ASSERT_EQ(s_numPdus, 0);
+}
@@ -0,0 +1,87 @@
+#include "bt-embedded/buffer.h"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <vector>
+
+TEST(Buffer, testPoolReuse) {
+    BteBuffer *b = bte_buffer_alloc_contiguous(10);
+    ASSERT_NE(b, nullptr);
+    ASSERT_EQ(b->ref_count, 1);
+    ASSERT_EQ(b->size, 10);
+    ASSERT_EQ(b->total_size, 10);
+    ASSERT_EQ(b->next, nullptr);
+    ASSERT_EQ(b->free_func, bte_buffer_free);
+    BteBuffer *old = b;
+    bte_buffer_unref(b);
+
+    /* The buffer returns to its pool and is handed out again */
+    b = bte_buffer_alloc_contiguous(BTE_BUFFER_POOL_SMALL_SIZE);
+    ASSERT_EQ(b, old);
+    bte_buffer_unref(b);
+
+    /* Larger sizes come from a different pool */
+    b = bte_buffer_alloc_contiguous(BTE_BUFFER_POOL_SMALL_SIZE + 1);
+    ASSERT_NE(b, old);
+    bte_buffer_unref(b);
+}
+
+TEST(Buffer, testExhaustedPool) {
+    const int count = BTE_BUFFER_POOL_SMALL_COUNT +
+        BTE_BUFFER_POOL_MEDIUM_COUNT + BTE_BUFFER_POOL_LARGE_COUNT + 4;
+    std::vector<BteBuffer *> buffers;
+    std::set<BteBuffer *> distinct;
+    for (int i = 0; i < count; i++) {
+        BteBuffer *b = bte_buffer_alloc_contiguous(8);
+        ASSERT_NE(b, nullptr);
+        memset(b->data, i, 8);
+        buffers.push_back(b);
+        distinct.insert(b);
+    }
+    ASSERT_EQ(distinct.size(), buffers.size());
+
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(buffers[i]->data[7], uint8_t(i));
+        bte_buffer_unref(buffers[i]);
+    }
+
+    /* Oversized buffers are always allocated from the heap */
+    BteBuffer *b = bte_buffer_alloc_contiguous(BTE_BUFFER_POOL_LARGE_SIZE + 1);
+    ASSERT_NE(b, nullptr);
+    ASSERT_EQ(b->size, BTE_BUFFER_POOL_LARGE_SIZE + 1);
+    bte_buffer_unref(b);
+}
+
+#ifdef BTE_BUFFER_SEGMENT_SIZE
+TEST(Buffer, testChainedAllocation) {
+    const uint16_t size = BTE_BUFFER_SEGMENT_SIZE * 2 + 10;
+    BteBuffer *b = bte_buffer_alloc(size);
+    ASSERT_NE(b, nullptr);
+    ASSERT_EQ(b->total_size, size);
+
+    std::vector<uint16_t> segmentSizes;
+    for (BteBuffer *s = b; s; s = s->next) segmentSizes.push_back(s->size);
+    std::vector<uint16_t> expectedSizes = {
+        BTE_BUFFER_SEGMENT_SIZE, BTE_BUFFER_SEGMENT_SIZE, 10,
+    };
+    ASSERT_EQ(segmentSizes, expectedSizes);
+
+    std::vector<uint8_t> data(size);
+    for (int i = 0; i < size; i++) data[i] = uint8_t(i);
+    BteBufferWriter writer;
+    bte_buffer_writer_init(&writer, b);
+    ASSERT_TRUE(bte_buffer_writer_write(&writer, data.data(), size));
+
+    std::vector<uint8_t> readData(size);
+    BteBufferReader reader;
+    bte_buffer_reader_init(&reader, b);
+    ASSERT_EQ(bte_buffer_reader_read(&reader, readData.data(), size), size);
+    ASSERT_EQ(readData, data);
+    bte_buffer_unref(b);
+
+    /* Smaller buffers are contiguous */
+    b = bte_buffer_alloc(BTE_BUFFER_SEGMENT_SIZE);
+    ASSERT_EQ(b->next, nullptr);
+    bte_buffer_unref(b);
+}
+#endif
@@ -0,0 +1,140 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/capture.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/internals.h"
+#include <gtest/gtest.h>
+
+struct CaptureRecord {
+    uint32_t origLen;
+    uint32_t flags;
+    uint32_t drops;
+    Buffer data;
+
+    bool operator==(const CaptureRecord &other) const {
+        return origLen == other.origLen && flags == other.flags &&
+            drops == other.drops && data == other.data;
+    }
+};
+
+static uint32_t readBe32(const uint8_t *ptr)
+{
+    return (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+static bool storeBytes(const void *data, size_t size, void *userdata)
+{
+    Buffer *stream = static_cast<Buffer *>(userdata);
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    stream->insert(stream->end(), bytes, bytes + size);
+    return true;
+}
+
+/* Parses a btsnoop stream */
+static std::vector<CaptureRecord> parseCapture(const Buffer &stream,
+                                               uint64_t *lastTimestamp)
+{
+    std::vector<CaptureRecord> records;
+    size_t pos = 16;
+    while (pos < stream.size()) {
+        const uint8_t *header = stream.data() + pos;
+        uint32_t inclLen = readBe32(header + 4);
+        *lastTimestamp = (uint64_t(readBe32(header + 16)) << 32) |
+            readBe32(header + 20);
+        records.push_back({
+            readBe32(header),
+            readBe32(header + 8),
+            readBe32(header + 12),
+            Buffer(header + 24, header + 24 + inclLen),
+        });
+        pos += 24 + inclLen;
+    }
+    return records;
+}
+
+class TestCapture: public testing::Test {
+protected:
+    void SetUp() override {
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        ASSERT_TRUE(bte_capture_start(storeBytes, &m_stream));
+    }
+
+    void TearDown() override {
+        bte_capture_stop();
+        bte_client_unref(m_client);
+    }
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+    Buffer m_stream;
+};
+
+TEST_F(TestCapture, testHeader) {
+    Buffer expectedHeader {
+        'b', 't', 's', 'n', 'o', 'o', 'p', 0,
+        0, 0, 0, 1, /* version */
+        0, 0, 0x03, 0xea, /* H4 */
+    };
+    ASSERT_EQ(m_stream, expectedHeader);
+    /* Only one capture at a time */
+    ASSERT_FALSE(bte_capture_start(storeBytes, &m_stream));
+}
+
+TEST_F(TestCapture, testTraffic) {
+    bte_hci_reset(m_hci, nullptr);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0 });
+    m_backend.sendData({ 0x01, 0x20, 2, 0, 0xaa, 0xbb });
+    bte_handle_events();
+    /* Nothing is written until the capture is flushed */
+    ASSERT_EQ(m_stream.size(), 16);
+
+    ASSERT_EQ(bte_capture_flush(), 3);
+    uint64_t timestamp = 0;
+    std::vector<CaptureRecord> expectedRecords = {
+        { 4, 2, 0, { HCI_COMMAND_DATA_PACKET, 0x03, 0x0c, 0 }},
+        { 7, 3, 0, { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                     1, 0x03, 0x0c, 0 }},
+        { 7, 1, 0, { HCI_ACL_DATA_PACKET, 0x01, 0x20, 2, 0, 0xaa, 0xbb }},
+    };
+    ASSERT_EQ(parseCapture(m_stream, &timestamp), expectedRecords);
+    /* Microseconds since year 0: anything after year 2000 will do */
+    ASSERT_GT(timestamp, 0x00e03ab44a676000ULL);
+}
+
+TEST_F(TestCapture, testTruncationAndDrops) {
+    Buffer payload;
+    payload.resize(BTE_CAPTURE_SNAP_LEN + 10);
+    for (int i = 0; i < BTE_CAPTURE_RING_SIZE + 2; i++) {
+        m_backend.sendData(Buffer{ 0x01, 0x20, uint8_t(payload.size()), 0 } +
+                           payload);
+    }
+    bte_handle_events();
+
+    ASSERT_EQ(bte_capture_flush(), BTE_CAPTURE_RING_SIZE);
+    uint64_t timestamp;
+    std::vector<CaptureRecord> records = parseCapture(m_stream, &timestamp);
+    ASSERT_EQ(records.size(), BTE_CAPTURE_RING_SIZE);
+    ASSERT_EQ(records[0].origLen, 1 + 4 + payload.size());
+    ASSERT_EQ(records[0].data.size(), 1 + BTE_CAPTURE_SNAP_LEN);
+    ASSERT_EQ(records.back().drops, 2);
+}
+
+TEST_F(TestCapture, testLeftoversAreDiscarded) {
+    bte_capture_stop();
+    /* As if another thread had still been capturing a packet while the
+     * capture was stopped */
+    Buffer packet { 0x01, 0x20, 2, 0, 0xaa, 0xbb };
+    BteBuffer *buffer = bte_buffer_alloc_contiguous(packet.size());
+    memcpy(buffer->data, packet.data(), packet.size());
+    _bte_capture_packet(HCI_ACL_DATA_PACKET, true, buffer);
+    bte_buffer_unref(buffer);
+
+    m_stream.clear();
+    ASSERT_TRUE(bte_capture_start(storeBytes, &m_stream));
+    ASSERT_EQ(bte_capture_flush(), 0);
+    ASSERT_EQ(m_stream.size(), 16);
+}
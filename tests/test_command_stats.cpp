@@ -0,0 +1,175 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/command_stats.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include <gtest/gtest.h>
+
+class TestCommandStats: public testing::Test {
+protected:
+    void SetUp() override {
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        bte_command_stats_reset();
+        bte_command_stats_enable(true);
+    }
+
+    void TearDown() override {
+        bte_command_stats_enable(false);
+        bte_command_stats_reset();
+        bte_client_unref(m_client);
+    }
+
+    static const BteCommandOpcodeStats *findOpcode(
+        const BteCommandStats &stats, uint16_t opcode) {
+        for (int i = 0; i < stats.num_opcodes; i++) {
+            if (stats.opcodes[i].opcode == opcode) return &stats.opcodes[i];
+        }
+        return nullptr;
+    }
+
+    static uint32_t histogramTotal(const BteCommandOpcodeStats &os) {
+        uint32_t total = 0;
+        for (uint32_t count: os.latency_histogram) total += count;
+        return total;
+    }
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+static void ignoreReadBdAddr(BteHci *, const BteHciReadBdAddrReply *, void *)
+{
+}
+
+static void ignoreReply(BteHci *, const BteHciReply *, void *)
+{
+}
+
+static void ignoreInquiryReply(BteHci *, const BteHciInquiryReply *, void *)
+{
+}
+
+static void ignoreVendorReply(BteHci *, BteBuffer *, void *)
+{
+}
+
+TEST_F(TestCommandStats, testCompleted) {
+    const uint16_t opcode = 0x1009; /* Read BD_ADDR */
+    bte_hci_read_bd_addr(m_hci, ignoreReadBdAddr);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 10, 1, 0x09, 0x10,
+                          0, 1, 2, 3, 4, 5, 6 });
+    bte_handle_events();
+
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    ASSERT_EQ(stats.num_opcodes, 1);
+    const BteCommandOpcodeStats *os = findOpcode(stats, opcode);
+    ASSERT_NE(os, nullptr);
+    EXPECT_EQ(os->num_sent, 1);
+    EXPECT_EQ(os->num_completed, 1);
+    EXPECT_EQ(os->num_rejected, 0);
+    EXPECT_EQ(os->num_orphaned, 0);
+    EXPECT_EQ(histogramTotal(*os), 1);
+    EXPECT_GE(os->total_latency_us, os->max_latency_us);
+}
+
+TEST_F(TestCommandStats, testCommandStatus) {
+    const uint16_t opcode = 0x0401; /* Inquiry */
+    bte_hci_inquiry(m_hci, BTE_LAP_GIAC, 4, 0, ignoreReply,
+                    ignoreInquiryReply);
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x01, 0x04 });
+    m_backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    const BteCommandOpcodeStats *os = findOpcode(stats, opcode);
+    ASSERT_NE(os, nullptr);
+    EXPECT_EQ(os->num_sent, 1);
+    EXPECT_EQ(os->num_completed, 1);
+}
+
+TEST_F(TestCommandStats, testRejectedAndOrphaned) {
+    const uint16_t opcode = 0x0c18; /* Write Page Timeout */
+    bte_hci_write_page_timeout(m_hci, 0x2000, ignoreReply);
+    /* The same command cannot be pending twice */
+    bte_hci_write_page_timeout(m_hci, 0x2000, ignoreReply);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    /* This one has no matching command */
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    /* The controller announcing its credits is not an orphaned reply */
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 3, 1, 0, 0 });
+    bte_handle_events();
+
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    ASSERT_EQ(stats.num_opcodes, 1);
+    const BteCommandOpcodeStats *os = findOpcode(stats, opcode);
+    ASSERT_NE(os, nullptr);
+    EXPECT_EQ(os->num_sent, 1);
+    EXPECT_EQ(os->num_completed, 1);
+    EXPECT_EQ(os->num_rejected, 1);
+    EXPECT_EQ(os->num_orphaned, 1);
+}
+
+TEST_F(TestCommandStats, testOnlyTransmittedCommandsAreSent) {
+    /* This one never gets a reply */
+    bte_hci_host_num_comp_packets(m_hci, 0x0001, 1);
+
+    /* This one waits in the queue for the controller to accept commands */
+    _bte_hci_dev.num_packets = 0;
+    bte_hci_write_page_timeout(m_hci, 0x2000, ignoreReply);
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, 0);
+
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 3, 1, 0, 0 });
+    bte_handle_events();
+    bte_command_stats_snapshot(&stats);
+    ASSERT_EQ(stats.num_opcodes, 1);
+    EXPECT_EQ(stats.opcodes[0].opcode, 0x0c18);
+    EXPECT_EQ(stats.opcodes[0].num_sent, 1);
+
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    bte_handle_events();
+}
+
+TEST_F(TestCommandStats, testDisabledAndReset) {
+    bte_command_stats_enable(false);
+    bte_hci_write_page_timeout(m_hci, 0x2000, ignoreReply);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    bte_handle_events();
+
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, 0);
+
+    bte_command_stats_enable(true);
+    bte_hci_write_page_timeout(m_hci, 0x2000, ignoreReply);
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, 1);
+
+    bte_command_stats_reset();
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, 0);
+    EXPECT_EQ(findOpcode(stats, 0x0c18), nullptr);
+}
+
+TEST_F(TestCommandStats, testTableFull) {
+    uint8_t data = 0;
+    for (int i = 0; i < BTE_COMMAND_STATS_MAX_OPCODES + 2; i++) {
+        bte_hci_vendor_command(m_hci, i, &data, 1, ignoreVendorReply);
+        m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1,
+                              uint8_t(i), 0xfc, 0 });
+        bte_handle_events();
+    }
+
+    BteCommandStats stats;
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, BTE_COMMAND_STATS_MAX_OPCODES);
+    EXPECT_GT(stats.num_untracked, 0);
+}
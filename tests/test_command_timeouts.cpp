@@ -0,0 +1,155 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+
+/* This test is built with a timer tick of 1 ms and a completion timeout of 50
+ * ms (see CMakeLists.txt) */
+class TestCommandTimeouts: public testing::Test {
+protected:
+    void SetUp() override {
+        s_statuses.clear();
+        s_connectionStatuses.clear();
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        bte_hci_set_command_timeout(m_hci, 5);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client);
+    }
+
+    static void sleepAndHandleEvents(int ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        bte_handle_events();
+    }
+
+    static void statusCb(BteHci *, const BteHciReply *reply, void *) {
+        s_statuses.push_back(reply->status);
+    }
+
+    static void connectionCb(BteHci *,
+                             const BteHciCreateConnectionReply *reply,
+                             void *) {
+        s_connectionStatuses.push_back(reply->status);
+    }
+
+    void createConnection() {
+        BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+        bte_hci_create_connection(m_hci, &address, BTE_PACKET_TYPE_DM1, 0,
+                                  BTE_HCI_CLOCK_OFFSET_INVALID, false,
+                                  statusCb, connectionCb);
+    }
+
+    static std::vector<uint8_t> s_statuses;
+    static std::vector<uint8_t> s_connectionStatuses;
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+std::vector<uint8_t> TestCommandTimeouts::s_statuses;
+std::vector<uint8_t> TestCommandTimeouts::s_connectionStatuses;
+
+TEST_F(TestCommandTimeouts, testCommandCompleteTimesOut) {
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    bte_handle_events();
+    ASSERT_TRUE(s_statuses.empty());
+
+    sleepAndHandleEvents(10);
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { HCI_HOST_TIMEOUT });
+
+    /* The timeout restored the credit: the next command is sent */
+    bte_hci_write_scan_enable(m_hci, 0, statusCb);
+    ASSERT_EQ(m_backend.sentCommands().size(), 2);
+
+    /* A late reply is ignored */
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses.size(), 1);
+}
+
+TEST_F(TestCommandTimeouts, testReplyInTime) {
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+
+    sleepAndHandleEvents(10);
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+}
+
+TEST_F(TestCommandTimeouts, testTimeoutDisabled) {
+    bte_hci_set_command_timeout(m_hci, 0);
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    sleepAndHandleEvents(10);
+    ASSERT_TRUE(s_statuses.empty());
+}
+
+TEST_F(TestCommandTimeouts, testSlotsAreReclaimed) {
+    /* All these commands have different opcodes */
+    BteHciDoneCb cb = statusCb;
+    bte_hci_write_page_timeout(m_hci, 0x2000, cb);
+    bte_hci_write_scan_enable(m_hci, 0, cb);
+    bte_hci_write_auth_enable(m_hci, 0, cb);
+    bte_hci_write_pin_type(m_hci, 0, cb);
+    bte_hci_write_inquiry_mode(m_hci, 0, cb);
+    bte_hci_write_page_scan_type(m_hci, 0, cb);
+    bte_hci_write_inquiry_scan_type(m_hci, 0, cb);
+    bte_hci_write_local_name(m_hci, "name", cb);
+    /* No more room */
+    bte_hci_reset(m_hci, cb);
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { HCI_MEMORY_FULL });
+
+    /* The controller never replies: each command times out after being
+     * sent, and gives its turn to the next one */
+    s_statuses.clear();
+    for (int i = 0; i < 100 && s_statuses.size() < 8; i++) {
+        sleepAndHandleEvents(5);
+    }
+    ASSERT_EQ(s_statuses, std::vector<uint8_t>(8, HCI_HOST_TIMEOUT));
+    ASSERT_EQ(m_backend.sentCommands().size(), 8);
+
+    /* The device is still usable */
+    s_statuses.clear();
+    bte_hci_reset(m_hci, cb);
+    ASSERT_EQ(m_backend.sentCommands().size(), 9);
+    EXPECT_EQ(m_backend.lastCommand(), Buffer({ 0x03, 0x0c, 0 }));
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+}
+
+TEST_F(TestCommandTimeouts, testCommandStatusTimesOut) {
+    createConnection();
+    sleepAndHandleEvents(10);
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { HCI_HOST_TIMEOUT });
+    ASSERT_TRUE(s_connectionStatuses.empty());
+}
+
+TEST_F(TestCommandTimeouts, testCompletionEventTimesOut) {
+    createConnection();
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x05, 0x04 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+
+    /* The command timeout does not apply here */
+    sleepAndHandleEvents(10);
+    ASSERT_TRUE(s_connectionStatuses.empty());
+
+    sleepAndHandleEvents(50);
+    ASSERT_EQ(s_connectionStatuses, std::vector<uint8_t> { HCI_HOST_TIMEOUT });
+}
+
+TEST_F(TestCommandTimeouts, testWaitIsShortened) {
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    /* Timeouts are also checked when waiting for events */
+    bte_wait_events(0);
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { HCI_HOST_TIMEOUT });
+}
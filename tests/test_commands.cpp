@@ -366,6 +366,249 @@ TEST(Commands, Inquiry) {
     };
 }
 
+static std::vector<BteHciInquiryResponse> s_streamedResponses;
+static std::vector<std::string> s_streamedNames;
+
+static void storeInquiryResult(BteHci *, const BteHciInquiryResponse *response,
+                               const BteHciEir *eir, void *)
+{
+    s_streamedResponses.push_back(*response);
+    BteHciEirField field;
+    if (eir && bte_hci_eir_find(eir, BTE_HCI_EIR_NAME_COMPLETE, &field)) {
+        s_streamedNames.emplace_back((const char *)field.data, field.len);
+    } else {
+        s_streamedNames.emplace_back();
+    }
+}
+
+TEST(Commands, InquiryStreaming) {
+    s_streamedResponses.clear();
+    s_streamedNames.clear();
+    AsyncCommandInvoker<StoredInquiryReply, BteHciInquiryReply> invoker(
+        [&](BteHci *hci, BteHciDoneCb statusCb, BteHciInquiryCb replyCb) {
+            bte_hci_on_inquiry_result(hci, storeInquiryResult);
+            bte_hci_inquiry(hci, BTE_LAP_GIAC, 4, 0, statusCb, replyCb);
+        },
+        {HCI_COMMAND_STATUS, 4, 0, 1, 0x1, 0x4});
+
+    MockBackend &backend = invoker.backend();
+    BteBdAddr address0{ 1, 2, 3, 4, 5, 6 };
+    BteBdAddr address1{ 1, 2, 3, 4, 5, 7 };
+    /* Two responses in the same event */
+    backend.sendEvent({
+        HCI_INQUIRY_RESULT, 29, 2,
+        1, 2, 3, 4, 5, 6,  1, 2, 3, 4, 5, 7,
+        1, 2, // scan rep
+        0, 0, // scan period
+        0, 0, // reserved
+        0x04, 0x25, 0x00,  0x08, 0x05, 0x00, // device class
+        0x34, 0x12,  0x78, 0x56, // clock offset
+    });
+    bte_handle_events();
+
+    /* The devices are reported before the inquiry completes */
+    ASSERT_EQ(invoker.replyCount(), 0);
+    ASSERT_EQ(s_streamedResponses.size(), 2);
+    EXPECT_EQ(s_streamedResponses[0].address, address0);
+    EXPECT_EQ(s_streamedResponses[0].page_scan_rep_mode, 1);
+    EXPECT_EQ(s_streamedResponses[0].clock_offset, 0x1234);
+    EXPECT_EQ(s_streamedResponses[1].address, address1);
+    EXPECT_EQ(s_streamedResponses[1].page_scan_rep_mode, 2);
+    EXPECT_EQ(s_streamedResponses[1].class_of_device.bytes[0], 0x08);
+    EXPECT_EQ(s_streamedResponses[1].clock_offset, 0x5678);
+
+    /* The same device again, with a different clock offset */
+    Buffer again = createInquiryResult(address1);
+    again[again.size() - 2] = 0x99;
+    backend.sendEvent(again);
+    backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_streamedResponses.size(), 2);
+
+    ASSERT_EQ(invoker.replyCount(), 1);
+    const StoredInquiryReply &reply = invoker.receivedReply();
+    ASSERT_EQ(reply.status, 0);
+    ASSERT_EQ(reply.num_responses, 0);
+}
+
+TEST(Commands, InquiryDuplicates) {
+    AsyncCommandInvoker<StoredInquiryReply, BteHciInquiryReply> invoker(
+        [&](BteHci *hci, BteHciDoneCb statusCb, BteHciInquiryCb replyCb) {
+            bte_hci_inquiry(hci, BTE_LAP_GIAC, 4, 0, statusCb, replyCb);
+        },
+        {HCI_COMMAND_STATUS, 4, 0, 1, 0x1, 0x4});
+
+    /* Enough devices to make the table of seen devices grow a few times,
+     * each of them seen twice with a different clock offset */
+    MockBackend &backend = invoker.backend();
+    std::vector<BteBdAddr> addresses;
+    for (int i = 0; i < 200; i++) {
+        addresses.emplace_back(BteBdAddr{ uint8_t(i), 0, 0, 0x1a, 0x7d, 0xda });
+    };
+    for (int round = 0; round < 2; round++) {
+        for (const BteBdAddr &address: addresses) {
+            Buffer event = createInquiryResult(address);
+            event[event.size() - 2] = round;
+            backend.sendEvent(event);
+        }
+        bte_handle_events();
+    }
+
+    backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    ASSERT_EQ(invoker.replyCount(), 1);
+    const StoredInquiryReply &reply = invoker.receivedReply();
+    ASSERT_EQ(reply.num_responses, addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++) {
+        ASSERT_EQ(reply.responses[i].address, addresses[i]);
+        /* The responses have been updated with the latest data */
+        ASSERT_EQ(reply.responses[i].clock_offset & 0xff, 1);
+    };
+}
+
+TEST(Commands, InquiryWithRssi) {
+    AsyncCommandInvoker<StoredInquiryReply, BteHciInquiryReply> invoker(
+        [&](BteHci *hci, BteHciDoneCb statusCb, BteHciInquiryCb replyCb) {
+            bte_hci_inquiry(hci, BTE_LAP_GIAC, 4, 0, statusCb, replyCb);
+        },
+        {HCI_COMMAND_STATUS, 4, 0, 1, 0x1, 0x4});
+
+    MockBackend &backend = invoker.backend();
+    backend.sendEvent({
+        HCI_INQUIRY_RESULT_WITH_RSSI, 29, 2,
+        1, 2, 3, 4, 5, 6,  1, 2, 3, 4, 5, 7,
+        1, 2, // scan rep
+        0, 0, // reserved
+        0x04, 0x25, 0x00,  0x08, 0x05, 0x00, // device class
+        0x34, 0x12,  0x78, 0x56, // clock offset
+        0xc4, 0xe2, // RSSI
+    });
+    backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    ASSERT_EQ(invoker.replyCount(), 1);
+    const StoredInquiryReply &reply = invoker.receivedReply();
+    ASSERT_EQ(reply.num_responses, 2);
+    BteBdAddr address0{ 1, 2, 3, 4, 5, 6 };
+    EXPECT_EQ(reply.responses[0].address, address0);
+    EXPECT_EQ(reply.responses[0].page_scan_rep_mode, 1);
+    EXPECT_EQ(reply.responses[0].class_of_device.bytes[1], 0x25);
+    EXPECT_EQ(reply.responses[0].clock_offset, 0x1234);
+    EXPECT_EQ(reply.responses[0].rssi, -60);
+    EXPECT_EQ(reply.responses[1].page_scan_rep_mode, 2);
+    EXPECT_EQ(reply.responses[1].clock_offset, 0x5678);
+    EXPECT_EQ(reply.responses[1].rssi, -30);
+}
+
+static Buffer createExtendedInquiryResult(const BteBdAddr &address,
+                                          int8_t rssi, const Buffer &eir)
+{
+    const uint8_t *b = address.bytes;
+    Buffer event {
+        HCI_EXTENDED_INQUIRY_RESULT,
+        255, // len
+        1, // num responses
+        b[0], b[1], b[2], b[3], b[4], b[5],
+        1, // scan rep
+        0, // reserved
+        0x08, 0x05, 0x00, // device class
+        0x34, 0x12, // clock offset
+        uint8_t(rssi),
+    };
+    event.insert(event.end(), eir.begin(), eir.end());
+    event.resize(2 + 255);
+    return event;
+}
+
+TEST(Commands, InquiryExtendedStreaming) {
+    s_streamedResponses.clear();
+    s_streamedNames.clear();
+    AsyncCommandInvoker<StoredInquiryReply, BteHciInquiryReply> invoker(
+        [&](BteHci *hci, BteHciDoneCb statusCb, BteHciInquiryCb replyCb) {
+            bte_hci_on_inquiry_result(hci, storeInquiryResult);
+            bte_hci_inquiry(hci, BTE_LAP_GIAC, 4, 0, statusCb, replyCb);
+        },
+        {HCI_COMMAND_STATUS, 4, 0, 1, 0x1, 0x4});
+
+    MockBackend &backend = invoker.backend();
+    BteBdAddr address{ 1, 2, 3, 4, 5, 6 };
+    Buffer eir {
+        2, BTE_HCI_EIR_FLAGS, 0x06,
+        5, BTE_HCI_EIR_NAME_COMPLETE, 'P', 'a', 'd', '1',
+    };
+    backend.sendEvent(createExtendedInquiryResult(address, -42, eir));
+    /* The same device again is not reported */
+    backend.sendEvent(createExtendedInquiryResult(address, -40, eir));
+    backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    ASSERT_EQ(s_streamedResponses.size(), 1);
+    EXPECT_EQ(s_streamedResponses[0].address, address);
+    EXPECT_EQ(s_streamedResponses[0].page_scan_rep_mode, 1);
+    EXPECT_EQ(s_streamedResponses[0].clock_offset, 0x1234);
+    EXPECT_EQ(s_streamedResponses[0].rssi, -42);
+    EXPECT_EQ(s_streamedNames[0], "Pad1");
+    ASSERT_EQ(invoker.replyCount(), 1);
+}
+
+TEST(Commands, InquiryExtendedBuffered) {
+    AsyncCommandInvoker<StoredInquiryReply, BteHciInquiryReply> invoker(
+        [&](BteHci *hci, BteHciDoneCb statusCb, BteHciInquiryCb replyCb) {
+            bte_hci_inquiry(hci, BTE_LAP_GIAC, 4, 0, statusCb, replyCb);
+        },
+        {HCI_COMMAND_STATUS, 4, 0, 1, 0x1, 0x4});
+
+    MockBackend &backend = invoker.backend();
+    BteBdAddr address{ 1, 2, 3, 4, 5, 6 };
+    backend.sendEvent(createExtendedInquiryResult(address, -42, {}));
+    backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    ASSERT_EQ(invoker.replyCount(), 1);
+    const StoredInquiryReply &reply = invoker.receivedReply();
+    ASSERT_EQ(reply.num_responses, 1);
+    EXPECT_EQ(reply.responses[0].address, address);
+    EXPECT_EQ(reply.responses[0].rssi, -42);
+}
+
+TEST(Commands, EirIterator) {
+    const uint8_t data[] = {
+        2, BTE_HCI_EIR_FLAGS, 0x06,
+        1, BTE_HCI_EIR_NAME_COMPLETE, // empty name
+        3, BTE_HCI_EIR_UUID16_COMPLETE, 0x24, 0x11,
+        0, 0xaa, 0xbb, // padding
+    };
+    BteHciEir eir = { data, sizeof(data) };
+
+    std::vector<std::pair<uint8_t, Buffer>> fields;
+    BteHciEirIter iter;
+    BteHciEirField field;
+    bte_hci_eir_iter_init(&iter, &eir);
+    while (bte_hci_eir_iter_next(&iter, &field)) {
+        fields.emplace_back(field.type,
+                            Buffer(field.data, field.data + field.len));
+    }
+    std::vector<std::pair<uint8_t, Buffer>> expectedFields = {
+        { BTE_HCI_EIR_FLAGS, { 0x06 }},
+        { BTE_HCI_EIR_NAME_COMPLETE, {}},
+        { BTE_HCI_EIR_UUID16_COMPLETE, { 0x24, 0x11 }},
+    };
+    ASSERT_EQ(fields, expectedFields);
+    /* Pointers into the original data */
+    ASSERT_TRUE(bte_hci_eir_find(&eir, BTE_HCI_EIR_UUID16_COMPLETE, &field));
+    ASSERT_EQ(field.data, data + 7);
+    ASSERT_FALSE(bte_hci_eir_find(&eir, BTE_HCI_EIR_TX_POWER_LEVEL, &field));
+
+    /* A structure overflowing the data ends the iteration */
+    const uint8_t truncated[] = { 2, BTE_HCI_EIR_FLAGS, 0x06, 4, 0x09, 'a' };
+    eir = { truncated, sizeof(truncated) };
+    int count = 0;
+    bte_hci_eir_iter_init(&iter, &eir);
+    while (bte_hci_eir_iter_next(&iter, &field)) count++;
+    ASSERT_EQ(count, 1);
+}
+
 TEST(Commands, InquiryFailed) {
     uint32_t requestedLap = 0xaabbcc;
     uint8_t requestedLen = 4;
@@ -527,7 +770,7 @@ TEST(Commands, testCreateConnection) {
     expectedCommand = {0x5, 0x4, cmdSize};
     expectedCommand += address1;
     expectedCommand += Buffer{
-        0x10, 0x40, page_scan_rep_mode1, 0x00, 0x22, 0x11, allow_role_switch1};
+        0x10, 0x40, page_scan_rep_mode1, 0x00, 0x22, 0x91, allow_role_switch1};
     ASSERT_EQ(backend.lastCommand(), expectedCommand);
 
     /* Send the status reply for this second command */
@@ -1553,3 +1796,202 @@ TEST(Commands, testVendorCommand) {
     ASSERT_EQ(doneCalls, expectedDoneCalls);
 }
 
+
+TEST(CommandQueue, testCommandsWaitForCredits) {
+    MockBackend backend;
+    BteClient *client = bte_client_new();
+    BteHci *hci = bte_hci_get(client);
+
+    static std::vector<uint8_t> statuses;
+    statuses.clear();
+    struct Callbacks {
+        static void done(BteHci *, const BteHciReply *reply, void *) {
+            statuses.push_back(reply->status);
+        }
+    };
+
+    /* The controller initially accepts a single command */
+    bte_hci_reset(hci, Callbacks::done);
+    bte_hci_write_pin_type(hci, BTE_HCI_PIN_TYPE_FIXED, Callbacks::done);
+    bte_hci_set_event_mask(hci, 0, Callbacks::done);
+    std::vector<Buffer> expectedCommands = {
+        {0x03, 0x0c, 0},
+    };
+    ASSERT_EQ(backend.sentCommands(), expectedCommands);
+
+    BteHciCommandQueueStats stats;
+    bte_hci_get_command_queue_stats(hci, &stats);
+    ASSERT_EQ(stats.depth, 2);
+    ASSERT_EQ(stats.max_depth, 2);
+    ASSERT_EQ(stats.num_queued, 2);
+
+    /* This one does not need to wait */
+    bte_hci_host_num_comp_packets(hci, 0x0102, 3);
+    expectedCommands.push_back({0x35, 0x0c, 5, 1, 0x02, 0x01, 3, 0});
+    ASSERT_EQ(backend.sentCommands(), expectedCommands);
+
+    /* The reply to the reset gives room for two more commands */
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 2, 0x03, 0x0c, 0 });
+    bte_handle_events();
+    expectedCommands.push_back({0x0a, 0x0c, 1, BTE_HCI_PIN_TYPE_FIXED});
+    expectedCommands.push_back({0x01, 0x0c, 8, 0, 0, 0, 0, 0, 0, 0, 0});
+    ASSERT_EQ(backend.sentCommands(), expectedCommands);
+
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x0a, 0x0c, 0 });
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x01, 0x0c, 0 });
+    bte_handle_events();
+    std::vector<uint8_t> expectedStatuses = { 0, 0, 0 };
+    ASSERT_EQ(statuses, expectedStatuses);
+
+    bte_hci_get_command_queue_stats(hci, &stats);
+    ASSERT_EQ(stats.depth, 0);
+    ASSERT_EQ(stats.max_depth, 2);
+    ASSERT_EQ(stats.num_queued, 2);
+    ASSERT_EQ(stats.num_dropped, 0);
+    ASSERT_GE(stats.total_wait_us, stats.max_wait_us);
+
+    bte_client_unref(client);
+}
+
+TEST(CommandQueue, testSendFailure) {
+    MockBackend backend;
+    BteClient *client = bte_client_new();
+    BteHci *hci = bte_hci_get(client);
+
+    static std::vector<uint8_t> statuses;
+    statuses.clear();
+    struct Callbacks {
+        static void done(BteHci *, const BteHciReply *reply, void *) {
+            statuses.push_back(reply->status);
+        }
+    };
+
+    bte_hci_reset(hci, Callbacks::done);
+    bte_hci_write_pin_type(hci, BTE_HCI_PIN_TYPE_FIXED, Callbacks::done);
+    bte_hci_set_event_mask(hci, 0, Callbacks::done);
+
+    /* The first queued command cannot be sent: it fails at once, without
+     * taking the credit which the next one needs */
+    backend.onSendCommand([](BteBuffer *buffer) {
+        return buffer->data[0] == 0x0a ? -EIO : 0;
+    });
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0 });
+    bte_handle_events();
+    std::vector<Buffer> expectedCommands = {
+        {0x03, 0x0c, 0},
+        {0x0a, 0x0c, 1, BTE_HCI_PIN_TYPE_FIXED},
+        {0x01, 0x0c, 8, 0, 0, 0, 0, 0, 0, 0, 0},
+    };
+    ASSERT_EQ(backend.sentCommands(), expectedCommands);
+    /* The credit is taken before the reply is delivered */
+    std::vector<uint8_t> expectedStatuses = { HCI_HW_FAILURE, 0 };
+    ASSERT_EQ(statuses, expectedStatuses);
+
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x01, 0x0c, 0 });
+    bte_handle_events();
+    expectedStatuses.push_back(0);
+    ASSERT_EQ(statuses, expectedStatuses);
+
+    /* The slot of the failed command has been released */
+    backend.onSendCommand(nullptr);
+    bte_hci_write_pin_type(hci, BTE_HCI_PIN_TYPE_FIXED, Callbacks::done);
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x0a, 0x0c, 0 });
+    bte_handle_events();
+    expectedStatuses.push_back(0);
+    ASSERT_EQ(statuses, expectedStatuses);
+
+    bte_client_unref(client);
+}
+
+TEST(CommandQueue, testControllerBusy) {
+    MockBackend backend;
+    BteClient *client = bte_client_new();
+    BteHci *hci = bte_hci_get(client);
+
+    static int doneCount;
+    doneCount = 0;
+    struct Callbacks {
+        static void done(BteHci *, const BteHciReply *, void *) {
+            doneCount++;
+        }
+    };
+
+    bte_hci_reset(hci, Callbacks::done);
+    /* The controller replies, but can't take more commands at the moment */
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 0, 0x03, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(doneCount, 1);
+
+    bte_hci_write_pin_type(hci, BTE_HCI_PIN_TYPE_FIXED, Callbacks::done);
+    ASSERT_EQ(backend.sentCommands().size(), 1);
+
+    /* A NOP command complete event signals that commands are accepted */
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 3, 1, 0x00, 0x00 });
+    bte_handle_events();
+    ASSERT_EQ(backend.sentCommands().size(), 2);
+    ASSERT_EQ(backend.lastCommand(),
+              Buffer({0x0a, 0x0c, 1, BTE_HCI_PIN_TYPE_FIXED}));
+
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x0a, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(doneCount, 2);
+
+    bte_client_unref(client);
+}
+
+TEST(PendingCommands, testOutOfOrderReplies) {
+    MockBackend backend;
+    BteClient *client = bte_client_new();
+    BteHci *hci = bte_hci_get(client);
+
+    static std::vector<uint16_t> replies;
+    replies.clear();
+    struct Callbacks {
+        static void done(BteHci *, BteBuffer *buffer, void *) {
+            replies.push_back(buffer->data[3] | (buffer->data[4] << 8));
+        }
+        static void statusCb(BteHci *, const BteHciReply *reply, void *) {
+            replies.push_back(reply->status);
+        }
+    };
+
+    const int numCommands = BTE_HCI_MAX_PENDING_COMMANDS - 1;
+    for (int i = 0; i < numCommands; i++) {
+        uint8_t data = i;
+        bte_hci_vendor_command(hci, 0x100 + i, &data, 1, Callbacks::done);
+    }
+    ASSERT_EQ(_bte_hci_dev.num_pending_commands, numCommands);
+
+    /* Identical commands cannot be told apart, the second is refused */
+    bte_hci_reset(hci, Callbacks::statusCb);
+    bte_hci_reset(hci, Callbacks::statusCb);
+    ASSERT_EQ(replies, std::vector<uint16_t> { HCI_MEMORY_FULL });
+    replies.clear();
+
+    /* And now we are full */
+    bte_hci_nop(hci, Callbacks::statusCb);
+    ASSERT_EQ(replies, std::vector<uint16_t> { HCI_MEMORY_FULL });
+    replies.clear();
+
+    std::vector<uint16_t> expectedReplies;
+    for (int i = numCommands - 1; i >= 0; i--) {
+        uint16_t opcode = (0x100 + i) | (HCI_VENDOR_OGF << 10);
+        backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1,
+                            uint8_t(opcode & 0xff), uint8_t(opcode >> 8), 0 });
+        expectedReplies.push_back(opcode);
+    }
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0 });
+    expectedReplies.push_back(0);
+    bte_handle_events();
+    ASSERT_EQ(replies, expectedReplies);
+    ASSERT_EQ(_bte_hci_dev.num_pending_commands, 0);
+
+    /* The freed slots can be reused */
+    replies.clear();
+    bte_hci_reset(hci, Callbacks::statusCb);
+    backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0x12 });
+    bte_handle_events();
+    ASSERT_EQ(replies, std::vector<uint16_t> { 0x12 });
+
+    bte_client_unref(client);
+}
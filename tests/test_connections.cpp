@@ -0,0 +1,193 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+#include <gtest/gtest.h>
+
+static std::vector<BteHciDisconnectionCompleteReply> s_disconnections;
+
+static void storeDisconnection(BteHci *hci,
+                               const BteHciDisconnectionCompleteReply *reply,
+                               void *userdata)
+{
+    s_disconnections.push_back(*reply);
+}
+
+class TestConnections: public testing::Test {
+protected:
+    void SetUp() override {
+        s_disconnections.clear();
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client);
+    }
+
+    void connectionComplete(uint8_t status, BteHciConnHandle conn_handle,
+                            const BteBdAddr &address) {
+        const uint8_t *a = address.bytes;
+        m_backend.sendEvent({
+            HCI_CONNECTION_COMPLETE, 11, status,
+            uint8_t(conn_handle & 0xff), uint8_t(conn_handle >> 8),
+            a[0], a[1], a[2], a[3], a[4], a[5],
+            BTE_HCI_LINK_TYPE_ACL, 0,
+        });
+        bte_handle_events();
+    }
+
+    void disconnectionComplete(BteHciConnHandle conn_handle) {
+        m_backend.sendEvent({
+            HCI_DISCONNECTION_COMPLETE, 4, 0,
+            uint8_t(conn_handle & 0xff), uint8_t(conn_handle >> 8),
+            HCI_OTHER_END_TERMINATED_CONN_USER_ENDED,
+        });
+        bte_handle_events();
+    }
+
+    static void ignoreReply(BteHci *, const BteHciReply *, void *) {}
+    static void ignoreConnection(BteHci *,
+                                 const BteHciCreateConnectionReply *,
+                                 void *) {}
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+TEST_F(TestConnections, testIncomingConnection) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    connectionComplete(0, 0x0042, address);
+
+    BteHciConnectionInfo info;
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci, 0x0042, &info));
+    EXPECT_EQ(info.state, BTE_HCI_CONN_STATE_CONNECTED);
+    EXPECT_EQ(info.role, BTE_HCI_ROLE_SLAVE);
+    EXPECT_EQ(info.mode, BTE_HCI_MODE_ACTIVE);
+    EXPECT_EQ(info.conn_handle, 0x0042);
+    EXPECT_EQ(memcmp(&info.address, &address, sizeof(address)), 0);
+
+    BteHciConnectionInfo byAddress;
+    ASSERT_TRUE(bte_hci_get_connection_by_address(m_hci, &address,
+                                                  &byAddress));
+    EXPECT_EQ(byAddress.conn_handle, 0x0042);
+
+    BteBdAddr unknown = {{ 6, 5, 4, 3, 2, 1 }};
+    EXPECT_FALSE(bte_hci_get_connection_by_address(m_hci, &unknown, &info));
+    EXPECT_FALSE(bte_hci_get_connection_info(m_hci, 0x0043, &info));
+
+    disconnectionComplete(0x0042);
+}
+
+TEST_F(TestConnections, testOutgoingConnection) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    bte_hci_create_connection(m_hci, &address, BTE_PACKET_TYPE_DM1, 0, 0,
+                              false, ignoreReply, ignoreConnection);
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x05, 0x04 });
+    bte_handle_events();
+
+    BteHciConnectionInfo info;
+    ASSERT_TRUE(bte_hci_get_connection_by_address(m_hci, &address, &info));
+    EXPECT_EQ(info.state, BTE_HCI_CONN_STATE_CONNECTING);
+    EXPECT_EQ(info.role, BTE_HCI_ROLE_MASTER);
+
+    connectionComplete(0, 0x0007, address);
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci, 0x0007, &info));
+    EXPECT_EQ(info.state, BTE_HCI_CONN_STATE_CONNECTED);
+    EXPECT_EQ(info.role, BTE_HCI_ROLE_MASTER);
+
+    disconnectionComplete(0x0007);
+}
+
+TEST_F(TestConnections, testFailedConnection) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    bte_hci_create_connection(m_hci, &address, BTE_PACKET_TYPE_DM1, 0, 0,
+                              false, ignoreReply, ignoreConnection);
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x05, 0x04 });
+    bte_handle_events();
+
+    connectionComplete(HCI_PAGE_TIMEOUT, 0, address);
+    BteHciConnectionInfo info;
+    EXPECT_FALSE(bte_hci_get_connection_by_address(m_hci, &address, &info));
+}
+
+TEST_F(TestConnections, testRoleAndModeChanges) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    connectionComplete(0, 0x0042, address);
+
+    m_backend.sendEvent({
+        HCI_ROLE_CHANGE, 8, 0, 1, 2, 3, 4, 5, 6, BTE_HCI_ROLE_MASTER,
+    });
+    m_backend.sendEvent({
+        HCI_MODE_CHANGE, 6, 0, 0x42, 0x00, BTE_HCI_MODE_SNIFF, 0x20, 0x00,
+    });
+    bte_handle_events();
+
+    BteHciConnectionInfo info;
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci, 0x0042, &info));
+    EXPECT_EQ(info.role, BTE_HCI_ROLE_MASTER);
+    EXPECT_EQ(info.mode, BTE_HCI_MODE_SNIFF);
+
+    disconnectionComplete(0x0042);
+}
+
+TEST_F(TestConnections, testDisconnection) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    connectionComplete(0, 0x0042, address);
+    bte_hci_on_disconnection(m_hci, storeDisconnection);
+
+    /* Queue a PDU which cannot be sent yet */
+    _bte_hci_dev.acl_mtu = 4;
+    _bte_hci_dev.acl_max_packets = 1;
+    _bte_hci_dev.acl_in_flight = 0;
+    Buffer pdu{6, 0, 0x40, 0, 1, 2, 3, 4, 5, 6};
+    BteBuffer *b = pdu.toBuffer();
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0042, b), 0);
+    ASSERT_EQ(_bte_hci_dev.acl_in_flight, 1);
+    ASSERT_EQ(b->ref_count, 2);
+
+    disconnectionComplete(0x0042);
+
+    /* The queue was dropped and the in-flight packet credited back */
+    EXPECT_EQ(b->ref_count, 1);
+    EXPECT_EQ(_bte_hci_dev.acl_in_flight, 0);
+    bte_buffer_unref(b);
+
+    BteHciConnectionInfo info;
+    EXPECT_FALSE(bte_hci_get_connection_info(m_hci, 0x0042, &info));
+    EXPECT_FALSE(bte_hci_get_connection_by_address(m_hci, &address, &info));
+    ASSERT_EQ(s_disconnections.size(), 1);
+    EXPECT_EQ(s_disconnections[0].status, 0);
+    EXPECT_EQ(s_disconnections[0].conn_handle, 0x0042);
+    EXPECT_EQ(s_disconnections[0].reason,
+              HCI_OTHER_END_TERMINATED_CONN_USER_ENDED);
+}
+
+TEST_F(TestConnections, testCounters) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    connectionComplete(0, 0x0001, address);
+    _bte_hci_dev.acl_mtu = 8;
+    _bte_hci_dev.acl_max_packets = 8;
+    _bte_hci_dev.acl_in_flight = 0;
+
+    Buffer pdu{6, 0, 0x40, 0, 1, 2, 3, 4, 5, 6};
+    BteBuffer *b = pdu.toBuffer();
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci, 0x0001, b), 0);
+    bte_buffer_unref(b);
+
+    m_backend.sendData({ 0x01, 0x20, 3, 0, 1, 2, 3 });
+    bte_handle_events();
+
+    BteHciConnectionInfo info;
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci, 0x0001, &info));
+    EXPECT_EQ(info.tx_packets, 2);
+    EXPECT_EQ(info.tx_bytes, pdu.size());
+    EXPECT_EQ(info.rx_packets, 1);
+    EXPECT_EQ(info.rx_bytes, 3);
+
+    disconnectionComplete(0x0001);
+}
@@ -0,0 +1,140 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include <gtest/gtest.h>
+
+class TestDeviceCache: public testing::Test {
+protected:
+    void SetUp() override {
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        bte_hci_clear_device_cache(m_hci);
+    }
+
+    void TearDown() override {
+        bte_hci_clear_device_cache(m_hci);
+        bte_client_unref(m_client);
+    }
+
+    /* Issues a Create Connection through the cache, and returns the paging
+     * parameters found in the command */
+    Buffer connect(const BteBdAddr &address) {
+        bte_hci_connect(m_hci, &address, BTE_PACKET_TYPE_DM1, false,
+                        ignoreReply, ignoreConnection);
+        Buffer command = m_backend.lastCommand();
+        /* Let the command fail, to release it */
+        m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, HCI_PAGE_TIMEOUT,
+                              1, 0x05, 0x04 });
+        bte_handle_events();
+        /* Skip the header, the address and the packet type */
+        return Buffer(command.begin() + 3 + 6 + 2, command.begin() + 3 + 6 + 6);
+    }
+
+    static void ignoreReply(BteHci *, const BteHciReply *, void *) {}
+    static void ignoreConnection(BteHci *,
+                                 const BteHciCreateConnectionReply *,
+                                 void *) {}
+    static void ignoreInquiryReply(BteHci *, const BteHciInquiryReply *,
+                                   void *) {}
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+TEST_F(TestDeviceCache, testUnknownDevice) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    uint8_t mode;
+    uint16_t clock_offset;
+    ASSERT_FALSE(bte_hci_get_cached_paging_params(m_hci, &address, &mode,
+                                                  &clock_offset));
+    /* R2, reserved byte, no clock offset */
+    ASSERT_EQ(connect(address), Buffer({ 2, 0, 0, 0 }));
+}
+
+TEST_F(TestDeviceCache, testFromInquiry) {
+    bte_hci_inquiry(m_hci, BTE_LAP_GIAC, 4, 0, ignoreReply,
+                    ignoreInquiryReply);
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x01, 0x04 });
+    m_backend.sendEvent({
+        HCI_INQUIRY_RESULT, 15, 1,
+        1, 2, 3, 4, 5, 6,
+        1, // scan rep
+        0, 0, // scan period, reserved
+        0x04, 0x25, 0x00, // device class
+        0x34, 0x12, // clock offset
+    });
+    m_backend.sendEvent({ HCI_INQUIRY_COMPLETE, 1, 0 });
+    bte_handle_events();
+
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    uint8_t mode;
+    uint16_t clock_offset;
+    ASSERT_TRUE(bte_hci_get_cached_paging_params(m_hci, &address, &mode,
+                                                 &clock_offset));
+    EXPECT_EQ(mode, BTE_HCI_PAGE_SCAN_REP_MODE_R1);
+    EXPECT_EQ(clock_offset, 0x1234);
+
+    /* The offset is flagged as valid */
+    ASSERT_EQ(connect(address), Buffer({ 1, 0, 0x34, 0x92 }));
+}
+
+TEST_F(TestDeviceCache, testFromConnectionEvents) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    m_backend.sendEvent({ HCI_CONNECTION_COMPLETE, 11, 0, 0x42, 0x00,
+                          1, 2, 3, 4, 5, 6, 1, 0 });
+    m_backend.sendEvent({ HCI_PSCAN_REP_MODE_CHANGE, 7,
+                          1, 2, 3, 4, 5, 6, 0 });
+    /* Matched to the device through the connection handle */
+    m_backend.sendEvent({ HCI_READ_CLOCK_OFFSET_COMPLETE, 5, 0, 0x42, 0x00,
+                          0x21, 0x43 });
+    bte_handle_events();
+
+    uint8_t mode;
+    uint16_t clock_offset;
+    ASSERT_TRUE(bte_hci_get_cached_paging_params(m_hci, &address, &mode,
+                                                 &clock_offset));
+    EXPECT_EQ(mode, BTE_HCI_PAGE_SCAN_REP_MODE_R0);
+    EXPECT_EQ(clock_offset, 0x4321);
+
+    /* Once disconnected, the handle no longer refers to the device */
+    m_backend.sendEvent({ HCI_DISCONNECTION_COMPLETE, 4, 0, 0x42, 0x00,
+                          0x13 });
+    m_backend.sendEvent({ HCI_READ_CLOCK_OFFSET_COMPLETE, 5, 0, 0x42, 0x00,
+                          0x00, 0x10 });
+    bte_handle_events();
+    ASSERT_TRUE(bte_hci_get_cached_paging_params(m_hci, &address, &mode,
+                                                 &clock_offset));
+    EXPECT_EQ(clock_offset, 0x4321);
+}
+
+TEST_F(TestDeviceCache, testLeastRecentlyUsedIsEvicted) {
+    const int cacheSize = 16; /* BTE_HCI_DEVICE_CACHE_SIZE */
+    for (int i = 0; i < cacheSize; i++) {
+        m_backend.sendEvent({ HCI_PSCAN_REP_MODE_CHANGE, 7,
+                              uint8_t(i), 2, 3, 4, 5, 6, 1 });
+    }
+    bte_handle_events();
+
+    /* Use the first device, so that the second one gets evicted */
+    BteBdAddr first = {{ 0, 2, 3, 4, 5, 6 }};
+    BteBdAddr second = {{ 1, 2, 3, 4, 5, 6 }};
+    uint8_t mode;
+    uint16_t clock_offset;
+    ASSERT_TRUE(bte_hci_get_cached_paging_params(m_hci, &first, &mode,
+                                                 &clock_offset));
+    m_backend.sendEvent({ HCI_PSCAN_REP_MODE_CHANGE, 7,
+                          0xff, 2, 3, 4, 5, 6, 1 });
+    bte_handle_events();
+
+    EXPECT_TRUE(bte_hci_get_cached_paging_params(m_hci, &first, &mode,
+                                                 &clock_offset));
+    EXPECT_FALSE(bte_hci_get_cached_paging_params(m_hci, &second, &mode,
+                                                  &clock_offset));
+    BteBdAddr last = {{ 0xff, 2, 3, 4, 5, 6 }};
+    EXPECT_TRUE(bte_hci_get_cached_paging_params(m_hci, &last, &mode,
+                                                 &clock_offset));
+}
@@ -0,0 +1,223 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/command_stats.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+#include <future>
+#include <gtest/gtest.h>
+#include <thread>
+
+/* Owns a device served by the mock backend; declared before the MockBackend,
+ * so that the device outlives it */
+struct MockDevice {
+    MockDevice(): dev(bte_hci_dev_new(&_bte_backend, nullptr)) {}
+    ~MockDevice() { bte_hci_dev_free(dev); }
+
+    BteHciDev *dev;
+};
+
+static std::vector<std::pair<BteHci *, uint8_t>> s_replies;
+
+static void storeReply(BteHci *hci, const BteHciReply *reply, void *)
+{
+    s_replies.push_back({hci, reply->status});
+}
+
+class TestDevices: public testing::Test {
+protected:
+    void SetUp() override {
+        s_replies.clear();
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        m_client2 = bte_client_new_for_dev(m_device2.dev);
+        m_hci2 = bte_hci_get(m_client2);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client2);
+        bte_client_unref(m_client);
+    }
+
+    static Buffer connectionComplete(BteHciConnHandle conn_handle,
+                                     const BteBdAddr &address) {
+        const uint8_t *a = address.bytes;
+        return Buffer {
+            HCI_CONNECTION_COMPLETE, 11, 0,
+            uint8_t(conn_handle & 0xff), uint8_t(conn_handle >> 8),
+            a[0], a[1], a[2], a[3], a[4], a[5],
+            BTE_HCI_LINK_TYPE_ACL, 0,
+        };
+    }
+
+    MockBackend m_backend;
+    MockDevice m_device2;
+    MockBackend m_backend2{m_device2.dev};
+    BteClient *m_client;
+    BteHci *m_hci;
+    BteClient *m_client2;
+    BteHci *m_hci2;
+};
+
+TEST_F(TestDevices, testClientsAreBoundToTheirDevice) {
+    ASSERT_NE(m_device2.dev, nullptr);
+    EXPECT_EQ(bte_hci_get_dev(m_hci), &_bte_hci_dev);
+    EXPECT_EQ(bte_hci_get_dev(m_hci2), m_device2.dev);
+}
+
+TEST_F(TestDevices, testCommandsGoToTheirDevice) {
+    bte_hci_nop(m_hci2, storeReply);
+    EXPECT_TRUE(m_backend.sentCommands().empty());
+    ASSERT_EQ(m_backend2.sentCommands().size(), 1);
+    EXPECT_EQ(m_backend2.lastCommand(), Buffer({ 0x0, 0x0, 0 }));
+
+    /* A reply from the other controller does not complete the command */
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x00, 0x00, 0 });
+    bte_handle_events();
+    EXPECT_TRUE(s_replies.empty());
+    EXPECT_EQ(m_device2.dev->num_pending_commands, 1);
+
+    m_backend2.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x00, 0x00, 0 });
+    bte_hci_dev_handle_events(m_device2.dev);
+    ASSERT_EQ(s_replies.size(), 1);
+    EXPECT_EQ(s_replies[0].first, m_hci2);
+    EXPECT_EQ(s_replies[0].second, 0);
+    EXPECT_EQ(m_device2.dev->num_pending_commands, 0);
+}
+
+TEST_F(TestDevices, testConnectionsAreSeparate) {
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    m_backend2.sendEvent(connectionComplete(0x0001, address));
+    bte_hci_dev_handle_events(m_device2.dev);
+
+    BteHciConnectionInfo info;
+    EXPECT_TRUE(bte_hci_get_connection_info(m_hci2, 0x0001, &info));
+    EXPECT_FALSE(bte_hci_get_connection_info(m_hci, 0x0001, &info));
+
+    /* The same handle can be in use on both controllers */
+    BteBdAddr address1 = {{ 6, 5, 4, 3, 2, 1 }};
+    m_backend.sendEvent(connectionComplete(0x0001, address1));
+    bte_handle_events();
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci, 0x0001, &info));
+    EXPECT_EQ(memcmp(&info.address, &address1, sizeof(address1)), 0);
+    ASSERT_TRUE(bte_hci_get_connection_info(m_hci2, 0x0001, &info));
+    EXPECT_EQ(memcmp(&info.address, &address, sizeof(address)), 0);
+
+    /* ACL data leaves through the backend of the connection's device */
+    m_device2.dev->acl_mtu = 32;
+    m_device2.dev->acl_max_packets = 4;
+    Buffer pdu{2, 0, 0x40, 0, 1, 2};
+    BteBuffer *b = pdu.toBuffer();
+    ASSERT_EQ(bte_hci_send_acl_data(m_hci2, 0x0001, b), 0);
+    bte_buffer_unref(b);
+    EXPECT_TRUE(m_backend.sentData().empty());
+    ASSERT_EQ(m_backend2.sentData().size(), 1);
+
+    m_backend2.sendEvent({
+        HCI_DISCONNECTION_COMPLETE, 4, 0, 0x01, 0x00,
+        HCI_OTHER_END_TERMINATED_CONN_USER_ENDED,
+    });
+    bte_hci_dev_handle_events(m_device2.dev);
+    EXPECT_FALSE(bte_hci_get_connection_info(m_hci2, 0x0001, &info));
+    EXPECT_TRUE(bte_hci_get_connection_info(m_hci, 0x0001, &info));
+
+    m_backend.sendEvent({
+        HCI_DISCONNECTION_COMPLETE, 4, 0, 0x01, 0x00,
+        HCI_OTHER_END_TERMINATED_CONN_USER_ENDED,
+    });
+    bte_handle_events();
+}
+
+TEST_F(TestDevices, testCommandStatsAreSeparate) {
+    bte_command_stats_reset();
+    bte_command_stats_enable(true);
+
+    bte_hci_nop(m_hci2, storeReply);
+    m_backend2.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x00, 0x00, 0 });
+    bte_hci_dev_handle_events(m_device2.dev);
+    bte_command_stats_enable(false);
+
+    BteCommandStats stats;
+    bte_hci_dev_command_stats_snapshot(m_device2.dev, &stats);
+    ASSERT_EQ(stats.num_opcodes, 1);
+    EXPECT_EQ(stats.opcodes[0].opcode, 0);
+    EXPECT_EQ(stats.opcodes[0].num_sent, 1);
+    EXPECT_EQ(stats.opcodes[0].num_completed, 1);
+
+    bte_command_stats_snapshot(&stats);
+    EXPECT_EQ(stats.num_opcodes, 0);
+
+    bte_hci_dev_command_stats_reset(m_device2.dev);
+    bte_hci_dev_command_stats_snapshot(m_device2.dev, &stats);
+    EXPECT_EQ(stats.num_opcodes, 0);
+}
+
+TEST_F(TestDevices, testCallsAreQueued) {
+    static int s_calls;
+    s_calls = 0;
+    auto countCall = [](BteHciDev *dev, void *userdata) {
+        EXPECT_EQ(userdata, &s_calls);
+        s_calls++;
+    };
+    for (int i = 0; i < BTE_HCI_DEV_CALL_QUEUE_SIZE; i++) {
+        ASSERT_EQ(bte_hci_dev_call(m_device2.dev, countCall, &s_calls), 0);
+    }
+    EXPECT_EQ(bte_hci_dev_call(m_device2.dev, countCall, &s_calls), -EAGAIN);
+
+    /* Only the loop of the target device runs them */
+    bte_handle_events();
+    EXPECT_EQ(s_calls, 0);
+    bte_hci_dev_handle_events(m_device2.dev);
+    EXPECT_EQ(s_calls, BTE_HCI_DEV_CALL_QUEUE_SIZE);
+}
+
+struct LoopCall {
+    BteHci *hci;
+    std::thread::id threadId;
+    std::promise<void> called;
+};
+
+static std::promise<std::thread::id> s_replyThread;
+
+static void storeReplyThread(BteHci *hci, const BteHciReply *reply, void *)
+{
+    storeReply(hci, reply, nullptr);
+    s_replyThread.set_value(std::this_thread::get_id());
+}
+
+TEST_F(TestDevices, testLoopRunsInItsOwnThread) {
+    BteHciDev *dev = m_device2.dev;
+    std::thread loop([dev]() {
+        EXPECT_EQ(bte_hci_dev_run(dev), 0);
+    });
+
+    s_replyThread = std::promise<std::thread::id>();
+    std::future<std::thread::id> replyThread = s_replyThread.get_future();
+    LoopCall call;
+    call.hci = m_hci2;
+    std::future<void> called = call.called.get_future();
+    auto sendNop = [](BteHciDev *dev, void *userdata) {
+        LoopCall *call = static_cast<LoopCall*>(userdata);
+        call->threadId = std::this_thread::get_id();
+        bte_hci_nop(call->hci, storeReplyThread);
+        call->called.set_value();
+    };
+    ASSERT_EQ(bte_hci_dev_call(dev, sendNop, &call), 0);
+    ASSERT_EQ(called.wait_for(std::chrono::seconds(5)),
+              std::future_status::ready);
+    EXPECT_EQ(call.threadId, loop.get_id());
+
+    /* The reply is delivered in the loop thread too */
+    m_backend2.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x00, 0x00, 0 });
+    ASSERT_EQ(replyThread.wait_for(std::chrono::seconds(5)),
+              std::future_status::ready);
+    EXPECT_EQ(replyThread.get(), loop.get_id());
+    bte_hci_dev_quit(dev);
+    loop.join();
+
+    ASSERT_EQ(s_replies.size(), 1);
+    EXPECT_EQ(s_replies[0].first, m_hci2);
+    EXPECT_EQ(m_backend2.sentCommands().size(), 1);
+}
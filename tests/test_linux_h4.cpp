@@ -0,0 +1,198 @@
+#include "bt-embedded/backend.h"
+#include "bt-embedded/backends/linux_h4.h"
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+/* The backend is initialized only once, when the first client is created;
+ * therefore all tests share the same socket pair. The test plays the role of
+ * the controller on the other end of it. */
+class TestLinuxH4: public testing::Test {
+protected:
+    static void SetUpTestSuite() {
+        if (s_fds[0] >= 0) return;
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, s_fds), 0);
+        bte_linux_h4_set_fd(s_fds[0]);
+    }
+
+    void SetUp() override {
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client);
+    }
+
+    static void controllerWrite(const Bytes &bytes) {
+        ASSERT_EQ(write(s_fds[1], bytes.data(), bytes.size()),
+                  ssize_t(bytes.size()));
+    }
+
+    /* Read from the controller side, while letting the backend flush its
+     * queue */
+    static Bytes controllerRead(size_t size) {
+        Bytes bytes(size);
+        size_t received = 0;
+        for (int i = 0; i < 1000 && received < size; i++) {
+            bte_handle_events();
+            struct pollfd pfd = { s_fds[1], POLLIN, 0 };
+            if (poll(&pfd, 1, 10) <= 0) continue;
+            ssize_t n = read(s_fds[1], bytes.data() + received,
+                             size - received);
+            if (n > 0) received += n;
+        }
+        bytes.resize(received);
+        return bytes;
+    }
+
+    static void handleEventsFor(int times) {
+        for (int i = 0; i < times; i++) bte_wait_events(10);
+    }
+
+    static int s_fds[2];
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+int TestLinuxH4::s_fds[2] = { -1, -1 };
+
+static std::vector<uint8_t> s_statuses;
+
+static void statusCb(BteHci *, const BteHciReply *reply, void *)
+{
+    s_statuses.push_back(reply->status);
+}
+
+TEST_F(TestLinuxH4, testCommandIsFramed) {
+    s_statuses.clear();
+    bte_hci_reset(m_hci, statusCb);
+
+    Bytes expected = { HCI_COMMAND_DATA_PACKET, 0x03, 0x0c, 0 };
+    ASSERT_EQ(controllerRead(expected.size()), expected);
+
+    controllerWrite({ HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                      1, 0x03, 0x0c, 0 });
+    handleEventsFor(1);
+    ASSERT_EQ(s_statuses, Bytes { 0 });
+}
+
+TEST_F(TestLinuxH4, testFragmentedStream) {
+    s_statuses.clear();
+    bte_hci_reset(m_hci, statusCb);
+    ASSERT_EQ(controllerRead(4).size(), 4);
+
+    /* The event arrives one byte at a time */
+    Bytes event = { HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4,
+                    1, 0x03, 0x0c, 0x12 };
+    for (uint8_t byte: event) {
+        controllerWrite({ byte });
+        handleEventsFor(1);
+    }
+    ASSERT_EQ(s_statuses, Bytes { 0x12 });
+}
+
+TEST_F(TestLinuxH4, testCoalescedPackets) {
+    s_statuses.clear();
+    bte_hci_write_page_timeout(m_hci, 0x2000, statusCb);
+    ASSERT_EQ(controllerRead(6).size(), 6);
+
+    /* A stray byte, a SCO packet (which we don't handle), an unsolicited
+     * event, and our reply, all in a single chunk */
+    controllerWrite({
+        0x42,
+        HCI_SCO_DATA_PACKET, 0x01, 0x00, 3, 0xaa, 0xbb, 0xcc,
+        HCI_EVENT_PACKET, HCI_PSCAN_REP_MODE_CHANGE, 7,
+        1, 2, 3, 4, 5, 6, 1,
+        HCI_EVENT_PACKET, HCI_COMMAND_COMPLETE, 4, 1, 0x18, 0x0c, 0,
+    });
+    handleEventsFor(1);
+    ASSERT_EQ(s_statuses, Bytes { 0 });
+}
+
+TEST_F(TestLinuxH4, testSendChainedData) {
+    uint8_t storage[3][sizeof(BteBuffer) + 8];
+    BteBuffer *segments[3];
+    for (int i = 0; i < 3; i++) {
+        segments[i] = reinterpret_cast<BteBuffer *>(storage[i]);
+        segments[i]->ref_count = 1;
+        segments[i]->free_func = nullptr;
+        segments[i]->size = 3;
+        segments[i]->next = nullptr;
+        for (int j = 0; j < 3; j++) segments[i]->data[j] = i * 3 + j;
+    }
+    segments[0]->next = segments[1];
+    segments[1]->next = segments[2];
+    segments[0]->total_size = 8; /* The last byte is not part of the packet */
+
+    ASSERT_EQ(_bte_backend.hci_send_data(&_bte_hci_dev, segments[0]), 0);
+    Bytes expected = { HCI_ACL_DATA_PACKET, 0, 1, 2, 3, 4, 5, 6, 7 };
+    ASSERT_EQ(controllerRead(expected.size()), expected);
+    /* The backend has released its reference */
+    ASSERT_EQ(segments[0]->ref_count, 1);
+}
+
+TEST_F(TestLinuxH4, testSendQueuedWhenSocketIsFull) {
+    int sndbuf = 4096;
+    setsockopt(s_fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    const int numPackets = 20;
+    const uint16_t payloadSize = 1000;
+    Bytes expected;
+    for (int i = 0; i < numPackets; i++) {
+        BteBuffer *b = bte_buffer_alloc_contiguous(payloadSize);
+        expected.push_back(HCI_ACL_DATA_PACKET);
+        for (int j = 0; j < payloadSize; j++) {
+            b->data[j] = uint8_t(i + j);
+            expected.push_back(b->data[j]);
+        }
+        ASSERT_EQ(_bte_backend.hci_send_data(&_bte_hci_dev, b), 0);
+        bte_buffer_unref(b);
+    }
+
+    ASSERT_EQ(controllerRead(expected.size()), expected);
+}
+
+TEST_F(TestLinuxH4, testCallWakesUpTheLoop) {
+    std::thread loop([]() {
+        EXPECT_EQ(bte_hci_dev_run(&_bte_hci_dev), 0);
+    });
+
+    /* Without a wakeup the loop would block forever in epoll_wait() */
+    auto quit = [](BteHciDev *dev, void *) { bte_hci_dev_quit(dev); };
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(bte_hci_dev_call(&_bte_hci_dev, quit, nullptr), 0);
+    loop.join();
+}
+
+TEST(TestLinuxH4Devices, testUnusedDeviceIsFreed) {
+    /* The backend state is allocated with the device, and must be released
+     * with it even if no client ever initialized it (checked by the leak
+     * sanitizer) */
+    BteHciDev *dev = bte_linux_h4_dev_new("/nonexistent", 0);
+    ASSERT_NE(dev, nullptr);
+    EXPECT_EQ(dev->init_status, BTE_HCI_INIT_STATUS_UNINITIALIZED);
+    bte_hci_dev_free(dev);
+}
+
+TEST(TestLinuxH4Devices, testFailedInitCanBeRetried) {
+    BteHciDev *dev = bte_linux_h4_dev_new("/nonexistent", 0);
+    ASSERT_NE(dev, nullptr);
+
+    /* The device doesn't pretend to be initializing */
+    EXPECT_EQ(bte_client_new_for_dev(dev), nullptr);
+    EXPECT_EQ(dev->init_status, BTE_HCI_INIT_STATUS_UNINITIALIZED);
+    EXPECT_EQ(bte_client_new_for_dev(dev), nullptr);
+    bte_hci_dev_free(dev);
+}
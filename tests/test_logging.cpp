@@ -0,0 +1,82 @@
+#include "bt-embedded/logging.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+struct LogMessage {
+    int level;
+    std::string text;
+
+    bool operator==(const LogMessage &other) const {
+        return level == other.level && text == other.text;
+    }
+};
+
+static std::vector<LogMessage> s_messages;
+
+static void storeMessage(int level, const char *message, void *userdata)
+{
+    s_messages.push_back({level, message});
+}
+
+class TestLogging: public testing::Test {
+protected:
+    void SetUp() override {
+        if (BTE_LOG_LEVEL < BTE_LOG_LEVEL_WARN) {
+            GTEST_SKIP() << "Warnings are compiled out";
+        }
+        bte_log_set_sink(storeMessage, nullptr);
+        bte_log_flush();
+        s_messages.clear();
+    }
+
+    void TearDown() override {
+        bte_log_set_sink(nullptr, nullptr);
+    }
+};
+
+TEST_F(TestLogging, testLevels) {
+    BTE_WARN("Warning %d\n", 42);
+    /* Only compiled in when building with the DEBUG level */
+    BTE_DEBUG("Debug %d\n", 1);
+
+    std::vector<LogMessage> expectedMessages = {
+        {BTE_LOG_LEVEL_WARN, "Warning 42\n"},
+    };
+    if (BTE_LOG_LEVEL >= BTE_LOG_LEVEL_DEBUG) {
+        expectedMessages.push_back({BTE_LOG_LEVEL_DEBUG, "Debug 1\n"});
+    }
+    ASSERT_EQ(s_messages, expectedMessages);
+}
+
+TEST_F(TestLogging, testDeferred) {
+    BTE_WARN_DEFERRED("Event %02x, size %u\n", 0x0e, 6);
+    BTE_WARN_DEFERRED("No arguments\n");
+    ASSERT_TRUE(s_messages.empty());
+
+    ASSERT_EQ(bte_log_flush(), 2);
+    std::vector<LogMessage> expectedMessages = {
+        {BTE_LOG_LEVEL_WARN, "Event 0e, size 6\n"},
+        {BTE_LOG_LEVEL_WARN, "No arguments\n"},
+    };
+    ASSERT_EQ(s_messages, expectedMessages);
+    ASSERT_EQ(bte_log_flush(), 0);
+}
+
+TEST_F(TestLogging, testDeferredOverflow) {
+    for (int i = 0; i < BTE_LOG_DEFERRED_SIZE + 3; i++) {
+        BTE_WARN_DEFERRED("%d\n", i);
+    }
+
+    ASSERT_EQ(bte_log_flush(), BTE_LOG_DEFERRED_SIZE);
+    ASSERT_EQ(s_messages.size(), BTE_LOG_DEFERRED_SIZE + 1);
+    ASSERT_EQ(s_messages[0].text, "3 log messages dropped\n");
+    ASSERT_EQ(s_messages.back().text,
+              std::to_string(BTE_LOG_DEFERRED_SIZE - 1) + "\n");
+
+    /* The ring can be reused */
+    BTE_WARN_DEFERRED("%d\n", 100);
+    ASSERT_EQ(bte_log_flush(), 1);
+    ASSERT_EQ(s_messages.back().text, "100\n");
+}
@@ -0,0 +1,70 @@
+#include "bt-embedded/spsc_ring.h"
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+TEST(SpscRing, testFillAndDrain) {
+    BteSpscRing ring;
+    uint32_t slots[4];
+    _bte_spsc_ring_init(&ring, 4);
+    ASSERT_EQ(_bte_spsc_ring_read_slot(&ring), -1);
+
+    for (uint32_t i = 0; i < 4; i++) {
+        int32_t slot = _bte_spsc_ring_write_slot(&ring);
+        ASSERT_GE(slot, 0);
+        slots[slot] = i;
+        _bte_spsc_ring_push(&ring);
+    }
+    ASSERT_EQ(_bte_spsc_ring_write_slot(&ring), -1);
+    ASSERT_EQ(_bte_spsc_ring_count(&ring), 4);
+
+    /* Wrap around */
+    for (uint32_t i = 0; i < 10; i++) {
+        int32_t slot = _bte_spsc_ring_read_slot(&ring);
+        ASSERT_GE(slot, 0);
+        ASSERT_EQ(slots[slot], i);
+        _bte_spsc_ring_pop(&ring);
+
+        slot = _bte_spsc_ring_write_slot(&ring);
+        ASSERT_GE(slot, 0);
+        slots[slot] = i + 4;
+        _bte_spsc_ring_push(&ring);
+    }
+    ASSERT_EQ(_bte_spsc_ring_count(&ring), 4);
+}
+
+TEST(SpscRing, testConcurrentProducer) {
+    const uint32_t numItems = 100000;
+    BteSpscRing ring;
+    uint32_t slots[16];
+    _bte_spsc_ring_init(&ring, 16);
+
+    /* The thread plays the role of the interrupt handler */
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < numItems;) {
+            int32_t slot = _bte_spsc_ring_write_slot(&ring);
+            if (slot < 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            slots[slot] = i++;
+            _bte_spsc_ring_push(&ring);
+        }
+    });
+
+    uint32_t expected = 0;
+    while (expected < numItems) {
+        int32_t slot = _bte_spsc_ring_read_slot(&ring);
+        if (slot < 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (slots[slot] != expected) break;
+        expected++;
+        _bte_spsc_ring_pop(&ring);
+    }
+    producer.join();
+    ASSERT_EQ(expected, numItems);
+    ASSERT_EQ(_bte_spsc_ring_read_slot(&ring), -1);
+}
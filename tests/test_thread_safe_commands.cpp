@@ -0,0 +1,226 @@
+#include "mock_backend.h"
+
+#include "bt-embedded/bte.h"
+#include "bt-embedded/client.h"
+#include "bt-embedded/hci.h"
+#include "bt-embedded/hci_proto.h"
+#include "bt-embedded/internals.h"
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+
+static std::vector<uint8_t> s_statuses;
+static std::vector<std::thread::id> s_statusThreads;
+
+static void statusCb(BteHci *, const BteHciReply *reply, void *)
+{
+    s_statuses.push_back(reply->status);
+    s_statusThreads.push_back(std::this_thread::get_id());
+}
+
+static std::vector<BteHciCreateConnectionReply> s_connections;
+
+static void connectionCb(BteHci *, const BteHciCreateConnectionReply *reply,
+                         void *)
+{
+    s_connections.push_back(*reply);
+}
+
+class TestThreadSafeCommands: public testing::Test {
+protected:
+    void SetUp() override {
+        s_statuses.clear();
+        s_statusThreads.clear();
+        s_connections.clear();
+        m_client = bte_client_new();
+        m_hci = bte_hci_get(m_client);
+        bte_hci_set_thread_safe(m_hci, true);
+    }
+
+    void TearDown() override {
+        bte_client_unref(m_client);
+    }
+
+    /* Runs the given function in another thread and waits for it */
+    template <typename F>
+    static void inOtherThread(F f) {
+        std::thread thread(f);
+        thread.join();
+    }
+
+    MockBackend m_backend;
+    BteClient *m_client;
+    BteHci *m_hci;
+};
+
+TEST_F(TestThreadSafeCommands, testCommandIsSentByTheLoop) {
+    BteHci *hci = m_hci;
+    inOtherThread([hci]() { bte_hci_nop(hci, statusCb); });
+
+    /* Nothing happened yet */
+    EXPECT_TRUE(m_backend.sentCommands().empty());
+    EXPECT_EQ(_bte_hci_dev.num_pending_commands, 0);
+
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), 1);
+    EXPECT_EQ(m_backend.lastCommand(), Buffer({ 0x0, 0x0, 0 }));
+    EXPECT_EQ(_bte_hci_dev.num_pending_commands, 1);
+
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x00, 0x00, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+    EXPECT_EQ(s_statusThreads[0], std::this_thread::get_id());
+}
+
+TEST_F(TestThreadSafeCommands, testAsyncCommand) {
+    BteHci *hci = m_hci;
+    BteBdAddr address = {{ 1, 2, 3, 4, 5, 6 }};
+    inOtherThread([hci, &address]() {
+        bte_hci_create_connection(hci, &address, BTE_PACKET_TYPE_DM1, 0, 0,
+                                  false, statusCb, connectionCb);
+    });
+
+    /* The connection is only tracked once the loop has sent the command */
+    BteHciConnectionInfo info;
+    EXPECT_FALSE(bte_hci_get_connection_by_address(m_hci, &address, &info));
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), 1);
+    ASSERT_TRUE(bte_hci_get_connection_by_address(m_hci, &address, &info));
+    EXPECT_EQ(info.state, BTE_HCI_CONN_STATE_CONNECTING);
+    EXPECT_EQ(info.role, BTE_HCI_ROLE_MASTER);
+
+    m_backend.sendEvent({ HCI_COMMAND_STATUS, 4, 0, 1, 0x05, 0x04 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+
+    /* The data stored by the command function was carried over */
+    m_backend.sendEvent({
+        HCI_CONNECTION_COMPLETE, 11, 0, 0x42, 0x00, 1, 2, 3, 4, 5, 6,
+        BTE_HCI_LINK_TYPE_ACL, 0,
+    });
+    bte_handle_events();
+    ASSERT_EQ(s_connections.size(), 1);
+    EXPECT_EQ(s_connections[0].conn_handle, 0x0042);
+    EXPECT_EQ(memcmp(&s_connections[0].address, &address, sizeof(address)), 0);
+
+    m_backend.sendEvent({
+        HCI_DISCONNECTION_COMPLETE, 4, 0, 0x42, 0x00,
+        HCI_OTHER_END_TERMINATED_CONN_USER_ENDED,
+    });
+    bte_handle_events();
+}
+
+TEST_F(TestThreadSafeCommands, testHostStateChangedByTheLoop) {
+    _bte_hci_dev.host_flow_control_requested =
+        BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF;
+    BteHci *hci = m_hci;
+    inOtherThread([hci]() {
+        bte_hci_set_ctrl_to_host_flow_control(
+            hci, BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL, statusCb);
+    });
+
+    /* The calling thread didn't touch the device */
+    EXPECT_EQ(_bte_hci_dev.host_flow_control_requested,
+              BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF);
+    bte_handle_events();
+    ASSERT_EQ(m_backend.sentCommands().size(), 1);
+    EXPECT_EQ(_bte_hci_dev.host_flow_control_requested,
+              BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL);
+
+    m_backend.sendEvent({ HCI_COMMAND_COMPLETE, 4, 1, 0x31, 0x0c, 0 });
+    bte_handle_events();
+    ASSERT_EQ(s_statuses, std::vector<uint8_t> { 0 });
+    EXPECT_EQ(_bte_hci_dev.host_flow_control,
+              BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_ACL);
+
+    _bte_hci_dev.host_flow_control = BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF;
+    _bte_hci_dev.host_flow_control_requested =
+        BTE_HCI_CTRL_TO_HOST_FLOW_CONTROL_OFF;
+}
+
+TEST_F(TestThreadSafeCommands, testQueueFull) {
+    auto ignore = [](BteHciDev *, void *) {};
+    for (int i = 0; i < BTE_HCI_DEV_CALL_QUEUE_SIZE; i++) {
+        ASSERT_EQ(bte_hci_dev_call(&_bte_hci_dev, ignore, nullptr), 0);
+    }
+
+    /* The command is refused at once, without invoking the callback in
+     * the submitting thread */
+    BteHci *hci = m_hci;
+    inOtherThread([hci]() { bte_hci_nop(hci, statusCb); });
+    EXPECT_TRUE(s_statuses.empty());
+    EXPECT_EQ(bte_hci_take_rejected_commands(m_hci), 1);
+    EXPECT_EQ(bte_hci_take_rejected_commands(m_hci), 0);
+
+    bte_handle_events();
+    EXPECT_TRUE(m_backend.sentCommands().empty());
+    EXPECT_TRUE(s_statuses.empty());
+}
+
+TEST_F(TestThreadSafeCommands, testConcurrentSubmission) {
+    /* The controller replies to every command */
+    MockBackend &backend = m_backend;
+    m_backend.onSendCommand([&backend](BteBuffer *buffer) {
+        backend.sendEvent({
+            HCI_COMMAND_COMPLETE, 4, 1, buffer->data[0], buffer->data[1], 0,
+        });
+        return 0;
+    });
+
+    static std::atomic<int> s_replies[4];
+    static std::atomic<int> s_wrongThread;
+    static std::thread::id s_loopThread;
+    s_wrongThread = 0;
+    for (auto &replies: s_replies) replies = 0;
+
+    std::thread loop([]() {
+        s_loopThread = std::this_thread::get_id();
+        bte_hci_dev_run(&_bte_hci_dev);
+    });
+
+    /* Each thread issues a different command, so that they don't get
+     * refused as duplicates, and waits for its reply before the next one */
+    auto makeCb = [](auto index) {
+        return [](BteHci *, const BteHciReply *reply, void *) {
+            if (std::this_thread::get_id() != s_loopThread) s_wrongThread++;
+            EXPECT_EQ(reply->status, 0);
+            s_replies[decltype(index)::value]++;
+        };
+    };
+    using std::integral_constant;
+    BteHciDoneCb callbacks[4] = {
+        makeCb(integral_constant<int, 0>()),
+        makeCb(integral_constant<int, 1>()),
+        makeCb(integral_constant<int, 2>()),
+        makeCb(integral_constant<int, 3>()),
+    };
+
+    const int numCommands = 100;
+    BteHci *hci = m_hci;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([hci, t, &callbacks]() {
+            for (int i = 0; i < numCommands; i++) {
+                switch (t) {
+                case 0: bte_hci_write_page_timeout(hci, i, callbacks[t]);
+                        break;
+                case 1: bte_hci_write_scan_enable(hci, i, callbacks[t]);
+                        break;
+                case 2: bte_hci_write_auth_enable(hci, i, callbacks[t]);
+                        break;
+                case 3: bte_hci_write_inquiry_mode(hci, i, callbacks[t]);
+                        break;
+                }
+                while (s_replies[t] <= i) std::this_thread::yield();
+            }
+        });
+    }
+    for (std::thread &thread: threads) thread.join();
+    bte_hci_dev_quit(&_bte_hci_dev);
+    loop.join();
+
+    for (auto &replies: s_replies) EXPECT_EQ(replies, numCommands);
+    EXPECT_EQ(s_wrongThread, 0);
+    EXPECT_EQ(m_backend.sentCommands().size(), 4 * numCommands);
+    EXPECT_EQ(_bte_hci_dev.num_pending_commands, 0);
+}